@@ -61,6 +61,8 @@ reset_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 
 	if (bytes != 1)
 		return -1;
+
+	pthread_mutex_lock(&pm_lock);
 	if (in)
 		*eax = reset_control;
 	else {
@@ -79,6 +81,7 @@ reset_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 			mevent_notify();
 		}
 	}
+	pthread_mutex_unlock(&pm_lock);
 	return 0;
 }
 INOUT_PORT(reset_reg, 0xCF9, IOPORT_F_INOUT, reset_handler);
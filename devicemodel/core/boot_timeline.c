@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "dm.h"
+#include "atomic.h"
+#include "boot_timeline.h"
+
+#define BOOT_PHASE_MAX		128
+#define BOOT_PHASE_NAMESZ	48
+
+struct boot_phase {
+	char		name[BOOT_PHASE_NAMESZ];
+	uint64_t	begin_ns;
+	uint64_t	end_ns;		/* 0 while the phase is running */
+};
+
+static struct boot_phase boot_phases[BOOT_PHASE_MAX];
+static int boot_nphases;
+static uint64_t boot_t0_ns;
+
+static uint64_t
+boot_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void
+boot_timeline_reset(void)
+{
+	atomic_store(&boot_nphases, 0);
+	boot_t0_ns = boot_now_ns();
+}
+
+int
+boot_phase_begin(const char *fmt, ...)
+{
+	struct boot_phase *p;
+	va_list args;
+	int phase;
+
+	phase = atomic_fetch_add(&boot_nphases, 1);
+	if (phase >= BOOT_PHASE_MAX) {
+		atomic_sub_fetch(&boot_nphases, 1);
+		return -1;
+	}
+
+	p = &boot_phases[phase];
+	va_start(args, fmt);
+	vsnprintf(p->name, sizeof(p->name), fmt, args);
+	va_end(args);
+	p->end_ns = 0;
+	p->begin_ns = boot_now_ns();
+
+	return phase;
+}
+
+void
+boot_phase_end(int phase)
+{
+	if (phase < 0 || phase >= BOOT_PHASE_MAX)
+		return;
+
+	boot_phases[phase].end_ns = boot_now_ns();
+}
+
+/* Phase names come from device and stage names, only quote the JSON
+ * special characters.
+ */
+static void
+boot_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+int
+boot_timeline_dump(FILE *fp)
+{
+	struct boot_phase *p;
+	int i, n;
+
+	n = atomic_load(&boot_nphases);
+	if (n > BOOT_PHASE_MAX)
+		n = BOOT_PHASE_MAX;
+
+	fprintf(fp, "{\n  \"vm\": ");
+	boot_json_string(fp, vmname ? vmname : "");
+	fprintf(fp, ",\n  \"now_us\": %lu,\n  \"phases\": [",
+		(boot_now_ns() - boot_t0_ns) / 1000);
+
+	for (i = 0; i < n; i++) {
+		p = &boot_phases[i];
+		fprintf(fp, "%s\n    { \"name\": ", i ? "," : "");
+		boot_json_string(fp, p->name);
+		fprintf(fp, ", \"start_us\": %lu, ",
+			(p->begin_ns - boot_t0_ns) / 1000);
+		if (p->end_ns)
+			fprintf(fp, "\"dur_us\": %lu }",
+				(p->end_ns - p->begin_ns) / 1000);
+		else
+			fprintf(fp, "\"dur_us\": null }");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+
+	return ferror(fp) ? -1 : 0;
+}
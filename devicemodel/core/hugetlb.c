@@ -36,6 +36,8 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "vmmapi.h"
 
@@ -70,6 +72,7 @@
  *.---if > 0: it's the gap for needed page; if < 0, more free than needed.
  * - nr_pages_path: sys path for total number of pages
  *.- free_pages_path: sys path for number of free pages
+ * - map_ns/fault_ns: time spent in mmap and in pre-faulting the pages
  */
 struct hugetlb_info {
 	bool mounted;
@@ -85,6 +88,9 @@ struct hugetlb_info {
 	int pages_delta;
 	char *nr_pages_path;
 	char *free_pages_path;
+
+	uint64_t map_ns;
+	uint64_t fault_ns;
 };
 
 static struct hugetlb_info hugetlb_priv[HUGETLB_LV_MAX] = {
@@ -120,6 +126,100 @@ static void *ptr;
 static size_t total_size;
 static int hugetlb_lv_max;
 
+/* threads touching the hugepages, 0 or 1 does it in the caller */
+static int prefault_threads;
+
+struct prefault_chunk {
+	char *addr;
+	size_t len;
+	size_t pagesz;
+};
+
+void hugetlb_set_prefault_threads(int nthreads)
+{
+	prefault_threads = nthreads;
+}
+
+static uint64_t hugetlb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void *prefault_chunk(void *arg)
+{
+	struct prefault_chunk *c = arg;
+	char *addr = c->addr;
+	size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+	/* let the kernel fault in the whole chunk in one call */
+	if (madvise(addr, c->len, MADV_POPULATE_WRITE) == 0)
+		return NULL;
+#endif
+
+	for (i = 0; i < c->len / c->pagesz; i++) {
+		*(volatile char *)addr = *addr;
+		addr += c->pagesz;
+	}
+
+	return NULL;
+}
+
+/*
+ * Pre-allocate the hugepages of [addr, addr + len) by touching them,
+ * split into page-aligned chunks over prefault_threads threads.
+ */
+static void prefault_hugetlbfs(char *addr, size_t len, size_t pagesz)
+{
+	struct prefault_chunk *chunks;
+	pthread_t *tids;
+	bool *started;
+	size_t npages, per, start;
+	int i, n;
+
+	npages = len / pagesz;
+	n = prefault_threads;
+	if (n > npages)
+		n = npages;
+
+	chunks = calloc(n, sizeof(*chunks));
+	tids = calloc(n, sizeof(*tids));
+	started = calloc(n, sizeof(*started));
+	if (n <= 1 || !chunks || !tids || !started) {
+		struct prefault_chunk c = { addr, len, pagesz };
+
+		prefault_chunk(&c);
+		goto out;
+	}
+
+	per = npages / n;
+	start = 0;
+	for (i = 0; i < n; i++) {
+		chunks[i].addr = addr + start * pagesz;
+		chunks[i].len = ((i == n - 1) ? npages - start : per) * pagesz;
+		chunks[i].pagesz = pagesz;
+		start += per;
+
+		started[i] = !pthread_create(&tids[i], NULL, prefault_chunk,
+					     &chunks[i]);
+		if (!started[i])
+			prefault_chunk(&chunks[i]);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+	}
+
+out:
+	free(chunks);
+	free(tids);
+	free(started);
+}
+
 static int open_hugetlbfs(struct vmctx *ctx, int level)
 {
 	char uuid_str[48];
@@ -219,6 +319,7 @@ static int mmap_hugetlbfs(struct vmctx *ctx, int level, size_t len,
 {
 	char *addr;
 	size_t pagesz = 0;
+	uint64_t t0, t1;
 	int fd, i;
 
 	if (level >= HUGETLB_LV_MAX) {
@@ -226,11 +327,14 @@ static int mmap_hugetlbfs(struct vmctx *ctx, int level, size_t len,
 		return -EINVAL;
 	}
 
+	t0 = hugetlb_now_ns();
 	fd = hugetlb_priv[level].fd;
 	addr = mmap(ctx->baseaddr + offset, len, PROT_READ | PROT_WRITE,
 			MAP_SHARED | MAP_FIXED, fd, skip);
 	if (addr == MAP_FAILED)
 		return -ENOMEM;
+	t1 = hugetlb_now_ns();
+	hugetlb_priv[level].map_ns += t1 - t0;
 
 	printf("mmap 0x%lx@%p\n", len, addr);
 
@@ -239,10 +343,15 @@ static int mmap_hugetlbfs(struct vmctx *ctx, int level, size_t len,
 
 	printf("touch %ld pages with pagesz 0x%lx\n", len/pagesz, pagesz);
 
-	for (i = 0; i < len/pagesz; i++) {
-		*(volatile char *)addr = *addr;
-		addr += pagesz;
+	if (prefault_threads > 1)
+		prefault_hugetlbfs(addr, len, pagesz);
+	else {
+		for (i = 0; i < len/pagesz; i++) {
+			*(volatile char *)addr = *addr;
+			addr += pagesz;
+		}
 	}
+	hugetlb_priv[level].fault_ns += hugetlb_now_ns() - t1;
 
 	return 0;
 }
@@ -598,6 +707,8 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 
 	/* open hugetlbfs and get pagesize for two level */
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
+		hugetlb_priv[level].map_ns = 0;
+		hugetlb_priv[level].fault_ns = 0;
 		if (open_hugetlbfs(ctx, level) < 0) {
 			perror("failed to open hugetlbfs");
 			goto err;
@@ -690,10 +801,15 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	/* dump hugepage really setup */
 	printf("\nreally setup hugepage with:\n");
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
-		printf("\tlevel %d - lowmem 0x%lx, highmem 0x%lx\n", level,
+		printf("\tlevel %d - lowmem 0x%lx, highmem 0x%lx, "
+			"mmap %lu us, prefault %lu us\n", level,
 			hugetlb_priv[level].lowmem,
-			hugetlb_priv[level].highmem);
+			hugetlb_priv[level].highmem,
+			hugetlb_priv[level].map_ns / 1000,
+			hugetlb_priv[level].fault_ns / 1000);
 	}
+	printf("prefault threads %d\n",
+		prefault_threads > 1 ? prefault_threads : 1);
 	printf("total_size 0x%lx\n\n", total_size);
 
 	/* map ept for lowmem*/
@@ -722,6 +838,43 @@ err:
 	return -ENOMEM;
 }
 
+/*
+ * Describe guest memory as hugetlbfs file segments, so that another
+ * process (e.g. a vhost-user backend) can map it from the fds.
+ *
+ * Lowmem is made of the 1G level file then the 2M one, each from file
+ * offset 0; highmem follows lowmem in the same files.
+ */
+int hugetlb_get_mem_regions(struct vmctx *ctx, struct vm_mem_region *regions,
+		int max)
+{
+	uint64_t gpa[2] = { 0, 4 * GB };
+	size_t len;
+	int level, n = 0, hi;
+
+	for (hi = 0; hi < 2; hi++) {
+		for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
+			len = hi ? hugetlb_priv[level].highmem :
+				hugetlb_priv[level].lowmem;
+			if (len == 0)
+				continue;
+			if (n >= max || hugetlb_priv[level].fd < 0)
+				return -1;
+
+			regions[n].gpa = gpa[hi];
+			regions[n].size = len;
+			regions[n].hva = ctx->baseaddr + gpa[hi];
+			regions[n].fd = hugetlb_priv[level].fd;
+			regions[n].fd_offset = hi ?
+				hugetlb_priv[level].lowmem : 0;
+			gpa[hi] += len;
+			n++;
+		}
+	}
+
+	return n;
+}
+
 void hugetlb_unsetup_memory(struct vmctx *ctx)
 {
 	int level;
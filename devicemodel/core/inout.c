@@ -28,10 +28,14 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/queue.h>
 
 #include "inout.h"
+#include "atomic.h"
 
 SET_DECLARE(inout_port_set, struct inout_port);
 
@@ -40,13 +44,39 @@ SET_DECLARE(inout_port_set, struct inout_port);
 #define	VERIFY_IOPORT(port, size) \
 	((port) >= 0 && (size) > 0 && ((port) + (size)) <= MAX_IOPORTS)
 
-static struct {
+/*
+ * Each registration is one handler entry covering its whole port range.
+ * Ports map to entries through a two-level table: 256 pages of 256
+ * ports, a page only being allocated once a port in it is claimed.  An
+ * unclaimed port, or a port in a missing page, goes to inout_default.
+ *
+ * Entries are never freed while the VM runs, emulate_inout() may still
+ * be using one that was just unregistered; a later registration of the
+ * same range and handler reuses it, keeping its counters.
+ */
+#define	INOUT_PAGE_SHIFT	8
+#define	INOUT_PAGE_SIZE		(1 << INOUT_PAGE_SHIFT)
+#define	INOUT_NPAGES		(MAX_IOPORTS >> INOUT_PAGE_SHIFT)
+
+struct inout_handler {
 	const char	*name;
+	int		port;
+	int		size;
 	int		flags;
 	inout_func_t	handler;
 	void		*arg;
 	bool		enabled;
-} inout_handlers[MAX_IOPORTS];
+	bool		registered;
+
+	uint64_t	hits;
+	uint64_t	cycles;		/* TSC cycles spent in the handler */
+
+	LIST_ENTRY(inout_handler) list;
+};
+
+static struct inout_handler **inout_pages[INOUT_NPAGES];
+static LIST_HEAD(, inout_handler) inout_entries;
+static pthread_mutex_t inout_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static int
 default_inout(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
@@ -69,32 +99,83 @@ default_inout(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 	return 0;
 }
 
-static void
-register_default_iohandler(int start, int size)
+static struct inout_handler inout_default = {
+	.name = "default",
+	.port = 0,
+	.size = MAX_IOPORTS,
+	.flags = IOPORT_F_INOUT | IOPORT_F_DEFAULT,
+	.handler = default_inout,
+	.enabled = true,
+	.registered = true,
+};
+
+static inline uint64_t
+inout_rdtsc(void)
 {
-	struct inout_port iop;
+	return __builtin_ia32_rdtsc();
+}
+
+static inline struct inout_handler *
+inout_lookup(int port)
+{
+	struct inout_handler **page, *h = NULL;
+
+	page = atomic_load(&inout_pages[port >> INOUT_PAGE_SHIFT]);
+	if (page)
+		h = atomic_load(&page[port & (INOUT_PAGE_SIZE - 1)]);
+
+	return h ? h : &inout_default;
+}
+
+/* Point ports [port, port + size) to h, NULL for the default handler */
+static int
+inout_set_range(int port, int size, struct inout_handler *h)
+{
+	struct inout_handler **page;
+	int i;
 
-	if (!VERIFY_IOPORT(start, size)) {
-		printf("invalid input: port:0x%x, size:%d", start, size);
-		return;
+	for (i = port; i < port + size; i++) {
+		page = inout_pages[i >> INOUT_PAGE_SHIFT];
+		if (page == NULL) {
+			if (h == NULL)
+				continue;
+			page = calloc(INOUT_PAGE_SIZE, sizeof(*page));
+			if (page == NULL)
+				return -1;
+			atomic_store(&inout_pages[i >> INOUT_PAGE_SHIFT], page);
+		}
+		atomic_store(&page[i & (INOUT_PAGE_SIZE - 1)], h);
 	}
 
-	bzero(&iop, sizeof(iop));
-	iop.name = "default";
-	iop.port = start;
-	iop.size = size;
-	iop.flags = IOPORT_F_INOUT | IOPORT_F_DEFAULT;
-	iop.handler = default_inout;
+	return 0;
+}
 
-	register_inout(&iop);
+static void
+inout_reset(void)
+{
+	struct inout_handler *h;
+	int i;
+
+	pthread_mutex_lock(&inout_mtx);
+	while ((h = LIST_FIRST(&inout_entries)) != NULL) {
+		LIST_REMOVE(h, list);
+		free(h);
+	}
+	for (i = 0; i < INOUT_NPAGES; i++) {
+		free(inout_pages[i]);
+		inout_pages[i] = NULL;
+	}
+	inout_default.hits = 0;
+	inout_default.cycles = 0;
+	pthread_mutex_unlock(&inout_mtx);
 }
 
 int
 emulate_inout(struct vmctx *ctx, int *pvcpu, struct pio_request *pio_request)
 {
 	int bytes, flags, in, port;
-	inout_func_t handler;
-	void *arg;
+	struct inout_handler *h;
+	uint64_t tsc;
 	int retval;
 
 	bytes = pio_request->size;
@@ -104,9 +185,8 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct pio_request *pio_request)
 	assert(port + bytes - 1 < MAX_IOPORTS);
 	assert(bytes == 1 || bytes == 2 || bytes == 4);
 
-	handler = inout_handlers[port].handler;
-	flags = inout_handlers[port].flags;
-	arg = inout_handlers[port].arg;
+	h = inout_lookup(port);
+	flags = h->flags;
 
 	if (pio_request->direction == REQUEST_READ) {
 		if (!(flags & IOPORT_F_IN))
@@ -116,12 +196,16 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct pio_request *pio_request)
 			return -1;
 	}
 
-	if (inout_handlers[port].enabled == false) {
+	if (h->enabled == false) {
 		return -1;
 	}
 
-	retval = handler(ctx, *pvcpu, in, port, bytes,
-		(uint32_t *)&(pio_request->value), arg);
+	tsc = inout_rdtsc();
+	retval = h->handler(ctx, *pvcpu, in, port, bytes,
+		(uint32_t *)&(pio_request->value), h->arg);
+	atomic_add_fetch(&h->cycles, inout_rdtsc() - tsc);
+	atomic_add_fetch(&h->hits, 1);
+
 	return retval;
 }
 
@@ -131,9 +215,9 @@ init_inout(void)
 	struct inout_port **iopp, *iop;
 
 	/*
-	 * Set up the default handler for all ports
+	 * All ports start out on the default handler
 	 */
-	register_default_iohandler(0, MAX_IOPORTS);
+	inout_reset();
 
 	/*
 	 * Overwrite with specified handlers
@@ -141,16 +225,16 @@ init_inout(void)
 	SET_FOREACH(iopp, inout_port_set) {
 		iop = *iopp;
 		assert(iop->port < MAX_IOPORTS);
-		inout_handlers[iop->port].name = iop->name;
-		inout_handlers[iop->port].flags = iop->flags;
-		inout_handlers[iop->port].handler = iop->handler;
-		inout_handlers[iop->port].arg = NULL;
+		if (register_inout(iop) != 0)
+			printf("failed to register %s at port 0x%x\n",
+			       iop->name, iop->port);
 	}
 }
 
-int
-disable_inout(struct inout_port *iop)
+static int
+inout_set_enabled(struct inout_port *iop, bool enabled)
 {
+	struct inout_handler *h;
 	int i;
 
 	if (!VERIFY_IOPORT(iop->port, iop->size)) {
@@ -159,34 +243,33 @@ disable_inout(struct inout_port *iop)
 		return -1;
 	}
 
+	pthread_mutex_lock(&inout_mtx);
 	for (i = iop->port; i < iop->port + iop->size; i++) {
-		inout_handlers[i].enabled = false;
+		h = inout_lookup(i);
+		if (h != &inout_default)
+			h->enabled = enabled;
 	}
+	pthread_mutex_unlock(&inout_mtx);
 
 	return 0;
 }
 
 int
-enable_inout(struct inout_port *iop)
+disable_inout(struct inout_port *iop)
 {
-	int i;
-
-	if (!VERIFY_IOPORT(iop->port, iop->size)) {
-		printf("invalid input: port:0x%x, size:%d",
-				iop->port, iop->size);
-		return -1;
-	}
-
-	for (i = iop->port; i < iop->port + iop->size; i++) {
-		inout_handlers[i].enabled = true;
-	}
+	return inout_set_enabled(iop, false);
+}
 
-	return 0;
+int
+enable_inout(struct inout_port *iop)
+{
+	return inout_set_enabled(iop, true);
 }
 
 int
 register_inout(struct inout_port *iop)
 {
+	struct inout_handler *h;
 	int i;
 
 	if (!VERIFY_IOPORT(iop->port, iop->size)) {
@@ -195,31 +278,60 @@ register_inout(struct inout_port *iop)
 		return -1;
 	}
 
+	pthread_mutex_lock(&inout_mtx);
+
 	/*
 	 * Verify that the new registration is not overwriting an already
 	 * allocated i/o range.
 	 */
-	if ((iop->flags & IOPORT_F_DEFAULT) == 0) {
-		for (i = iop->port; i < iop->port + iop->size; i++) {
-			if ((inout_handlers[i].flags & IOPORT_F_DEFAULT) == 0)
-				return -1;
+	for (i = iop->port; i < iop->port + iop->size; i++) {
+		if (inout_lookup(i) != &inout_default) {
+			pthread_mutex_unlock(&inout_mtx);
+			return -1;
 		}
 	}
 
-	for (i = iop->port; i < iop->port + iop->size; i++) {
-		inout_handlers[i].name = iop->name;
-		inout_handlers[i].flags = iop->flags;
-		inout_handlers[i].handler = iop->handler;
-		inout_handlers[i].arg = iop->arg;
-		inout_handlers[i].enabled = true;
+	/* a range that comes back, e.g. a PCI i/o BAR being re-enabled */
+	LIST_FOREACH(h, &inout_entries, list) {
+		if (!h->registered && h->port == iop->port &&
+		    h->size == iop->size && h->handler == iop->handler &&
+		    h->arg == iop->arg)
+			break;
+	}
+
+	if (h == NULL) {
+		h = calloc(1, sizeof(*h));
+		if (h == NULL) {
+			pthread_mutex_unlock(&inout_mtx);
+			return -1;
+		}
+		h->port = iop->port;
+		h->size = iop->size;
+		h->handler = iop->handler;
+		h->arg = iop->arg;
+		LIST_INSERT_HEAD(&inout_entries, h, list);
+	}
+
+	h->name = iop->name;
+	h->flags = iop->flags;
+	h->enabled = true;
+	h->registered = true;
+
+	if (inout_set_range(iop->port, iop->size, h) != 0) {
+		inout_set_range(iop->port, iop->size, NULL);
+		h->registered = false;
+		pthread_mutex_unlock(&inout_mtx);
+		return -1;
 	}
 
+	pthread_mutex_unlock(&inout_mtx);
 	return 0;
 }
 
 int
 unregister_inout(struct inout_port *iop)
 {
+	struct inout_handler *h;
 
 	if (!VERIFY_IOPORT(iop->port, iop->size)) {
 		printf("invalid input: port:0x%x, size:%d",
@@ -227,9 +339,40 @@ unregister_inout(struct inout_port *iop)
 		return -1;
 	}
 
-	assert(inout_handlers[iop->port].name == iop->name);
+	pthread_mutex_lock(&inout_mtx);
+	h = inout_lookup(iop->port);
+	assert(h->name == iop->name);
 
-	register_default_iohandler(iop->port, iop->size);
+	inout_set_range(iop->port, iop->size, NULL);
+	if (h != &inout_default)
+		h->registered = false;
+	pthread_mutex_unlock(&inout_mtx);
 
 	return 0;
 }
+
+int
+inout_dump_stats(FILE *fp)
+{
+	struct inout_handler *h;
+
+	pthread_mutex_lock(&inout_mtx);
+	fprintf(fp, "{\n  \"handlers\": [\n");
+	LIST_FOREACH(h, &inout_entries, list) {
+		fprintf(fp, "    { \"name\": \"%s\", \"port\": %d, "
+			"\"size\": %d, \"registered\": %s, "
+			"\"hits\": %lu, \"cycles\": %lu },\n",
+			h->name, h->port, h->size,
+			h->registered ? "true" : "false",
+			atomic_load(&h->hits), atomic_load(&h->cycles));
+	}
+	fprintf(fp, "    { \"name\": \"%s\", \"port\": 0, \"size\": %d, "
+		"\"registered\": true, \"hits\": %lu, \"cycles\": %lu }\n",
+		inout_default.name, MAX_IOPORTS,
+		atomic_load(&inout_default.hits),
+		atomic_load(&inout_default.cycles));
+	fprintf(fp, "  ]\n}\n");
+	pthread_mutex_unlock(&inout_mtx);
+
+	return ferror(fp) ? -1 : 0;
+}
@@ -35,9 +35,12 @@
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sysexits.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <strings.h>
+#include <time.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
@@ -64,6 +67,7 @@
 #include "atomic.h"
 #include "vmcfg_config.h"
 #include "vmcfg.h"
+#include "boot_timeline.h"
 
 #define GUEST_NIO_PORT		0x488	/* guest upcalls via i/o port */
 
@@ -71,6 +75,9 @@
 #define VHM_REQ_PIO_INVAL	(~0U)
 #define VHM_REQ_MMIO_INVAL	(~0UL)
 
+/* longest the dispatcher waits on in-flight requests before a rescan */
+#define IOREQ_RESCAN_US		50	/* default of --ioreq_rescan */
+
 typedef void (*vmexit_handler_t)(struct vmctx *,
 		struct vhm_request *, int *vcpu);
 
@@ -82,6 +89,9 @@ char *vsbl_file_name;
 char *kernel_file_name;
 char *elf_file_name;
 uint8_t trusty_enabled;
+bool rtvm_enabled;
+uint16_t sched_weight;	/* 0: the hypervisor default */
+uint16_t sched_cap;	/* 0: no cap */
 bool stdio_in_use;
 
 static int virtio_msix = 1;
@@ -120,6 +130,34 @@ struct mt_vmm_info {
 
 static cpuset_t *vcpumap[VM_MAXCPU] = { NULL };
 
+/*
+ * I/O request dispatch: vm_loop() is the only waiter on the ioreq
+ * client and hands each pending request slot (one per vCPU) to a
+ * worker thread, so that a slow device emulation only stalls the vCPU
+ * it came from.  Slot i is served by worker i % ioreq_nworkers.
+ */
+struct ioreq_worker {
+	pthread_t	tid;
+	pthread_cond_t	cond;
+	uint32_t	pending;	/* slots queued to this worker */
+	bool		exit;
+
+	/* dispatch to completion latency */
+	uint64_t	nreqs;
+	uint64_t	total_ns;
+	uint64_t	max_ns;
+};
+
+static int ioreq_nworkers;	/* 0: one worker per vCPU */
+static long ioreq_rescan_ns = IOREQ_RESCAN_US * 1000L;	/* 0: no rescan */
+static int ioreq_nslots;
+static struct vmctx *ioreq_ctx;
+static struct ioreq_worker ioreq_workers[VHM_REQUEST_MAX];
+static struct timespec ioreq_stamp[VHM_REQUEST_MAX];
+static uint32_t ioreq_inflight;	/* slots handed out, not completed */
+static pthread_mutex_t ioreq_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioreq_done;	/* on CLOCK_MONOTONIC */
+
 static struct vmctx *_ctx;
 
 static void
@@ -129,7 +167,8 @@ usage(int code)
 		"Usage: %s [-hAEWY] [-c vcpus] [-l <lpc>]\n"
 		"       %*s [-m mem] [-p vcpu:hostcpu] [-s <pci>] [-U uuid] \n"
 		"       %*s [--vsbl vsbl_file_name] [--part_info part_info_name]\n"
-		"       %*s [--enable_trusty] [--debugexit] <vm>\n"
+		"       %*s [--enable_trusty] [--debugexit] [--rtvm]\n"
+		"       %*s [--sched weight[,cap]] <vm>\n"
 		"       -A: create ACPI tables\n"
 		"       -c: # cpus (default 1)\n"
 		"       -E: elf image path\n"
@@ -157,9 +196,20 @@ usage(int code)
 		"       --ptdev_no_reset: disable reset check for ptdev\n"
 		"       --debugexit: enable debug exit function\n"
 		"       --intr_monitor: enable interrupt storm monitor\n"
-		"............its params: threshold/s,probe-period(s),delay_time(ms),delay_duration(ms)\n",
+		"............its params: threshold/s,probe-period(s),delay_time(ms),delay_duration(ms)\n"
+		"       --ioreq_workers: # I/O request threads (default one per vcpu)\n"
+		"       --ioreq_rescan: <us> check for new I/O requests this often while\n"
+		"............one is in flight (default 50, 0: only on completion)\n"
+		"       --mevent_loop: <name>[:hostcpu] run event loop 'name' in its own thread\n"
+		"............virtio kicks always run on their own 'pci<slot>.<func>' loop\n"
+		"       --hugetlb_prefault: # threads pre-faulting guest hugepages (default 1)\n"
+		"       --image_load: <nthreads>[,cache] kernel/ramdisk loading threads,\n"
+		"............'cache' keeps the images mapped for VM resets\n"
+		"       --rtvm: give each vcpu a physical cpu of its own\n"
+		"       --sched: <weight>[,<cap>] relative cpu share of the vcpus\n"
+		"............on shared physical cpus and max percentage of a cpu\n",
 		progname, (int)strlen(progname), "", (int)strlen(progname), "",
-		(int)strlen(progname), "");
+		(int)strlen(progname), "", (int)strlen(progname), "");
 
 	exit(code);
 }
@@ -209,6 +259,33 @@ pincpu_parse(const char *opt)
 	return 0;
 }
 
+static int
+sched_parse(const char *opt)
+{
+	int weight, cap = 0;
+
+	if (sscanf(opt, "%d,%d", &weight, &cap) < 1) {
+		fprintf(stderr, "invalid format: %s\n", opt);
+		return -1;
+	}
+
+	if (weight < 1 || weight > UINT16_MAX) {
+		fprintf(stderr, "weight '%d' outside valid range from 1 to %d\n",
+		    weight, UINT16_MAX);
+		return -1;
+	}
+
+	if (cap < 0 || cap > 100) {
+		fprintf(stderr, "cap '%d' outside valid range from 0 to 100\n",
+		    cap);
+		return -1;
+	}
+
+	sched_weight = weight;
+	sched_cap = cap;
+	return 0;
+}
+
 /**
  * @brief Convert guest physical address to host virtual address
  *
@@ -319,7 +396,7 @@ vmexit_mmio_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
 	int err;
 
-	stats.vmexit_mmio_emul++;
+	atomic_add_fetch(&stats.vmexit_mmio_emul, 1);
 	err = emulate_mem(ctx, &vhm_req->reqs.mmio_request);
 
 	if (err) {
@@ -411,7 +488,7 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 static int
 vm_init_vdevs(struct vmctx *ctx)
 {
-	int ret;
+	int ret, phase;
 
 	init_mem();
 	init_inout();
@@ -442,7 +519,9 @@ vm_init_vdevs(struct vmctx *ctx)
 	if (ret < 0)
 		goto monitor_fail;
 
+	phase = boot_phase_begin("init_pci");
 	ret = init_pci(ctx);
+	boot_phase_end(phase);
 	if (ret < 0)
 		goto pci_fail;
 
@@ -541,7 +620,7 @@ vm_system_reset(struct vmctx *ctx)
 	 */
 
 	vm_pause(ctx);
-	for (vcpu_id = 0; vcpu_id < 4; vcpu_id++) {
+	for (vcpu_id = 0; vcpu_id < ioreq_nslots; vcpu_id++) {
 		struct vhm_request *vhm_req;
 
 		vhm_req = &vhm_req_buf[vcpu_id];
@@ -611,7 +690,7 @@ vm_suspend_resume(struct vmctx *ctx)
 	 *   6. hypercall restart vm
 	 */
 	vm_pause(ctx);
-	for (vcpu_id = 0; vcpu_id < 4; vcpu_id++) {
+	for (vcpu_id = 0; vcpu_id < ioreq_nslots; vcpu_id++) {
 		struct vhm_request *vhm_req;
 
 		vhm_req = &vhm_req_buf[vcpu_id];
@@ -635,31 +714,222 @@ vm_suspend_resume(struct vmctx *ctx)
 	vm_run(ctx);
 }
 
+static void *
+ioreq_worker_thread(void *param)
+{
+	struct ioreq_worker *w = param;
+	struct timespec now;
+	uint32_t slots;
+	uint64_t ns;
+	int slot;
+
+	pthread_mutex_lock(&ioreq_mtx);
+	for (;;) {
+		while (!w->pending && !w->exit)
+			pthread_cond_wait(&w->cond, &ioreq_mtx);
+		if (w->exit)
+			break;
+		slots = w->pending;
+		w->pending = 0;
+		pthread_mutex_unlock(&ioreq_mtx);
+
+		while (slots) {
+			slot = ffs(slots) - 1;
+			slots &= ~(1U << slot);
+			handle_vmexit(ioreq_ctx, &vhm_req_buf[slot], slot);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			pthread_mutex_lock(&ioreq_mtx);
+			ns = (now.tv_sec - ioreq_stamp[slot].tv_sec) *
+				1000000000UL + now.tv_nsec -
+				ioreq_stamp[slot].tv_nsec;
+			w->nreqs++;
+			w->total_ns += ns;
+			if (ns > w->max_ns)
+				w->max_ns = ns;
+			ioreq_inflight &= ~(1U << slot);
+			pthread_cond_signal(&ioreq_done);
+			pthread_mutex_unlock(&ioreq_mtx);
+		}
+
+		pthread_mutex_lock(&ioreq_mtx);
+	}
+	pthread_mutex_unlock(&ioreq_mtx);
+
+	return NULL;
+}
+
+static int
+ioreq_workers_start(struct vmctx *ctx)
+{
+	char tname[MAXCOMLEN + 1];
+	struct ioreq_worker *w;
+	pthread_condattr_t attr;
+	int i, n, error;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ioreq_done, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ioreq_ctx = ctx;
+	ioreq_nslots = guest_ncpus;
+	n = ioreq_nworkers;
+	if (n <= 0 || n > ioreq_nslots)
+		n = ioreq_nslots;
+
+	for (i = 0; i < n; i++) {
+		w = &ioreq_workers[i];
+		memset(w, 0, sizeof(*w));
+		pthread_cond_init(&w->cond, NULL);
+		error = pthread_create(&w->tid, NULL, ioreq_worker_thread, w);
+		if (error) {
+			pthread_cond_destroy(&w->cond);
+			break;
+		}
+		snprintf(tname, sizeof(tname), "ioreq %d", i);
+		pthread_setname_np(w->tid, tname);
+	}
+	ioreq_nworkers = i;
+
+	return i > 0 ? 0 : -1;
+}
+
+static void
+ioreq_workers_stop(void)
+{
+	struct ioreq_worker *w;
+	int i;
+
+	pthread_mutex_lock(&ioreq_mtx);
+	for (i = 0; i < ioreq_nworkers; i++) {
+		ioreq_workers[i].exit = true;
+		pthread_cond_signal(&ioreq_workers[i].cond);
+	}
+	pthread_mutex_unlock(&ioreq_mtx);
+
+	for (i = 0; i < ioreq_nworkers; i++) {
+		w = &ioreq_workers[i];
+		pthread_join(w->tid, NULL);
+		pthread_cond_destroy(&w->cond);
+		if (w->nreqs)
+			printf("ioreq worker %d: %lu requests, latency "
+				"avg %lu ns max %lu ns\n", i, w->nreqs,
+				w->total_ns / w->nreqs, w->max_ns);
+	}
+}
+
+/*
+ * Hand the pending request slots not yet in flight to their workers.
+ * If there are none, wait for an in-flight one to complete instead.
+ * VHM keeps the slot of a request pending in the client until the
+ * request is completed, so waiting on the client again would return
+ * at once and spin.
+ *
+ * VHM gives no other way to learn of a new request from another vCPU,
+ * so the wait is bounded by ioreq_rescan_ns; without it the new request
+ * sits behind the slow one until that completes. The price is a rescan
+ * every interval while a request is in flight: about 9000 wakeups and
+ * 8% of a CPU per second with the default 50 us, 800 and 2% with 1 ms.
+ * --ioreq_rescan 0 waits for the completion only.
+ */
+static void
+ioreq_dispatch(struct vmctx *ctx)
+{
+	struct vhm_request *vhm_req;
+	struct ioreq_worker *w;
+	struct timespec now, deadline;
+	bool queued = false;
+	int slot;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&ioreq_mtx);
+	for (slot = 0; slot < ioreq_nslots; slot++) {
+		vhm_req = &vhm_req_buf[slot];
+		if ((ioreq_inflight & (1U << slot)) ||
+		    atomic_load(&vhm_req->processed) != REQ_STATE_PROCESSING ||
+		    vhm_req->client != ctx->ioreq_client)
+			continue;
+
+		ioreq_inflight |= 1U << slot;
+		ioreq_stamp[slot] = now;
+		w = &ioreq_workers[slot % ioreq_nworkers];
+		w->pending |= 1U << slot;
+		pthread_cond_signal(&w->cond);
+		queued = true;
+	}
+	if (!queued && ioreq_inflight && ioreq_rescan_ns == 0)
+		pthread_cond_wait(&ioreq_done, &ioreq_mtx);
+	else if (!queued && ioreq_inflight) {
+		deadline = now;
+		deadline.tv_sec += ioreq_rescan_ns / 1000000000;
+		deadline.tv_nsec += ioreq_rescan_ns % 1000000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+		pthread_cond_timedwait(&ioreq_done, &ioreq_mtx, &deadline);
+	}
+	pthread_mutex_unlock(&ioreq_mtx);
+}
+
+/*
+ * Have the hypervisor deliver the upcalls to the SOS vCPU vm_loop() is
+ * running on (SOS CPU n is vCPU n), rather than to vCPU 0, so that the
+ * wakeup of the waiter stays on one CPU.
+ */
+static void
+ioreq_set_notify_vcpu(void)
+{
+	static int notify_cpu = -1;
+	int cpu, slot;
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || cpu == notify_cpu)
+		return;
+
+	for (slot = 0; slot < ioreq_nslots; slot++)
+		vhm_req_buf[slot].notify_vcpu = cpu;
+	notify_cpu = cpu;
+}
+
+/* wait for all the dispatched requests to complete */
+static void
+ioreq_drain(void)
+{
+	pthread_mutex_lock(&ioreq_mtx);
+	while (ioreq_inflight)
+		pthread_cond_wait(&ioreq_done, &ioreq_mtx);
+	pthread_mutex_unlock(&ioreq_mtx);
+}
+
 static void
 vm_loop(struct vmctx *ctx)
 {
-	int error;
+	int error, phase;
 
 	ctx->ioreq_client = vm_create_ioreq_client(ctx);
 	assert(ctx->ioreq_client > 0);
 
+	error = ioreq_workers_start(ctx);
+	assert(error == 0);
+
+	phase = boot_phase_begin("vm_run");
 	error = vm_run(ctx);
+	boot_phase_end(phase);
 	assert(error == 0);
 
 	while (1) {
-		int vcpu_id;
-		struct vhm_request *vhm_req;
+		ioreq_set_notify_vcpu();
 
 		error = vm_attach_ioreq_client(ctx);
 		if (error)
 			break;
 
-		for (vcpu_id = 0; vcpu_id < 4; vcpu_id++) {
-			vhm_req = &vhm_req_buf[vcpu_id];
-			if ((atomic_load(&vhm_req->processed) == REQ_STATE_PROCESSING)
-				&& (vhm_req->client == ctx->ioreq_client))
-				handle_vmexit(ctx, vhm_req, vcpu_id);
-		}
+		ioreq_dispatch(ctx);
+
+		if (vm_get_suspend_mode() != VM_SUSPEND_NONE)
+			ioreq_drain();
 
 		if (VM_SUSPEND_FULL_RESET == vm_get_suspend_mode() ||
 		    VM_SUSPEND_POWEROFF == vm_get_suspend_mode()) {
@@ -674,16 +944,27 @@ vm_loop(struct vmctx *ctx)
 			vm_suspend_resume(ctx);
 		}
 	}
+	ioreq_drain();
+	ioreq_workers_stop();
 	printf("VM loop exit\n");
 }
 
 static int
 num_vcpus_allowed(struct vmctx *ctx)
 {
+	long ncpus;
+
 	/* TODO: add ioctl to get gerneric information including
-	 * virtual cpus, now hardcode
+	 * virtual cpus, now bound it by the physical cpus and the
+	 * VHM request slots, one of which is used per vcpu.
 	 */
-	return VM_MAXCPU;
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (ncpus <= 0 || ncpus > VM_MAXCPU)
+		ncpus = VM_MAXCPU;
+	if (ncpus > VHM_REQUEST_MAX)
+		ncpus = VHM_REQUEST_MAX;
+
+	return ncpus;
 }
 
 static void
@@ -703,6 +984,13 @@ enum {
 	CMD_OPT_VMCFG,
 	CMD_OPT_DUMP,
 	CMD_OPT_INTR_MONITOR,
+	CMD_OPT_IOREQ_WORKERS,
+	CMD_OPT_IOREQ_RESCAN,
+	CMD_OPT_MEVENT_LOOP,
+	CMD_OPT_HUGETLB_PREFAULT,
+	CMD_OPT_IMAGE_LOAD,
+	CMD_OPT_RTVM,
+	CMD_OPT_SCHED,
 };
 
 static struct option long_options[] = {
@@ -737,6 +1025,14 @@ static struct option long_options[] = {
 		CMD_OPT_PTDEV_NO_RESET},
 	{"debugexit",		no_argument,		0, CMD_OPT_DEBUGEXIT},
 	{"intr_monitor",	required_argument,	0, CMD_OPT_INTR_MONITOR},
+	{"ioreq_workers",	required_argument,	0, CMD_OPT_IOREQ_WORKERS},
+	{"ioreq_rescan",	required_argument,	0, CMD_OPT_IOREQ_RESCAN},
+	{"mevent_loop",		required_argument,	0, CMD_OPT_MEVENT_LOOP},
+	{"hugetlb_prefault",	required_argument,	0,
+		CMD_OPT_HUGETLB_PREFAULT},
+	{"image_load",		required_argument,	0, CMD_OPT_IMAGE_LOAD},
+	{"rtvm",		no_argument,		0, CMD_OPT_RTVM},
+	{"sched",		required_argument,	0, CMD_OPT_SCHED},
 	{0,			0,			0,  0  },
 };
 
@@ -745,7 +1041,7 @@ static char optstr[] = "hAWYvE:k:r:B:p:c:s:m:l:U:G:i:";
 int
 dm_run(int argc, char *argv[])
 {
-	int c, error, err;
+	int c, error, err, phase;
 	int max_vcpus, mptgen;
 	struct vmctx *ctx;
 	size_t memsize;
@@ -867,6 +1163,42 @@ dm_run(int argc, char *argv[])
 				exit(1);
 			}
 			break;
+		case CMD_OPT_IOREQ_WORKERS:
+			ioreq_nworkers = atoi(optarg);
+			if (ioreq_nworkers < 1)
+				errx(EX_USAGE, "invalid ioreq_workers %s",
+					optarg);
+			break;
+		case CMD_OPT_IOREQ_RESCAN:
+			ioreq_rescan_ns = atol(optarg);
+			if (ioreq_rescan_ns < 0 || ioreq_rescan_ns > 1000000)
+				errx(EX_USAGE, "invalid ioreq_rescan %s",
+					optarg);
+			ioreq_rescan_ns *= 1000;
+			break;
+		case CMD_OPT_MEVENT_LOOP:
+			if (mevent_loop_config(optarg) != 0)
+				errx(EX_USAGE, "invalid mevent_loop %s",
+					optarg);
+			break;
+		case CMD_OPT_HUGETLB_PREFAULT:
+			if (atoi(optarg) < 1)
+				errx(EX_USAGE, "invalid hugetlb_prefault %s",
+					optarg);
+			hugetlb_set_prefault_threads(atoi(optarg));
+			break;
+		case CMD_OPT_IMAGE_LOAD:
+			if (acrn_parse_image_load(optarg) != 0)
+				errx(EX_USAGE, "invalid image_load %s",
+					optarg);
+			break;
+		case CMD_OPT_RTVM:
+			rtvm_enabled = true;
+			break;
+		case CMD_OPT_SCHED:
+			if (sched_parse(optarg) != 0)
+				errx(EX_USAGE, "invalid sched %s", optarg);
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -887,6 +1219,8 @@ dm_run(int argc, char *argv[])
 	vmname = argv[0];
 
 	for (;;) {
+		boot_timeline_reset();
+
 		ctx = vm_create(vmname, (unsigned long)vhm_req_buf);
 		if (!ctx) {
 			perror("vm_open");
@@ -906,7 +1240,9 @@ dm_run(int argc, char *argv[])
 			goto fail;
 		}
 
+		phase = boot_phase_begin("setup_memory");
 		err = vm_setup_memory(ctx, memsize);
+		boot_phase_end(phase);
 		if (err) {
 			fprintf(stderr, "Unable to setup memory (%d)\n", errno);
 			goto fail;
@@ -919,7 +1255,10 @@ dm_run(int argc, char *argv[])
 			goto mevent_fail;
 		}
 
-		if (vm_init_vdevs(ctx) < 0) {
+		phase = boot_phase_begin("init_vdevs");
+		err = vm_init_vdevs(ctx);
+		boot_phase_end(phase);
+		if (err < 0) {
 			fprintf(stderr, "Unable to init vdev (%d)\n", errno);
 			goto dev_fail;
 		}
@@ -928,23 +1267,31 @@ dm_run(int argc, char *argv[])
 		 * build the guest tables, MP etc.
 		 */
 		if (mptgen) {
+			phase = boot_phase_begin("mptable_build");
 			error = mptable_build(ctx, guest_ncpus);
+			boot_phase_end(phase);
 			if (error) {
 				goto vm_fail;
 			}
 		}
 
+		phase = boot_phase_begin("smbios_build");
 		error = smbios_build(ctx);
+		boot_phase_end(phase);
 		if (error)
 			goto vm_fail;
 
 		if (acpi) {
+			phase = boot_phase_begin("acpi_build");
 			error = acpi_build(ctx, guest_ncpus);
+			boot_phase_end(phase);
 			if (error)
 				goto vm_fail;
 		}
 
+		phase = boot_phase_begin("sw_load");
 		error = acrn_sw_load(ctx);
+		boot_phase_end(phase);
 		if (error)
 			goto vm_fail;
 
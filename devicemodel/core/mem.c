@@ -30,6 +30,13 @@
  * Memory ranges are represented with an RB tree. On insertion, the range
  * is checked for overlaps. On lookup, the key has the same base and limit
  * so it can be searched within the range.
+ *
+ * The RB trees are only used by the updaters, under mmio_mtx.  After each
+ * update they are flattened into an immutable sorted table that is
+ * published with an atomic pointer store, so emulate_mem() never blocks:
+ * a reader announces the epoch it started in, and an updater frees the
+ * old table (and the removed range) only once every reader that may still
+ * see it has left.
  */
 
 #include <errno.h>
@@ -38,10 +45,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include "vmm.h"
 #include "mem.h"
 #include "tree.h"
+#include "atomic.h"
 
 struct mmio_rb_range {
 	RB_ENTRY(mmio_rb_range)	mr_link;	/* RB tree links */
@@ -56,14 +65,58 @@ RB_PROTOTYPE(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
 RB_HEAD(mmio_rb_tree, mmio_rb_range) mmio_rb_root, mmio_rb_fallback;
 
+/* Serializes the updaters; readers go through mmio_table. */
+static pthread_mutex_t mmio_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Immutable, sorted snapshot of both RB trees. */
+struct mmio_table {
+	uint64_t		gen;
+	int			nr_root;
+	int			nr_fallback;
+	struct mmio_rb_range	**fallback;
+	struct mmio_rb_range	*ranges[];
+};
+
+static struct mmio_table *mmio_table;
+static uint64_t mmio_table_gen;
+
 /*
- * Per-VM cache. Since most accesses from a vCPU will be to
+ * Reader epochs, one slot per thread doing lookups.  A slot holds the
+ * epoch its thread entered the read section in, or 0 outside it.
+ * Threads that find no free slot share mmio_readers_overflow.
+ */
+#define MMIO_READERS_MAX	64
+
+static struct mmio_reader {
+	uint64_t	epoch;
+	int		used;
+} __attribute__((aligned(64))) mmio_readers[MMIO_READERS_MAX];
+
+static uint64_t mmio_epoch = 1;
+static int mmio_readers_overflow;
+static pthread_key_t mmio_reader_key;
+
+static __thread struct mmio_reader *mmio_reader;
+static __thread bool mmio_reader_init;
+
+/* Nesting count of mem_reclaim_hold() on this thread. */
+static __thread int mmio_reclaim_held;
+
+/*
+ * Per-thread cache. Since most accesses from a vCPU will be to
  * consecutive addresses in a range, it makes sense to cache the
- * result of a lookup.
+ * result of a lookup.  It is only valid for the table it came from.
  */
-static struct mmio_rb_range	*mmio_hint;
+static __thread struct mmio_rb_range *mmio_hint;
+static __thread uint64_t mmio_hint_gen;
+
+/* Retired tables and ranges, freed after a grace period. */
+struct mmio_retired {
+	void			*ptr;
+	struct mmio_retired	*next;
+};
 
-static pthread_rwlock_t mmio_rwlock;
+static struct mmio_retired *mmio_retired;
 
 static int
 mmio_rb_range_compare(struct mmio_rb_range *a, struct mmio_rb_range *b)
@@ -120,17 +173,207 @@ mmio_rb_dump(struct mmio_rb_tree *rbt)
 {
 	struct mmio_rb_range *np;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	RB_FOREACH(np, mmio_rb_tree, rbt) {
 		printf(" %lx:%lx, %s\n", np->mr_base, np->mr_end,
 		       np->mr_param.name);
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
 }
 #endif
 
 RB_GENERATE(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
+static void
+mmio_reader_release(void *arg)
+{
+	struct mmio_reader *r = arg;
+
+	atomic_store(&r->used, 0);
+}
+
+static void
+mmio_reader_key_init(void)
+{
+	pthread_key_create(&mmio_reader_key, mmio_reader_release);
+}
+
+static struct mmio_reader *
+mmio_reader_get(void)
+{
+	int i, expected;
+
+	if (mmio_reader_init)
+		return mmio_reader;
+
+	mmio_reader_init = true;
+	for (i = 0; i < MMIO_READERS_MAX; i++) {
+		expected = 0;
+		if (atomic_cmpxchg(&mmio_readers[i].used, &expected, 1)) {
+			mmio_reader = &mmio_readers[i];
+			pthread_setspecific(mmio_reader_key, mmio_reader);
+			break;
+		}
+	}
+	return mmio_reader;
+}
+
+static struct mmio_table *
+mmio_read_lock(void)
+{
+	struct mmio_reader *r = mmio_reader_get();
+
+	if (r)
+		atomic_store(&r->epoch, atomic_load(&mmio_epoch));
+	else
+		atomic_add_fetch(&mmio_readers_overflow, 1);
+	/* the epoch store above is ordered before the table load */
+	return atomic_load(&mmio_table);
+}
+
+static void
+mmio_read_unlock(void)
+{
+	if (mmio_reader)
+		atomic_store(&mmio_reader->epoch, 0);
+	else
+		atomic_sub_fetch(&mmio_readers_overflow, 1);
+}
+
+/* Is the calling thread inside mmio_read_lock()? */
+static bool
+mmio_in_read_section(void)
+{
+	if (mmio_reader)
+		return atomic_load(&mmio_reader->epoch) != 0;
+	/* can't tell for overflow readers, be conservative */
+	return mmio_reader_init;
+}
+
+/*
+ * Take the retired items after a table swap.  Called with mmio_mtx held.
+ * An updater running inside a read section (from an MMIO handler) can't
+ * wait for itself, so it leaves them to the next update.  So does one
+ * inside mem_reclaim_hold(), it waits at mem_reclaim_release().
+ */
+static struct mmio_retired *
+mmio_reclaim_start(void)
+{
+	struct mmio_retired *list = mmio_retired;
+
+	if (list == NULL || mmio_reclaim_held || mmio_in_read_section())
+		return NULL;
+
+	mmio_retired = NULL;
+	return list;
+}
+
+/*
+ * Wait until every reader that entered before the table swap has left,
+ * then free the retired items.  Called without mmio_mtx so that a reader
+ * may itself be waiting for the mutex.
+ */
+static void
+mmio_reclaim_finish(struct mmio_retired *list)
+{
+	struct mmio_retired *next;
+	uint64_t epoch, e;
+	int i;
+
+	if (list == NULL)
+		return;
+
+	epoch = atomic_add_fetch(&mmio_epoch, 1);
+	for (i = 0; i < MMIO_READERS_MAX; i++) {
+		for (;;) {
+			e = atomic_load(&mmio_readers[i].epoch);
+			if (e == 0 || e >= epoch)
+				break;
+			sched_yield();
+		}
+	}
+	while (atomic_load(&mmio_readers_overflow))
+		sched_yield();
+
+	for (; list; list = next) {
+		next = list->next;
+		free(list->ptr);
+		free(list);
+	}
+}
+
+static void
+mmio_retire(void *ptr)
+{
+	struct mmio_retired *r;
+
+	if (ptr == NULL)
+		return;
+
+	/* out of memory: leak it rather than free it under a reader */
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+		return;
+	r->ptr = ptr;
+	r->next = mmio_retired;
+	mmio_retired = r;
+}
+
+/*
+ * Flatten both RB trees into a new table and publish it.  Called with
+ * mmio_mtx held.
+ */
+static int
+mmio_table_update(void)
+{
+	struct mmio_table *t, *old;
+	struct mmio_rb_range *np;
+	int n = 0;
+
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_root)
+		n++;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_fallback)
+		n++;
+
+	t = malloc(sizeof(*t) + n * sizeof(t->ranges[0]));
+	if (t == NULL)
+		return -1;
+
+	n = 0;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_root)
+		t->ranges[n++] = np;
+	t->nr_root = n;
+	t->fallback = &t->ranges[n];
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_fallback)
+		t->ranges[n++] = np;
+	t->nr_fallback = n - t->nr_root;
+	t->gen = ++mmio_table_gen;
+
+	old = mmio_table;
+	atomic_store(&mmio_table, t);
+	mmio_retire(old);
+
+	return 0;
+}
+
+static struct mmio_rb_range *
+mmio_table_lookup(struct mmio_rb_range **ranges, int nr, uint64_t addr)
+{
+	int lo = 0, hi = nr - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (addr < ranges[mid]->mr_base)
+			hi = mid - 1;
+		else if (addr > ranges[mid]->mr_end)
+			lo = mid + 1;
+		else
+			return ranges[mid];
+	}
+
+	return NULL;
+}
+
 __attribute__((unused))
 static int
 mem_read(void *ctx, int vcpu, uint64_t gpa, uint64_t *rval, int size, void *arg)
@@ -161,29 +404,40 @@ emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_table *t;
 	int err;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	t = mmio_read_lock();
+	if (t == NULL) {
+		mmio_read_unlock();
+		return -ESRCH;
+	}
+
 	/*
-	 * First check the per-VM cache
+	 * First check the per-thread cache
 	 */
-	if (mmio_hint && paddr >= mmio_hint->mr_base &&
-			paddr <= mmio_hint->mr_end)
+	if (mmio_hint && mmio_hint_gen == t->gen &&
+	    paddr >= mmio_hint->mr_base && paddr <= mmio_hint->mr_end)
 		entry = mmio_hint;
 
 	if (entry == NULL) {
-		if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-			/* Update the per-VMU cache */
+		entry = mmio_table_lookup(t->ranges, t->nr_root, paddr);
+		if (entry) {
+			/* Update the per-thread cache */
 			mmio_hint = entry;
-		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
-			pthread_rwlock_unlock(&mmio_rwlock);
-			return -ESRCH;
+			mmio_hint_gen = t->gen;
+		} else {
+			entry = mmio_table_lookup(t->fallback,
+						  t->nr_fallback, paddr);
+			if (entry == NULL) {
+				mmio_read_unlock();
+				return -ESRCH;
+			}
 		}
 	}
 
-	assert(entry != NULL);
-
-	if (entry->enabled == false) {
+	if (atomic_load(&entry->enabled) == false) {
+		mmio_read_unlock();
 		return -1;
 	}
 
@@ -194,7 +448,7 @@ emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
 		err = mem_write(ctx, 0, paddr, mmio_req->value,
 				size, &entry->mr_param);
 
-	pthread_rwlock_unlock(&mmio_rwlock);
+	mmio_read_unlock();
 
 	return err;
 }
@@ -203,6 +457,7 @@ static int
 register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
 	struct mmio_rb_range *entry, *mrp;
+	struct mmio_retired *retired;
 	int err;
 
 	err = 0;
@@ -214,10 +469,16 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		mrp->mr_base = memp->base;
 		mrp->mr_end = memp->base + memp->size - 1;
 		mrp->enabled = true;
-		pthread_rwlock_wrlock(&mmio_rwlock);
+		pthread_mutex_lock(&mmio_mtx);
 		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0)
 			err = mmio_rb_add(rbt, mrp);
-		pthread_rwlock_unlock(&mmio_rwlock);
+		if (err == 0 && mmio_table_update() != 0) {
+			RB_REMOVE(mmio_rb_tree, rbt, mrp);
+			err = -1;
+		}
+		retired = mmio_reclaim_start();
+		pthread_mutex_unlock(&mmio_mtx);
+		mmio_reclaim_finish(retired);
 		if (err)
 			free(mrp);
 	} else
@@ -226,66 +487,37 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 	return err;
 }
 
-int
-disable_mem(struct mem_range *memp)
+static int
+mmio_set_enabled(struct mem_range *memp, bool enabled)
 {
 	uint64_t paddr = memp->base;
 	struct mmio_rb_range *entry = NULL;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
-	/*
-	 * First check the per-VM cache
-	 */
-	if (mmio_hint && paddr >= mmio_hint->mr_base &&
-			paddr <= mmio_hint->mr_end)
-		entry = mmio_hint;
-
-	if (entry == NULL) {
-		if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-			/* Update the per-VMU cache */
-			mmio_hint = entry;
-		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
-			pthread_rwlock_unlock(&mmio_rwlock);
-			return -ESRCH;
-		}
+	pthread_mutex_lock(&mmio_mtx);
+	if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) &&
+	    mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
+		pthread_mutex_unlock(&mmio_mtx);
+		return -ESRCH;
 	}
 
 	assert(entry != NULL);
-	entry->enabled = false;
-	pthread_rwlock_unlock(&mmio_rwlock);
+	/* readers see the flag flip without a new table */
+	atomic_store(&entry->enabled, enabled);
+	pthread_mutex_unlock(&mmio_mtx);
 
 	return 0;
 }
 
 int
-enable_mem(struct mem_range *memp)
+disable_mem(struct mem_range *memp)
 {
-	uint64_t paddr = memp->base;
-	struct mmio_rb_range *entry = NULL;
-
-	pthread_rwlock_rdlock(&mmio_rwlock);
-	/*
-	 * First check the per-VM cache
-	 */
-	if (mmio_hint && paddr >= mmio_hint->mr_base &&
-			paddr <= mmio_hint->mr_end)
-		entry = mmio_hint;
-
-	if (entry == NULL) {
-		if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-			/* Update the per-VMU cache */
-			mmio_hint = entry;
-		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
-			pthread_rwlock_unlock(&mmio_rwlock);
-			return -ESRCH;
-		}
-	}
-
-	assert(entry != NULL);
-	entry->enabled = true;
-	pthread_rwlock_unlock(&mmio_rwlock);
+	return mmio_set_enabled(memp, false);
+}
 
-	return 0;
+int
+enable_mem(struct mem_range *memp)
+{
+	return mmio_set_enabled(memp, true);
 }
 
 int
@@ -305,9 +537,10 @@ unregister_mem_fallback(struct mem_range *memp)
 {
 	struct mem_range *mr;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_retired *retired = NULL;
 	int err;
 
-	pthread_rwlock_wrlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	err = mmio_rb_lookup(&mmio_rb_fallback, memp->base, &entry);
 	if (err == 0) {
 		mr = &entry->mr_param;
@@ -315,15 +548,17 @@ unregister_mem_fallback(struct mem_range *memp)
 		assert(mr->base == memp->base && mr->size == memp->size);
 		assert((mr->flags & MEM_F_IMMUTABLE) == 0);
 		RB_REMOVE(mmio_rb_tree, &mmio_rb_fallback, entry);
-
-		/* flush Per-VM cache */
-		if (mmio_hint == entry)
-			mmio_hint = NULL;
+		if (mmio_table_update() == 0) {
+			/* readers of the old table may still use it */
+			mmio_retire(entry);
+		} else {
+			RB_INSERT(mmio_rb_tree, &mmio_rb_fallback, entry);
+			err = -1;
+		}
+		retired = mmio_reclaim_start();
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
-
-	if (entry)
-		free(entry);
+	pthread_mutex_unlock(&mmio_mtx);
+	mmio_reclaim_finish(retired);
 
 	return err;
 }
@@ -333,9 +568,10 @@ unregister_mem(struct mem_range *memp)
 {
 	struct mem_range *mr;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_retired *retired = NULL;
 	int err;
 
-	pthread_rwlock_wrlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	err = mmio_rb_lookup(&mmio_rb_root, memp->base, &entry);
 	if (err == 0) {
 		mr = &entry->mr_param;
@@ -343,23 +579,60 @@ unregister_mem(struct mem_range *memp)
 		assert(mr->base == memp->base && mr->size == memp->size);
 		assert((mr->flags & MEM_F_IMMUTABLE) == 0);
 		RB_REMOVE(mmio_rb_tree, &mmio_rb_root, entry);
-
-		/* flush Per-VM cache */
-		if (mmio_hint == entry)
-			mmio_hint = NULL;
+		if (mmio_table_update() == 0) {
+			/* readers of the old table may still use it */
+			mmio_retire(entry);
+		} else {
+			RB_INSERT(mmio_rb_tree, &mmio_rb_root, entry);
+			err = -1;
+		}
+		retired = mmio_reclaim_start();
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
-
-	if (entry)
-		free(entry);
+	pthread_mutex_unlock(&mmio_mtx);
+	mmio_reclaim_finish(retired);
 
 	return err;
 }
 
+/*
+ * Don't wait for MMIO readers on this thread until the matching
+ * mem_reclaim_release().  For updaters holding a lock that an MMIO
+ * handler may take too: such a reader would never leave its read
+ * section while the updater waits for it.
+ */
+void
+mem_reclaim_hold(void)
+{
+	mmio_reclaim_held++;
+}
+
+void
+mem_reclaim_release(void)
+{
+	struct mmio_retired *retired;
+
+	assert(mmio_reclaim_held > 0);
+	if (--mmio_reclaim_held)
+		return;
+
+	pthread_mutex_lock(&mmio_mtx);
+	retired = mmio_reclaim_start();
+	pthread_mutex_unlock(&mmio_mtx);
+	mmio_reclaim_finish(retired);
+}
+
 void
 init_mem(void)
 {
+	static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+	struct mmio_retired *retired;
+
+	pthread_once(&key_once, mmio_reader_key_init);
 	RB_INIT(&mmio_rb_root);
 	RB_INIT(&mmio_rb_fallback);
-	pthread_rwlock_init(&mmio_rwlock, NULL);
+	pthread_mutex_lock(&mmio_mtx);
+	mmio_table_update();
+	retired = mmio_reclaim_start();
+	pthread_mutex_unlock(&mmio_mtx);
+	mmio_reclaim_finish(retired);
 }
@@ -29,12 +29,24 @@
 /*
  * Micro event library for FreeBSD, designed for a single i/o thread
  * using EPOLL, and having events be persistent by default.
+ *
+ * Besides the default loop run by mevent_dispatch() on the main thread,
+ * named loops can be configured with "--mevent_loop name[:cpu]".  Each
+ * named loop gets its own epoll fd and thread, optionally pinned to a
+ * host cpu, so that a busy device doesn't delay the events of another.
+ * A device asks for its loop with mevent_loop_get(); a name that wasn't
+ * configured maps to the default loop.  mevent_loop_get_own() starts a
+ * loop for an unconfigured name too, unbound, as long as fewer than
+ * MEVENT_LOOPS_MAX loops run.
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
@@ -44,17 +56,15 @@
 #include "vmmapi.h"
 
 #define	MEVENT_MAX	64
+#define	MEVENT_HASH	64
+#define	MEVENT_LOOPS_MAX	32
+#define	MEVENT_LOOP_NAME	16
 
 #define	MEV_ADD		1
 #define	MEV_ENABLE	2
 #define	MEV_DISABLE	3
 #define	MEV_DEL_PENDING	4
 
-static int epoll_fd;
-static pthread_t mevent_tid;
-static int mevent_pipefd[2];
-static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
-
 struct mevent {
 	void	(*me_func)(int, enum ev_type, void *);
 	int	me_fd;
@@ -63,22 +73,62 @@ struct mevent {
 	int	me_cq;
 	int	me_state;
 	int	me_closefd;
+	struct mevent_loop *me_loop;
 
 	LIST_ENTRY(mevent) me_list;
 };
 
-static LIST_HEAD(listhead, mevent) global_head;
+LIST_HEAD(listhead, mevent);
+
+struct mevent_loop {
+	char		name[MEVENT_LOOP_NAME];
+	int		cpu;
+	int		epoll_fd;
+	int		pipefd[2];
+	pthread_t	tid;
+	bool		running;
+	volatile bool	exit;
+	pthread_mutex_t	mtx;
+
+	/* events hashed by fd, for the duplicate check in mevent_add() */
+	struct listhead	hash[MEVENT_HASH];
+};
+
+static struct mevent_loop mevent_default = {
+	.name = "mevent",
+	.cpu = -1,
+	.epoll_fd = -1,
+	.pipefd = {-1, -1},
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Named loops given on the command line and the ones started so far */
+static struct {
+	char	name[MEVENT_LOOP_NAME];
+	int	cpu;
+} mevent_loop_cfg[MEVENT_LOOPS_MAX];
+static int mevent_nloop_cfg;
+
+static struct mevent_loop *mevent_loops[MEVENT_LOOPS_MAX];
+static int mevent_nloops;
+static pthread_mutex_t mevent_loops_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static void
-mevent_qlock(void)
+mevent_qlock(struct mevent_loop *loop)
 {
-	pthread_mutex_lock(&mevent_lmutex);
+	pthread_mutex_lock(&loop->mtx);
 }
 
 static void
-mevent_qunlock(void)
+mevent_qunlock(struct mevent_loop *loop)
+{
+	pthread_mutex_unlock(&loop->mtx);
+}
+
+static struct listhead *
+mevent_bucket(struct mevent_loop *loop, int fd)
 {
-	pthread_mutex_unlock(&mevent_lmutex);
+	return &loop->hash[(unsigned int)fd % MEVENT_HASH];
 }
 
 static void
@@ -96,19 +146,26 @@ mevent_pipe_read(int fd, enum ev_type type, void *param)
 	} while (status == MEVENT_MAX);
 }
 
+static int
+mevent_loop_kick(struct mevent_loop *loop)
+{
+	char c = 0;
+
+	if (loop->pipefd[1] >= 0 && write(loop->pipefd[1], &c, 1) <= 0)
+		return -1;
+	return 0;
+}
+
 /*On error, -1 is returned, else return zero*/
 int
 mevent_notify(void)
 {
-	char c;
-
 	/*
 	 * If calling from outside the i/o thread, write a byte on the
 	 * pipe to force the i/o thread to exit the blocking epoll call.
 	 */
-	if (mevent_pipefd[1] != 0 && pthread_self() != mevent_tid)
-		if (write(mevent_pipefd[1], &c, 1) <= 0)
-			return -1;
+	if (pthread_self() != mevent_default.tid)
+		return mevent_loop_kick(&mevent_default);
 	return 0;
 }
 
@@ -135,30 +192,34 @@ mevent_kq_filter(struct mevent *mevp)
 }
 
 static void
-mevent_destroy(void)
+mevent_destroy(struct mevent_loop *loop)
 {
 	struct mevent *mevp, *tmpp;
 	struct epoll_event ee;
+	int i;
 
-	mevent_qlock();
+	mevent_qlock(loop);
 
-	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
-		LIST_REMOVE(mevp, me_list);
-		ee.events = mevent_kq_filter(mevp);
-		ee.data.ptr = mevp;
-		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, &ee);
+	for (i = 0; i < MEVENT_HASH; i++) {
+		list_foreach_safe(mevp, &loop->hash[i], me_list, tmpp) {
+			LIST_REMOVE(mevp, me_list);
+			ee.events = mevent_kq_filter(mevp);
+			ee.data.ptr = mevp;
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, mevp->me_fd,
+				  &ee);
 
-		if ((mevp->me_type == EVF_READ ||
-		     mevp->me_type == EVF_READ_ET ||
-		     mevp->me_type == EVF_WRITE ||
-		     mevp->me_type == EVF_WRITE_ET) &&
-		     mevp->me_fd != STDIN_FILENO)
-			close(mevp->me_fd);
+			if ((mevp->me_type == EVF_READ ||
+			     mevp->me_type == EVF_READ_ET ||
+			     mevp->me_type == EVF_WRITE ||
+			     mevp->me_type == EVF_WRITE_ET) &&
+			     mevp->me_fd != STDIN_FILENO)
+				close(mevp->me_fd);
 
-		free(mevp);
+			free(mevp);
+		}
 	}
 
-	mevent_qunlock();
+	mevent_qunlock(loop);
 }
 
 static void
@@ -176,12 +237,13 @@ mevent_handle(struct epoll_event *kev, int numev)
 }
 
 struct mevent *
-mevent_add(int tfd, enum ev_type type,
-	   void (*func)(int, enum ev_type, void *), void *param)
+mevent_add_loop(struct mevent_loop *loop, int tfd, enum ev_type type,
+		void (*func)(int, enum ev_type, void *), void *param)
 {
 	int ret;
 	struct epoll_event ee;
 	struct mevent *lp, *mevp;
+	struct listhead *bucket;
 
 	if (tfd < 0 || func == NULL)
 		return NULL;
@@ -189,15 +251,19 @@ mevent_add(int tfd, enum ev_type type,
 	if (type == EVF_TIMER)
 		return NULL;
 
-	mevent_qlock();
+	if (loop == NULL)
+		loop = &mevent_default;
+	bucket = mevent_bucket(loop, tfd);
+
+	mevent_qlock(loop);
 	/* Verify that the fd/type tuple is not present in the list */
-	LIST_FOREACH(lp, &global_head, me_list) {
+	LIST_FOREACH(lp, bucket, me_list) {
 		if (lp->me_fd == tfd && lp->me_type == type) {
-			mevent_qunlock();
+			mevent_qunlock(loop);
 			return lp;
 		}
 	}
-	mevent_qunlock();
+	mevent_qunlock(loop);
 
 	/*
 	 * Allocate an entry, populate it, and add it to the list.
@@ -210,14 +276,15 @@ mevent_add(int tfd, enum ev_type type,
 	mevp->me_type = type;
 	mevp->me_func = func;
 	mevp->me_param = param;
+	mevp->me_loop = loop;
 
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
-	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
+	ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
 	if (ret == 0) {
-		mevent_qlock();
-		LIST_INSERT_HEAD(&global_head, mevp, me_list);
-		mevent_qunlock();
+		mevent_qlock(loop);
+		LIST_INSERT_HEAD(bucket, mevp, me_list);
+		mevent_qunlock(loop);
 
 		return mevp;
 	} else {
@@ -226,29 +293,37 @@ mevent_add(int tfd, enum ev_type type,
 	}
 }
 
+struct mevent *
+mevent_add(int tfd, enum ev_type type,
+	   void (*func)(int, enum ev_type, void *), void *param)
+{
+	return mevent_add_loop(&mevent_default, tfd, type, func, param);
+}
+
 int
 mevent_enable(struct mevent *evp)
 {
 	int ret;
 	struct epoll_event ee;
+	struct mevent_loop *loop = evp->me_loop;
 	struct mevent *lp, *mevp = NULL;
 
-	mevent_qlock();
-	/* Verify that the fd/type tuple is not present in the list */
-	LIST_FOREACH(lp, &global_head, me_list) {
+	mevent_qlock(loop);
+	/* Verify that the event is still present in the list */
+	LIST_FOREACH(lp, mevent_bucket(loop, evp->me_fd), me_list) {
 		if (lp == evp) {
 			mevp = lp;
 			break;
 		}
 	}
-	mevent_qunlock();
+	mevent_qunlock(loop);
 
 	if (!mevp)
 		return -1;
 
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
-	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
+	ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
 	if (ret < 0 && errno == EEXIST)
 		ret = 0;
 
@@ -260,7 +335,8 @@ mevent_disable(struct mevent *evp)
 {
 	int ret;
 
-	ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, NULL);
+	ret = epoll_ctl(evp->me_loop->epoll_fd, EPOLL_CTL_DEL, evp->me_fd,
+			NULL);
 	if (ret < 0 && errno == ENOENT)
 		ret = 0;
 
@@ -271,14 +347,15 @@ static int
 mevent_delete_event(struct mevent *evp, int closefd)
 {
 	struct epoll_event ee;
+	struct mevent_loop *loop = evp->me_loop;
 
-	mevent_qlock();
+	mevent_qlock(loop);
 	LIST_REMOVE(evp, me_list);
-	mevent_qunlock();
+	mevent_qunlock(loop);
 
 	ee.events = mevent_kq_filter(evp);
 	ee.data.ptr = evp;
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, &ee);
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, evp->me_fd, &ee);
 
 	if (closefd)
 		close(evp->me_fd);
@@ -299,73 +376,292 @@ mevent_delete_close(struct mevent *evp)
 	return mevent_delete_event(evp, 1);
 }
 
+static int
+mevent_loop_init(struct mevent_loop *loop)
+{
+	struct mevent *pipev;
+	int i;
+
+	for (i = 0; i < MEVENT_HASH; i++)
+		LIST_INIT(&loop->hash[i]);
+
+	loop->exit = false;
+	loop->epoll_fd = epoll_create1(0);
+	if (loop->epoll_fd < 0)
+		return -1;
+
+	/*
+	 * Open the pipe that will be used for other threads to force
+	 * the blocking epoll call to exit by writing to it. Set the
+	 * descriptor to non-blocking.
+	 */
+	if (pipe2(loop->pipefd, O_NONBLOCK) < 0) {
+		perror("pipe");
+		goto fail;
+	}
+
+	/*
+	 * Add internal event handler for the pipe write fd
+	 */
+	pipev = mevent_add_loop(loop, loop->pipefd[0], EVF_READ,
+				mevent_pipe_read, NULL);
+	if (pipev == NULL) {
+		close(loop->pipefd[0]);
+		close(loop->pipefd[1]);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	loop->pipefd[0] = loop->pipefd[1] = -1;
+	close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+	return -1;
+}
+
+static void
+mevent_loop_deinit(struct mevent_loop *loop)
+{
+	if (loop->epoll_fd < 0)
+		return;
+
+	/* closes the pipe read side too */
+	mevent_destroy(loop);
+	close(loop->pipefd[1]);
+	loop->pipefd[0] = loop->pipefd[1] = -1;
+	close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+}
+
+static void
+mevent_loop_wait(struct mevent_loop *loop)
+{
+	struct epoll_event eventlist[MEVENT_MAX];
+	int ret;
+
+	/*
+	 * Block awaiting events
+	 */
+	ret = epoll_wait(loop->epoll_fd, eventlist, MEVENT_MAX, -1);
+	if (ret == -1) {
+		if (errno != EINTR)
+			perror("Error return from epoll_wait");
+		return;
+	}
+
+	/*
+	 * Handle reported events
+	 */
+	mevent_handle(eventlist, ret);
+}
+
+static void *
+mevent_loop_thread(void *param)
+{
+	struct mevent_loop *loop = param;
+
+	while (!loop->exit)
+		mevent_loop_wait(loop);
+
+	return NULL;
+}
+
+static struct mevent_loop *
+mevent_loop_start(const char *name, int cpu)
+{
+	struct mevent_loop *loop;
+	char tname[16];
+	cpu_set_t mask;
+
+	loop = calloc(1, sizeof(*loop));
+	if (loop == NULL)
+		return NULL;
+
+	snprintf(loop->name, sizeof(loop->name), "%s", name);
+	loop->cpu = cpu;
+	pthread_mutex_init(&loop->mtx, NULL);
+	if (mevent_loop_init(loop) < 0)
+		goto fail;
+
+	if (pthread_create(&loop->tid, NULL, mevent_loop_thread, loop)) {
+		mevent_loop_deinit(loop);
+		goto fail;
+	}
+	loop->running = true;
+
+	snprintf(tname, sizeof(tname), "mevent %s", name);
+	pthread_setname_np(loop->tid, tname);
+
+	if (cpu >= 0) {
+		CPU_ZERO(&mask);
+		CPU_SET(cpu, &mask);
+		if (pthread_setaffinity_np(loop->tid, sizeof(mask), &mask))
+			fprintf(stderr, "mevent: can't bind %s to cpu %d\n",
+				name, cpu);
+	}
+
+	return loop;
+
+fail:
+	fprintf(stderr, "mevent: failed to start loop %s\n", name);
+	pthread_mutex_destroy(&loop->mtx);
+	free(loop);
+	return NULL;
+}
+
+static void
+mevent_loop_stop(struct mevent_loop *loop)
+{
+	if (!loop->running)
+		return;
+
+	loop->exit = true;
+	mevent_loop_kick(loop);
+	pthread_join(loop->tid, NULL);
+	loop->running = false;
+}
+
+/*
+ * Stop the named loop threads once the VM is going down, so that devices
+ * can delete their events without racing with the handlers.
+ */
 static void
-mevent_set_name(void)
+mevent_loops_stop(void)
 {
-	pthread_setname_np(mevent_tid, "mevent");
+	int i;
+
+	pthread_mutex_lock(&mevent_loops_mtx);
+	for (i = 0; i < mevent_nloops; i++)
+		mevent_loop_stop(mevent_loops[i]);
+	pthread_mutex_unlock(&mevent_loops_mtx);
 }
 
 int
-mevent_init(void)
+mevent_loop_config(const char *opt)
 {
-	epoll_fd = epoll_create1(0);
-	assert(epoll_fd >= 0);
+	char *name, *cp;
+	long cpu = -1;
+
+	if (mevent_nloop_cfg >= MEVENT_LOOPS_MAX)
+		return -1;
+
+	name = strdup(opt);
+	if (name == NULL)
+		return -1;
+
+	cp = strchr(name, ':');
+	if (cp) {
+		*cp++ = '\0';
+		errno = 0;
+		cpu = strtol(cp, &cp, 10);
+		if (errno || *cp != '\0' || cpu < 0 || cpu >= CPU_SETSIZE) {
+			free(name);
+			return -1;
+		}
+	}
 
-	if (epoll_fd >= 0)
-		return 0;
-	else
+	if (*name == '\0' || strlen(name) >= MEVENT_LOOP_NAME) {
+		free(name);
 		return -1;
+	}
+
+	snprintf(mevent_loop_cfg[mevent_nloop_cfg].name, MEVENT_LOOP_NAME,
+		 "%s", name);
+	mevent_loop_cfg[mevent_nloop_cfg].cpu = cpu;
+	mevent_nloop_cfg++;
+	free(name);
+
+	return 0;
 }
 
-void
-mevent_deinit(void)
+static struct mevent_loop *
+mevent_loop_lookup(const char *name, bool own)
+{
+	struct mevent_loop *loop = &mevent_default;
+	int i, cpu = -1;
+
+	pthread_mutex_lock(&mevent_loops_mtx);
+	for (i = 0; i < mevent_nloops; i++) {
+		if (!strcmp(mevent_loops[i]->name, name)) {
+			loop = mevent_loops[i];
+			goto done;
+		}
+	}
+
+	for (i = 0; i < mevent_nloop_cfg; i++) {
+		if (!strcmp(mevent_loop_cfg[i].name, name))
+			break;
+	}
+	if (i < mevent_nloop_cfg)
+		cpu = mevent_loop_cfg[i].cpu;
+	else if (!own)
+		goto done;
+
+	if (mevent_nloops < MEVENT_LOOPS_MAX) {
+		loop = mevent_loop_start(name, cpu);
+		if (loop)
+			mevent_loops[mevent_nloops++] = loop;
+		else
+			loop = &mevent_default;
+	}
+
+done:
+	pthread_mutex_unlock(&mevent_loops_mtx);
+	return loop;
+}
+
+struct mevent_loop *
+mevent_loop_get(const char *name)
 {
-	mevent_destroy();
-	close(epoll_fd);
+	return mevent_loop_lookup(name, false);
 }
 
-void
-mevent_dispatch(void)
+struct mevent_loop *
+mevent_loop_get_own(const char *name)
 {
-	struct epoll_event eventlist[MEVENT_MAX];
+	return mevent_loop_lookup(name, true);
+}
 
-	struct mevent *pipev;
+int
+mevent_init(void)
+{
 	int ret;
 
-	mevent_tid = pthread_self();
-	mevent_set_name();
+	ret = mevent_loop_init(&mevent_default);
+	assert(ret == 0);
 
-	/*
-	 * Open the pipe that will be used for other threads to force
-	 * the blocking kqueue call to exit by writing to it. Set the
-	 * descriptor to non-blocking.
-	 */
-	ret = pipe(mevent_pipefd);
-	if (ret < 0) {
-		perror("pipe");
-		exit(0);
+	return ret;
+}
+
+void
+mevent_deinit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&mevent_loops_mtx);
+	for (i = 0; i < mevent_nloops; i++) {
+		mevent_loop_stop(mevent_loops[i]);
+		mevent_loop_deinit(mevent_loops[i]);
+		pthread_mutex_destroy(&mevent_loops[i]->mtx);
+		free(mevent_loops[i]);
 	}
+	mevent_nloops = 0;
+	pthread_mutex_unlock(&mevent_loops_mtx);
 
-	/*
-	 * Add internal event handler for the pipe write fd
-	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL);
-	assert(pipev != NULL);
+	mevent_loop_deinit(&mevent_default);
+}
+
+void
+mevent_dispatch(void)
+{
+	mevent_default.tid = pthread_self();
+	pthread_setname_np(mevent_default.tid, "mevent");
 
 	for (;;) {
 		int suspend_mode;
 
-		/*
-		 * Block awaiting events
-		 */
-		ret = epoll_wait(epoll_fd, eventlist, MEVENT_MAX, -1);
-		if (ret == -1 && errno != EINTR)
-			perror("Error return from epoll_wait");
-
-		/*
-		 * Handle reported events
-		 */
-		mevent_handle(eventlist, ret);
+		mevent_loop_wait(&mevent_default);
 
 		suspend_mode = vm_get_suspend_mode();
 
@@ -374,4 +670,6 @@ mevent_dispatch(void)
 		    (suspend_mode != VM_SUSPEND_SUSPEND))
 			break;
 	}
+
+	mevent_loops_stop();
 }
@@ -23,6 +23,9 @@
 #include "acrn_mngr.h"
 #include "pm.h"
 #include "vmmapi.h"
+#include "boot_timeline.h"
+#include "inout.h"
+#include "block_if.h"
 
 #define INTR_STORM_MONITOR_PERIOD	10 /* 10 seconds */
 #define INTR_STORM_THRESHOLD	100000 /* 10K times per second */
@@ -408,6 +411,60 @@ static void handle_query(struct mngr_msg *msg, int client_fd, void *param)
 	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
 }
 
+/*
+ * Reports that don't fit in a mngr_msg are written as JSON to
+ * /run/acrn/<vmname>.<suffix>.json, the ack only carries the result.
+ */
+static void handle_dump(struct mngr_msg *msg, int client_fd,
+			const char *suffix, int (*dump)(FILE *fp))
+{
+	struct mngr_msg ack;
+	char path[128], tmp[136];
+	FILE *fp;
+	int ret = -1;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	snprintf(path, sizeof(path), "/run/acrn/%s.%s.json", vmname, suffix);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fp = fopen(tmp, "w");
+	if (fp) {
+		ret = dump(fp);
+		if (fclose(fp))
+			ret = -1;
+		if (ret == 0 && rename(tmp, path))
+			ret = -1;
+		if (ret)
+			unlink(tmp);
+	}
+	if (ret)
+		fprintf(stderr, "%s: failed to write %s\r\n", __func__, path);
+
+	ack.data.err = ret;
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_boot_timeline(struct mngr_msg *msg, int client_fd,
+				 void *param)
+{
+	handle_dump(msg, client_fd, "boot", boot_timeline_dump);
+}
+
+static void handle_pio_stats(struct mngr_msg *msg, int client_fd,
+			     void *param)
+{
+	handle_dump(msg, client_fd, "pio", inout_dump_stats);
+}
+
+static void handle_blk_stats(struct mngr_msg *msg, int client_fd,
+			     void *param)
+{
+	handle_dump(msg, client_fd, "blk", blockif_dump_stats);
+}
+
 static struct monitor_vm_ops pmc_ops = {
 	.stop       = NULL,
 	.resume     = vm_monitor_resume,
@@ -449,6 +506,12 @@ int monitor_init(struct vmctx *ctx)
 	ret += mngr_add_handler(monitor_fd, DM_PAUSE, handle_pause, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_CONTINUE, handle_continue, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_QUERY, handle_query, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BOOT_TIMELINE,
+				handle_boot_timeline, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_PIO_STATS,
+				handle_pio_stats, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BLK_STATS,
+				handle_blk_stats, NULL);
 
 	if (ret) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
@@ -170,37 +170,29 @@ acrn_parse_ramdisk(char *arg)
 static int
 acrn_prepare_ramdisk(struct vmctx *ctx)
 {
-	FILE *fp;
-	int len, read;
+	ssize_t len;
 
-	fp = fopen(ramdisk_path, "r");
-	if (fp == NULL) {
+	len = acrn_image_size(ramdisk_path);
+	if (len < 0) {
 		printf("SW_LOAD ERR: could not open ramdisk file %s\n",
 				ramdisk_path);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
 	if (len > (BOOTARGS_LOAD_OFF(ctx) - RAMDISK_LOAD_OFF(ctx))) {
 		printf("SW_LOAD ERR: the size of ramdisk file is too big"
-				" file len=0x%x, limit is 0x%lx\n", len,
+				" file len=0x%lx, limit is 0x%lx\n", len,
 				BOOTARGS_LOAD_OFF(ctx) - RAMDISK_LOAD_OFF(ctx));
-		fclose(fp);
 		return -1;
 	}
 	ramdisk_size = len;
 
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + RAMDISK_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
+	if (acrn_load_image(ramdisk_path,
+			ctx->baseaddr + RAMDISK_LOAD_OFF(ctx), len) < 0) {
 		printf("SW_LOAD ERR: could not read the whole ramdisk file,"
-				" file len=%d, read %d\n", len, read);
-		fclose(fp);
+				" file len=%ld\n", len);
 		return -1;
 	}
-	fclose(fp);
 	printf("SW_LOAD: ramdisk %s size %d copied to guest 0x%lx\n",
 			ramdisk_path, ramdisk_size, RAMDISK_LOAD_OFF(ctx));
 
@@ -210,35 +202,27 @@ acrn_prepare_ramdisk(struct vmctx *ctx)
 static int
 acrn_prepare_kernel(struct vmctx *ctx)
 {
-	FILE *fp;
-	int len, read;
+	ssize_t len;
 
-	fp = fopen(kernel_path, "r");
-	if (fp == NULL) {
+	len = acrn_image_size(kernel_path);
+	if (len < 0) {
 		printf("SW_LOAD ERR: could not open kernel file %s\n",
 				kernel_path);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
 	if ((len + KERNEL_LOAD_OFF(ctx)) > RAMDISK_LOAD_OFF(ctx)) {
 		printf("SW_LOAD ERR: need big system memory to fit image\n");
-		fclose(fp);
 		return -1;
 	}
 	kernel_size = len;
 
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + KERNEL_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
+	if (acrn_load_image(kernel_path,
+			ctx->baseaddr + KERNEL_LOAD_OFF(ctx), len) < 0) {
 		printf("SW_LOAD ERR: could not read the whole kernel file,"
-				" file len=%d, read %d\n", len, read);
-		fclose(fp);
+				" file len=%ld\n", len);
 		return -1;
 	}
-	fclose(fp);
 	printf("SW_LOAD: kernel %s size %d copied to guest 0x%lx\n",
 			kernel_path, kernel_size, KERNEL_LOAD_OFF(ctx));
 
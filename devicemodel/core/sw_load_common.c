@@ -29,6 +29,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
@@ -37,6 +43,40 @@
 int with_bootargs;
 static char bootargs[STR_LEN];
 
+/*
+ * Image loading: files are copied to guest memory by image_load_threads
+ * threads, each pread()ing one chunk straight into the guest mapping.
+ * With image_cache, a file stays mapped and populated after its first
+ * load, so the reloads of a VM reset copy from the page cache without
+ * any syscall, as long as the file is unchanged.
+ */
+#define IMAGE_CHUNK_MIN		(4UL * 1024 * 1024)
+#define IMAGE_LOAD_THREADS_MAX	16
+#define IMAGE_CACHE_MAX		4
+
+static int image_load_threads = 1;
+static bool image_cache;
+
+struct image_cache_entry {
+	char	*path;
+	dev_t	dev;
+	ino_t	ino;
+	off_t	size;
+	struct timespec mtime;
+	void	*map;
+};
+
+static struct image_cache_entry image_cache_entries[IMAGE_CACHE_MAX];
+
+struct image_chunk {
+	int	fd;		/* -1 to copy from src */
+	const char *src;
+	char	*dst;
+	size_t	len;
+	off_t	off;
+	int	err;
+};
+
 /*
  * Default e820 mem map:
  *
@@ -110,6 +150,30 @@ acrn_parse_bootargs(char *arg)
 		return -1;
 }
 
+/*
+ * Parse "--image_load <nthreads>[,cache]"
+ */
+int
+acrn_parse_image_load(char *arg)
+{
+	char *cp;
+	long n;
+
+	n = strtol(arg, &cp, 10);
+	if (cp == arg || n < 1 || n > IMAGE_LOAD_THREADS_MAX)
+		return -1;
+
+	if (*cp == ',') {
+		if (strcmp(cp + 1, "cache"))
+			return -1;
+		image_cache = true;
+	} else if (*cp != '\0')
+		return -1;
+
+	image_load_threads = n;
+	return 0;
+}
+
 char*
 get_bootargs(void)
 {
@@ -129,6 +193,175 @@ check_image(char *path)
 	return 0;
 }
 
+ssize_t
+acrn_image_size(char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+
+	return st.st_size;
+}
+
+static void *
+image_copy_chunk(void *arg)
+{
+	struct image_chunk *c = arg;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (c->fd < 0) {
+		memcpy(c->dst, c->src, c->len);
+		return NULL;
+	}
+
+	while (done < c->len) {
+		ret = pread(c->fd, c->dst + done, c->len - done,
+			    c->off + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			c->err = -1;
+			break;
+		}
+		done += ret;
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy len bytes, from fd at offset 0 or from src if fd < 0, to dst in
+ * up to image_load_threads chunks of at least IMAGE_CHUNK_MIN.
+ */
+static int
+image_copy(int fd, const char *src, char *dst, size_t len)
+{
+	struct image_chunk chunks[IMAGE_LOAD_THREADS_MAX];
+	pthread_t tids[IMAGE_LOAD_THREADS_MAX];
+	bool started[IMAGE_LOAD_THREADS_MAX];
+	size_t per, off = 0;
+	int i, n, err = 0;
+
+	n = image_load_threads;
+	if (n > len / IMAGE_CHUNK_MIN)
+		n = len / IMAGE_CHUNK_MIN;
+	if (n < 1)
+		n = 1;
+
+	/*
+	 * chunk boundaries on 2M, the guest memory page size; rounding
+	 * len / n up keeps n chunks covering all of len
+	 */
+	per = roundup2((len + n - 1) / n, 0x200000UL);
+
+	for (i = 0; i < n && off < len; i++) {
+		chunks[i].fd = fd;
+		chunks[i].src = src ? src + off : NULL;
+		chunks[i].dst = dst + off;
+		chunks[i].off = off;
+		chunks[i].len = (len - off < per) ? len - off : per;
+		chunks[i].err = 0;
+		off += chunks[i].len;
+
+		/* the calling thread takes the last chunk */
+		started[i] = (off < len) && !pthread_create(&tids[i], NULL,
+					image_copy_chunk, &chunks[i]);
+		if (!started[i])
+			image_copy_chunk(&chunks[i]);
+	}
+	n = i;
+
+	for (i = 0; i < n; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+		err |= chunks[i].err;
+	}
+
+	return err;
+}
+
+/*
+ * Find path in the image cache, mapping it on first use.  An entry is
+ * dropped when the file changed since it was mapped.
+ */
+static void *
+image_cache_get(char *path, int fd, size_t len)
+{
+	struct image_cache_entry *e, *free_e = NULL;
+	struct stat st;
+	void *map;
+	int i;
+
+	if (fstat(fd, &st) < 0 || st.st_size != len)
+		return NULL;
+
+	for (i = 0; i < IMAGE_CACHE_MAX; i++) {
+		e = &image_cache_entries[i];
+		if (!e->path) {
+			if (!free_e)
+				free_e = e;
+			continue;
+		}
+		if (strcmp(e->path, path))
+			continue;
+
+		if (e->dev == st.st_dev && e->ino == st.st_ino &&
+		    e->size == st.st_size &&
+		    e->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    e->mtime.tv_nsec == st.st_mtim.tv_nsec)
+			return e->map;
+
+		munmap(e->map, e->size);
+		free(e->path);
+		memset(e, 0, sizeof(*e));
+		free_e = e;
+		break;
+	}
+
+	if (!free_e || len == 0)
+		return NULL;
+
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	free_e->path = strdup(path);
+	if (!free_e->path) {
+		munmap(map, len);
+		return NULL;
+	}
+	free_e->dev = st.st_dev;
+	free_e->ino = st.st_ino;
+	free_e->size = st.st_size;
+	free_e->mtime = st.st_mtim;
+	free_e->map = map;
+
+	return map;
+}
+
+int
+acrn_load_image(char *path, void *dst, size_t len)
+{
+	void *map = NULL;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (image_cache)
+		map = image_cache_get(path, fd, len);
+	if (!map)
+		posix_fadvise(fd, 0, len, POSIX_FADV_SEQUENTIAL);
+
+	err = image_copy(map ? -1 : fd, map, dst, len);
+	close(fd);
+
+	return err;
+}
+
 /* Assumption:
  * the range [start, start + size] belongs to one entry of e820 table
  */
@@ -130,6 +130,12 @@ vm_create(const char *name, uint64_t req_buf)
 	else
 		create_vm.vm_flag &= (~SECURE_WORLD_ENABLED);
 
+	/* Set dedicated pcpu flag and scheduling parameters */
+	if (rtvm_enabled)
+		create_vm.vm_flag |= DEDICATED_PCPU_ENABLED;
+	create_vm.sched_weight = sched_weight;
+	create_vm.sched_cap = sched_cap;
+
 	create_vm.req_buf = req_buf;
 	while (retry > 0) {
 		error = ioctl(ctx->fd, IC_CREATE_VM, &create_vm);
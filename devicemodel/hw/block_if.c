@@ -30,22 +30,29 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <unistd.h>
 
 #include "dm.h"
 #include "block_if.h"
+#include "block_overlay.h"
 #include "ahci.h"
 #include "dm_string.h"
+#include "atomic.h"
 
 /*
  * Notes:
@@ -59,10 +66,32 @@
 #define F_OFD_SETLK	37
 #endif
 
+/*
+ * io_uring syscall numbers are the same on all architectures, provide them
+ * in case the build host ships an older libc.
+ */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+
 #define BLOCKIF_SIG	0xb109b109
 
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
+#define BLOCKIF_MAXQ	16
+
+/* default latency bound of a group commit, in microseconds */
+#define BLOCKIF_GC_DELAY_US	0
+
+/*
+ * A request takes at most two SQEs (write + linked fsync in writethru
+ * mode), so the ring never runs out of entries with BLOCKIF_MAXREQ
+ * requests in flight.
+ */
+#define BLOCKIF_URING_ENTRIES	256
 
 /*
  * Debug printf
@@ -86,6 +115,12 @@ enum blockstat {
 	BST_DONE
 };
 
+/* I/O engine used to serve the requests of one blockif_ctxt */
+enum blockaio {
+	BAIO_THREADS,	/* pool of worker threads doing preadv/pwritev */
+	BAIO_URING	/* io_uring submission/completion rings */
+};
+
 struct blockif_elem {
 	TAILQ_ENTRY(blockif_elem) link;
 	struct blockif_req  *req;
@@ -93,6 +128,99 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+
+	/* io_uring engine only */
+	int		     uring_inflight;	/* SQEs not completed yet */
+	int		     uring_err;
+	int		     uring_sync;	/* run by completion thread */
+	int		     uring_fsync;	/* linked fsync was cancelled */
+
+	/* guest flush waiting for the next group commit */
+	TAILQ_ENTRY(blockif_elem) gc_link;
+
+	/*
+	 * Contiguous requests merged into this one, served by a single
+	 * vectored syscall. Only the head of a merge chain owns merge_iov.
+	 */
+	struct blockif_elem  *merge_next;
+	struct iovec	     merge_iov[BLOCKIF_IOV_MAX];
+};
+
+/*
+ * user_data of an SQE is the blockif_elem pointer. The fsync linked after
+ * a writethru write is tagged with the low bit so that its completion does
+ * not account for transferred bytes. user_data 0 is the wakeup NOP used on
+ * close.
+ */
+#define BLOCKIF_URING_LINKED	1UL
+
+struct blockif_uring {
+	int			fd;
+	pthread_t		tid;
+	unsigned int		to_submit;	/* SQEs not passed to kernel */
+	unsigned int		sq_tail;	/* local copy of sq tail */
+
+	/* submission queue, shared with kernel */
+	void			*sq_ptr;
+	size_t			sq_sz;
+	unsigned int		*sq_khead;
+	unsigned int		*sq_ktail;
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	/* completion queue, shared with kernel */
+	void			*cq_ptr;
+	size_t			cq_sz;
+	unsigned int		*cq_khead;
+	unsigned int		*cq_ktail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+/*
+ * A request queue with its own lock, request elements and I/O threads (or
+ * io_uring ring). Multi-queue frontends pick the queue with
+ * blockif_req->qidx so that their queues don't contend with each other.
+ */
+struct blockif_queue {
+	struct blockif_ctxt	*bc;
+	int			cpu;	/* pinned SOS CPU or -1 */
+	int			plugged;
+	pthread_t		btid[BLOCKIF_NUMTHR];
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	struct blockif_uring	uring;
+
+	/* Request elements and free/pending/busy queues */
+	TAILQ_HEAD(, blockif_elem) freeq;
+	TAILQ_HEAD(, blockif_elem) pendq;
+	TAILQ_HEAD(, blockif_elem) busyq;
+	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+
+	/* read/write requests dequeued, and how many were merged */
+	uint64_t		rw_reqs;
+	uint64_t		rw_merged;
+};
+
+/*
+ * Group commit: in BLOCKIF_WCE_GROUP mode guest flushes are not synced one
+ * by one. They are handed to a per-drive sync thread, which completes all
+ * the flushes queued since its last commit with a single fdatasync().
+ */
+struct blockif_gc {
+	pthread_t		tid;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	TAILQ_HEAD(, blockif_elem) flushq;
+	int			delay_us;	/* max wait for more flushes */
+	int			stopping;	/* no more flushes accepted */
+
+	/* statistics */
+	uint64_t		flushes;
+	uint64_t		syncs;
 };
 
 struct blockif_ctxt {
@@ -105,24 +233,29 @@ struct blockif_ctxt {
 	int			sub_file_assign;
 	off_t			sub_file_start_lba;
 	struct flock		fl;
+	struct ovl_image	*ovl;		/* copy-on-write overlay, or NULL */
 	int			sectsz;
 	int			psectsz;
 	int			psectoff;
 	int			closing;
-	pthread_t		btid[BLOCKIF_NUMTHR];
-	pthread_mutex_t		mtx;
-	pthread_cond_t		cond;
+	enum blockaio		aio;
 
-	/* Request elements and free/pending/busy queues */
-	TAILQ_HEAD(, blockif_elem) freeq;
-	TAILQ_HEAD(, blockif_elem) pendq;
-	TAILQ_HEAD(, blockif_elem) busyq;
-	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+	int			bq_num;
+	struct blockif_queue	*bqs;
+	struct blockif_gc	gc;
 
-	/* write cache enable */
+	/* write cache mode, BLOCKIF_WCE_* */
 	uint8_t			wce;
+
+	char			ident[16];	/* for the stats */
+	LIST_ENTRY(blockif_ctxt) list;
 };
 
+/* open drives, for blockif_dump_stats() */
+static LIST_HEAD(, blockif_ctxt) blockif_ctxts =
+	LIST_HEAD_INITIALIZER(blockif_ctxts);
+static pthread_mutex_t blockif_ctxts_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
 struct blockif_sig_elem {
@@ -134,6 +267,15 @@ struct blockif_sig_elem {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+/* fsync() the image, an overlay writes out its metadata as well */
+static int
+blockif_fsync(struct blockif_ctxt *bc, bool datasync)
+{
+	if (bc->ovl)
+		return ovl_flush(bc->ovl);
+	return datasync ? fdatasync(bc->fd) : fsync(bc->fd);
+}
+
 static int
 blockif_flush_cache(struct blockif_ctxt *bc)
 {
@@ -142,24 +284,24 @@ blockif_flush_cache(struct blockif_ctxt *bc)
 	err = 0;
 	assert(bc != NULL);
 	if (!bc->wce) {
-		if (fsync(bc->fd))
+		if (blockif_fsync(bc, false))
 			err = errno;
 	}
 	return err;
 }
 
 static int
-blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
+blockif_enqueue(struct blockif_queue *bq, struct blockif_req *breq,
 		enum blockop op)
 {
 	struct blockif_elem *be, *tbe;
 	off_t off;
 	int i;
 
-	be = TAILQ_FIRST(&bc->freeq);
+	be = TAILQ_FIRST(&bq->freeq);
 	assert(be != NULL);
 	assert(be->status == BST_FREE);
-	TAILQ_REMOVE(&bc->freeq, be, link);
+	TAILQ_REMOVE(&bq->freeq, be, link);
 	be->req = breq;
 	be->op = op;
 	switch (op) {
@@ -175,12 +317,12 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		off = 1 << (sizeof(off_t) - 1);
 	}
 	be->block = off;
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+	TAILQ_FOREACH(tbe, &bq->pendq, link) {
 		if (tbe->block == breq->offset)
 			break;
 	}
 	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->busyq, link) {
+		TAILQ_FOREACH(tbe, &bq->busyq, link) {
 			if (tbe->block == breq->offset)
 				break;
 		}
@@ -189,67 +331,212 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		be->status = BST_PEND;
 	else
 		be->status = BST_BLOCK;
-	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	TAILQ_INSERT_TAIL(&bq->pendq, be, link);
 	return (be->status == BST_PEND);
 }
 
+/*
+ * A request starting at off is blocked (see blockif_enqueue()) by tail and
+ * possibly by other requests. Tell whether anything other than tail
+ * blocks it.
+ */
 static int
-blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
+blockif_blocked_by_other(struct blockif_queue *bq, struct blockif_elem *tail,
+			 off_t off)
+{
+	struct blockif_elem *tbe;
+
+	TAILQ_FOREACH(tbe, &bq->busyq, link) {
+		if (tbe != tail && tbe->block == off)
+			return 1;
+	}
+	TAILQ_FOREACH(tbe, &bq->pendq, link) {
+		if (tbe != tail && tbe->block == off)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Elevator merge stage: append to be the pending requests of the same op
+ * which continue right where it ends, as long as the combined iovec fits
+ * in BLOCKIF_IOV_MAX. Sequential requests are blocked behind each other by
+ * blockif_enqueue(), so this is where they pile up.
+ */
+static void
+blockif_merge(struct blockif_queue *bq, struct blockif_elem *be, pthread_t t)
+{
+	struct blockif_elem *tail, *tbe;
+	int iovcnt;
+
+	be->merge_next = NULL;
+	if (be->op != BOP_READ && be->op != BOP_WRITE)
+		return;
+
+	bq->rw_reqs++;
+	tail = be;
+	iovcnt = be->req->iovcnt;
+	for (;;) {
+		if (blockif_blocked_by_other(bq, tail, tail->block))
+			break;
+		TAILQ_FOREACH(tbe, &bq->pendq, link) {
+			if (tbe->op == be->op &&
+			    tbe->req->offset == tail->block &&
+			    tbe->block > tbe->req->offset &&
+			    iovcnt + tbe->req->iovcnt <= BLOCKIF_IOV_MAX)
+				break;
+		}
+		if (tbe == NULL)
+			break;
+
+		TAILQ_REMOVE(&bq->pendq, tbe, link);
+		tbe->status = BST_BUSY;
+		tbe->tid = t;
+		tbe->merge_next = NULL;
+		TAILQ_INSERT_TAIL(&bq->busyq, tbe, link);
+
+		tail->merge_next = tbe;
+		tail = tbe;
+		iovcnt += tbe->req->iovcnt;
+		bq->rw_reqs++;
+		bq->rw_merged++;
+	}
+}
+
+static int
+blockif_dequeue(struct blockif_queue *bq, pthread_t t,
+		struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
-	TAILQ_FOREACH(be, &bc->pendq, link) {
+	TAILQ_FOREACH(be, &bq->pendq, link) {
 		if (be->status == BST_PEND)
 			break;
 		assert(be->status == BST_BLOCK);
 	}
 	if (be == NULL)
 		return 0;
-	TAILQ_REMOVE(&bc->pendq, be, link);
+	TAILQ_REMOVE(&bq->pendq, be, link);
 	be->status = BST_BUSY;
 	be->tid = t;
-	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	TAILQ_INSERT_TAIL(&bq->busyq, be, link);
+	blockif_merge(bq, be, t);
 	*bep = be;
 	return 1;
 }
 
+/*
+ * Return the iovec covering the whole merge chain headed by be.
+ */
+static int
+blockif_merge_iov(struct blockif_elem *be, struct iovec **iovp)
+{
+	struct blockif_elem *tbe;
+	int iovcnt;
+
+	if (be->merge_next == NULL) {
+		*iovp = be->req->iov;
+		return be->req->iovcnt;
+	}
+
+	iovcnt = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->merge_next) {
+		memcpy(&be->merge_iov[iovcnt], tbe->req->iov,
+			tbe->req->iovcnt * sizeof(struct iovec));
+		iovcnt += tbe->req->iovcnt;
+	}
+	*iovp = be->merge_iov;
+	return iovcnt;
+}
+
+/*
+ * Split the byte count transferred for a merge chain back to its requests.
+ */
+static void
+blockif_merge_split(struct blockif_elem *be, ssize_t len)
+{
+	struct blockif_elem *tbe;
+	ssize_t n;
+
+	for (tbe = be; tbe != NULL; tbe = tbe->merge_next) {
+		n = MIN(len, tbe->block - tbe->req->offset);
+		tbe->req->resid -= n;
+		len -= n;
+	}
+}
+
+/*
+ * Mark all requests of the chain done and run their callbacks.
+ */
+static void
+blockif_merge_done(struct blockif_elem *be, int err)
+{
+	struct blockif_elem *tbe, *next;
+
+	for (tbe = be; tbe != NULL; tbe = next) {
+		next = tbe->merge_next;
+		tbe->status = BST_DONE;
+		(*tbe->req->callback)(tbe->req, err);
+	}
+}
+
 static void
-blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
+blockif_complete(struct blockif_queue *bq, struct blockif_elem *be)
 {
 	struct blockif_elem *tbe;
 
 	if (be->status == BST_DONE || be->status == BST_BUSY)
-		TAILQ_REMOVE(&bc->busyq, be, link);
+		TAILQ_REMOVE(&bq->busyq, be, link);
 	else
-		TAILQ_REMOVE(&bc->pendq, be, link);
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+		TAILQ_REMOVE(&bq->pendq, be, link);
+	TAILQ_FOREACH(tbe, &bq->pendq, link) {
 		if (tbe->req->offset == be->block)
 			tbe->status = BST_PEND;
 	}
 	be->tid = 0;
 	be->status = BST_FREE;
 	be->req = NULL;
-	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
+	TAILQ_INSERT_TAIL(&bq->freeq, be, link);
+}
+
+/*
+ * Release all requests of the chain. Called with the queue lock held.
+ */
+static void
+blockif_merge_complete(struct blockif_queue *bq, struct blockif_elem *be)
+{
+	struct blockif_elem *tbe, *next;
+
+	for (tbe = be; tbe != NULL; tbe = next) {
+		next = tbe->merge_next;
+		tbe->merge_next = NULL;
+		blockif_complete(bq, tbe);
+	}
 }
 
 static void
 blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
 	struct blockif_req *br;
+	struct iovec *iov;
 	off_t arg[2];
 	ssize_t len;
-	int err;
+	int err, iovcnt;
 
 	br = be->req;
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
-		len = preadv(bc->fd, br->iov, br->iovcnt,
+		iovcnt = blockif_merge_iov(be, &iov);
+		if (bc->ovl)
+			len = ovl_preadv(bc->ovl, iov, iovcnt, br->offset);
+		else
+			len = preadv(bc->fd, iov, iovcnt,
 				 br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
 		else
-			br->resid -= len;
+			blockif_merge_split(be, len);
 		break;
 	case BOP_WRITE:
 		if (bc->rdonly) {
@@ -257,17 +544,21 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 			break;
 		}
 
-		len = pwritev(bc->fd, br->iov, br->iovcnt,
+		iovcnt = blockif_merge_iov(be, &iov);
+		if (bc->ovl)
+			len = ovl_pwritev(bc->ovl, iov, iovcnt, br->offset);
+		else
+			len = pwritev(bc->fd, iov, iovcnt,
 				  br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
 		else {
-			br->resid -= len;
+			blockif_merge_split(be, len);
 			err = blockif_flush_cache(bc);
 		}
 		break;
 	case BOP_FLUSH:
-		if (fsync(bc->fd))
+		if (blockif_fsync(bc, false))
 			err = errno;
 		break;
 	case BOP_DELETE:
@@ -292,41 +583,453 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 		break;
 	}
 
-	be->status = BST_DONE;
+	blockif_merge_done(be, err);
+}
+
+/*
+ * Hand a guest flush to the group commit thread instead of syncing it
+ * right away. Called with the queue lock held; the element stays on the
+ * busy queue until the commit covering it is done.
+ */
+static int
+blockif_gc_defer(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_gc *gc = &bc->gc;
+	int deferred = 0;
+
+	if (be->op != BOP_FLUSH || bc->wce != BLOCKIF_WCE_GROUP)
+		return 0;
 
-	(*br->callback)(br, err);
+	pthread_mutex_lock(&gc->mtx);
+	if (gc->tid != 0 && !gc->stopping) {
+		TAILQ_INSERT_TAIL(&gc->flushq, be, gc_link);
+		pthread_cond_signal(&gc->cond);
+		deferred = 1;
+	}
+	pthread_mutex_unlock(&gc->mtx);
+	return deferred;
 }
 
 static void *
-blockif_thr(void *arg)
+blockif_gc_thr(void *arg)
 {
+	TAILQ_HEAD(, blockif_elem) batch;
 	struct blockif_ctxt *bc;
+	struct blockif_gc *gc;
 	struct blockif_elem *be;
-	pthread_t t;
+	struct blockif_queue *bq;
+	struct blockif_req *br;
+	uint64_t n;
+	int err;
 
 	bc = arg;
+	gc = &bc->gc;
+
+	pthread_mutex_lock(&gc->mtx);
+	for (;;) {
+		while (TAILQ_EMPTY(&gc->flushq) && !gc->stopping)
+			pthread_cond_wait(&gc->cond, &gc->mtx);
+		/* nothing can be queued once stopping is seen empty */
+		if (TAILQ_EMPTY(&gc->flushq))
+			break;
+
+		/* let concurrent flushes join this commit */
+		if (gc->delay_us) {
+			pthread_mutex_unlock(&gc->mtx);
+			usleep(gc->delay_us);
+			pthread_mutex_lock(&gc->mtx);
+		}
+
+		/*
+		 * All writes acknowledged before any of these flushes were
+		 * issued have completed pwritev(), so one sync covers them.
+		 */
+		TAILQ_INIT(&batch);
+		TAILQ_CONCAT(&batch, &gc->flushq, gc_link);
+		pthread_mutex_unlock(&gc->mtx);
+
+		err = 0;
+		if (blockif_fsync(bc, true))
+			err = errno;
+
+		n = 0;
+		while ((be = TAILQ_FIRST(&batch)) != NULL) {
+			TAILQ_REMOVE(&batch, be, gc_link);
+			br = be->req;
+			bq = &bc->bqs[br->qidx];
+
+			be->status = BST_DONE;
+			(*br->callback)(br, err);
+
+			pthread_mutex_lock(&bq->mtx);
+			blockif_complete(bq, be);
+			pthread_mutex_unlock(&bq->mtx);
+			n++;
+		}
+
+		pthread_mutex_lock(&gc->mtx);
+		gc->flushes += n;
+		gc->syncs++;
+		DPRINTF(("blockif: group commit of %lu flushes\n", n));
+	}
+	pthread_mutex_unlock(&gc->mtx);
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+blockif_thr(void *arg)
+{
+	struct blockif_queue *bq;
+	struct blockif_elem *be;
+	pthread_t t;
+
+	bq = arg;
 	t = pthread_self();
 
-	pthread_mutex_lock(&bc->mtx);
+	pthread_mutex_lock(&bq->mtx);
 
 	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
-			pthread_mutex_unlock(&bc->mtx);
-			blockif_proc(bc, be);
-			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
+		while (blockif_dequeue(bq, t, &be)) {
+			if (blockif_gc_defer(bq->bc, be))
+				continue;
+			pthread_mutex_unlock(&bq->mtx);
+			blockif_proc(bq->bc, be);
+			pthread_mutex_lock(&bq->mtx);
+			blockif_merge_complete(bq, be);
 		}
 		/* Check ctxt status here to see if exit requested */
-		if (bc->closing)
+		if (bq->bc->closing)
+			break;
+		pthread_cond_wait(&bq->cond, &bq->mtx);
+	}
+
+	pthread_mutex_unlock(&bq->mtx);
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+/*
+ * Pass all prepared SQEs to the kernel. Called with bq->mtx held. SQEs the
+ * kernel could not take now (e.g. CQ overflow) stay queued and are retried
+ * on the next submission or after the completion thread reaped a batch.
+ */
+static void
+blockif_uring_submit(struct blockif_queue *bq)
+{
+	struct blockif_uring *ur = &bq->uring;
+	int ret;
+
+	if (ur->to_submit == 0)
+		return;
+
+	atomic_store(ur->sq_ktail, ur->sq_tail);
+	ret = io_uring_enter(ur->fd, ur->to_submit, 0, 0);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+			WPRINTF(("blockif: io_uring_enter failed, %d\n", errno));
+		return;
+	}
+	ur->to_submit -= ret;
+}
+
+static struct io_uring_sqe *
+blockif_uring_get_sqe(struct blockif_queue *bq)
+{
+	struct blockif_uring *ur = &bq->uring;
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (ur->sq_tail - atomic_load(ur->sq_khead) >= ur->sq_entries)
+		return NULL;
+
+	idx = ur->sq_tail & ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[idx] = idx;
+	ur->sq_tail++;
+	ur->to_submit++;
+	return sqe;
+}
+
+/*
+ * Translate a dequeued request into SQEs. Operations the ring can't
+ * express (discard, writes to a read-only backend) are queued as a NOP and
+ * executed synchronously by the completion thread through blockif_proc().
+ */
+static void
+blockif_uring_prep(struct blockif_queue *bq, struct blockif_elem *be)
+{
+	struct blockif_ctxt *bc = bq->bc;
+	struct blockif_uring *ur = &bq->uring;
+	struct blockif_req *br = be->req;
+	struct io_uring_sqe *sqe, *fsqe;
+	struct iovec *iov;
+
+	/* keep a linked write + fsync pair within one submission */
+	if (ur->sq_tail - atomic_load(ur->sq_khead) + 2 > ur->sq_entries)
+		blockif_uring_submit(bq);
+
+	sqe = blockif_uring_get_sqe(bq);
+	assert(sqe != NULL);
+
+	be->uring_inflight = 1;
+	be->uring_err = 0;
+	be->uring_sync = 0;
+	be->uring_fsync = 0;
+
+	sqe->fd = bc->fd;
+	sqe->user_data = (uintptr_t)be;
+	switch (be->op) {
+	case BOP_READ:
+		sqe->opcode = IORING_OP_READV;
+		sqe->len = blockif_merge_iov(be, &iov);
+		sqe->addr = (uintptr_t)iov;
+		sqe->off = br->offset + bc->sub_file_start_lba;
+		break;
+	case BOP_WRITE:
+		if (bc->rdonly) {
+			sqe->opcode = IORING_OP_NOP;
+			be->uring_sync = 1;
+			break;
+		}
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->len = blockif_merge_iov(be, &iov);
+		sqe->addr = (uintptr_t)iov;
+		sqe->off = br->offset + bc->sub_file_start_lba;
+
+		/* writethru: order a fsync after the write on the ring */
+		if (!bc->wce) {
+			fsqe = blockif_uring_get_sqe(bq);
+			assert(fsqe != NULL);
+			sqe->flags |= IOSQE_IO_LINK;
+			fsqe->opcode = IORING_OP_FSYNC;
+			fsqe->fd = bc->fd;
+			fsqe->user_data = (uintptr_t)be | BLOCKIF_URING_LINKED;
+			be->uring_inflight++;
+		}
+		break;
+	case BOP_FLUSH:
+		sqe->opcode = IORING_OP_FSYNC;
+		break;
+	default:
+		sqe->opcode = IORING_OP_NOP;
+		be->uring_sync = 1;
+		break;
+	}
+}
+
+/*
+ * Move all runnable pending requests to the ring. Called with bq->mtx held.
+ */
+static void
+blockif_uring_dispatch(struct blockif_queue *bq)
+{
+	struct blockif_elem *be;
+
+	while (blockif_dequeue(bq, bq->uring.tid, &be)) {
+		if (!blockif_gc_defer(bq->bc, be))
+			blockif_uring_prep(bq, be);
+	}
+
+	blockif_uring_submit(bq);
+}
+
+/*
+ * Drain the completion queue. Finished requests are returned in done[] so
+ * that they can be released with a single acquisition of bq->mtx.
+ */
+static int
+blockif_uring_reap(struct blockif_queue *bq, struct blockif_elem **done)
+{
+	struct blockif_uring *ur = &bq->uring;
+	struct io_uring_cqe *cqe;
+	struct blockif_elem *be;
+	unsigned int head, tail;
+	uintptr_t data;
+	int n = 0;
+
+	head = *ur->cq_khead;
+	tail = atomic_load(ur->cq_ktail);
+	for (; head != tail; head++) {
+		cqe = &ur->cqes[head & ur->cq_mask];
+		data = cqe->user_data;
+		if (data == 0)		/* wakeup on close */
+			continue;
+
+		be = (struct blockif_elem *)(data & ~BLOCKIF_URING_LINKED);
+		if (cqe->res == -ECANCELED && (data & BLOCKIF_URING_LINKED)) {
+			/*
+			 * A short write breaks the link. The write itself
+			 * tells whether it failed; if it didn't, sync after
+			 * it as the worker threads do.
+			 */
+			be->uring_fsync = 1;
+		} else if (cqe->res < 0) {
+			if (be->uring_err == 0)
+				be->uring_err = -cqe->res;
+		} else if (!(data & BLOCKIF_URING_LINKED) &&
+			   (be->op == BOP_READ || be->op == BOP_WRITE))
+			blockif_merge_split(be, cqe->res);
+
+		if (--be->uring_inflight == 0)
+			done[n++] = be;
+	}
+	atomic_store(ur->cq_khead, head);
+
+	return n;
+}
+
+static void *
+blockif_uring_thr(void *arg)
+{
+	struct blockif_queue *bq;
+	struct blockif_elem *done[BLOCKIF_MAXREQ];
+	struct blockif_elem *be;
+	int i, n, stop;
+
+	bq = arg;
+
+	for (;;) {
+		if (io_uring_enter(bq->uring.fd, 0, 1,
+				IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			WPRINTF(("blockif: io_uring wait failed, %d\n", errno));
+
+		n = blockif_uring_reap(bq, done);
+		for (i = 0; i < n; i++) {
+			be = done[i];
+			if (be->uring_fsync && be->uring_err == 0 &&
+			    fsync(bq->bc->fd))
+				be->uring_err = errno;
+			if (be->uring_sync)
+				blockif_proc(bq->bc, be);
+			else
+				blockif_merge_done(be, be->uring_err);
+		}
+
+		pthread_mutex_lock(&bq->mtx);
+		for (i = 0; i < n; i++)
+			blockif_merge_complete(bq, done[i]);
+		/* start requests unblocked by this batch, retry leftovers */
+		blockif_uring_dispatch(bq);
+		stop = bq->bc->closing && TAILQ_EMPTY(&bq->busyq);
+		pthread_mutex_unlock(&bq->mtx);
+
+		if (stop)
 			break;
-		pthread_cond_wait(&bc->cond, &bc->mtx);
 	}
 
-	pthread_mutex_unlock(&bc->mtx);
 	pthread_exit(NULL);
 	return NULL;
 }
 
+static void
+blockif_uring_deinit(struct blockif_queue *bq)
+{
+	struct blockif_uring *ur = &bq->uring;
+
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqes_sz);
+	if (ur->cq_ptr)
+		munmap(ur->cq_ptr, ur->cq_sz);
+	if (ur->sq_ptr)
+		munmap(ur->sq_ptr, ur->sq_sz);
+	close(ur->fd);
+	memset(ur, 0, sizeof(*ur));
+}
+
+static int
+blockif_uring_init(struct blockif_queue *bq, const char *tname)
+{
+	struct blockif_uring *ur = &bq->uring;
+	struct io_uring_params p;
+	void *ptr;
+
+	memset(&p, 0, sizeof(p));
+	ur->fd = io_uring_setup(BLOCKIF_URING_ENTRIES, &p);
+	if (ur->fd < 0) {
+		WPRINTF(("blockif: io_uring_setup failed, %d\n", errno));
+		return -1;
+	}
+
+	ur->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ptr = mmap(NULL, ur->sq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ur->sq_ptr = ptr;
+	ur->sq_khead = ptr + p.sq_off.head;
+	ur->sq_ktail = ptr + p.sq_off.tail;
+	ur->sq_mask = *(unsigned int *)(ptr + p.sq_off.ring_mask);
+	ur->sq_entries = *(unsigned int *)(ptr + p.sq_off.ring_entries);
+	ur->sq_array = ptr + p.sq_off.array;
+	ur->sq_tail = *ur->sq_ktail;
+
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ur->sqes = ptr;
+
+	ur->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ptr = mmap(NULL, ur->cq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ur->cq_ptr = ptr;
+	ur->cq_khead = ptr + p.cq_off.head;
+	ur->cq_ktail = ptr + p.cq_off.tail;
+	ur->cq_mask = *(unsigned int *)(ptr + p.cq_off.ring_mask);
+	ur->cqes = ptr + p.cq_off.cqes;
+
+	if (pthread_create(&ur->tid, NULL, blockif_uring_thr, bq))
+		goto fail;
+	pthread_setname_np(ur->tid, tname);
+
+	return 0;
+
+fail:
+	WPRINTF(("blockif: io_uring ring setup failed\n"));
+	blockif_uring_deinit(bq);
+	return -1;
+}
+
+static void
+blockif_uring_close(struct blockif_queue *bq)
+{
+	struct io_uring_sqe *sqe;
+	void *jval;
+
+	/* Kick the completion thread so that it sees the closing flag */
+	pthread_mutex_lock(&bq->mtx);
+	sqe = blockif_uring_get_sqe(bq);
+	if (sqe) {
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = 0;
+	}
+	blockif_uring_submit(bq);
+	pthread_mutex_unlock(&bq->mtx);
+
+	pthread_join(bq->uring.tid, &jval);
+	blockif_uring_deinit(bq);
+}
+
 static void
 blockif_sigcont_handler(int signal)
 {
@@ -407,14 +1110,98 @@ sub_file_unlock(struct blockif_ctxt *bc)
 	}
 }
 
+static void
+blockif_set_affinity(pthread_t tid, int cpu)
+{
+	cpu_set_t cpuset;
+
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	if (pthread_setaffinity_np(tid, sizeof(cpuset), &cpuset))
+		WPRINTF(("blockif: failed to pin thread to cpu %d\n", cpu));
+}
+
+static void
+blockif_queue_init(struct blockif_ctxt *bc, struct blockif_queue *bq,
+		   int cpu)
+{
+	int i;
+
+	bq->bc = bc;
+	bq->cpu = cpu;
+	pthread_mutex_init(&bq->mtx, NULL);
+	pthread_cond_init(&bq->cond, NULL);
+	TAILQ_INIT(&bq->freeq);
+	TAILQ_INIT(&bq->pendq);
+	TAILQ_INIT(&bq->busyq);
+	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+		bq->reqs[i].status = BST_FREE;
+		TAILQ_INSERT_HEAD(&bq->freeq, &bq->reqs[i], link);
+	}
+}
+
+/*
+ * Set up one io_uring ring per queue. If any of them fails, all are torn
+ * down so that the caller can fall back to worker threads.
+ */
+static int
+blockif_start_uring(struct blockif_ctxt *bc, const char *ident)
+{
+	char tname[MAXCOMLEN + 1];
+	struct blockif_queue *bq;
+	int i, j;
+
+	for (i = 0; i < bc->bq_num; i++) {
+		bq = &bc->bqs[i];
+		if (snprintf(tname, sizeof(tname), "blk-%s-%d-ur",
+					ident, i) >= sizeof(tname)) {
+			perror("blk thread name too long");
+		}
+		if (blockif_uring_init(bq, tname) < 0) {
+			bc->closing = 1;
+			for (j = 0; j < i; j++)
+				blockif_uring_close(&bc->bqs[j]);
+			bc->closing = 0;
+			return -1;
+		}
+		blockif_set_affinity(bq->uring.tid, bq->cpu);
+	}
+
+	return 0;
+}
+
+static void
+blockif_start_threads(struct blockif_ctxt *bc, const char *ident)
+{
+	char tname[MAXCOMLEN + 1];
+	struct blockif_queue *bq;
+	int i, j;
+
+	for (i = 0; i < bc->bq_num; i++) {
+		bq = &bc->bqs[i];
+		for (j = 0; j < BLOCKIF_NUMTHR; j++) {
+			if (snprintf(tname, sizeof(tname), "blk-%s-%d-%d",
+						ident, i, j) >= sizeof(tname)) {
+				perror("blk thread name too long");
+			}
+			pthread_create(&bq->btid[j], NULL, blockif_thr, bq);
+			pthread_setname_np(bq->btid[j], tname);
+			blockif_set_affinity(bq->btid[j], bq->cpu);
+		}
+	}
+}
 
 struct blockif_ctxt *
-blockif_open(const char *optstr, const char *ident)
+blockif_open(const char *optstr, const char *ident, int queue_num)
 {
 	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *ovl_base;
 	struct blockif_ctxt *bc;
+	struct ovl_image *ovl;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
@@ -425,9 +1212,17 @@ blockif_open(const char *optstr, const char *ident)
 	int err_code = -1;
 	off_t sub_file_start_lba, sub_file_size;
 	int sub_file_assign;
+	enum blockaio aio;
+	int cpus[BLOCKIF_MAXQ], ncpus;
+	int gc_delay;
 
 	pthread_once(&blockif_once, blockif_init);
 
+	if (queue_num <= 0 || queue_num > BLOCKIF_MAXQ) {
+		fprintf(stderr, "Invalid block queue number %d\n", queue_num);
+		return NULL;
+	}
+
 	fd = -1;
 	ssopt = 0;
 	pssopt = 0;
@@ -437,7 +1232,18 @@ blockif_open(const char *optstr, const char *ident)
 	sub_file_size = 0;
 
 	/* writethru is on by default */
-	writeback = 0;
+	writeback = BLOCKIF_WCE_OFF;
+	gc_delay = BLOCKIF_GC_DELAY_US;
+
+	/* worker threads are the default I/O engine */
+	aio = BAIO_THREADS;
+
+	/* queue threads are not pinned by default */
+	ncpus = 0;
+
+	/* raw image by default */
+	ovl = NULL;
+	ovl_base = NULL;
 
 	/*
 	 * The first element in the optstring is always a pathname.
@@ -453,11 +1259,36 @@ blockif_open(const char *optstr, const char *ident)
 		if (cp == nopt)		/* file or device pathname */
 			continue;
 		else if (!strcmp(cp, "writeback"))
-			writeback = 1;
+			writeback = BLOCKIF_WCE_ON;
 		else if (!strcmp(cp, "writethru"))
-			writeback = 0;
+			writeback = BLOCKIF_WCE_OFF;
+		else if (!strcmp(cp, "groupcommit"))
+			writeback = BLOCKIF_WCE_GROUP;
+		else if (!strncmp(cp, "groupcommit=", strlen("groupcommit="))) {
+			/* groupcommit=<latency bound in us> */
+			writeback = BLOCKIF_WCE_GROUP;
+			cp += strlen("groupcommit=");
+			if (dm_strtoi(cp, &cp, 10, &gc_delay) || *cp != '\0' ||
+			    gc_delay < 0)
+				goto err;
+		}
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "aio=threads"))
+			aio = BAIO_THREADS;
+		else if (!strcmp(cp, "aio=io_uring"))
+			aio = BAIO_URING;
+		else if (!strncmp(cp, "overlay", strlen("overlay"))) {
+			/*
+			 * overlay[=<base image>]
+			 * The pathname is a copy-on-write overlay on top of the
+			 * base image, or of the one recorded in the overlay.
+			 */
+			if (strsep(&cp, "=") && cp != NULL)
+				ovl_base = cp;
+			else
+				ovl_base = "";
+		}
 		else if (!strncmp(cp, "sectorsize", strlen("sectorsize"))) {
 			/*
 			 *  sectorsize=<sector size>
@@ -481,6 +1312,21 @@ blockif_open(const char *optstr, const char *ident)
 				sub_file_assign = 1;
 			else
 				goto err;
+		} else if (!strncmp(cp, "cpus", strlen("cpus"))) {
+			/*
+			 * cpus=<cpu>[/<cpu>...]
+			 * I/O threads of queue i are pinned to the
+			 * (i % number of listed cpus)th cpu.
+			 */
+			if (!strsep(&cp, "="))
+				goto err;
+			do {
+				if (ncpus == BLOCKIF_MAXQ ||
+				    dm_strtoi(cp, &cp, 10, &cpus[ncpus]) ||
+				    cpus[ncpus] < 0 || cpus[ncpus] >= CPU_SETSIZE)
+					goto err;
+				ncpus++;
+			} while (*cp++ == '/');
 		} else {
 			fprintf(stderr, "Invalid device option \"%s\"\n", cp);
 			goto err;
@@ -494,7 +1340,11 @@ blockif_open(const char *optstr, const char *ident)
 	 * operation to emulate it.
 	 */
 
-	fd = open(nopt, ro ? O_RDONLY : O_RDWR);
+	if (ovl_base && *ovl_base && !ro)
+		/* a new overlay image is formatted on top of ovl_base */
+		fd = open(nopt, O_RDWR | O_CREAT, 0644);
+	else
+		fd = open(nopt, ro ? O_RDONLY : O_RDWR);
 	if (fd < 0 && !ro) {
 		/* Attempt a r/w fail with a r/o open */
 		fd = open(nopt, O_RDONLY);
@@ -555,6 +1405,25 @@ blockif_open(const char *optstr, const char *ident)
 	} else
 		psectsz = sbuf.st_blksize;
 
+	if (ovl_base) {
+		if (!S_ISREG(sbuf.st_mode) || sub_file_assign) {
+			fprintf(stderr, "overlay needs a regular file "
+					"and no range\n");
+			goto err;
+		}
+		ovl = ovl_open(fd, *ovl_base ? ovl_base : NULL, ro);
+		if (ovl == NULL)
+			goto err;
+		size = ovl_size(ovl);
+
+		/* overlay lookups are synchronous, keep to worker threads */
+		if (aio == BAIO_URING) {
+			fprintf(stderr, "blockif: io_uring does not support "
+					"overlay, use worker threads\n");
+			aio = BAIO_THREADS;
+		}
+	}
+
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
 		    ssopt > pssopt) {
@@ -611,6 +1480,7 @@ blockif_open(const char *optstr, const char *ident)
 
 	bc->magic = BLOCKIF_SIG;
 	bc->fd = fd;
+	bc->ovl = ovl;
 	bc->isblk = S_ISBLK(sbuf.st_mode);
 	bc->candelete = candelete;
 	bc->rdonly = ro;
@@ -619,27 +1489,51 @@ blockif_open(const char *optstr, const char *ident)
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
 	bc->wce = writeback;
-	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
-	TAILQ_INIT(&bc->freeq);
-	TAILQ_INIT(&bc->pendq);
-	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
-		bc->reqs[i].status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
-	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		if (snprintf(tname, sizeof(tname), "blk-%s-%d",
-					ident, i) >= sizeof(tname)) {
+	bc->bqs = calloc(queue_num, sizeof(struct blockif_queue));
+	if (bc->bqs == NULL) {
+		perror("calloc");
+		free(bc);
+		goto err;
+	}
+	bc->bq_num = queue_num;
+	for (i = 0; i < queue_num; i++)
+		blockif_queue_init(bc, &bc->bqs[i],
+				ncpus ? cpus[i % ncpus] : -1);
+
+	pthread_mutex_init(&bc->gc.mtx, NULL);
+	pthread_cond_init(&bc->gc.cond, NULL);
+	TAILQ_INIT(&bc->gc.flushq);
+	bc->gc.delay_us = gc_delay;
+	if (writeback == BLOCKIF_WCE_GROUP) {
+		if (snprintf(tname, sizeof(tname), "blk-%s-gc",
+					ident) >= sizeof(tname)) {
 			perror("blk thread name too long");
 		}
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		pthread_setname_np(bc->btid[i], tname);
+		pthread_create(&bc->gc.tid, NULL, blockif_gc_thr, bc);
+		pthread_setname_np(bc->gc.tid, tname);
 	}
 
+	bc->aio = BAIO_THREADS;
+	if (aio == BAIO_URING) {
+		if (blockif_start_uring(bc, ident) == 0)
+			bc->aio = BAIO_URING;
+		else
+			fprintf(stderr, "blockif: io_uring unavailable, "
+					"fall back to worker threads\n");
+	}
+	if (bc->aio == BAIO_THREADS)
+		blockif_start_threads(bc, ident);
+
+	snprintf(bc->ident, sizeof(bc->ident), "%s", ident);
+	pthread_mutex_lock(&blockif_ctxts_mtx);
+	LIST_INSERT_HEAD(&blockif_ctxts, bc, list);
+	pthread_mutex_unlock(&blockif_ctxts_mtx);
+
 	return bc;
 err:
+	if (ovl)
+		ovl_close(ovl);
 	if (fd >= 0)
 		close(fd);
 	return NULL;
@@ -649,18 +1543,28 @@ static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
+	struct blockif_queue *bq;
 	int err;
 
 	err = 0;
 
-	pthread_mutex_lock(&bc->mtx);
-	if (!TAILQ_EMPTY(&bc->freeq)) {
+	assert(breq->qidx >= 0 && breq->qidx < bc->bq_num);
+	bq = &bc->bqs[breq->qidx];
+
+	pthread_mutex_lock(&bq->mtx);
+	if (!TAILQ_EMPTY(&bq->freeq)) {
 		/*
 		 * Enqueue and inform the block i/o thread
-		 * that there is work available
+		 * that there is work available. With io_uring the
+		 * request goes to the ring right away, unless the
+		 * caller is batching (see blockif_plug()).
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		if (blockif_enqueue(bq, breq, op)) {
+			if (bc->aio == BAIO_THREADS)
+				pthread_cond_signal(&bq->cond);
+			else if (!bq->plugged)
+				blockif_uring_dispatch(bq);
+		}
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -670,7 +1574,7 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 */
 		err = E2BIG;
 	}
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bq->mtx);
 
 	return err;
 }
@@ -703,18 +1607,56 @@ blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DELETE);
 }
 
+/*
+ * Requests issued to queue qidx between blockif_plug() and blockif_unplug()
+ * may be held back and passed to the backend as one batch on unplug. Only
+ * the io_uring engine batches, the worker threads start on each request.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc, int qidx)
+{
+	struct blockif_queue *bq;
+
+	assert(bc->magic == BLOCKIF_SIG);
+	assert(qidx >= 0 && qidx < bc->bq_num);
+	bq = &bc->bqs[qidx];
+
+	pthread_mutex_lock(&bq->mtx);
+	bq->plugged++;
+	pthread_mutex_unlock(&bq->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc, int qidx)
+{
+	struct blockif_queue *bq;
+
+	assert(bc->magic == BLOCKIF_SIG);
+	assert(qidx >= 0 && qidx < bc->bq_num);
+	bq = &bc->bqs[qidx];
+
+	pthread_mutex_lock(&bq->mtx);
+	assert(bq->plugged > 0);
+	if (--bq->plugged == 0 && bc->aio == BAIO_URING)
+		blockif_uring_dispatch(bq);
+	pthread_mutex_unlock(&bq->mtx);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
+	struct blockif_queue *bq;
 	struct blockif_elem *be;
 
 	assert(bc->magic == BLOCKIF_SIG);
+	assert(breq->qidx >= 0 && breq->qidx < bc->bq_num);
+	bq = &bc->bqs[breq->qidx];
 
-	pthread_mutex_lock(&bc->mtx);
+	pthread_mutex_lock(&bq->mtx);
 	/*
 	 * Check pending requests.
 	 */
-	TAILQ_FOREACH(be, &bc->pendq, link) {
+	TAILQ_FOREACH(be, &bq->pendq, link) {
 		if (be->req == breq)
 			break;
 	}
@@ -722,8 +1664,8 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		/*
 		 * Found it.
 		 */
-		blockif_complete(bc, be);
-		pthread_mutex_unlock(&bc->mtx);
+		blockif_complete(bq, be);
+		pthread_mutex_unlock(&bq->mtx);
 
 		return 0;
 	}
@@ -731,7 +1673,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 	/*
 	 * Check in-flight requests.
 	 */
-	TAILQ_FOREACH(be, &bc->busyq, link) {
+	TAILQ_FOREACH(be, &bq->busyq, link) {
 		if (be->req == breq)
 			break;
 	}
@@ -739,10 +1681,19 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		/*
 		 * Didn't find it.
 		 */
-		pthread_mutex_unlock(&bc->mtx);
+		pthread_mutex_unlock(&bq->mtx);
 		return -1;
 	}
 
+	/*
+	 * Requests on the ring can't be interrupted, they complete through
+	 * the normal callback path.
+	 */
+	if (bc->aio == BAIO_URING) {
+		pthread_mutex_unlock(&bq->mtx);
+		return -EBUSY;
+	}
+
 	/*
 	 * Interrupt the processing thread to force it return
 	 * prematurely via it's normal callback path.
@@ -771,7 +1722,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		pthread_mutex_unlock(&bse.mtx);
 	}
 
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bq->mtx);
 
 	/*
 	 * The processing thread has been interrupted.  Since it's not
@@ -783,21 +1734,59 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 int
 blockif_close(struct blockif_ctxt *bc)
 {
+	struct blockif_queue *bq;
+	uint64_t rw_reqs = 0, rw_merged = 0;
 	void *jval;
-	int i;
+	int i, j;
 
 	assert(bc->magic == BLOCKIF_SIG);
 	sub_file_unlock(bc);
 
+	pthread_mutex_lock(&blockif_ctxts_mtx);
+	LIST_REMOVE(bc, list);
+	pthread_mutex_unlock(&blockif_ctxts_mtx);
+
+	/*
+	 * Stop the group commit thread first. Once stopping is set under
+	 * the lock the queue threads sync flushes themselves, and the
+	 * thread only exits after it has completed everything queued to it.
+	 */
+	if (bc->gc.tid) {
+		pthread_mutex_lock(&bc->gc.mtx);
+		bc->gc.stopping = 1;
+		pthread_cond_signal(&bc->gc.cond);
+		pthread_mutex_unlock(&bc->gc.mtx);
+		pthread_join(bc->gc.tid, &jval);
+
+		pthread_mutex_lock(&bc->gc.mtx);
+		bc->gc.tid = 0;
+		pthread_mutex_unlock(&bc->gc.mtx);
+		if (bc->gc.flushes)
+			printf("blockif: %lu flushes served by %lu syncs\n",
+				bc->gc.flushes, bc->gc.syncs);
+	}
+
 	/*
-	 * Stop the block i/o thread
+	 * Stop the block i/o threads of all queues
 	 */
-	pthread_mutex_lock(&bc->mtx);
-	bc->closing = 1;
-	pthread_mutex_unlock(&bc->mtx);
-	pthread_cond_broadcast(&bc->cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
-		pthread_join(bc->btid[i], &jval);
+	for (i = 0; i < bc->bq_num; i++) {
+		bq = &bc->bqs[i];
+		pthread_mutex_lock(&bq->mtx);
+		bc->closing = 1;
+		pthread_mutex_unlock(&bq->mtx);
+		if (bc->aio == BAIO_URING)
+			blockif_uring_close(bq);
+		else {
+			pthread_cond_broadcast(&bq->cond);
+			for (j = 0; j < BLOCKIF_NUMTHR; j++)
+				pthread_join(bq->btid[j], &jval);
+		}
+		rw_reqs += bq->rw_reqs;
+		rw_merged += bq->rw_merged;
+	}
+	if (rw_merged)
+		printf("blockif: %lu of %lu r/w requests merged\n",
+			rw_merged, rw_reqs);
 
 	/* XXX Cancel queued i/o's ??? */
 
@@ -805,12 +1794,66 @@ blockif_close(struct blockif_ctxt *bc)
 	 * Release resources
 	 */
 	bc->magic = 0;
+	if (bc->ovl)
+		ovl_close(bc->ovl);
 	close(bc->fd);
+	free(bc->bqs);
 	free(bc);
 
 	return 0;
 }
 
+/*
+ * Write the stats of every open drive to fp as JSON, for the monitor.
+ * flushes/syncs count the guest flushes completed by group commits and
+ * the fdatasync() calls that served them, rw_requests/rw_merged the read
+ * and write requests of all queues and how many of them the elevator
+ * merged into another.
+ */
+int
+blockif_dump_stats(FILE *fp)
+{
+	static const char *const wce_names[] = {
+		[BLOCKIF_WCE_OFF] = "writethru",
+		[BLOCKIF_WCE_ON] = "writeback",
+		[BLOCKIF_WCE_GROUP] = "groupcommit",
+	};
+	struct blockif_ctxt *bc;
+	struct blockif_queue *bq;
+	uint64_t flushes, syncs, rw_reqs, rw_merged;
+	const char *sep = "";
+	int i;
+
+	pthread_mutex_lock(&blockif_ctxts_mtx);
+	fprintf(fp, "{\n  \"drives\": [");
+	LIST_FOREACH(bc, &blockif_ctxts, list) {
+		pthread_mutex_lock(&bc->gc.mtx);
+		flushes = bc->gc.flushes;
+		syncs = bc->gc.syncs;
+		pthread_mutex_unlock(&bc->gc.mtx);
+
+		rw_reqs = rw_merged = 0;
+		for (i = 0; i < bc->bq_num; i++) {
+			bq = &bc->bqs[i];
+			pthread_mutex_lock(&bq->mtx);
+			rw_reqs += bq->rw_reqs;
+			rw_merged += bq->rw_merged;
+			pthread_mutex_unlock(&bq->mtx);
+		}
+
+		fprintf(fp, "%s\n    { \"ident\": \"%s\", \"wce\": \"%s\", "
+			"\"flushes\": %lu, \"syncs\": %lu, "
+			"\"rw_requests\": %lu, \"rw_merged\": %lu }",
+			sep, bc->ident, wce_names[bc->wce], flushes, syncs,
+			rw_reqs, rw_merged);
+		sep = ",";
+	}
+	fprintf(fp, "\n  ]\n}\n");
+	pthread_mutex_unlock(&blockif_ctxts_mtx);
+
+	return ferror(fp) ? -1 : 0;
+}
+
 /*
  * Return virtual C/H/S values for a given block. Use the algorithm
  * outlined in the VHD specification to calculate values.
@@ -913,10 +1956,17 @@ blockif_get_wce(struct blockif_ctxt *bc)
 	return bc->wce;
 }
 
+/*
+ * Switch the write cache mode at runtime. BLOCKIF_WCE_GROUP needs the group
+ * commit thread, which only exists if the drive was opened with the
+ * groupcommit option; plain writeback is used otherwise.
+ */
 void
 blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce)
 {
 	assert(bc->magic == BLOCKIF_SIG);
+	if (wce == BLOCKIF_WCE_GROUP && bc->gc.tid == 0)
+		wce = BLOCKIF_WCE_ON;
 	bc->wce = wce;
 }
 
@@ -927,7 +1977,7 @@ blockif_flush_all(struct blockif_ctxt *bc)
 
 	err=0;
 	assert(bc->magic == BLOCKIF_SIG);
-	if (fsync(bc->fd))
+	if (blockif_fsync(bc, false))
 		err = errno;
 	return err;
 }
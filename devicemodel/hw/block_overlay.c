@@ -0,0 +1,732 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Copy-on-write overlay image format
+ *
+ * Layout of the overlay file, in clusters of (1 << cluster_bits) bytes:
+ *
+ *   cluster 0       struct ovl_header followed by the base image path
+ *   l1_offset       L1 table, l1_size 64-bit entries
+ *   ...             L2 tables and data clusters, appended on allocation
+ *
+ * An L1 entry is the overlay file offset of an L2 table, an L2 table fills
+ * one cluster and each of its entries is the overlay file offset of a data
+ * cluster. Offset 0 means not allocated: the cluster reads from the base
+ * image (or as zeros past its end) until the guest writes it.
+ *
+ * Allocating a cluster only updates the cached L2 table (and the L1 for
+ * a new table), ovl_flush() writes them out with one barrier per batch:
+ * data clusters are synced before the L2 entries pointing to them, and
+ * L2 tables before their L1 entry, so a crash can only leak clusters.
+ * Dirty L2 tables stay in the cache until then.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "block_if.h"
+#include "block_overlay.h"
+
+#define	OVL_MAGIC		0x4c564f41	/* "AOVL" */
+#define	OVL_VERSION		1
+#define	OVL_CLUSTER_BITS	16		/* 64KiB clusters */
+#define	OVL_MIN_CLUSTER_BITS	12
+#define	OVL_MAX_CLUSTER_BITS	21
+
+/* number of L2 tables cached, 8GiB of disk with 64KiB clusters */
+#define	OVL_L2_CACHE		16
+
+/* an L2 table is written out in chunks of 1/32 */
+#define	OVL_L2_CHUNK_BITS	5
+
+struct ovl_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	cluster_bits;
+	uint32_t	l1_size;	/* number of L1 entries */
+	uint64_t	size;		/* virtual disk size in bytes */
+	uint64_t	l1_offset;
+	uint32_t	base_len;	/* length of the base path, no NUL */
+	uint32_t	reserved;
+} __attribute__((packed));
+
+struct ovl_l2 {
+	uint64_t	offset;		/* of the table in the overlay file */
+	uint64_t	*table;
+	uint64_t	lru;
+	uint32_t	dirty;		/* chunks changed since the last flush */
+	bool		wb;		/* being written out by ovl_flush() */
+};
+
+struct ovl_image {
+	int		fd;
+	int		base_fd;	/* -1 if there is no base image */
+	off_t		base_size;
+	uint64_t	size;
+
+	uint32_t	cluster_bits;
+	uint64_t	cluster_size;
+	uint32_t	l2_bits;	/* log2 of entries per L2 table */
+
+	uint32_t	l1_size;
+	uint64_t	l1_offset;
+	uint64_t	*l1;
+
+	/* protects everything below, and serializes cluster allocation */
+	pthread_mutex_t	mtx;
+	uint64_t	next;		/* where the next cluster goes */
+	uint64_t	lru_clock;
+	struct ovl_l2	l2[OVL_L2_CACHE];
+	bool		l1_dirty;
+	uint8_t		*cow;		/* cluster buffer for copy-on-write */
+	uint64_t	flush_req;	/* ovl_flush() calls so far */
+
+	/* serializes ovl_flush(), taken before mtx */
+	pthread_mutex_t	flush_mtx;
+	uint64_t	flush_done;	/* calls covered by a completed flush */
+	uint8_t		*wb_l2;		/* copies of the L2 tables written out */
+	uint64_t	*wb_l1;
+};
+
+static int
+ovl_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			/* past the end of file */
+			memset(buf, 0, len);
+			break;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+ovl_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/*
+ * Describe len bytes of iov, starting skip bytes in, with sub.
+ */
+static int
+ovl_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len,
+	      struct iovec *sub)
+{
+	int i, n;
+
+	for (i = 0; i < iovcnt && skip >= iov[i].iov_len; i++)
+		skip -= iov[i].iov_len;
+
+	for (n = 0; i < iovcnt && len > 0; i++, n++) {
+		sub[n].iov_base = (uint8_t *)iov[i].iov_base + skip;
+		sub[n].iov_len = MIN(iov[i].iov_len - skip, len);
+		len -= sub[n].iov_len;
+		skip = 0;
+	}
+	return n;
+}
+
+static void
+ovl_iov_zero(const struct iovec *iov, int iovcnt, size_t skip)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		n = iov[i].iov_len - skip;
+		memset((uint8_t *)iov[i].iov_base + skip, 0, n);
+		skip = 0;
+	}
+}
+
+/*
+ * Return the cached L2 table at offset l2off, reading it in if needed.
+ * Fails with EBUSY if every cached table is dirty, ovl_flush() makes room.
+ * Called with the lock held.
+ */
+static struct ovl_l2 *
+ovl_l2_get(struct ovl_image *ovl, uint64_t l2off, bool fresh)
+{
+	struct ovl_l2 *l2, *victim;
+	int i;
+
+	victim = NULL;
+	for (i = 0; i < OVL_L2_CACHE; i++) {
+		l2 = &ovl->l2[i];
+		if (l2->offset == l2off) {
+			l2->lru = ++ovl->lru_clock;
+			return l2;
+		}
+		if (l2->dirty || l2->wb)
+			continue;
+		if (victim == NULL || l2->lru < victim->lru)
+			victim = l2;
+	}
+
+	if (victim == NULL) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	/* the table cached in victim is clean, just drop it */
+	victim->offset = 0;
+	victim->lru = 0;
+	if (fresh)
+		memset(victim->table, 0, ovl->cluster_size);
+	else if (ovl_pread(ovl->fd, victim->table, ovl->cluster_size, l2off))
+		return NULL;
+	victim->offset = l2off;
+	victim->lru = ++ovl->lru_clock;
+	return victim;
+}
+
+/*
+ * Get the overlay file offset of guest cluster cidx, 0 if it is not
+ * allocated. Called with the lock held.
+ */
+static int
+ovl_lookup(struct ovl_image *ovl, uint64_t cidx, uint64_t *offp)
+{
+	struct ovl_l2 *l2;
+	uint64_t l1_idx;
+
+	l1_idx = cidx >> ovl->l2_bits;
+	if (ovl->l1[l1_idx] == 0) {
+		*offp = 0;
+		return 0;
+	}
+
+	l2 = ovl_l2_get(ovl, ovl->l1[l1_idx], false);
+	if (l2 == NULL)
+		return -1;
+	*offp = l2->table[cidx & ((1UL << ovl->l2_bits) - 1)];
+	return 0;
+}
+
+/*
+ * Allocate guest cluster cidx in the overlay, filling it with the base
+ * image content overwritten by iov at byte inoff of the cluster.
+ * Called with the lock held.
+ */
+static int
+ovl_cow(struct ovl_image *ovl, uint64_t cidx, size_t inoff,
+	const struct iovec *iov, int iovcnt)
+{
+	uint64_t l1_idx, l2_idx, l2off, data;
+	struct ovl_l2 *l2;
+	uint8_t *p;
+	bool fresh;
+	int i;
+
+	p = ovl->cow;
+	if (ovl->base_fd < 0 ||
+	    (off_t)(cidx << ovl->cluster_bits) >= ovl->base_size)
+		memset(p, 0, ovl->cluster_size);
+	else if (ovl_pread(ovl->base_fd, p, ovl->cluster_size,
+			   cidx << ovl->cluster_bits))
+		return -1;
+
+	p += inoff;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	l1_idx = cidx >> ovl->l2_bits;
+	l2_idx = cidx & ((1UL << ovl->l2_bits) - 1);
+	l2off = ovl->l1[l1_idx];
+	fresh = (l2off == 0);
+	if (fresh)
+		l2off = ovl->next;
+	l2 = ovl_l2_get(ovl, l2off, fresh);
+	if (l2 == NULL)
+		return -1;
+	if (fresh) {
+		/* on disk at the next flush, the L1 entry after it */
+		l2->dirty = ~0U;
+		ovl->next += ovl->cluster_size;
+		ovl->l1[l1_idx] = l2off;
+		ovl->l1_dirty = true;
+	}
+
+	data = ovl->next;
+	if (ovl_pwrite(ovl->fd, ovl->cow, ovl->cluster_size, data))
+		return -1;
+	ovl->next += ovl->cluster_size;
+
+	l2->table[l2_idx] = data;
+	l2->dirty |= 1U << (l2_idx >> (ovl->l2_bits - OVL_L2_CHUNK_BITS));
+	return 0;
+}
+
+/*
+ * Read len bytes of an unallocated cluster range at guest offset pos.
+ */
+static ssize_t
+ovl_read_base(struct ovl_image *ovl, const struct iovec *iov, int iovcnt,
+	      off_t pos, size_t len)
+{
+	ssize_t n;
+
+	if (ovl->base_fd < 0 || pos >= ovl->base_size)
+		n = 0;
+	else {
+		n = preadv(ovl->base_fd, iov, iovcnt, pos);
+		if (n < 0)
+			return -1;
+	}
+
+	if (n < len && pos + n >= ovl->base_size) {
+		ovl_iov_zero(iov, iovcnt, n);
+		n = len;
+	}
+	return n;
+}
+
+static ssize_t
+ovl_rw(struct ovl_image *ovl, const struct iovec *iov, int iovcnt,
+       off_t offset, bool write)
+{
+	struct iovec sub[BLOCKIF_IOV_MAX];
+	uint64_t cidx, data;
+	size_t total, done, inoff, len;
+	ssize_t n;
+	bool cow;
+	int i, subcnt, err;
+
+	if (iovcnt > BLOCKIF_IOV_MAX || offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (offset + total > ovl->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (done = 0; done < total; done += n) {
+		cidx = (offset + done) >> ovl->cluster_bits;
+		inoff = (offset + done) & (ovl->cluster_size - 1);
+		len = MIN(ovl->cluster_size - inoff, total - done);
+		subcnt = ovl_iov_slice(iov, iovcnt, done, len, sub);
+
+		pthread_mutex_lock(&ovl->mtx);
+		err = ovl_lookup(ovl, cidx, &data);
+		cow = (!err && write && data == 0);
+		if (cow) {
+			/* allocation is serialized by the lock */
+			err = ovl_cow(ovl, cidx, inoff, sub, subcnt);
+		}
+		pthread_mutex_unlock(&ovl->mtx);
+		if (err && errno == EBUSY) {
+			/* no clean L2 table to evict, write them out and retry */
+			if (ovl_flush(ovl))
+				break;
+			n = 0;
+			continue;
+		}
+		if (err)
+			break;
+		if (cow) {
+			n = len;
+			continue;
+		}
+
+		/* allocated clusters never move, no need for the lock */
+		if (write)
+			n = pwritev(ovl->fd, sub, subcnt, data + inoff);
+		else if (data)
+			n = preadv(ovl->fd, sub, subcnt, data + inoff);
+		else
+			n = ovl_read_base(ovl, sub, subcnt, offset + done, len);
+		if (n < 0)
+			break;
+		if (n < len) {
+			done += n;
+			break;
+		}
+	}
+
+	if (done == 0 && done < total)
+		return -1;
+	return done;
+}
+
+/*
+ * Write the dirty chunks of a copy of the L2 table at offset l2off.
+ */
+static int
+ovl_l2_write(struct ovl_image *ovl, const uint8_t *table, uint64_t l2off,
+	     uint32_t dirty)
+{
+	size_t chunk = ovl->cluster_size >> OVL_L2_CHUNK_BITS;
+	int first, last;
+
+	/* one write per run of dirty chunks */
+	while (dirty) {
+		first = ffs(dirty) - 1;
+		for (last = first; last < 32 && (dirty & (1U << last)); last++)
+			dirty &= ~(1U << last);
+		if (ovl_pwrite(ovl->fd, table + first * chunk,
+			       (last - first) * chunk, l2off + first * chunk))
+			return -1;
+	}
+	return 0;
+}
+
+int
+ovl_flush(struct ovl_image *ovl)
+{
+	uint64_t wb_off[OVL_L2_CACHE];
+	uint32_t wb_dirty[OVL_L2_CACHE];
+	size_t cs = ovl->cluster_size;
+	struct ovl_l2 *l2;
+	uint64_t ticket, covered;
+	bool l1_dirty;
+	int i, n, err;
+
+	pthread_mutex_lock(&ovl->mtx);
+	ticket = ++ovl->flush_req;
+	pthread_mutex_unlock(&ovl->mtx);
+
+	pthread_mutex_lock(&ovl->flush_mtx);
+	/* a flush that started while we waited did our job */
+	if (ovl->flush_done >= ticket) {
+		pthread_mutex_unlock(&ovl->flush_mtx);
+		return 0;
+	}
+
+	/*
+	 * Copy the dirty metadata: the data clusters it points to are
+	 * written already, those allocated from now on are not covered.
+	 */
+	pthread_mutex_lock(&ovl->mtx);
+	covered = ovl->flush_req;
+	for (i = 0, n = 0; i < OVL_L2_CACHE; i++) {
+		l2 = &ovl->l2[i];
+		if (!l2->dirty)
+			continue;
+		memcpy(ovl->wb_l2 + n * cs, l2->table, cs);
+		wb_off[n] = l2->offset;
+		wb_dirty[n++] = l2->dirty;
+		l2->dirty = 0;
+		l2->wb = true;
+	}
+	l1_dirty = ovl->l1_dirty;
+	if (l1_dirty)
+		memcpy(ovl->wb_l1, ovl->l1, ovl->l1_size * sizeof(uint64_t));
+	ovl->l1_dirty = false;
+	pthread_mutex_unlock(&ovl->mtx);
+
+	/* data, then the L2 tables, then the L1 entries pointing to them */
+	err = fdatasync(ovl->fd);
+	for (i = 0; i < n && !err; i++)
+		err = ovl_l2_write(ovl, ovl->wb_l2 + i * cs, wb_off[i],
+				   wb_dirty[i]);
+	if (!err && l1_dirty)
+		err = fdatasync(ovl->fd) ||
+		      ovl_pwrite(ovl->fd, ovl->wb_l1,
+				 ovl->l1_size * sizeof(uint64_t),
+				 ovl->l1_offset);
+	if (!err && (n > 0 || l1_dirty))
+		err = fdatasync(ovl->fd);
+	if (err)
+		err = errno;
+
+	/* on error, the next flush writes them again */
+	pthread_mutex_lock(&ovl->mtx);
+	for (i = 0, n = 0; i < OVL_L2_CACHE; i++) {
+		l2 = &ovl->l2[i];
+		if (l2->wb && err)
+			l2->dirty |= wb_dirty[n];
+		if (l2->wb)
+			n++;
+		l2->wb = false;
+	}
+	if (l1_dirty && err)
+		ovl->l1_dirty = true;
+	pthread_mutex_unlock(&ovl->mtx);
+
+	if (!err)
+		ovl->flush_done = covered;
+
+	pthread_mutex_unlock(&ovl->flush_mtx);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t
+ovl_preadv(struct ovl_image *ovl, const struct iovec *iov, int iovcnt,
+	   off_t offset)
+{
+	return ovl_rw(ovl, iov, iovcnt, offset, false);
+}
+
+ssize_t
+ovl_pwritev(struct ovl_image *ovl, const struct iovec *iov, int iovcnt,
+	    off_t offset)
+{
+	return ovl_rw(ovl, iov, iovcnt, offset, true);
+}
+
+static int
+ovl_open_base(struct ovl_image *ovl, const char *base)
+{
+	ovl->base_fd = open(base, O_RDONLY);
+	if (ovl->base_fd < 0) {
+		fprintf(stderr, "overlay: cannot open base image %s\n", base);
+		return -1;
+	}
+
+	/* works for both regular files and block devices */
+	ovl->base_size = lseek(ovl->base_fd, 0, SEEK_END);
+	if (ovl->base_size < 0) {
+		fprintf(stderr, "overlay: cannot size base image %s\n", base);
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t
+ovl_l1_size(uint64_t size, uint32_t cluster_bits)
+{
+	uint64_t l2_span;
+
+	/* bytes of disk mapped by one L2 table */
+	l2_span = 1UL << (cluster_bits + cluster_bits - 3);
+	return (size + l2_span - 1) / l2_span;
+}
+
+static int
+ovl_format(struct ovl_image *ovl, const char *base)
+{
+	struct ovl_header *hdr;
+	uint64_t l1_bytes;
+	uint8_t *buf;
+	size_t base_len;
+
+	base_len = strlen(base);
+	if (sizeof(*hdr) + base_len > ovl->cluster_size) {
+		fprintf(stderr, "overlay: base image path too long\n");
+		return -1;
+	}
+
+	buf = calloc(1, ovl->cluster_size);
+	if (buf == NULL)
+		return -1;
+
+	ovl->size = ovl->base_size;
+	ovl->l1_size = ovl_l1_size(ovl->size, ovl->cluster_bits);
+	ovl->l1_offset = ovl->cluster_size;
+
+	hdr = (struct ovl_header *)buf;
+	hdr->magic = OVL_MAGIC;
+	hdr->version = OVL_VERSION;
+	hdr->cluster_bits = ovl->cluster_bits;
+	hdr->l1_size = ovl->l1_size;
+	hdr->size = ovl->size;
+	hdr->l1_offset = ovl->l1_offset;
+	hdr->base_len = base_len;
+	memcpy(buf + sizeof(*hdr), base, base_len);
+
+	l1_bytes = roundup(ovl->l1_size * sizeof(uint64_t), ovl->cluster_size);
+	ovl->l1 = calloc(1, l1_bytes);
+	if (ovl->l1 == NULL ||
+	    ovl_pwrite(ovl->fd, ovl->l1, l1_bytes, ovl->l1_offset) ||
+	    ovl_pwrite(ovl->fd, buf, ovl->cluster_size, 0) ||
+	    fsync(ovl->fd)) {
+		fprintf(stderr, "overlay: failed to format overlay image\n");
+		free(buf);
+		return -1;
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int
+ovl_load(struct ovl_image *ovl, const char *base)
+{
+	struct ovl_header hdr;
+	char *path;
+	uint64_t l1_bytes;
+	int err;
+
+	if (ovl_pread(ovl->fd, &hdr, sizeof(hdr), 0))
+		return -1;
+
+	if (hdr.magic != OVL_MAGIC || hdr.version != OVL_VERSION ||
+	    hdr.cluster_bits < OVL_MIN_CLUSTER_BITS ||
+	    hdr.cluster_bits > OVL_MAX_CLUSTER_BITS ||
+	    hdr.l1_size != ovl_l1_size(hdr.size, hdr.cluster_bits) ||
+	    hdr.l1_offset == 0 ||
+	    hdr.l1_offset & ((1UL << hdr.cluster_bits) - 1) ||
+	    sizeof(hdr) + hdr.base_len > (1UL << hdr.cluster_bits)) {
+		fprintf(stderr, "overlay: invalid overlay image header\n");
+		return -1;
+	}
+
+	ovl->cluster_bits = hdr.cluster_bits;
+	ovl->cluster_size = 1UL << hdr.cluster_bits;
+	ovl->size = hdr.size;
+	ovl->l1_size = hdr.l1_size;
+	ovl->l1_offset = hdr.l1_offset;
+
+	if (base == NULL && hdr.base_len) {
+		path = calloc(1, hdr.base_len + 1);
+		if (path == NULL)
+			return -1;
+		err = ovl_pread(ovl->fd, path, hdr.base_len, sizeof(hdr));
+		if (!err)
+			err = ovl_open_base(ovl, path);
+		free(path);
+		if (err)
+			return -1;
+	} else if (base && ovl_open_base(ovl, base))
+		return -1;
+
+	l1_bytes = roundup(ovl->l1_size * sizeof(uint64_t), ovl->cluster_size);
+	ovl->l1 = calloc(1, l1_bytes);
+	if (ovl->l1 == NULL ||
+	    ovl_pread(ovl->fd, ovl->l1, ovl->l1_size * sizeof(uint64_t),
+		      ovl->l1_offset))
+		return -1;
+
+	return 0;
+}
+
+struct ovl_image *
+ovl_open(int fd, const char *base, int ro)
+{
+	struct ovl_image *ovl;
+	struct stat sbuf;
+	int i;
+
+	ovl = calloc(1, sizeof(*ovl));
+	if (ovl == NULL)
+		return NULL;
+	ovl->fd = fd;
+	ovl->base_fd = -1;
+	ovl->cluster_bits = OVL_CLUSTER_BITS;
+	ovl->cluster_size = 1UL << OVL_CLUSTER_BITS;
+	pthread_mutex_init(&ovl->mtx, NULL);
+	pthread_mutex_init(&ovl->flush_mtx, NULL);
+
+	if (fstat(fd, &sbuf) < 0)
+		goto fail;
+
+	if (sbuf.st_size == 0) {
+		if (ro || base == NULL) {
+			fprintf(stderr, "overlay: empty overlay image needs "
+					"a writable file and a base image\n");
+			goto fail;
+		}
+		if (ovl_open_base(ovl, base) || ovl_format(ovl, base))
+			goto fail;
+		if (fstat(fd, &sbuf) < 0)
+			goto fail;
+	} else if (ovl_load(ovl, base))
+		goto fail;
+
+	ovl->l2_bits = ovl->cluster_bits - 3;
+	ovl->next = roundup(sbuf.st_size, ovl->cluster_size);
+	for (i = 0; i < OVL_L2_CACHE; i++) {
+		ovl->l2[i].table = malloc(ovl->cluster_size);
+		if (ovl->l2[i].table == NULL)
+			goto fail;
+	}
+	ovl->cow = malloc(ovl->cluster_size);
+	ovl->wb_l2 = malloc(OVL_L2_CACHE * ovl->cluster_size);
+	ovl->wb_l1 = malloc(ovl->l1_size * sizeof(uint64_t));
+	if (ovl->cow == NULL || ovl->wb_l2 == NULL || ovl->wb_l1 == NULL)
+		goto fail;
+
+	return ovl;
+
+fail:
+	ovl_close(ovl);
+	return NULL;
+}
+
+void
+ovl_close(struct ovl_image *ovl)
+{
+	bool dirty;
+	int i;
+
+	/* the guest may not have flushed its last allocations */
+	dirty = ovl->l1_dirty;
+	for (i = 0; i < OVL_L2_CACHE; i++)
+		dirty |= (ovl->l2[i].dirty != 0);
+	if (dirty && ovl_flush(ovl))
+		fprintf(stderr, "overlay: failed to write metadata: %s\n",
+			strerror(errno));
+
+	if (ovl->base_fd >= 0)
+		close(ovl->base_fd);
+	for (i = 0; i < OVL_L2_CACHE; i++)
+		free(ovl->l2[i].table);
+	free(ovl->l1);
+	free(ovl->cow);
+	free(ovl->wb_l2);
+	free(ovl->wb_l1);
+	pthread_mutex_destroy(&ovl->mtx);
+	pthread_mutex_destroy(&ovl->flush_mtx);
+	free(ovl);
+}
+
+off_t
+ovl_size(struct ovl_image *ovl)
+{
+	return ovl->size;
+}
@@ -44,6 +44,8 @@
 #include "irq.h"
 #include "lpc.h"
 #include "sw_load.h"
+#include "boot_timeline.h"
+#include "atomic.h"
 
 #define CONF1_ADDR_PORT    0x0cf8
 #define CONF1_DATA_PORT    0x0cfc
@@ -87,6 +89,13 @@ static uint64_t pci_emul_iobase;
 static uint64_t pci_emul_membase32;
 static uint64_t pci_emul_membase64;
 
+/*
+ * Config space accesses from all vCPUs, through CF8/CFC or the ECFG
+ * window, are serialized here: BAR (re)programming isn't safe otherwise.
+ * BAR accesses don't take it, they check the BAR bounds instead.
+ */
+static pthread_mutex_t pci_cfg_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 #define	PCI_EMUL_IOBASE		0x2000
 #define	PCI_EMUL_IOLIMIT	0x10000
 
@@ -361,14 +370,16 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 {
 	struct pci_vdev *pdi = arg;
 	struct pci_vdev_ops *ops = pdi->dev_ops;
-	uint64_t offset;
+	uint64_t offset, base;
 	int i;
 
 	for (i = 0; i <= PCI_BARMAX; i++) {
+		/* the BAR may be moving under us, see pci_emul_mem_handler */
+		base = atomic_load(&pdi->bar[i].addr);
 		if (pdi->bar[i].type == PCIBAR_IO &&
-		    port >= pdi->bar[i].addr &&
-		    port + bytes <= pdi->bar[i].addr + pdi->bar[i].size) {
-			offset = port - pdi->bar[i].addr;
+		    port >= base &&
+		    port + bytes <= base + pdi->bar[i].size) {
+			offset = port - base;
 			if (in)
 				*eax = (*ops->vdev_barread)(ctx, vcpu, pdi, i,
 							 offset, bytes);
@@ -387,16 +398,26 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 {
 	struct pci_vdev *pdi = arg1;
 	struct pci_vdev_ops *ops = pdi->dev_ops;
-	uint64_t offset;
+	uint64_t offset, base;
 	int bidx = (int) arg2;
 
 	assert(bidx <= PCI_BARMAX);
 	assert(pdi->bar[bidx].type == PCIBAR_MEM32 ||
 	       pdi->bar[bidx].type == PCIBAR_MEM64);
-	assert(addr >= pdi->bar[bidx].addr &&
-	       addr + size <= pdi->bar[bidx].addr + pdi->bar[bidx].size);
 
-	offset = addr - pdi->bar[bidx].addr;
+	/*
+	 * Another vCPU may be moving the BAR: the range we were called for
+	 * is then gone or not yet in place.  Treat the access like one to
+	 * the PCI hole.
+	 */
+	base = atomic_load(&pdi->bar[bidx].addr);
+	if (addr < base || addr + size > base + pdi->bar[bidx].size) {
+		if (dir == MEM_F_READ)
+			*val = ~0UL;
+		return 0;
+	}
+
+	offset = addr - base;
 
 	if (dir == MEM_F_WRITE) {
 		if (size == 8) {
@@ -609,22 +630,21 @@ update_bar_address(struct  pci_vdev *dev, uint64_t addr, int idx, int type)
 	if (decode)
 		unregister_bar(dev, idx);
 
+	/* BAR accesses read it unlocked, publish it in one store */
 	switch (type) {
 	case PCIBAR_IO:
 	case PCIBAR_MEM32:
-		dev->bar[idx].addr = addr;
 		break;
 	case PCIBAR_MEM64:
-		dev->bar[idx].addr &= ~0xffffffffUL;
-		dev->bar[idx].addr |= addr;
+		addr |= dev->bar[idx].addr & ~0xffffffffUL;
 		break;
 	case PCIBAR_MEMHI64:
-		dev->bar[idx].addr &= 0xffffffff;
-		dev->bar[idx].addr |= addr;
+		addr |= dev->bar[idx].addr & 0xffffffff;
 		break;
 	default:
 		assert(0);
 	}
+	atomic_store(&dev->bar[idx].addr, addr);
 
 	if (decode)
 		register_bar(dev, idx);
@@ -837,7 +857,7 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	      int func, struct funcinfo *fi)
 {
 	struct pci_vdev *pdi;
-	int err;
+	int err, phase;
 
 	pdi = calloc(1, sizeof(struct pci_vdev));
 	if (!pdi) {
@@ -868,7 +888,9 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		fi->fi_param = strdup(fi->fi_param_saved);
 	else
 		fi->fi_param = NULL;
+	phase = boot_phase_begin("vdev_init %s", pdi->name);
 	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
+	boot_phase_end(phase);
 	if (err == 0)
 		fi->fi_devi = pdi;
 	else
@@ -1992,9 +2014,10 @@ pci_emul_cmdsts_write(struct pci_vdev *dev, int coff, uint32_t new, int bytes)
 	pci_lintr_update(dev);
 }
 
+/* Called with pci_cfg_mtx held */
 static void
-pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
-	  int coff, int bytes, uint32_t *eax)
+pci_cfgrw_locked(struct vmctx *ctx, int vcpu, int in, int bus, int slot,
+		 int func, int coff, int bytes, uint32_t *eax)
 {
 	struct businfo *bi;
 	struct slotinfo *si;
@@ -2144,6 +2167,22 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 	}
 }
 
+static void
+pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
+	  int coff, int bytes, uint32_t *eax)
+{
+	/*
+	 * A BAR move unregisters its old MMIO range.  Don't wait for the
+	 * MMIO readers then: one of them may be an ECFG access blocked on
+	 * pci_cfg_mtx.
+	 */
+	mem_reclaim_hold();
+	pthread_mutex_lock(&pci_cfg_mtx);
+	pci_cfgrw_locked(ctx, vcpu, in, bus, slot, func, coff, bytes, eax);
+	pthread_mutex_unlock(&pci_cfg_mtx);
+	mem_reclaim_release();
+}
+
 static int cfgenable, cfgbus, cfgslot, cfgfunc, cfgoff;
 
 static int
@@ -70,9 +70,29 @@ vhost_kernel_deinit(struct vhost_dev *vdev)
 
 static int
 vhost_kernel_set_mem_table(struct vhost_dev *vdev,
-			   struct vhost_memory *mem)
+			   struct vm_mem_region *regions, int nregions)
 {
-	return vhost_kernel_ioctl(vdev, VHOST_SET_MEM_TABLE, mem);
+	struct vhost_memory *mem;
+	int i, rc;
+
+	mem = calloc(1, sizeof(struct vhost_memory) +
+		sizeof(struct vhost_memory_region) * nregions);
+	if (!mem) {
+		WPRINTF("out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < nregions; i++) {
+		mem->regions[i].guest_phys_addr = regions[i].gpa;
+		mem->regions[i].memory_size = regions[i].size;
+		mem->regions[i].userspace_addr = (uintptr_t)regions[i].hva;
+	}
+	mem->nregions = nregions;
+	mem->padding = 0;
+
+	rc = vhost_kernel_ioctl(vdev, VHOST_SET_MEM_TABLE, mem);
+	free(mem);
+	return rc;
 }
 
 static int
@@ -161,6 +181,22 @@ vhost_kernel_net_set_backend(struct vhost_dev *vdev,
 	return vhost_kernel_ioctl(vdev, VHOST_NET_SET_BACKEND, file);
 }
 
+static const struct vhost_ops vhost_kernel_ops = {
+	.set_mem_table		= vhost_kernel_set_mem_table,
+	.set_vring_addr		= vhost_kernel_set_vring_addr,
+	.set_vring_num		= vhost_kernel_set_vring_num,
+	.set_vring_base		= vhost_kernel_set_vring_base,
+	.get_vring_base		= vhost_kernel_get_vring_base,
+	.set_vring_kick		= vhost_kernel_set_vring_kick,
+	.set_vring_call		= vhost_kernel_set_vring_call,
+	.set_vring_busyloop_timeout = vhost_kernel_set_vring_busyloop_timeout,
+	.set_features		= vhost_kernel_set_features,
+	.get_features		= vhost_kernel_get_features,
+	.set_owner		= vhost_kernel_set_owner,
+	.reset_device		= vhost_kernel_reset_device,
+	.net_set_backend	= vhost_kernel_net_set_backend,
+};
+
 static int
 vhost_eventfd_test_and_clear(int fd)
 {
@@ -202,7 +238,6 @@ vhost_vq_register_eventfd(struct vhost_dev *vdev,
 	struct virtio_base *base;
 	struct vhost_vq *vq;
 	struct virtio_vq_info *vqi;
-	struct pcibar *bar;
 	int rc = -1;
 
 	/* this interface is called only by vhost_vq_start,
@@ -218,38 +253,11 @@ vhost_vq_register_eventfd(struct vhost_dev *vdev,
 	}
 
 	/* register ioeventfd for kick */
-	if (base->device_caps & ACRN_VIRTIO_F_VERSION_1) {
-		/*
-		 * in the current implementation, if virtio 1.0 with pio
-		 * notity, its bar idx should be set to non-zero
-		 */
-		if (base->modern_pio_bar_idx) {
-			bar = &vdev->base->dev->bar[base->modern_pio_bar_idx];
-			ioeventfd.data = vdev->vq_idx + idx;
-			ioeventfd.addr = bar->addr;
-			ioeventfd.len = 2;
-			ioeventfd.flags |= (ACRN_IOEVENTFD_FLAG_DATAMATCH |
-				ACRN_IOEVENTFD_FLAG_PIO);
-		} else if (base->modern_mmio_bar_idx) {
-			bar = &vdev->base->dev->bar[base->modern_mmio_bar_idx];
-			ioeventfd.data = 0;
-			ioeventfd.addr = bar->addr + VIRTIO_CAP_NOTIFY_OFFSET
-				+ (vdev->vq_idx + idx) *
-				VIRTIO_MODERN_NOTIFY_OFF_MULT;
-			ioeventfd.len = 2;
-			/* no additional flag bit should be set for MMIO */
-		} else {
-			WPRINTF("invalid virtio 1.0 parameters, 0x%lx\n",
-				base->device_caps);
-			return -1;
-		}
-	} else {
-		bar = &vdev->base->dev->bar[base->legacy_pio_bar_idx];
-		ioeventfd.data = vdev->vq_idx + idx;
-		ioeventfd.addr = bar->addr + VIRTIO_CR_QNOTIFY;
-		ioeventfd.len = 2;
-		ioeventfd.flags |= (ACRN_IOEVENTFD_FLAG_DATAMATCH |
-			ACRN_IOEVENTFD_FLAG_PIO);
+	if (virtio_vq_ioeventfd_addr(base, vdev->vq_idx + idx,
+				     &ioeventfd) < 0) {
+		WPRINTF("invalid virtio 1.0 parameters, 0x%lx\n",
+			base->device_caps);
+		return -1;
 	}
 
 	ioeventfd.fd = vq->kick_fd;
@@ -412,7 +420,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_NUM */
 	ring.index = idx;
 	ring.num = vqi->qsize;
-	rc = vhost_kernel_set_vring_num(vdev, &ring);
+	rc = vdev->ops->set_vring_num(vdev, &ring);
 	if (rc < 0) {
 		WPRINTF("set_vring_num failed: idx = %d\n", idx);
 		goto fail_vring;
@@ -420,7 +428,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 
 	/* VHOST_SET_VRING_BASE */
 	ring.num = vqi->last_avail;
-	rc = vhost_kernel_set_vring_base(vdev, &ring);
+	rc = vdev->ops->set_vring_base(vdev, &ring);
 	if (rc < 0) {
 		WPRINTF("set_vring_base failed: idx = %d, last_avail = %d\n",
 			idx, vqi->last_avail);
@@ -434,7 +442,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	addr.used_user_addr = (uintptr_t)vqi->used;
 	addr.log_guest_addr = (uintptr_t)NULL;
 	addr.flags = 0;
-	rc = vhost_kernel_set_vring_addr(vdev, &addr);
+	rc = vdev->ops->set_vring_addr(vdev, &addr);
 	if (rc < 0) {
 		WPRINTF("set_vring_addr failed: idx = %d\n", idx);
 		goto fail_vring;
@@ -443,7 +451,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_CALL */
 	file.index = idx;
 	file.fd = vq->call_fd;
-	rc = vhost_kernel_set_vring_call(vdev, &file);
+	rc = vdev->ops->set_vring_call(vdev, &file);
 	if (rc < 0) {
 		WPRINTF("set_vring_call failed\n");
 		goto fail_vring;
@@ -452,7 +460,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_KICK */
 	file.index = idx;
 	file.fd = vq->kick_fd;
-	rc = vhost_kernel_set_vring_kick(vdev, &file);
+	rc = vdev->ops->set_vring_kick(vdev, &file);
 	if (rc < 0) {
 		WPRINTF("set_vring_kick failed: idx = %d", idx);
 		goto fail_vring_kick;
@@ -463,7 +471,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 fail_vring_kick:
 	file.index = idx;
 	file.fd = -1;
-	vhost_kernel_set_vring_call(vdev, &file);
+	vdev->ops->set_vring_call(vdev, &file);
 fail_vring:
 	vhost_vq_register_eventfd(vdev, idx, false);
 fail:
@@ -497,14 +505,14 @@ vhost_vq_stop(struct vhost_dev *vdev, int idx)
 	file.fd = -1;
 
 	/* VHOST_SET_VRING_KICK */
-	vhost_kernel_set_vring_kick(vdev, &file);
+	vdev->ops->set_vring_kick(vdev, &file);
 
 	/* VHOST_SET_VRING_CALL */
-	vhost_kernel_set_vring_call(vdev, &file);
+	vdev->ops->set_vring_call(vdev, &file);
 
 	/* VHOST_GET_VRING_BASE */
 	ring.index = idx;
-	rc = vhost_kernel_get_vring_base(vdev, &ring);
+	rc = vdev->ops->get_vring_base(vdev, &ring);
 	if (rc < 0)
 		WPRINTF("get_vring_base failed: idx = %d", idx);
 	else
@@ -525,54 +533,43 @@ static int
 vhost_set_mem_table(struct vhost_dev *vdev)
 {
 	struct vmctx *ctx;
-	struct vhost_memory *mem;
-	uint32_t nregions = 0;
-	int rc;
+	struct vm_mem_region regions[VHOST_MEM_REGIONS_MAX];
+	int i, nregions, rc;
 
 	ctx = vdev->base->dev->vmctx;
-	if (ctx->lowmem > 0)
-		nregions++;
-	if (ctx->highmem > 0)
-		nregions++;
 
-	mem = calloc(1, sizeof(struct vhost_memory) +
-		sizeof(struct vhost_memory_region) * nregions);
-	if (!mem) {
-		WPRINTF("out of memory\n");
-		return -1;
+	/*
+	 * Describe guest memory by the hugetlbfs files backing it, so that
+	 * a vhost-user backend in another process can map it from the fds.
+	 * Fall back to the plain lowmem/highmem layout otherwise.
+	 */
+	nregions = hugetlb_get_mem_regions(ctx, regions, VHOST_MEM_REGIONS_MAX);
+	if (nregions <= 0) {
+		nregions = 0;
+		if (ctx->lowmem > 0) {
+			regions[nregions].gpa = 0;
+			regions[nregions].size = ctx->lowmem;
+			regions[nregions].hva = ctx->baseaddr;
+			regions[nregions].fd = -1;
+			regions[nregions].fd_offset = 0;
+			nregions++;
+		}
+		if (ctx->highmem > 0) {
+			regions[nregions].gpa = 4*GB;
+			regions[nregions].size = ctx->highmem;
+			regions[nregions].hva = ctx->baseaddr + 4*GB;
+			regions[nregions].fd = -1;
+			regions[nregions].fd_offset = 0;
+			nregions++;
+		}
 	}
 
-	nregions = 0;
-	if (ctx->lowmem > 0) {
-		mem->regions[nregions].guest_phys_addr = (uintptr_t)0;
-		mem->regions[nregions].memory_size = ctx->lowmem;
-		mem->regions[nregions].userspace_addr =
-			(uintptr_t)ctx->baseaddr;
-		DPRINTF("[%d][0x%llx -> 0x%llx, 0x%llx]\n",
-			nregions,
-			mem->regions[nregions].guest_phys_addr,
-			mem->regions[nregions].userspace_addr,
-			mem->regions[nregions].memory_size);
-		nregions++;
-	}
-
-	if (ctx->highmem > 0) {
-		mem->regions[nregions].guest_phys_addr = 4*GB;
-		mem->regions[nregions].memory_size = ctx->highmem;
-		mem->regions[nregions].userspace_addr =
-			(uintptr_t)(ctx->baseaddr + 4*GB);
-		DPRINTF("[%d][0x%llx -> 0x%llx, 0x%llx]\n",
-			nregions,
-			mem->regions[nregions].guest_phys_addr,
-			mem->regions[nregions].userspace_addr,
-			mem->regions[nregions].memory_size);
-		nregions++;
-	}
+	for (i = 0; i < nregions; i++)
+		DPRINTF("[%d][0x%lx -> %p, 0x%lx, fd %d]\n", i,
+			regions[i].gpa, regions[i].hva, regions[i].size,
+			regions[i].fd);
 
-	mem->nregions = nregions;
-	mem->padding = 0;
-	rc = vhost_kernel_set_mem_table(vdev, mem);
-	free(mem);
+	rc = vdev->ops->set_mem_table(vdev, regions, nregions);
 	if (rc < 0) {
 		WPRINTF("set_mem_table failed\n");
 		return -1;
@@ -589,7 +586,7 @@ vhost_set_mem_table(struct vhost_dev *vdev)
  *
  * @param vdev Pointer to struct vhost_dev.
  * @param base Pointer to struct virtio_base.
- * @param fd fd of the vhost chardev.
+ * @param fd fd of the vhost chardev, or of the vhost-user socket.
  * @param vq_idx The first virtqueue which would be used by this vhost dev.
  * @param vhost_features Subset of vhost features which would be enabled.
  * @param vhost_ext_features Specific vhost internal features to be enabled.
@@ -625,9 +622,13 @@ vhost_dev_init(struct vhost_dev *vdev,
 		goto fail;
 	}
 
+	/* the in-kernel vhost unless the caller picked another backend */
+	if (!vdev->ops)
+		vdev->ops = &vhost_kernel_ops;
+
 	vhost_kernel_init(vdev, base, fd, vq_idx, busyloop_timeout);
 
-	rc = vhost_kernel_get_features(vdev, &features);
+	rc = vdev->ops->get_features(vdev, &features);
 	if (rc < 0) {
 		WPRINTF("vhost_get_features failed\n");
 		goto fail;
@@ -646,14 +647,18 @@ vhost_dev_init(struct vhost_dev *vdev,
 	vdev->vhost_features = vhost_features & features;
 
 	/*
-	 * If the features bits are not supported by either vhost kernel
-	 * mediator or configuration of device model(specified by
-	 * vhost_features), they should be disabled in device_caps,
-	 * which expose as virtio host_features for virtio FE driver.
+	 * If the features bits are wanted by the configuration of device
+	 * model(specified by vhost_features) but not supported by the vhost
+	 * backend, they should be disabled in device_caps, which expose as
+	 * virtio host_features for virtio FE driver. Bits only the backend
+	 * offers (a vhost-user backend may offer MAC or STATUS) are kept.
 	 */
-	vdev->base->device_caps &= ~(vhost_features ^ features);
+	vdev->base->device_caps &= ~(vhost_features & ~features);
 	vdev->started = false;
 
+	/* the kicks and interrupts belong to vhost */
+	vdev->base->flags |= VIRTIO_NO_EVENTFD;
+
 	return 0;
 
 fail:
@@ -716,7 +721,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 		goto fail;
 	}
 
-	rc = vhost_kernel_set_owner(vdev);
+	rc = vdev->ops->set_owner(vdev);
 	if (rc < 0) {
 		WPRINTF("vhost_set_owner failed\n");
 		goto fail;
@@ -725,7 +730,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 	/* set vhost internal features */
 	features = (vdev->base->negotiated_caps & vdev->vhost_features) |
 		vdev->vhost_ext_features;
-	rc = vhost_kernel_set_features(vdev, features);
+	rc = vdev->ops->set_features(vdev, features);
 	if (rc < 0) {
 		WPRINTF("set_features failed\n");
 		goto fail;
@@ -744,7 +749,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 		state.num = vdev->busyloop_timeout;
 		for (i = 0; i < vdev->nvqs; i++) {
 			state.index = i;
-			rc = vhost_kernel_set_vring_busyloop_timeout(vdev,
+			rc = vdev->ops->set_vring_busyloop_timeout(vdev,
 				&state);
 			if (rc < 0) {
 				WPRINTF("set_busyloop_timeout failed\n");
@@ -791,7 +796,7 @@ vhost_dev_stop(struct vhost_dev *vdev)
 	 * 1) resources of the vhost dev are freed
 	 * 2) vhost virtqueues are reset
 	 */
-	rc = vhost_kernel_reset_device(vdev);
+	rc = vdev->ops->reset_device(vdev);
 	if (rc < 0) {
 		WPRINTF("vhost_reset_device failed\n");
 		rc = -1;
@@ -821,7 +826,7 @@ vhost_net_set_backend(struct vhost_dev *vdev, int backend_fd)
 	file.fd = backend_fd;
 	for (i = 0; i < vdev->nvqs; i++) {
 		file.index = i;
-		rc = vhost_kernel_net_set_backend(vdev, &file);
+		rc = vdev->ops->net_set_backend(vdev, &file);
 		if (rc < 0)
 			goto fail;
 	}
@@ -831,7 +836,7 @@ fail:
 	file.fd = -1;
 	while (--i >= 0) {
 		file.index = i;
-		vhost_kernel_net_set_backend(vdev, &file);
+		vdev->ops->net_set_backend(vdev, &file);
 	}
 
 	return -1;
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * vhost-user transport: the vhost requests are sent over a UNIX socket to
+ * a backend in another process (e.g. a polling packet switch). Guest
+ * memory is shared by passing the fds of the hugetlbfs files backing it,
+ * and the kick/call eventfds are passed the same way.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/vhost.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "vmmapi.h"
+#include "vhost.h"
+
+static int vhost_user_debug;
+#define LOG_TAG "vhost_user: "
+#define DPRINTF(fmt, args...) \
+	do { if (vhost_user_debug) printf(LOG_TAG fmt, ##args); } while (0)
+#define WPRINTF(fmt, args...) printf(LOG_TAG fmt, ##args)
+
+enum vhost_user_request {
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+};
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_REPLY_MASK		(0x1 << 2)
+#define VHOST_USER_VRING_IDX_MASK	0xff
+#define VHOST_USER_VRING_NOFD_MASK	(0x1 << 8)
+
+struct vhost_user_mem_region {
+	uint64_t guest_phys_addr;
+	uint64_t memory_size;
+	uint64_t userspace_addr;
+	uint64_t mmap_offset;
+};
+
+struct vhost_user_memory {
+	uint32_t nregions;
+	uint32_t padding;
+	struct vhost_user_mem_region regions[VHOST_MEM_REGIONS_MAX];
+};
+
+/*
+ * On the wire the payload directly follows the 12 byte header; here it
+ * is kept aligned and the two are sent as separate iovecs.
+ */
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;		/* size of the payload */
+	union {
+		uint64_t u64;
+		struct vhost_vring_state state;
+		struct vhost_vring_addr addr;
+		struct vhost_user_memory memory;
+	} payload;
+};
+
+#define VHOST_USER_HDR_SIZE	(3 * sizeof(uint32_t))
+
+static int
+vhost_user_send(struct vhost_dev *vdev, struct vhost_user_msg *msg,
+		int *fds, int nfds)
+{
+	char control[CMSG_SPACE(sizeof(int) * VHOST_MEM_REGIONS_MAX)];
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov[2];
+	ssize_t rc;
+
+	msg->flags = VHOST_USER_VERSION;
+
+	iov[0].iov_base = msg;
+	iov[0].iov_len = VHOST_USER_HDR_SIZE;
+	iov[1].iov_base = &msg->payload;
+	iov[1].iov_len = msg->size;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	do {
+		rc = sendmsg(vdev->fd, &mh, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc != (ssize_t)(VHOST_USER_HDR_SIZE + msg->size)) {
+		WPRINTF("send request %u failed, errno = %d\n",
+			msg->request, errno);
+		return -1;
+	}
+	DPRINTF("request %u, size %u, nfds %d\n", msg->request, msg->size,
+		nfds);
+	return 0;
+}
+
+static int
+vhost_user_read(int fd, void *buf, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = recv(fd, buf, len, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		buf = (char *)buf + rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static int
+vhost_user_recv(struct vhost_dev *vdev, struct vhost_user_msg *msg,
+		uint32_t request)
+{
+	if (vhost_user_read(vdev->fd, msg, VHOST_USER_HDR_SIZE) < 0) {
+		WPRINTF("no reply to request %u, errno = %d\n", request, errno);
+		return -1;
+	}
+
+	if (msg->request != request ||
+	    (msg->flags & VHOST_USER_REPLY_MASK) == 0 ||
+	    msg->size > sizeof(msg->payload)) {
+		WPRINTF("bad reply to request %u: request %u, flags 0x%x, "
+			"size %u\n", request, msg->request, msg->flags,
+			msg->size);
+		return -1;
+	}
+
+	if (vhost_user_read(vdev->fd, &msg->payload, msg->size) < 0) {
+		WPRINTF("short reply to request %u\n", request);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+vhost_user_set_u64(struct vhost_dev *vdev, uint32_t request, uint64_t val)
+{
+	struct vhost_user_msg msg;
+
+	msg.request = request;
+	msg.size = sizeof(msg.payload.u64);
+	msg.payload.u64 = val;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_set_vring_state(struct vhost_dev *vdev, uint32_t request,
+			   struct vhost_vring_state *ring)
+{
+	struct vhost_user_msg msg;
+
+	msg.request = request;
+	msg.size = sizeof(msg.payload.state);
+	msg.payload.state = *ring;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_set_vring_file(struct vhost_dev *vdev, uint32_t request,
+			  struct vhost_vring_file *file)
+{
+	struct vhost_user_msg msg;
+	int fd = file->fd;
+
+	msg.request = request;
+	msg.size = sizeof(msg.payload.u64);
+	msg.payload.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+	if (fd < 0)
+		msg.payload.u64 |= VHOST_USER_VRING_NOFD_MASK;
+
+	return vhost_user_send(vdev, &msg, &fd, fd < 0 ? 0 : 1);
+}
+
+static int
+vhost_user_set_mem_table(struct vhost_dev *vdev,
+			 struct vm_mem_region *regions, int nregions)
+{
+	struct vhost_user_msg msg;
+	struct vhost_user_mem_region *r;
+	int fds[VHOST_MEM_REGIONS_MAX];
+	int i;
+
+	if (nregions > VHOST_MEM_REGIONS_MAX) {
+		WPRINTF("too many memory regions: %d\n", nregions);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	for (i = 0; i < nregions; i++) {
+		/* the backend can only reach memory it can map */
+		if (regions[i].fd < 0) {
+			WPRINTF("guest memory at 0x%lx is not shareable\n",
+				regions[i].gpa);
+			return -1;
+		}
+
+		r = &msg.payload.memory.regions[i];
+		r->guest_phys_addr = regions[i].gpa;
+		r->memory_size = regions[i].size;
+		r->userspace_addr = (uintptr_t)regions[i].hva;
+		r->mmap_offset = regions[i].fd_offset;
+		fds[i] = regions[i].fd;
+	}
+
+	msg.request = VHOST_USER_SET_MEM_TABLE;
+	msg.payload.memory.nregions = nregions;
+	msg.size = offsetof(struct vhost_user_memory, regions) +
+		sizeof(struct vhost_user_mem_region) * nregions;
+	return vhost_user_send(vdev, &msg, fds, nregions);
+}
+
+static int
+vhost_user_set_vring_addr(struct vhost_dev *vdev,
+			  struct vhost_vring_addr *addr)
+{
+	struct vhost_user_msg msg;
+
+	msg.request = VHOST_USER_SET_VRING_ADDR;
+	msg.size = sizeof(msg.payload.addr);
+	msg.payload.addr = *addr;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_set_vring_num(struct vhost_dev *vdev,
+			 struct vhost_vring_state *ring)
+{
+	return vhost_user_set_vring_state(vdev, VHOST_USER_SET_VRING_NUM, ring);
+}
+
+static int
+vhost_user_set_vring_base(struct vhost_dev *vdev,
+			  struct vhost_vring_state *ring)
+{
+	return vhost_user_set_vring_state(vdev, VHOST_USER_SET_VRING_BASE,
+		ring);
+}
+
+/* also stops the ring in the backend */
+static int
+vhost_user_get_vring_base(struct vhost_dev *vdev,
+			  struct vhost_vring_state *ring)
+{
+	struct vhost_user_msg msg;
+
+	if (vhost_user_set_vring_state(vdev, VHOST_USER_GET_VRING_BASE,
+			ring) < 0)
+		return -1;
+	if (vhost_user_recv(vdev, &msg, VHOST_USER_GET_VRING_BASE) < 0)
+		return -1;
+	if (msg.size != sizeof(msg.payload.state))
+		return -1;
+
+	ring->num = msg.payload.state.num;
+	return 0;
+}
+
+static int
+vhost_user_set_vring_kick(struct vhost_dev *vdev,
+			  struct vhost_vring_file *file)
+{
+	/*
+	 * A kick without fd asks the backend to poll the ring; the ring
+	 * is stopped by GET_VRING_BASE instead, so there is nothing to say.
+	 */
+	if (file->fd < 0)
+		return 0;
+	return vhost_user_set_vring_file(vdev, VHOST_USER_SET_VRING_KICK,
+		file);
+}
+
+static int
+vhost_user_set_vring_call(struct vhost_dev *vdev,
+			  struct vhost_vring_file *file)
+{
+	return vhost_user_set_vring_file(vdev, VHOST_USER_SET_VRING_CALL,
+		file);
+}
+
+static int
+vhost_user_set_vring_busyloop_timeout(struct vhost_dev *vdev,
+				      struct vhost_vring_state *s)
+{
+	/* polling is up to the backend */
+	return 0;
+}
+
+static int
+vhost_user_set_features(struct vhost_dev *vdev, uint64_t features)
+{
+	return vhost_user_set_u64(vdev, VHOST_USER_SET_FEATURES, features);
+}
+
+static int
+vhost_user_get_features(struct vhost_dev *vdev, uint64_t *features)
+{
+	struct vhost_user_msg msg;
+
+	msg.request = VHOST_USER_GET_FEATURES;
+	msg.size = 0;
+	if (vhost_user_send(vdev, &msg, NULL, 0) < 0)
+		return -1;
+	if (vhost_user_recv(vdev, &msg, VHOST_USER_GET_FEATURES) < 0)
+		return -1;
+	if (msg.size != sizeof(msg.payload.u64))
+		return -1;
+
+	*features = msg.payload.u64;
+	return 0;
+}
+
+static int
+vhost_user_set_owner(struct vhost_dev *vdev)
+{
+	struct vhost_user_msg msg;
+
+	msg.request = VHOST_USER_SET_OWNER;
+	msg.size = 0;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_reset_device(struct vhost_dev *vdev)
+{
+	/*
+	 * RESET_OWNER is deprecated for vhost-user and some backends tear
+	 * the connection down on it. The rings were already stopped by
+	 * GET_VRING_BASE and are set up again on the next start.
+	 */
+	return 0;
+}
+
+static int
+vhost_user_net_set_backend(struct vhost_dev *vdev,
+			   struct vhost_vring_file *file)
+{
+	/* the backend process owns the packet I/O */
+	return 0;
+}
+
+const struct vhost_ops vhost_user_ops = {
+	.set_mem_table		= vhost_user_set_mem_table,
+	.set_vring_addr		= vhost_user_set_vring_addr,
+	.set_vring_num		= vhost_user_set_vring_num,
+	.set_vring_base		= vhost_user_set_vring_base,
+	.get_vring_base		= vhost_user_get_vring_base,
+	.set_vring_kick		= vhost_user_set_vring_kick,
+	.set_vring_call		= vhost_user_set_vring_call,
+	.set_vring_busyloop_timeout = vhost_user_set_vring_busyloop_timeout,
+	.set_features		= vhost_user_set_features,
+	.get_features		= vhost_user_get_features,
+	.set_owner		= vhost_user_set_owner,
+	.reset_device		= vhost_user_reset_device,
+	.net_set_backend	= vhost_user_net_set_backend,
+};
+
+int
+vhost_user_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		WPRINTF("socket path too long: %s\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		WPRINTF("socket failed, errno = %d\n", errno);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		WPRINTF("connect to %s failed, errno = %d\n", path, errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
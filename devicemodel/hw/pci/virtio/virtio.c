@@ -25,13 +25,23 @@
  */
 
 #include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "dm.h"
+#include "vmmapi.h"
 #include "pci_core.h"
+#include "mevent.h"
 #include "virtio.h"
+#include "timer.h"
+#include "dm_string.h"
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -77,6 +87,467 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	}
 }
 
+/**
+ * @brief Fill in the notify address of a virtqueue for an ioeventfd.
+ *
+ * The address depends on the transport the guest driver uses: the
+ * legacy QNOTIFY register, or the modern notify capability in the
+ * pio or mmio BAR.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param idx Index of the virtqueue.
+ * @param ioeventfd Pointer to struct acrn_ioeventfd to fill in.
+ *
+ * @return 0 on success and -1 on fail.
+ */
+int
+virtio_vq_ioeventfd_addr(struct virtio_base *base, int idx,
+			 struct acrn_ioeventfd *ioeventfd)
+{
+	struct pcibar *bar;
+
+	/* a transitional device is notified where its driver was set up */
+	if (base->negotiated_caps & ACRN_VIRTIO_F_VERSION_1) {
+		/*
+		 * in the current implementation, if virtio 1.0 with pio
+		 * notity, its bar idx should be set to non-zero
+		 */
+		if (base->modern_pio_bar_idx) {
+			bar = &base->dev->bar[base->modern_pio_bar_idx];
+			ioeventfd->data = idx;
+			ioeventfd->addr = bar->addr;
+			ioeventfd->len = 2;
+			ioeventfd->flags |= (ACRN_IOEVENTFD_FLAG_DATAMATCH |
+				ACRN_IOEVENTFD_FLAG_PIO);
+		} else if (base->modern_mmio_bar_idx) {
+			bar = &base->dev->bar[base->modern_mmio_bar_idx];
+			ioeventfd->data = 0;
+			ioeventfd->addr = bar->addr + VIRTIO_CAP_NOTIFY_OFFSET
+				+ idx * VIRTIO_MODERN_NOTIFY_OFF_MULT;
+			ioeventfd->len = 2;
+			/* no additional flag bit should be set for MMIO */
+		} else
+			return -1;
+	} else {
+		bar = &base->dev->bar[base->legacy_pio_bar_idx];
+		ioeventfd->data = idx;
+		ioeventfd->addr = bar->addr + VIRTIO_CR_QNOTIFY;
+		ioeventfd->len = 2;
+		ioeventfd->flags |= (ACRN_IOEVENTFD_FLAG_DATAMATCH |
+			ACRN_IOEVENTFD_FLAG_PIO);
+	}
+
+	return 0;
+}
+
+/*
+ * Kick handler of the ioeventfd path: the guest notify write completed
+ * in the kernel, so run the device's notify handler here, as the
+ * QNOTIFY register write would have done.
+ */
+static void
+virtio_vq_kick(int fd, enum ev_type t __attribute__((unused)), void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	struct virtio_base *base = vq->base;
+	eventfd_t val;
+
+	if (eventfd_read(fd, &val) < 0)
+		return;
+
+	VIRTIO_BASE_LOCK(base);
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (base->vops->qnotify)
+		(*base->vops->qnotify)(DEV_STRUCT(base), vq);
+	VIRTIO_BASE_UNLOCK(base);
+}
+
+/*
+ * (Re)bind the irqfd of a virtqueue to its current MSI-X message.  A
+ * masked vector gets no irqfd, so its interrupts go through
+ * pci_generate_msix() and are dropped there as before.
+ */
+static void
+virtio_vq_irqfd_update(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct acrn_irqfd irqfd = {0};
+	struct msix_table_entry *mte;
+	struct pci_vdev *dev = base->dev;
+
+	irqfd.fd = vq->call_fd;
+	if (vq->irqfd_on) {
+		irqfd.flags = ACRN_IRQFD_FLAG_DEASSIGN;
+		vm_irqfd(dev->vmctx, &irqfd);
+		vq->irqfd_on = false;
+	}
+
+	if (!pci_msix_enabled(dev) || vq->msix_idx >= dev->msix.table_count)
+		return;
+	mte = &dev->msix.table[vq->msix_idx];
+	if (mte->vector_control & PCIM_MSIX_VCTRL_MASK)
+		return;
+
+	irqfd.flags = 0;
+	irqfd.msi.msi_addr = mte->addr;
+	irqfd.msi.msi_data = mte->msg_data;
+	vq->irqfd_on = (vm_irqfd(dev->vmctx, &irqfd) == 0);
+}
+
+/**
+ * @brief Deliver a virtqueue interrupt through its irqfd.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return 1 if delivered, 0 if the caller should take the ioctl path.
+ */
+int
+vq_irqfd_interrupt(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	/* the irqfd knows nothing of the MSI-X enable and function mask */
+	if (!pci_msix_enabled(base->dev) || base->dev->msix.function_mask)
+		return 0;
+	return eventfd_write(vq->call_fd, 1) == 0;
+}
+
+/* follow guest MSI-X table updates */
+static void
+virtio_update_irqfds(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (vq->kick_mevp && vq->call_fd >= 0)
+			virtio_vq_irqfd_update(base, vq);
+	}
+}
+
+/*
+ * Once the driver is ready, route the notify writes of every ready
+ * virtqueue to an ioeventfd, and its interrupts to an irqfd.  This
+ * keeps the vCPU out of the device's notify handler.  Any failure
+ * leaves that queue on the regular register emulation path.
+ *
+ * The kicks run on the device's event loop: the one the device set in
+ * base->evloop, else a loop of its own named "pci<slot>.<func>".  That
+ * loop is bound to a host cpu if given with --mevent_loop, and is the
+ * main mevent loop only once all the loop threads are taken.
+ */
+static void
+virtio_start_eventfds(struct virtio_base *base)
+{
+	struct acrn_ioeventfd ioeventfd;
+	struct virtio_vq_info *vq;
+	char name[16];
+	int i, fd;
+
+	if (base->flags & VIRTIO_NO_EVENTFD)
+		return;
+
+	if (base->evloop == NULL) {
+		snprintf(name, sizeof(name), "pci%d.%d", base->dev->slot,
+			 base->dev->func);
+		base->evloop = mevent_loop_get_own(name);
+	}
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (!vq_ring_ready(vq) || vq->kick_mevp)
+			continue;
+
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			return;
+		memset(&ioeventfd, 0, sizeof(ioeventfd));
+		ioeventfd.fd = fd;
+		if (virtio_vq_ioeventfd_addr(base, i, &ioeventfd) < 0 ||
+		    vm_ioeventfd(base->dev->vmctx, &ioeventfd) < 0) {
+			fprintf(stderr, "%s: vq %d: no ioeventfd, errno %d\r\n",
+				base->vops->name, i, errno);
+			close(fd);
+			continue;
+		}
+		vq->kick_fd = fd;
+		vq->kick_mevp = mevent_add_loop(base->evloop, fd, EVF_READ,
+						virtio_vq_kick, vq);
+		if (vq->kick_mevp == NULL) {
+			ioeventfd.flags |= ACRN_IOEVENTFD_FLAG_DEASSIGN;
+			vm_ioeventfd(base->dev->vmctx, &ioeventfd);
+			close(fd);
+			continue;
+		}
+
+		vq->call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (vq->call_fd >= 0)
+			virtio_vq_irqfd_update(base, vq);
+	}
+}
+
+static void
+virtio_stop_eventfds(struct virtio_base *base)
+{
+	struct acrn_ioeventfd ioeventfd;
+	struct acrn_irqfd irqfd = {0};
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (vq->kick_mevp == NULL)
+			continue;
+
+		memset(&ioeventfd, 0, sizeof(ioeventfd));
+		ioeventfd.fd = vq->kick_fd;
+		ioeventfd.flags = ACRN_IOEVENTFD_FLAG_DEASSIGN;
+		virtio_vq_ioeventfd_addr(base, i, &ioeventfd);
+		vm_ioeventfd(base->dev->vmctx, &ioeventfd);
+		mevent_delete_close(vq->kick_mevp);
+		vq->kick_mevp = NULL;
+
+		if (vq->irqfd_on) {
+			irqfd.fd = vq->call_fd;
+			irqfd.flags = ACRN_IRQFD_FLAG_DEASSIGN;
+			vm_irqfd(base->dev->vmctx, &irqfd);
+			vq->irqfd_on = false;
+		}
+		if (vq->call_fd >= 0)
+			close(vq->call_fd);
+	}
+}
+
+/*
+ * Interrupt coalescing of a virtqueue. Completions that would interrupt
+ * the guest are counted as pending; the interrupt goes out once the
+ * pending count reaches the threshold, or when the acrn_timer armed by
+ * the first of them expires.
+ *
+ * The threshold is the number of completions expected within max_usecs
+ * at the rate seen over the last window, capped by max_frames. Below two
+ * there is nothing to gain and each completion interrupts right away.
+ */
+#define VQ_COALESCE_WINDOW_NS	(10 * 1000 * 1000UL)
+
+struct vq_coalesce {
+	pthread_mutex_t mtx;	/* nests inside the virtio_base lock */
+	struct acrn_timer timer;
+	struct virtio_vq_info *vq;
+	uint32_t max_frames;
+	uint32_t max_usecs;
+	uint32_t threshold;	/* frames per interrupt currently applied */
+	uint32_t pending;	/* completions not signalled yet */
+	bool armed;		/* timer running */
+	uint64_t win_start;	/* start of the rate window, in ns */
+	uint32_t win_frames;	/* completions in the rate window */
+};
+
+static inline uint64_t
+vq_coalesce_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+vq_coalesce_timer(void *arg)
+{
+	struct vq_coalesce *coal = arg;
+	uint32_t pending;
+
+	pthread_mutex_lock(&coal->mtx);
+	pending = coal->pending;
+	coal->pending = 0;
+	coal->armed = false;
+	pthread_mutex_unlock(&coal->mtx);
+
+	if (pending)
+		vq_interrupt(coal->vq->base, coal->vq);
+}
+
+/*
+ * Called from vq_endchains() with intr set if the ring rules ask for an
+ * interrupt, and the number of entries used since the last call.
+ */
+static void
+vq_coalesce(struct virtio_vq_info *vq, int intr, uint32_t frames)
+{
+	struct vq_coalesce *coal = vq->coal;
+	struct itimerspec its;
+	uint64_t now, elapsed, expect;
+	bool fire = false;
+
+	pthread_mutex_lock(&coal->mtx);
+
+	now = vq_coalesce_now();
+	coal->win_frames += frames;
+	elapsed = now - coal->win_start;
+	if (elapsed >= VQ_COALESCE_WINDOW_NS) {
+		expect = (uint64_t)coal->win_frames * coal->max_usecs * 1000 /
+			elapsed;
+		if (expect < 1)
+			expect = 1;
+		coal->threshold = expect < coal->max_frames ?
+			expect : coal->max_frames;
+		coal->win_start = now;
+		coal->win_frames = 0;
+	}
+
+	/* an interrupt already held back covers these completions too */
+	if (!intr && coal->pending == 0) {
+		pthread_mutex_unlock(&coal->mtx);
+		return;
+	}
+
+	coal->pending += frames ? frames : 1;
+	if (coal->pending >= coal->threshold) {
+		/* a timer still armed finds nothing pending and stops */
+		coal->pending = 0;
+		fire = true;
+	} else if (!coal->armed) {
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = coal->max_usecs / 1000000;
+		its.it_value.tv_nsec = (coal->max_usecs % 1000000) * 1000;
+		if (acrn_timer_settime(&coal->timer, &its) == 0)
+			coal->armed = true;
+		else {
+			coal->pending = 0;
+			fire = true;
+		}
+	}
+
+	pthread_mutex_unlock(&coal->mtx);
+
+	if (fire)
+		vq_interrupt(vq->base, vq);
+}
+
+/* drop what is held back, the rings are gone */
+static void
+vq_coalesce_reset(struct virtio_vq_info *vq)
+{
+	struct vq_coalesce *coal = vq->coal;
+
+	if (!coal)
+		return;
+
+	pthread_mutex_lock(&coal->mtx);
+	coal->pending = 0;
+	coal->threshold = 1;
+	coal->win_start = vq_coalesce_now();
+	coal->win_frames = 0;
+	pthread_mutex_unlock(&coal->mtx);
+}
+
+static inline void
+vq_signal(struct virtio_vq_info *vq, int intr, uint32_t frames)
+{
+	if (vq->coal)
+		vq_coalesce(vq, intr, frames);
+	else if (intr)
+		vq_interrupt(vq->base, vq);
+}
+
+/**
+ * @brief Parse an interrupt coalescing option.
+ *
+ * @param opt Option value, "<max_frames>:<max_usecs>".
+ * @param coal Pointer to struct virtio_coalesce to fill.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int
+virtio_coalesce_parse(const char *opt, struct virtio_coalesce *coal)
+{
+	char *end;
+
+	if (dm_strtoui(opt, &end, 10, &coal->max_frames) || *end != ':' ||
+	    dm_strtoui(end + 1, &end, 10, &coal->max_usecs) || *end != '\0')
+		return -1;
+
+	/* a timer period of seconds would stall the device */
+	if (coal->max_frames == 0 || coal->max_usecs > 1000000)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Enable interrupt coalescing on all virtqueues of a device.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param coal Pointer to the coalescing parameters.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int
+virtio_coalesce_init(struct virtio_base *base,
+		     const struct virtio_coalesce *coal)
+{
+	struct vq_coalesce *c;
+	int i;
+
+	/* nothing to coalesce */
+	if (coal->max_frames <= 1 || coal->max_usecs == 0)
+		return 0;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			goto fail;
+
+		pthread_mutex_init(&c->mtx, NULL);
+		c->vq = &base->queues[i];
+		c->max_frames = coal->max_frames;
+		c->max_usecs = coal->max_usecs;
+		c->threshold = 1;
+		c->win_start = vq_coalesce_now();
+		c->timer.clockid = CLOCK_MONOTONIC;
+		if (acrn_timer_init(&c->timer, vq_coalesce_timer, c) < 0) {
+			pthread_mutex_destroy(&c->mtx);
+			free(c);
+			goto fail;
+		}
+		base->queues[i].coal = c;
+	}
+
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: interrupt coalescing setup failed\r\n",
+		base->vops->name);
+	virtio_coalesce_deinit(base);
+	return -1;
+}
+
+/**
+ * @brief Disable interrupt coalescing and release its resources.
+ *
+ * @param base Pointer to struct virtio_base.
+ *
+ * @return N/A
+ */
+void
+virtio_coalesce_deinit(struct virtio_base *base)
+{
+	struct vq_coalesce *c;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		c = base->queues[i].coal;
+		if (!c)
+			continue;
+
+		base->queues[i].coal = NULL;
+		acrn_timer_deinit(&c->timer);
+		pthread_mutex_destroy(&c->mtx);
+		free(c);
+	}
+}
+
 /**
  * @brief Reset device (device-wide).
  *
@@ -105,6 +576,10 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->flags = 0;
 		vq->last_avail = 0;
 		vq->save_used = 0;
+		vq->used_idx = 0;
+		vq->avail_wrap = true;
+		vq->used_wrap = true;
+		vq->save_wrap = true;
 		vq->pfn = 0;
 		vq->msix_idx = VIRTIO_MSI_NO_VECTOR;
 		vq->gpa_desc[0] = 0;
@@ -114,7 +589,9 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		vq_coalesce_reset(vq);
 	}
+	virtio_stop_eventfds(base);
 	base->negotiated_caps = 0;
 	base->curq = 0;
 	/* base->status = 0; -- redundant */
@@ -246,6 +723,57 @@ virtio_vq_init(struct virtio_base *base, uint32_t pfn)
 	vq->save_used = 0;
 }
 
+/*
+ * Packed flavour of virtio_vq_enable(): the desc gpa is the descriptor
+ * ring, the avail and used gpas are the driver and device event
+ * suppression structures.
+ */
+static void
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint16_t qsz;
+	uint64_t phys;
+	uint16_t *len;
+
+	qsz = vq->qsize;
+	len = realloc(vq->chain_len, 2 * qsz * sizeof(uint16_t));
+	if (len == NULL) {
+		fprintf(stderr, "%s: failed to allocate packed vq %d\r\n",
+			base->vops->name, vq->num);
+		return;
+	}
+	vq->chain_len = len;
+	vq->chain_tail = len + qsz;
+
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	vq->pdesc = paddr_guest2host(base->dev->vmctx, phys,
+		qsz * sizeof(struct virtio_packed_desc));
+
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	vq->driver_event = paddr_guest2host(base->dev->vmctx, phys,
+		sizeof(struct virtio_packed_event));
+
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vq->device_event = paddr_guest2host(base->dev->vmctx, phys,
+		sizeof(struct virtio_packed_event));
+	vq->device_event->flags = ACRN_VRING_PACKED_EVENT_F_ENABLE;
+
+	/* there is no split ring to poke at */
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+
+	/* Start at slot 0 with both wrap counters set. */
+	vq->flags = VQ_ALLOC | VQ_PACKED;
+	vq->last_avail = 0;
+	vq->used_idx = 0;
+	vq->avail_wrap = true;
+	vq->used_wrap = true;
+	vq->save_wrap = true;
+
+	vq->enabled = true;
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -264,6 +792,11 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (base->negotiated_caps & ACRN_VIRTIO_F_RING_PACKED) {
+		virtio_vq_enable_packed(base, vq);
+		return;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct virtio_desc);
@@ -291,20 +824,52 @@ virtio_vq_enable(struct virtio_base *base)
 	vq->enabled = true;
 }
 
+/*
+ * Translate a guest physical range for the rings and their buffers.
+ * The guest memory segments laid out by vm_setup_memory() never move,
+ * so the last segment hit is cached in the virtqueue and most lookups
+ * are a pair of compares; a miss falls back to paddr_guest2host() and
+ * reloads the cache from the segment that matched.
+ */
+static inline void *
+vq_map_gpa(struct virtio_vq_info *vq, uint64_t gpa, uint32_t len)
+{
+	struct vmctx *ctx;
+	void *hva;
+
+	if (gpa >= vq->gpa_cache.start && gpa < vq->gpa_cache.end &&
+	    gpa + len <= vq->gpa_cache.end)
+		return vq->gpa_cache.hva + gpa;
+
+	ctx = vq->base->dev->vmctx;
+	hva = paddr_guest2host(ctx, gpa, len);
+	if (hva == NULL)
+		return NULL;
+	if (gpa < vm_get_lowmem_size(ctx)) {
+		vq->gpa_cache.start = 0;
+		vq->gpa_cache.end = vm_get_lowmem_size(ctx);
+	} else {
+		vq->gpa_cache.start = 4 * GB;
+		vq->gpa_cache.end = 4 * GB + vm_get_highmem_size(ctx);
+	}
+	vq->gpa_cache.hva = (char *)hva - gpa;
+	return hva;
+}
+
 /*
  * Helper inline for vq_getchain(): record the i'th "real"
  * descriptor.
  */
 static inline void
-_vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
-	   struct iovec *iov, int n_iov, uint16_t *flags) {
+_vq_record(struct virtio_vq_info *vq, int i, uint64_t addr, uint32_t len,
+	   uint16_t vflags, struct iovec *iov, int n_iov, uint16_t *flags) {
 
 	if (i >= n_iov)
 		return;
-	iov[i].iov_base = paddr_guest2host(ctx, vd->addr, vd->len);
-	iov[i].iov_len = vd->len;
+	iov[i].iov_base = vq_map_gpa(vq, addr, len);
+	iov[i].iov_len = len;
 	if (flags != NULL)
-		flags[i] = vd->flags;
+		flags[i] = vflags;
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
@@ -347,47 +912,26 @@ _vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
  * You are assumed to have done a vq_ring_ready() if needed (note
  * that vq_has_descs() does one).
  */
-int
-vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
-	    struct iovec *iov, int n_iov, uint16_t *flags)
+/*
+ * Walk the split ring chain starting at descriptor head, see
+ * vq_getchain().  Each descriptor is copied out of guest memory once
+ * rather than re-read field by field.
+ */
+static int
+_vq_walk(struct virtio_vq_info *vq, u_int head,
+	 struct iovec *iov, int n_iov, uint16_t *flags)
 {
 	int i;
-	u_int ndesc, n_indir;
-	u_int idx, next;
+	u_int n_indir, next;
 
-	volatile struct virtio_desc *vdir, *vindir, *vp;
-	struct vmctx *ctx;
+	struct virtio_desc vdir, vp;
+	volatile struct virtio_desc *vindir;
 	struct virtio_base *base;
 	const char *name;
 
 	base = vq->base;
 	name = base->vops->name;
 
-	/*
-	 * Note: it's the responsibility of the guest not to
-	 * update vq->avail->idx until all of the descriptors
-	 * the guest has written are valid (including all their
-	 * next fields and vd_flags).
-	 *
-	 * Compute (last_avail - idx) in integers mod 2**16.  This is
-	 * the number of descriptors the device has made available
-	 * since the last time we updated vq->last_avail.
-	 *
-	 * We just need to do the subtraction as an unsigned int,
-	 * then trim off excess bits.
-	 */
-	idx = vq->last_avail;
-	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
-	if (ndesc == 0)
-		return 0;
-	if (ndesc > vq->qsize) {
-		/* XXX need better way to diagnose issues */
-		fprintf(stderr,
-		    "%s: ndesc (%u) out of range, driver confused?\r\n",
-		    name, (u_int)ndesc);
-		return -1;
-	}
-
 	/*
 	 * Now count/parse "involved" descriptors starting from
 	 * the head of the chain.
@@ -396,10 +940,7 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	 * check whether we're re-visiting a previously visited
 	 * index, but we just abort if the count gets excessive.
 	 */
-	ctx = base->dev->vmctx;
-	*pidx = next = vq->avail->ring[idx & (vq->qsize - 1)];
-	vq->last_avail++;
-	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir->next) {
+	for (i = 0, next = head; i < VQ_MAX_DESCRIPTORS; next = vdir.next) {
 		if (next >= vq->qsize) {
 			fprintf(stderr,
 			    "%s: descriptor index %u out of range, "
@@ -407,9 +948,10 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 			    name, next);
 			return -1;
 		}
-		vdir = &vq->desc[next];
-		if ((vdir->flags & ACRN_VRING_DESC_F_INDIRECT) == 0) {
-			_vq_record(i, vdir, ctx, iov, n_iov, flags);
+		vdir = vq->desc[next];
+		if ((vdir.flags & ACRN_VRING_DESC_F_INDIRECT) == 0) {
+			_vq_record(vq, i, vdir.addr, vdir.len, vdir.flags,
+				   iov, n_iov, flags);
 			i++;
 		} else if ((base->device_caps &
 		    ACRN_VIRTIO_RING_F_INDIRECT_DESC) == 0) {
@@ -419,16 +961,22 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 			    name);
 			return -1;
 		} else {
-			n_indir = vdir->len / 16;
-			if ((vdir->len & 0xf) || n_indir == 0) {
+			n_indir = vdir.len / 16;
+			if ((vdir.len & 0xf) || n_indir == 0) {
 				fprintf(stderr,
 				    "%s: invalid indir len 0x%x, "
 				    "driver confused?\r\n",
-				    name, (u_int)vdir->len);
+				    name, (u_int)vdir.len);
+				return -1;
+			}
+			vindir = vq_map_gpa(vq, vdir.addr, vdir.len);
+			if (vindir == NULL) {
+				fprintf(stderr,
+				    "%s: invalid indir addr 0x%lx, "
+				    "driver confused?\r\n",
+				    name, vdir.addr);
 				return -1;
 			}
-			vindir = paddr_guest2host(ctx,
-			    vdir->addr, vdir->len);
 			/*
 			 * Indirects start at the 0th, then follow
 			 * their own embedded "next"s until those run
@@ -438,20 +986,21 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 			 */
 			next = 0;
 			for (;;) {
-				vp = &vindir[next];
-				if (vp->flags & ACRN_VRING_DESC_F_INDIRECT) {
+				vp = vindir[next];
+				if (vp.flags & ACRN_VRING_DESC_F_INDIRECT) {
 					fprintf(stderr,
 					    "%s: indirect desc has INDIR flag,"
 					    " driver confused?\r\n",
 					    name);
 					return -1;
 				}
-				_vq_record(i, vp, ctx, iov, n_iov, flags);
+				_vq_record(vq, i, vp.addr, vp.len, vp.flags,
+					   iov, n_iov, flags);
 				if (++i > VQ_MAX_DESCRIPTORS)
 					goto loopy;
-				if ((vp->flags & ACRN_VRING_DESC_F_NEXT) == 0)
+				if ((vp.flags & ACRN_VRING_DESC_F_NEXT) == 0)
 					break;
-				next = vp->next;
+				next = vp.next;
 				if (next >= n_indir) {
 					fprintf(stderr,
 					    "%s: invalid next %u > %u, "
@@ -461,7 +1010,7 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 				}
 			}
 		}
-		if ((vdir->flags & ACRN_VRING_DESC_F_NEXT) == 0)
+		if ((vdir.flags & ACRN_VRING_DESC_F_NEXT) == 0)
 			return i;
 	}
 loopy:
@@ -471,6 +1020,214 @@ loopy:
 	return -1;
 }
 
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int i;
+	u_int ndesc, n_indir, j;
+	uint16_t idx, id;
+	bool wrap;
+
+	struct virtio_packed_desc vdir;
+	volatile struct virtio_desc *vindir;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
+
+	/*
+	 * The driver writes the flags of the head descriptor last, so
+	 * once the head is available the rest of the chain is valid.
+	 * The chain occupies consecutive ring slots; its buffer id is
+	 * carried by the last descriptor.
+	 */
+	idx = vq->last_avail;
+	wrap = vq->avail_wrap;
+	if (!vq_packed_desc_avail(vq->pdesc[idx].flags, wrap))
+		return 0;
+
+	i = 0;
+	for (ndesc = 1; ; ndesc++) {
+		/* read the descriptor once, the guest may change it */
+		vdir = vq->pdesc[idx];
+		id = vdir.id;
+		if (++idx == vq->qsize) {
+			idx = 0;
+			wrap = !wrap;
+		}
+
+		if ((vdir.flags & ACRN_VRING_DESC_F_INDIRECT) == 0) {
+			_vq_record(vq, i, vdir.addr, vdir.len, vdir.flags,
+				   iov, n_iov, flags);
+			i++;
+		} else if ((base->device_caps &
+		    ACRN_VIRTIO_RING_F_INDIRECT_DESC) == 0) {
+			fprintf(stderr,
+			    "%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			goto bad;
+		} else {
+			/* a packed indirect table is walked in order */
+			n_indir = vdir.len / 16;
+			if ((vdir.len & 0xf) || n_indir == 0) {
+				fprintf(stderr,
+				    "%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vdir.len);
+				goto bad;
+			}
+			vindir = vq_map_gpa(vq, vdir.addr, vdir.len);
+			if (vindir == NULL) {
+				fprintf(stderr,
+				    "%s: invalid indir addr 0x%lx, "
+				    "driver confused?\r\n",
+				    name, vdir.addr);
+				goto bad;
+			}
+			for (j = 0; j < n_indir; j++) {
+				_vq_record(vq, i, vindir[j].addr,
+					   vindir[j].len, vindir[j].flags,
+					   iov, n_iov, flags);
+				if (++i > VQ_MAX_DESCRIPTORS)
+					goto loopy;
+			}
+		}
+		if ((vdir.flags & ACRN_VRING_DESC_F_NEXT) == 0)
+			break;
+		if (ndesc >= vq->qsize || i > VQ_MAX_DESCRIPTORS)
+			goto loopy;
+	}
+
+	if (id >= vq->qsize) {
+		fprintf(stderr,
+		    "%s: buffer id %u out of range, driver confused?\r\n",
+		    name, id);
+		goto bad;
+	}
+
+	/*
+	 * Remember how many slots the chain took, by buffer id for
+	 * vq_relchain() and by its last slot for vq_retchain().
+	 */
+	vq->chain_len[id] = ndesc;
+	vq->chain_tail[(idx == 0 ? vq->qsize : idx) - 1] = ndesc;
+	vq->last_avail = idx;
+	vq->avail_wrap = wrap;
+	*pidx = id;
+	return i;
+
+loopy:
+	fprintf(stderr,
+	    "%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+bad:
+	/* skip what we walked, like the split ring does */
+	vq->last_avail = idx;
+	vq->avail_wrap = wrap;
+	return -1;
+}
+
+int
+vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
+	    struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	u_int ndesc, idx;
+	const char *name;
+
+	if (vq->flags & VQ_PACKED)
+		return vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
+	name = vq->base->vops->name;
+
+	/*
+	 * Note: it's the responsibility of the guest not to
+	 * update vq->avail->idx until all of the descriptors
+	 * the guest has written are valid (including all their
+	 * next fields and vd_flags).
+	 *
+	 * Compute (last_avail - idx) in integers mod 2**16.  This is
+	 * the number of descriptors the device has made available
+	 * since the last time we updated vq->last_avail.
+	 *
+	 * We just need to do the subtraction as an unsigned int,
+	 * then trim off excess bits.
+	 */
+	idx = vq->last_avail;
+	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
+	if (ndesc == 0)
+		return 0;
+	if (ndesc > vq->qsize) {
+		/* XXX need better way to diagnose issues */
+		fprintf(stderr,
+		    "%s: ndesc (%u) out of range, driver confused?\r\n",
+		    name, (u_int)ndesc);
+		return -1;
+	}
+
+	*pidx = vq->avail->ring[idx & (vq->qsize - 1)];
+	vq->last_avail++;
+	return _vq_walk(vq, *pidx, iov, n_iov, flags);
+}
+
+/*
+ * Batched vq_getchain(): fetch up to nchains chains in one pass over
+ * the avail ring.  Chain i gets the n_iov entries at iov[i * n_iov]
+ * (and flags[i * n_iov] if flags is not NULL), so iov must hold
+ * nchains * n_iov entries.
+ *
+ * Returns the number of chains fetched, each of which must be given
+ * back with vq_relchain() (or vq_retchain(), last first).  A chain
+ * with invalid descriptors has its n set to -1, as vq_getchain()
+ * would return.
+ */
+int
+vq_getchains(struct virtio_vq_info *vq, struct vq_chain *chains, int nchains,
+	     struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	struct vq_chain *c;
+	u_int ndesc, idx, mask;
+	int i;
+
+	if (vq->flags & VQ_PACKED) {
+		for (i = 0; i < nchains && vq_has_descs(vq); i++) {
+			c = &chains[i];
+			c->iov = &iov[i * n_iov];
+			c->flags = flags ? &flags[i * n_iov] : NULL;
+			c->n = vq_getchain_packed(vq, &c->idx, c->iov, n_iov,
+						  c->flags);
+		}
+		return i;
+	}
+
+	/* one look at avail->idx covers the whole batch */
+	idx = vq->last_avail;
+	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
+	if (ndesc > vq->qsize) {
+		fprintf(stderr,
+		    "%s: ndesc (%u) out of range, driver confused?\r\n",
+		    vq->base->vops->name, (u_int)ndesc);
+		return 0;
+	}
+	if (ndesc > nchains)
+		ndesc = nchains;
+
+	mask = vq->qsize - 1;
+	for (i = 0; i < ndesc; i++)
+		chains[i].idx = vq->avail->ring[(idx + i) & mask];
+	vq->last_avail += ndesc;
+
+	for (i = 0; i < ndesc; i++) {
+		c = &chains[i];
+		c->iov = &iov[i * n_iov];
+		c->flags = flags ? &flags[i * n_iov] : NULL;
+		c->n = _vq_walk(vq, c->idx, c->iov, n_iov, c->flags);
+	}
+	return ndesc;
+}
+
 /*
  * Return the currently-first request chain back to the available queue.
  *
@@ -480,7 +1237,54 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
-	vq->last_avail--;
+	uint16_t idx;
+
+	if ((vq->flags & VQ_PACKED) == 0) {
+		vq->last_avail--;
+		return;
+	}
+
+	/* step back over the slots of the most recent chain */
+	idx = (vq->last_avail == 0 ? vq->qsize : vq->last_avail) - 1;
+	if (vq->chain_tail[idx] > vq->last_avail) {
+		vq->last_avail += vq->qsize;
+		vq->avail_wrap = !vq->avail_wrap;
+	}
+	vq->last_avail -= vq->chain_tail[idx];
+}
+
+/*
+ * Packed flavour of vq_relchain(): write a used descriptor for buffer id
+ * into the next used slot, then skip the slots the chain occupied.
+ */
+static void
+vq_relchain_packed(struct virtio_vq_info *vq, uint16_t id, uint32_t iolen)
+{
+	volatile struct virtio_packed_desc *vd;
+	uint16_t idx;
+
+	if (id >= vq->qsize)
+		return;
+
+	idx = vq->used_idx;
+	vd = &vq->pdesc[idx];
+	vd->id = id;
+	vd->len = iolen;
+	/*
+	 * id and len must be visible before the flags flip the slot. Like
+	 * the split used ring, this relies on the volatile accesses and on
+	 * x86 not reordering stores, a fence here would cost more than the
+	 * rest of the function.
+	 */
+	vd->flags = vq->used_wrap ? (ACRN_VRING_PACKED_DESC_F_AVAIL |
+		ACRN_VRING_PACKED_DESC_F_USED) : 0;
+
+	idx += vq->chain_len[id];
+	if (idx >= vq->qsize) {
+		idx -= vq->qsize;
+		vq->used_wrap = !vq->used_wrap;
+	}
+	vq->used_idx = idx;
 }
 
 /*
@@ -507,6 +1311,11 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	 * (I apologize for the two fields named idx; the
 	 * virtio spec calls the one that vue points to, "id"...)
 	 */
+	if (vq->flags & VQ_PACKED) {
+		vq_relchain_packed(vq, idx, iolen);
+		return;
+	}
+
 	mask = vq->qsize - 1;
 	vuh = vq->used;
 
@@ -517,6 +1326,56 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vuh->idx = uidx;
 }
 
+/*
+ * Packed flavour of vq_endchains(): the driver event suppression
+ * structure replaces both the avail flags and the used_event index.
+ */
+static void
+vq_endchains_packed(struct virtio_vq_info *vq, int used_all_avail)
+{
+	struct virtio_base *base;
+	uint16_t event_idx, new_idx, old_idx, off_wrap;
+	bool old_wrap, moved;
+	uint32_t frames;
+	int intr;
+
+	base = vq->base;
+	old_idx = vq->save_used;
+	old_wrap = vq->save_wrap;
+	vq->save_used = new_idx = vq->used_idx;
+	vq->save_wrap = vq->used_wrap;
+	moved = new_idx != old_idx || vq->used_wrap != old_wrap;
+	frames = vq->used_wrap != old_wrap ?
+		new_idx + vq->qsize - old_idx : new_idx - old_idx;
+
+	if (used_all_avail &&
+	    (base->negotiated_caps & ACRN_VIRTIO_F_NOTIFY_ON_EMPTY))
+		intr = 1;
+	else if (vq->driver_event->flags ==
+	    ACRN_VRING_PACKED_EVENT_F_DISABLE)
+		intr = 0;
+	else if (vq->driver_event->flags == ACRN_VRING_PACKED_EVENT_F_DESC &&
+	    (base->negotiated_caps & ACRN_VIRTIO_RING_F_EVENT_IDX)) {
+		/*
+		 * The event offset is relative to the driver's view of
+		 * the used wrap counter; bring it into ours before the
+		 * usual event index check.
+		 */
+		off_wrap = vq->driver_event->off_wrap;
+		event_idx = off_wrap &
+			~(1 << ACRN_VRING_PACKED_EVENT_WRAP_SHIFT);
+		if ((off_wrap >> ACRN_VRING_PACKED_EVENT_WRAP_SHIFT) !=
+		    vq->used_wrap)
+			event_idx -= vq->qsize;
+		if (vq->used_wrap != old_wrap)
+			old_idx -= vq->qsize;
+		intr = moved && (uint16_t)(new_idx - event_idx - 1) <
+			(uint16_t)(new_idx - old_idx);
+	} else
+		intr = moved;
+	vq_signal(vq, intr, frames);
+}
+
 /*
  * Driver has finished processing "available" chains and calling
  * vq_relchain on each one.  If driver used all the available
@@ -549,6 +1408,10 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	 * entire avail was processed, we need to interrupt always.
 	 */
 	base = vq->base;
+	if (vq->flags & VQ_PACKED) {
+		vq_endchains_packed(vq, used_all_avail);
+		return;
+	}
 	old_idx = vq->save_used;
 	vq->save_used = new_idx = vq->used->idx;
 	if (used_all_avail &&
@@ -566,8 +1429,7 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 		intr = new_idx != old_idx &&
 		    !(vq->avail->flags & ACRN_VRING_AVAIL_F_NO_INTERRUPT);
 	}
-	if (intr)
-		vq_interrupt(base, vq);
+	vq_signal(vq, intr, (uint16_t)(new_idx - old_idx));
 }
 
 struct config_reg {
@@ -875,6 +1737,8 @@ bad:
 		base->status = value;
 		if (vops->set_status)
 			(*vops->set_status)(DEV_STRUCT(base), value);
+		if (value & VIRTIO_CR_STATUS_DRIVER_OK)
+			virtio_start_eventfds(base);
 		if (value == 0)
 			(*vops->reset)(DEV_STRUCT(base));
 		break;
@@ -1059,6 +1923,9 @@ virtio_set_modern_bar(struct virtio_base *base, bool use_notify_pio)
 	if (!vops || (base->device_caps & ACRN_VIRTIO_F_VERSION_1) == 0)
 		return -1;
 
+	/* the modern transport is what makes a packed ring negotiable */
+	base->device_caps |= ACRN_VIRTIO_F_RING_PACKED;
+
 	if (use_notify_pio)
 		rc = virtio_set_modern_pio_bar(base,
 			VIRTIO_MODERN_PIO_BAR_IDX);
@@ -1300,6 +2167,8 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 		base->status = value & 0xff;
 		if (vops->set_status)
 			(*vops->set_status)(DEV_STRUCT(base), value);
+		if (base->status & VIRTIO_CR_STATUS_DRIVER_OK)
+			virtio_start_eventfds(base);
 		if (base->status == 0)
 			(*vops->reset)(DEV_STRUCT(base));
 		break;
@@ -1728,6 +2597,7 @@ virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		if (baridx == pci_msix_table_bar(dev) ||
 		    baridx == pci_msix_pba_bar(dev)) {
 			pci_emul_msix_twrite(dev, offset, size, value);
+			virtio_update_irqfds(base);
 			return;
 		}
 	}
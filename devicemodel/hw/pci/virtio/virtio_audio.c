@@ -317,6 +317,8 @@ virtio_audio_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		      virt_audio,
 		      dev,
 		      virt_audio->vq);
+	/* the kernel backend owns the notify register */
+	virt_audio->base.flags |= VIRTIO_NO_EVENTFD;
 
 	rc = virtio_audio_kernel_init(virt_audio);
 	if (rc < 0) {
@@ -39,9 +39,12 @@
 #include "pci_core.h"
 #include "virtio.h"
 #include "block_if.h"
+#include "dm_string.h"
 
 #define VIRTIO_BLK_RINGSZ	64
 #define VIRTIO_BLK_MAX_OPTS_LEN	256
+#define VIRTIO_BLK_MAXQ		16
+#define VIRTIO_BLK_BATCH	8	/* chains fetched per vq_getchains() */
 
 #define VIRTIO_BLK_S_OK	0
 #define VIRTIO_BLK_S_IOERR	1
@@ -54,6 +57,7 @@
 #define	VIRTIO_BLK_F_BLK_SIZE	(1 << 6)	/* cfg block size valid */
 #define	VIRTIO_BLK_F_FLUSH	(1 << 9)	/* Cache flush support */
 #define	VIRTIO_BLK_F_TOPOLOGY	(1 << 10)	/* Optimal I/O alignment */
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple virtqueues */
 
 /* Device can toggle its cache between writeback and writethrough modes */
 #define	VIRTIO_BLK_F_CONFIG_WCE	(1 << 11)
@@ -65,7 +69,8 @@
 	(VIRTIO_BLK_F_SEG_MAX |						    \
 	VIRTIO_BLK_F_BLK_SIZE |						    \
 	VIRTIO_BLK_F_TOPOLOGY |						    \
-	ACRN_VIRTIO_RING_F_INDIRECT_DESC)	/* indirect descriptors */
+	ACRN_VIRTIO_RING_F_INDIRECT_DESC |	/* indirect descriptors */    \
+	ACRN_VIRTIO_F_VERSION_1)
 
 /*
  * Writeback cache bits
@@ -94,6 +99,8 @@ struct virtio_blk_config {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t	writeback;
+	uint8_t	unused;
+	uint16_t num_queues;
 } __attribute__((packed));
 
 /*
@@ -121,21 +128,29 @@ static int virtio_blk_debug;
 struct virtio_blk_ioreq {
 	struct blockif_req req;
 	struct virtio_blk *blk;
+	struct virtio_vq_info *vq;
 	uint8_t *status;
 	uint16_t idx;
 };
 
 /*
  * Per-device struct
+ *
+ * Each virtqueue is served by its own blockif queue, and its used ring is
+ * protected by its own mutex, so completions of different queues don't
+ * contend with each other.
  */
 struct virtio_blk {
 	struct virtio_base base;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	struct virtio_ops ops;	/* nvq depends on num_queues */
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAXQ];
+	pthread_mutex_t vq_mtx[VIRTIO_BLK_MAXQ];
+	int num_queues;
 	struct virtio_blk_config cfg;
 	struct blockif_ctxt *bc;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+	struct virtio_blk_ioreq *ios;	/* VIRTIO_BLK_RINGSZ per queue */
 	uint8_t original_wce;
 };
 
@@ -146,7 +161,7 @@ static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* set per device from num_queues */
 	sizeof(struct virtio_blk_config), /* config reg size */
 	virtio_blk_reset,	/* reset */
 	virtio_blk_notify,	/* device-wide qnotify */
@@ -160,9 +175,14 @@ static void
 virtio_blk_reset(void *vdev)
 {
 	struct virtio_blk *blk = vdev;
+	int i;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	for (i = 0; i < blk->num_queues; i++)
+		pthread_mutex_lock(&blk->vq_mtx[i]);
 	virtio_reset_dev(&blk->base);
+	for (i = blk->num_queues - 1; i >= 0; i--)
+		pthread_mutex_unlock(&blk->vq_mtx[i]);
 	blockif_set_wce(blk->bc, blk->original_wce);
 }
 
@@ -187,70 +207,117 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, 0);
-	pthread_mutex_unlock(&blk->mtx);
+	pthread_mutex_lock(&blk->vq_mtx[io->vq->num]);
+	vq_relchain(io->vq, io->idx, 1);
+	vq_endchains(io->vq, 0);
+	pthread_mutex_unlock(&blk->vq_mtx[io->vq->num]);
+}
+
+/*
+ * Copy the request header from the front of the chain, dropping the bytes
+ * it takes from the iovecs. VIRTIO_F_VERSION_1 lets the driver lay out the
+ * chain as it likes, so the header may share a descriptor with the data,
+ * or span several. Returns the index of the first iovec left, or -1 if
+ * the chain ends, or turns device-writable, before the header does.
+ */
+static int
+virtio_blk_get_hdr(struct iovec *iov, uint16_t *flags, int n,
+		   struct virtio_blk_hdr *vbh)
+{
+	size_t hlen = 0, len;
+	int i = 0;
+
+	while (hlen < sizeof(*vbh)) {
+		if (i == n || (flags[i] & ACRN_VRING_DESC_F_WRITE))
+			return -1;
+		len = MIN(iov[i].iov_len, sizeof(*vbh) - hlen);
+		memcpy((uint8_t *)vbh + hlen, iov[i].iov_base, len);
+		hlen += len;
+		iov[i].iov_base = (uint8_t *)iov[i].iov_base + len;
+		iov[i].iov_len -= len;
+		if (iov[i].iov_len == 0)
+			i++;
+	}
+	return i;
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq,
+		struct vq_chain *chain)
 {
-	struct virtio_blk_hdr *vbh;
+	struct virtio_blk_hdr vbh;
 	struct virtio_blk_ioreq *io;
 	int i, n;
 	int err;
 	ssize_t iolen;
 	int writeop, type;
-	struct iovec iov[BLOCKIF_IOV_MAX + 2];
-	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
+	struct iovec *iov = chain->iov;
+	uint16_t idx = chain->idx, *flags = chain->flags;
 
-	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
+	n = chain->n;
+	io = &blk->ios[vq->num * VIRTIO_BLK_RINGSZ + idx];
 
 	/*
-	 * The first descriptor will be the read-only fixed header,
-	 * and the last is for status (hence +2 above and below).
-	 * The remaining iov's are the actual data I/O vectors.
-	 *
-	 * XXX - note - this fails on crash dump, which does a
-	 * VIRTIO_BLK_T_FLUSH with a zero transfer length
+	 * The status is the last byte of the chain, and must be
+	 * device-writable. Without one there is no way to fail the
+	 * request, so the chain goes back unused.
 	 */
-	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
-
-	io = &blk->ios[idx];
-	assert((flags[0] & ACRN_VRING_DESC_F_WRITE) == 0);
-	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
-	vbh = iov[0].iov_base;
-	memcpy(&io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
-	io->req.iovcnt = n - 2;
-	io->req.offset = vbh->sector * DEV_BSIZE;
-	io->status = iov[--n].iov_base;
-	assert(iov[n].iov_len == 1);
-	assert(flags[n] & ACRN_VRING_DESC_F_WRITE);
+	while (n > 0 && iov[n - 1].iov_len == 0)
+		n--;
+	if (n == 0 || (flags[n - 1] & ACRN_VRING_DESC_F_WRITE) == 0) {
+		WPRINTF(("virtio_blk: request %u has no status byte\n\r",
+			 idx));
+		pthread_mutex_lock(&blk->vq_mtx[vq->num]);
+		vq_relchain(vq, idx, 0);
+		vq_endchains(vq, 0);
+		pthread_mutex_unlock(&blk->vq_mtx[vq->num]);
+		return;
+	}
+	io->status = (uint8_t *)iov[n - 1].iov_base + iov[n - 1].iov_len - 1;
+	iov[n - 1].iov_len--;
+
+	i = virtio_blk_get_hdr(iov, flags, n, &vbh);
+	if (i < 0) {
+		DPRINTF(("virtio_blk: request %u: short header\n\r", idx));
+		virtio_blk_done(&io->req, EINVAL);
+		return;
+	}
 
 	/*
 	 * XXX
 	 * The guest should not be setting the BARRIER flag because
 	 * we don't advertise the capability.
 	 */
-	type = vbh->type & ~VBH_FLAG_BARRIER;
+	type = vbh.type & ~VBH_FLAG_BARRIER;
 	writeop = (type == VBH_OP_WRITE);
 
+	/* the rest, empty iovecs aside, is the data */
 	iolen = 0;
-	for (i = 1; i < n; i++) {
+	io->req.iovcnt = 0;
+	for (; i < n; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
 		/*
 		 * - write op implies read-only descriptor,
 		 * - read/ident op implies write-only descriptor,
 		 * therefore test the inverse of the descriptor bit
 		 * to the op.
 		 */
-		assert(((flags[i] & ACRN_VRING_DESC_F_WRITE) == 0) == writeop);
+		if (((flags[i] & ACRN_VRING_DESC_F_WRITE) == 0) != writeop ||
+		    io->req.iovcnt == BLOCKIF_IOV_MAX) {
+			DPRINTF(("virtio_blk: request %u: bad data "
+				 "descriptors\n\r", idx));
+			virtio_blk_done(&io->req, EINVAL);
+			return;
+		}
+		io->req.iov[io->req.iovcnt++] = iov[i];
 		iolen += iov[i].iov_len;
 	}
+	io->req.offset = vbh.sector * DEV_BSIZE;
 	io->req.resid = iolen;
 
 	DPRINTF(("virtio_blk: %s op, %zd bytes, %d segs, offset %ld\n\r",
-		 writeop ? "write" : "read/ident", iolen, i - 1,
+		 writeop ? "write" : "read/ident", iolen, io->req.iovcnt,
 		 io->req.offset));
 
 	switch (type) {
@@ -268,10 +335,10 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		 *   read or write beyond capacity.
 		 */
 		if ((iolen & (DEV_BSIZE - 1)) ||
-		    vbh->sector + iolen / DEV_BSIZE > blk->cfg.capacity) {
+		    vbh.sector + iolen / DEV_BSIZE > blk->cfg.capacity) {
 			DPRINTF(("virtio_blk: invalid request, iolen = %ld, "
 			         "sector = %lu, capacity = %lu\n\r", iolen,
-			         vbh->sector, blk->cfg.capacity));
+			         vbh.sector, blk->cfg.capacity));
 			virtio_blk_done(&io->req, EINVAL);
 			return;
 		}
@@ -285,10 +352,14 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
+		if (io->req.iovcnt == 0) {
+			virtio_blk_done(&io->req, EINVAL);
+			return;
+		}
 		/* S/n equal to buffer is not zero-terminated. */
-		memset(iov[1].iov_base, 0, iov[1].iov_len);
-		strncpy(iov[1].iov_base, blk->ident,
-		    MIN(iov[1].iov_len, sizeof(blk->ident)));
+		memset(io->req.iov[0].iov_base, 0, io->req.iov[0].iov_len);
+		strncpy(io->req.iov[0].iov_base, blk->ident,
+		    MIN(io->req.iov[0].iov_len, sizeof(blk->ident)));
 		virtio_blk_done(&io->req, 0);
 		return;
 	default:
@@ -302,9 +373,18 @@ static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	struct vq_chain chains[VIRTIO_BLK_BATCH];
+	struct iovec iov[VIRTIO_BLK_BATCH][BLOCKIF_IOV_MAX + 2];
+	uint16_t flags[VIRTIO_BLK_BATCH][BLOCKIF_IOV_MAX + 2];
+	int i, n;
 
-	while (vq_has_descs(vq))
-		virtio_blk_proc(blk, vq);
+	/* let the block backend submit the whole kick as one batch */
+	blockif_plug(blk->bc, vq->num);
+	while ((n = vq_getchains(vq, chains, VIRTIO_BLK_BATCH, iov[0],
+			BLOCKIF_IOV_MAX + 2, flags[0])) > 0)
+		for (i = 0; i < n; i++)
+			virtio_blk_proc(blk, vq, &chains[i]);
+	blockif_unplug(blk->bc, vq->num);
 }
 
 static uint64_t
@@ -315,9 +395,67 @@ virtio_blk_get_caps(struct virtio_blk *blk, bool wb)
 	caps = VIRTIO_BLK_S_HOSTCAPS;
 	if (wb)
 		caps |= VIRTIO_BLK_F_WB_BITS;
+	if (blk->num_queues > 1)
+		caps |= VIRTIO_BLK_F_MQ;
 	return caps;
 }
 
+/*
+ * Consume the virtio-blk specific options and return a copy of opts with
+ * the remaining ones, to be passed to blockif_open().
+ *   num_queues=<n>: number of virtqueues (1 by default)
+ *   coalesce=<max frames>:<max usecs>: interrupt coalescing
+ */
+static char *
+virtio_blk_parse_opts(const char *opts, int *num_queues,
+		      struct virtio_coalesce *coal)
+{
+	char *nopt, *xopts, *cp, *endp, *bopts;
+	size_t len;
+
+	*num_queues = 1;
+
+	nopt = xopts = strdup(opts);
+	len = strlen(opts) + 1;
+	bopts = calloc(1, len);
+	if (!nopt || !bopts)
+		goto err;
+
+	while (xopts != NULL) {
+		cp = strsep(&xopts, ",");
+		if (!strncmp(cp, "num_queues=", strlen("num_queues="))) {
+			if (dm_strtoi(cp + strlen("num_queues="), &endp, 10,
+					num_queues) || *num_queues <= 0 ||
+			    *num_queues > VIRTIO_BLK_MAXQ) {
+				fprintf(stderr, "virtio_blk: invalid %s\n",
+					cp);
+				goto err;
+			}
+			continue;
+		}
+		if (!strncmp(cp, "coalesce=", strlen("coalesce="))) {
+			if (virtio_coalesce_parse(cp + strlen("coalesce="),
+					coal)) {
+				fprintf(stderr, "virtio_blk: invalid %s\n",
+					cp);
+				goto err;
+			}
+			continue;
+		}
+		if (*bopts)
+			strncat(bopts, ",", len - strlen(bopts) - 1);
+		strncat(bopts, cp, len - strlen(bopts) - 1);
+	}
+
+	free(nopt);
+	return bopts;
+
+err:
+	free(nopt);
+	free(bopts);
+	return NULL;
+}
+
 static int
 virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -329,7 +467,9 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	off_t size;
 	int i, sectsz, sts, sto;
 	pthread_mutexattr_t attr;
-	int rc;
+	struct virtio_coalesce coal = { 0 };
+	int rc, num_queues;
+	char *bopts;
 
 	if (opts == NULL) {
 		printf("virtio_blk: backing device required\n");
@@ -343,7 +483,11 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				dev->slot, dev->func) >= sizeof(bident)) {
 		WPRINTF(("bident error, please check slot and func\n"));
 	}
-	bctxt = blockif_open(opts, bident);
+	bopts = virtio_blk_parse_opts(opts, &num_queues, &coal);
+	if (bopts == NULL)
+		return -1;
+	bctxt = blockif_open(bopts, bident, num_queues);
+	free(bopts);
 	if (bctxt == NULL) {
 		perror("Could not open backing file");
 		return -1;
@@ -356,18 +500,33 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk = calloc(1, sizeof(struct virtio_blk));
 	if (!blk) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		blockif_close(bctxt);
+		return -1;
+	}
+
+	blk->ios = calloc(num_queues * VIRTIO_BLK_RINGSZ,
+			sizeof(struct virtio_blk_ioreq));
+	if (!blk->ios) {
+		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		blockif_close(bctxt);
+		free(blk);
 		return -1;
 	}
 
 	blk->bc = bctxt;
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
+	blk->num_queues = num_queues;
+	for (i = 0; i < num_queues * VIRTIO_BLK_RINGSZ; i++) {
 		struct virtio_blk_ioreq *io = &blk->ios[i];
 
 		io->req.callback = virtio_blk_done;
 		io->req.param = io;
+		io->req.qidx = i / VIRTIO_BLK_RINGSZ;
 		io->blk = blk;
-		io->idx = i;
+		io->vq = &blk->vqs[io->req.qidx];
+		io->idx = i % VIRTIO_BLK_RINGSZ;
 	}
+	for (i = 0; i < num_queues; i++)
+		pthread_mutex_init(&blk->vq_mtx[i], NULL);
 
 	/* init mutex attribute properly to avoid deadlock */
 	rc = pthread_mutexattr_init(&attr);
@@ -384,11 +543,14 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 					"error %d!\n", rc));
 
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = num_queues;
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs);
 	blk->base.mtx = &blk->mtx;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	for (i = 0; i < num_queues; i++)
+		blk->vqs[i].qsize = VIRTIO_BLK_RINGSZ;
+	/* blk->vqs[i].notify = we have no per-queue notify */
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -418,8 +580,9 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	    (sto != 0) ? ((sts - sto) / sectsz) : 0;
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.topology.opt_io_size = 0;
-	blk->cfg.writeback = blockif_get_wce(blk->bc);
-	blk->original_wce = blk->cfg.writeback; /* save for reset */
+	blk->original_wce = blockif_get_wce(blk->bc); /* save for reset */
+	blk->cfg.writeback = blk->original_wce != BLOCKIF_WCE_OFF;
+	blk->cfg.num_queues = num_queues;
 	blk->base.device_caps =
 		virtio_blk_get_caps(blk, !!blk->cfg.writeback);
 
@@ -436,10 +599,20 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	if (virtio_interrupt_init(&blk->base, virtio_uses_msix())) {
 		blockif_close(blk->bc);
+		free(blk->ios);
 		free(blk);
 		return -1;
 	}
 	virtio_set_io_bar(&blk->base, 0);
+
+	/* transitional: legacy BAR 0 plus the modern BARs */
+	if (virtio_set_modern_bar(&blk->base, true)) {
+		blockif_close(blk->bc);
+		free(blk->ios);
+		free(blk);
+		return -1;
+	}
+	virtio_coalesce_init(&blk->base, &coal);
 	return 0;
 }
 
@@ -457,6 +630,8 @@ virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			WPRINTF(("vrito_blk:"
 				"Failed to flush before close\n"));
 		blockif_close(bctxt);
+		virtio_coalesce_deinit(&blk->base);
+		free(blk->ios);
 		free(blk);
 	}
 }
@@ -473,7 +648,13 @@ virtio_blk_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 	if ((offset == offsetof(struct virtio_blk_config, writeback))
 		&& (size == 1)) {
 		memcpy(ptr, &value, size);
-		blockif_set_wce(blk->bc, blkcfg->writeback);
+		/* keep group commit if the drive was set up with it */
+		if (!blkcfg->writeback)
+			blockif_set_wce(blk->bc, BLOCKIF_WCE_OFF);
+		else if (blk->original_wce == BLOCKIF_WCE_OFF)
+			blockif_set_wce(blk->bc, BLOCKIF_WCE_ON);
+		else
+			blockif_set_wce(blk->bc, blk->original_wce);
 		if (blkcfg->writeback)
 			blk->base.device_caps |= VIRTIO_BLK_F_FLUSH;
 		else
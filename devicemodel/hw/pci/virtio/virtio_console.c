@@ -66,7 +66,8 @@
 #define	VIRTIO_CONSOLE_S_HOSTCAPS	\
 	(VIRTIO_CONSOLE_F_SIZE |	\
 	VIRTIO_CONSOLE_F_MULTIPORT |	\
-	VIRTIO_CONSOLE_F_EMERG_WRITE)
+	VIRTIO_CONSOLE_F_EMERG_WRITE |	\
+	ACRN_VIRTIO_F_VERSION_1)
 
 static int virtio_console_debug;
 #define DPRINTF(params) do {		\
@@ -403,7 +404,7 @@ virtio_console_notify_rx(void *vdev, struct virtio_vq_info *vq)
 
 	if (!port->rx_ready) {
 		port->rx_ready = 1;
-		vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
+		vq_kick_disable(vq);
 	}
 }
 
@@ -856,6 +857,14 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 	virtio_set_io_bar(&console->base, 0);
 
+	/* transitional: legacy BAR 0 plus the modern BARs */
+	if (virtio_set_modern_bar(&console->base, true)) {
+		if (console->config)
+			free(console->config);
+		free(console);
+		return -1;
+	}
+
 	/* create control port */
 	console->control_port.console = console;
 	console->control_port.txq = 2;
@@ -300,6 +300,8 @@ virtio_hyper_dmabuf_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		      hyper_dmabuf,
 		      dev,
 		      hyper_dmabuf->vq);
+	/* the kernel backend owns the notify register */
+	hyper_dmabuf->base.flags |= VIRTIO_NO_EVENTFD;
 
 	rc = virtio_hyper_dmabuf_k_init();
 	if (rc < 0) {
@@ -321,6 +321,8 @@ virtio_ipu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		      ipu,
 		      dev,
 		      ipu->vq);
+	/* the kernel backend owns the notify register */
+	ipu->base.flags |= VIRTIO_NO_EVENTFD;
 
 	rc = virtio_ipu_k_init(ipu);
 	if (rc < 0) {
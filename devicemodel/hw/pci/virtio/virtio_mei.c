@@ -1538,7 +1538,7 @@ vmei_notify_tx(void *data, struct virtio_vq_info *vq)
 
 	pthread_mutex_lock(&vmei->tx_mutex);
 	DPRINTF("TX: New OUT buffer available!\n");
-	vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
+	vq_kick_disable(vq);
 	pthread_mutex_unlock(&vmei->tx_mutex);
 
 	while (vq_has_descs(vq))
@@ -1548,7 +1548,7 @@ vmei_notify_tx(void *data, struct virtio_vq_info *vq)
 
 	pthread_mutex_lock(&vmei->tx_mutex);
 	DPRINTF("TX: New OUT buffer available!\n");
-	vq->used->flags &= ~ACRN_VRING_USED_F_NO_NOTIFY;
+	vq_kick_enable(vq);
 	pthread_mutex_unlock(&vmei->tx_mutex);
 }
 
@@ -1841,7 +1841,7 @@ static void *vmei_rx_thread(void *param)
 	while (vmei->status != VMEI_STST_DEINIT) {
 		/* note - rx mutex is locked here */
 		while (vq_ring_ready(vq)) {
-			vq->used->flags &= ~ACRN_VRING_USED_F_NO_NOTIFY;
+			vq_kick_enable(vq);
 			mb();
 			if (vq_has_descs(vq) &&
 			    vmei->rx_need_sched &&
@@ -1854,7 +1854,7 @@ static void *vmei_rx_thread(void *param)
 			if (err || vmei->status == VMEI_STST_DEINIT)
 				goto out;
 		}
-		vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
+		vq_kick_disable(vq);
 
 		do {
 			vmei->rx_need_sched = vmei_proc_rx(vmei, vq);
@@ -1881,7 +1881,7 @@ vmei_notify_rx(void *data, struct virtio_vq_info *vq)
 	/* Signal the rx thread for processing */
 	pthread_mutex_lock(&vmei->rx_mutex);
 	DPRINTF("RX: New IN buffer available!\n");
-	vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
+	vq_kick_disable(vq);
 	pthread_cond_signal(&vmei->rx_cond);
 	pthread_mutex_unlock(&vmei->rx_mutex);
 }
@@ -26,7 +26,9 @@
  * $FreeBSD$
  */
 
+#include <sys/param.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <net/ethernet.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -39,7 +41,9 @@
 #include <sys/ioctl.h>
 #include <sys/errno.h>
 #include <net/if.h>
+#include <arpa/inet.h>
 #include <linux/if_tun.h>
+#include <linux/if_packet.h>
 
 #include "dm.h"
 #include "pci_core.h"
@@ -51,6 +55,13 @@
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
 
+/* packets moved by one recvmmsg()/sendmmsg() of the packet backend */
+#define VIRTIO_NET_BATCH	32
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING	23
+#endif
+
 /*
  * Host capabilities.  Note that we only offer a few of these.
  */
@@ -73,18 +84,31 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple queue pairs */
 #define	VHOST_NET_F_VIRTIO_NET_HDR \
 				(1 << 27) /* vhost provides virtio_net_hdr */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
-	ACRN_VIRTIO_F_NOTIFY_ON_EMPTY | ACRN_VIRTIO_RING_F_INDIRECT_DESC)
+	ACRN_VIRTIO_F_NOTIFY_ON_EMPTY | ACRN_VIRTIO_RING_F_INDIRECT_DESC | \
+	ACRN_VIRTIO_F_VERSION_1)
+
+/* offered when the tap passes virtio-net headers through */
+#define VIRTIO_NET_S_OFFLOADS      \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+	VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | \
+	VIRTIO_NET_F_GUEST_ECN | VIRTIO_NET_F_HOST_TSO4 | \
+	VIRTIO_NET_F_HOST_TSO6 | VIRTIO_NET_F_HOST_ECN)
 
 #define VIRTIO_NET_S_VHOSTCAPS      \
 	(ACRN_VIRTIO_F_NOTIFY_ON_EMPTY | ACRN_VIRTIO_RING_F_INDIRECT_DESC | \
 	ACRN_VIRTIO_RING_F_EVENT_IDX | VIRTIO_NET_F_MRG_RXBUF | \
 	ACRN_VIRTIO_F_VERSION_1)
 
+/* largest frame received: a GSO super-frame, or a VLAN-tagged frame */
+#define VIRTIO_NET_MAX_GSO_FRAME	(65535 + ETHER_HDR_LEN + 4)
+#define VIRTIO_NET_MAX_FRAME		(ETHER_MAX_LEN + 4)
+
 /* is address mcast/bcast? */
 #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01)
 
@@ -94,17 +118,38 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
  * Queue definitions.
+ *
+ * Queue pair i uses RX queue 2 * i and TX queue 2 * i + 1. With more than
+ * one queue pair, the control queue comes after the last pair.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_CTLQ	2	/* NB: with one queue pair, not yet supported */
 
 #define VIRTIO_NET_MAXQ	3
 
+#define VIRTIO_NET_MAX_QPAIRS	8
+#define VIRTIO_NET_MAX_VQS	(VIRTIO_NET_MAX_QPAIRS * 2 + 1)
+
+/*
+ * Control queue commands
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
+
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+
 /*
  * Fixed network header size
  */
@@ -135,44 +180,86 @@ struct vhost_net {
 	bool vhost_started;
 };
 
+/*
+ * Descriptor chains gathered for one batched syscall
+ */
+struct virtio_net_batch {
+	struct mmsghdr	msgs[VIRTIO_NET_BATCH];
+	struct iovec	iov[VIRTIO_NET_BATCH][VIRTIO_NET_MAXSEGS + 1];
+	void		*vrx[VIRTIO_NET_BATCH];	/* rx headers */
+	struct vq_chain	chains[VIRTIO_NET_BATCH];
+	int		tlen[VIRTIO_NET_BATCH];
+};
+
+/*
+ * Per-queue-pair struct, each pair has its own tap queue, RX event
+ * and TX thread.
+ */
+struct virtio_net_qpair {
+	struct virtio_net *net;
+	int		rxq;		/* index of the RX virtqueue */
+	int		txq;		/* index of the TX virtqueue */
+
+	int		tapfd;
+	struct mevent	*mevp;
+
+	int		rx_ready;
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+
+	/* packet backend only */
+	struct virtio_net_batch *rxb;
+	struct virtio_net_batch *txb;
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_ops ops;		/* nvq depends on the queue pairs */
+	struct virtio_vq_info queues[VIRTIO_NET_MAX_VQS];
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
-
-	int		rx_ready;
+	struct virtio_net_qpair qps[VIRTIO_NET_MAX_QPAIRS];
+	int		nqps;		/* queue pairs of the device */
+	int		active_qps;	/* queue pairs enabled by the guest */
 
 	volatile int	resetting;	/* set and checked outside lock */
-	volatile int	closing;	/* stop the tx i/o thread */
+	volatile int	closing;	/* stop the tx i/o threads */
 
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
+	int		rx_maxlen;	/* room needed for the largest frame */
+	bool		vnet_hdr;	/* tap reads/writes virtio-net headers */
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	void (*virtio_net_rx)(struct virtio_net_qpair *qp);
+	void (*virtio_net_tx)(struct virtio_net_qpair *qp, struct iovec *iov,
 			     int iovcnt, int len);
+	/* processes up to a batch of TX chains, replaces virtio_net_tx */
+	void (*virtio_net_tx_batch)(struct virtio_net_qpair *qp,
+				    struct virtio_vq_info *vq);
 
 	struct vhost_net *vhost_net;
 	bool		use_vhost;
+
+	struct mevent_loop *evloop;	/* runs the rx callbacks */
 };
 
+/* Devices are numbered for the name of their event loop, "net<n>" */
+static int virtio_net_count;
+
 static void virtio_net_reset(void *vdev);
+static void virtio_net_tap_offload(struct virtio_net *net);
 static void virtio_net_tx_stop(struct virtio_net *net);
 static int virtio_net_cfgread(void *vdev, int offset, int size,
 	uint32_t *retval);
@@ -181,14 +268,14 @@ static int virtio_net_cfgwrite(void *vdev, int offset, int size,
 static void virtio_net_neg_features(void *vdev, uint64_t negotiated_features);
 static void virtio_net_set_status(void *vdev, uint64_t status);
 static struct vhost_net *vhost_net_init(struct virtio_base *base, int vhostfd,
-	int tapfd, int vq_idx);
+	int tapfd, int vq_idx, const struct vhost_ops *ops);
 static int vhost_net_deinit(struct vhost_net *vhost_net);
 static int vhost_net_start(struct vhost_net *vhost_net);
 static int vhost_net_stop(struct vhost_net *vhost_net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	VIRTIO_NET_MAXQ - 1,		/* 2 virtqueues per queue pair */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -233,36 +320,64 @@ ether_aton(const char *a, struct ether_addr *e)
  * If the transmit thread is active then stall until it is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_txwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	while (qp->tx_in_progress) {
+		pthread_mutex_unlock(&qp->tx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	while (qp->rx_in_progress) {
+		pthread_mutex_unlock(&qp->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&qp->rx_mtx);
+	}
+	pthread_mutex_unlock(&qp->rx_mtx);
+}
+
+/*
+ * Only keep the tap queues of the first n queue pairs attached, so that
+ * the tap doesn't steer packets to queues the guest doesn't use.
+ */
+static int
+virtio_net_set_qpairs(struct virtio_net *net, int n)
+{
+	struct ifreq ifr;
+	int i, rc;
+
+	if (n < 1 || n > net->nqps)
+		return -1;
+
+	for (i = 0; i < net->nqps && net->nqps > 1; i++) {
+		if (net->qps[i].tapfd < 0)
+			continue;
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = i < n ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		rc = ioctl(net->qps[i].tapfd, TUNSETQUEUE, (void *)&ifr);
+		if (rc < 0 && errno != EINVAL)
+			WPRINTF(("vtnet: failed to %s tap queue %d: %d\n",
+				i < n ? "attach" : "detach", i, errno));
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+	net->active_qps = n;
+	return 0;
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -272,46 +387,57 @@ virtio_net_reset(void *vdev)
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->nqps; i++) {
+		virtio_net_txwait(&net->qps[i]);
+		virtio_net_rxwait(&net->qps[i]);
+		net->qps[i].rx_ready = 0;
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
 
+	/* a driver without VIRTIO_NET_F_MQ only uses the first pair */
+	virtio_net_set_qpairs(net, 1);
+
+	/* no offloads until the driver negotiates them again */
+	net->features = 0;
+	virtio_net_tap_offload(net);
+
 	net->resetting = 0;
 	net->closing = 0;
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Send signal to tx I/O threads and wait till they exit
  */
 static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
 	void *jval;
+	int i;
 
 	net->closing = 1;
 
-	pthread_cond_broadcast(&net->tx_cond);
-
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->nqps; i++) {
+		pthread_cond_broadcast(&net->qps[i].tx_cond);
+		pthread_join(net->qps[i].tx_tid, &jval);
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_qpair *qp, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (qp->tapfd == -1)
 		return;
 
 	/*
@@ -324,7 +450,7 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(qp->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
@@ -337,8 +463,13 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
  */
 static uint8_t dummybuf[2048];
 
+/*
+ * Skip the virtio-net header at the start of a chain. A legacy driver
+ * puts it in a descriptor of its own, a virtio 1.0 one may put the
+ * frame right after it.
+ */
 static inline struct iovec *
-rx_iov_trim(struct iovec *iov, int *niov, int tlen)
+iov_trim(struct iovec *iov, int *niov, int tlen)
 {
 	struct iovec *riov;
 
@@ -358,10 +489,80 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
+/*
+ * Receive from a tap which provides the virtio-net header, possibly for
+ * a GSO super-frame. With mergeable rx buffers, enough chains for the
+ * largest frame are gathered and the frame is read into them at once;
+ * the chains it doesn't fill are handed back.
+ */
+static void
+virtio_net_tap_vnet_rx(struct virtio_net_qpair *qp, struct virtio_vq_info *vq)
+{
+	struct iovec iov[VIRTIO_NET_MAXSEGS];
+	struct virtio_net *net = qp->net;
+	struct virtio_net_rxhdr *vrxh;
+	uint16_t idx[VIRTIO_NET_MAXSEGS];
+	int chainlen[VIRTIO_NET_MAXSEGS];
+	int i, n, niov, nchains, room, len, used;
+
+	do {
+		niov = 0;
+		room = 0;
+		nchains = 0;
+		do {
+			n = vq_getchain(vq, &idx[nchains], &iov[niov],
+					VIRTIO_NET_MAXSEGS - niov, NULL);
+			assert(n >= 1);
+			n = MIN(n, VIRTIO_NET_MAXSEGS - niov);
+
+			chainlen[nchains] = 0;
+			for (i = niov; i < niov + n; i++)
+				chainlen[nchains] += iov[i].iov_len;
+			room += chainlen[nchains];
+			niov += n;
+			nchains++;
+		} while (net->rx_merge && room < net->rx_maxlen &&
+			 niov < VIRTIO_NET_MAXSEGS && vq_has_descs(vq));
+
+		assert(iov[0].iov_len >= net->rx_vhdrlen);
+		len = readv(qp->tapfd, iov, niov);
+		if (len < 0) {
+			/*
+			 * No more packets (or a frame too big for the
+			 * buffers, dropped by the tap): return the chains.
+			 * Interrupt if needed/appropriate.
+			 */
+			for (i = 0; i < nchains; i++)
+				vq_retchain(vq);
+			vq_endchains(vq, 0);
+			return;
+		}
+
+		if (net->rx_merge) {
+			vrxh = iov[0].iov_base;
+			for (i = 0; i < nchains && len > 0; i++) {
+				used = MIN(len, chainlen[i]);
+				vq_relchain(vq, idx[i], used);
+				len -= used;
+			}
+			vrxh->vrh_bufs = i;
+
+			/* hand back the chains left unfilled, last first */
+			for (; i < nchains; i++)
+				vq_retchain(vq);
+		} else
+			vq_relchain(vq, idx[0], len);
+	} while (vq_has_descs(vq));
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx(struct virtio_net_qpair *qp)
 {
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net *net = qp->net;
 	struct virtio_vq_info *vq;
 	void *vrx;
 	int len, n;
@@ -371,17 +572,17 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	assert(net->tapfd != -1);
+	assert(qp->tapfd != -1);
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		return;
@@ -390,19 +591,24 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = &net->queues[qp->rxq];
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		vq_endchains(vq, 1);
 		return;
 	}
 
+	if (net->vnet_hdr) {
+		virtio_net_tap_vnet_rx(qp, vq);
+		return;
+	}
+
 	do {
 		/*
 		 * Get descriptor chain.
@@ -415,9 +621,9 @@ virtio_net_tap_rx(struct virtio_net *net)
 		 * data immediately following it for the packet buffer.
 		 */
 		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+		riov = iov_trim(iov, &n, net->rx_vhdrlen);
 
-		len = readv(net->tapfd, riov, n);
+		len = readv(qp->tapfd, riov, n);
 
 		if (len < 0 && errno == EWOULDBLOCK) {
 			/*
@@ -452,16 +658,95 @@ virtio_net_tap_rx(struct virtio_net *net)
 	vq_endchains(vq, 1);
 }
 
+/*
+ * Packet socket backend: fill a batch of rx chains with one recvmmsg()
+ * and publish them with a single vq_endchains().
+ */
+static void
+virtio_net_pkt_rx(struct virtio_net_qpair *qp)
+{
+	struct virtio_net *net = qp->net;
+	struct virtio_net_batch *b = qp->rxb;
+	struct virtio_vq_info *vq;
+	struct iovec *riov;
+	int i, n, cnt, rcvd;
+	ssize_t ret;
+
+	if (!qp->rx_ready || net->resetting) {
+		/*
+		 * Drop the packet and try later.
+		 */
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
+		(void)ret; /*avoid compiler warning*/
+
+		return;
+	}
+
+	vq = &net->queues[qp->rxq];
+	if (!vq_has_descs(vq)) {
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
+		(void)ret; /*avoid compiler warning*/
+
+		vq_endchains(vq, 1);
+		return;
+	}
+
+	do {
+		cnt = vq_getchains(vq, b->chains, VIRTIO_NET_BATCH, b->iov[0],
+				VIRTIO_NET_MAXSEGS + 1, NULL);
+		for (i = 0; i < cnt; i++) {
+			n = b->chains[i].n;
+			assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+
+			b->vrx[i] = b->iov[i][0].iov_base;
+			riov = iov_trim(b->iov[i], &n, net->rx_vhdrlen);
+			memset(&b->msgs[i].msg_hdr, 0,
+				sizeof(b->msgs[i].msg_hdr));
+			b->msgs[i].msg_hdr.msg_iov = riov;
+			b->msgs[i].msg_hdr.msg_iovlen = n;
+		}
+
+		rcvd = recvmmsg(qp->tapfd, b->msgs, cnt, MSG_DONTWAIT, NULL);
+		if (rcvd < 0)
+			rcvd = 0;
+
+		for (i = 0; i < rcvd; i++) {
+			memset(b->vrx[i], 0, net->rx_vhdrlen);
+			if (net->rx_merge)
+				((struct virtio_net_rxhdr *)b->vrx[i])->vrh_bufs
+					= 1;
+			vq_relchain(vq, b->chains[i].idx,
+				b->msgs[i].msg_len + net->rx_vhdrlen);
+		}
+
+		/* hand back the chains left unfilled, last first */
+		for (i = rcvd; i < cnt; i++)
+			vq_retchain(vq);
+
+		if (rcvd < cnt) {
+			/*
+			 * No more packets, but still some avail ring
+			 * entries.  Interrupt if needed/appropriate.
+			 */
+			vq_endchains(vq, 0);
+			return;
+		}
+	} while (vq_has_descs(vq));
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
 static void
 virtio_net_rx_callback(int fd, enum ev_type type, void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_qpair *qp = param;
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	qp->rx_in_progress = 1;
+	qp->net->virtio_net_rx(qp);
+	qp->rx_in_progress = 0;
+	pthread_mutex_unlock(&qp->rx_mtx);
 
 }
 
@@ -469,49 +754,109 @@ static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qps[vq->num / 2];
 
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
+	if (qp->rx_ready == 0) {
+		qp->rx_ready = 1;
+		vq_kick_disable(vq);
 	}
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_proctx(struct virtio_net_qpair *qp, struct virtio_vq_info *vq)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
+	struct iovec iov[VIRTIO_NET_MAXSEGS + 1], *riov;
 	int i, n;
 	int plen, tlen;
 	uint16_t idx;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * Obtain chain of descriptors.  It starts with the header,
+	 * so we need to sum up two lengths: packet length and
+	 * transfer length.
 	 */
 	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
 	assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
+	tlen = 0;
+	for (i = 0; i < n; i++)
 		tlen += iov[i].iov_len;
-	}
+	plen = tlen - qp->net->rx_vhdrlen;
 
 	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	if (qp->net->vnet_hdr)
+		/* the tap takes the guest's header with the offload info */
+		qp->net->virtio_net_tx(qp, iov, n, plen);
+	else {
+		riov = iov_trim(iov, &n, qp->net->rx_vhdrlen);
+		qp->net->virtio_net_tx(qp, riov, n, plen);
+	}
 
 	/* chain is processed, release it and set tlen */
 	vq_relchain(vq, idx, tlen);
 }
 
+/*
+ * Packet socket backend: send up to a batch of tx chains with one
+ * sendmmsg(). The chains are only released once sent, as the iovecs
+ * point to guest buffers.
+ */
+static void
+virtio_net_pkt_proctx(struct virtio_net_qpair *qp, struct virtio_vq_info *vq)
+{
+	static char pad[60]; /* all zero bytes */
+	struct virtio_net_batch *b = qp->txb;
+	struct iovec *iov, *riov;
+	int i, j, n, cnt, sent, plen;
+
+	cnt = vq_getchains(vq, b->chains, VIRTIO_NET_BATCH, b->iov[0],
+			VIRTIO_NET_MAXSEGS + 1, NULL);
+	for (j = 0; j < cnt; j++) {
+		iov = b->iov[j];
+		n = b->chains[j].n;
+		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+
+		/* the chain starts with the header, as for the tap */
+		b->tlen[j] = 0;
+		for (i = 0; i < n; i++)
+			b->tlen[j] += iov[i].iov_len;
+		plen = b->tlen[j] - qp->net->rx_vhdrlen;
+		riov = iov_trim(iov, &n, qp->net->rx_vhdrlen);
+		if (plen < 60) {
+			riov[n].iov_base = pad;
+			riov[n].iov_len = 60 - plen;
+			n++;
+		}
+
+		memset(&b->msgs[j].msg_hdr, 0, sizeof(b->msgs[j].msg_hdr));
+		b->msgs[j].msg_hdr.msg_iov = riov;
+		b->msgs[j].msg_hdr.msg_iovlen = n;
+	}
+
+	for (i = 0; i < cnt; i += sent) {
+		sent = sendmmsg(qp->tapfd, &b->msgs[i], cnt - i, 0);
+		if (sent <= 0) {
+			if (sent < 0 && errno == EINTR) {
+				sent = 0;
+				continue;
+			}
+			/* drop the rest, like a failed tap write */
+			break;
+		}
+	}
+
+	DPRINTF(("virtio: %d packets sent in a batch\n\r", cnt));
+	for (i = 0; i < cnt; i++)
+		vq_relchain(vq, b->chains[i].idx, b->tlen[i]);
+}
+
 static void
 virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qps[vq->num / 2];
 
 	/*
 	 * Any ring entries to process?
@@ -520,59 +865,60 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 		return;
 
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	vq_kick_disable(vq);
+	if (qp->tx_in_progress == 0)
+		pthread_cond_signal(&qp->tx_cond);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
- * Thread which will handle processing of TX desc
+ * Thread which will handle processing of TX desc of one queue pair
  */
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_qpair *qp = param;
+	struct virtio_net *net = qp->net;
 	struct virtio_vq_info *vq;
 	int error;
 
-	vq = &net->queues[VIRTIO_NET_TXQ];
+	vq = &net->queues[qp->txq];
 
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
-	error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	error = pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 	assert(error == 0);
 	if (net->closing) {
 		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&qp->tx_mtx);
 		return NULL;
 	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
 		while (net->resetting || !vq_has_descs(vq)) {
-			vq->used->flags &= ~ACRN_VRING_USED_F_NO_NOTIFY;
+			vq_kick_enable(vq);
 			/* memory barrier */
 			mb();
 			if (!net->resetting && vq_has_descs(vq))
 				break;
 
-			net->tx_in_progress = 0;
-			error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			qp->tx_in_progress = 0;
+			error = pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 			assert(error == 0);
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&qp->tx_mtx);
 				return NULL;
 			}
 		}
-		vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		vq_kick_disable(vq);
+		qp->tx_in_progress = 1;
+		pthread_mutex_unlock(&qp->tx_mtx);
 
 		do {
 			/*
@@ -580,7 +926,10 @@ virtio_net_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
-			virtio_net_proctx(net, vq);
+			if (net->virtio_net_tx_batch)
+				net->virtio_net_tx_batch(qp, vq);
+			else
+				virtio_net_proctx(qp, vq);
 		} while (vq_has_descs(vq));
 
 		/*
@@ -588,17 +937,76 @@ virtio_net_tx_thread(void *param)
 		 */
 		vq_endchains(vq, 1);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
+	}
+}
+
+static uint8_t
+virtio_net_ctrl_mq(struct virtio_net *net, uint8_t cmd, uint8_t *data,
+		   int len)
+{
+	uint16_t pairs;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || len < sizeof(pairs))
+		return VIRTIO_NET_ERR;
+
+	memcpy(&pairs, data, sizeof(pairs));
+	if (virtio_net_set_qpairs(net, pairs)) {
+		WPRINTF(("vtnet: invalid number of queue pairs %d\n", pairs));
+		return VIRTIO_NET_ERR;
 	}
+	DPRINTF(("vtnet: %d queue pairs enabled\n\r", pairs));
+	return VIRTIO_NET_OK;
 }
 
-#ifdef notyet
+/*
+ * Control queue commands are handled synchronously in the notify
+ */
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = vdev;
+	struct virtio_net_ctrl_hdr *hdr;
+	struct iovec iov[VIRTIO_NET_MAXSEGS];
+	uint16_t flags[VIRTIO_NET_MAXSEGS];
+	uint8_t buf[64], *ack;
+	int i, n, len;
+	uint16_t idx;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, flags);
+		if (n < 2 || !(flags[n - 1] & ACRN_VRING_DESC_F_WRITE) ||
+		    iov[n - 1].iov_len < 1) {
+			WPRINTF(("vtnet: bad control queue chain\n"));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		/* gather the command, it may be split across descriptors */
+		len = 0;
+		for (i = 0; i < n - 1; i++) {
+			if (len + iov[i].iov_len > sizeof(buf))
+				break;
+			memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+
+		ack = iov[n - 1].iov_base;
+		hdr = (struct virtio_net_ctrl_hdr *)buf;
+		if (i < n - 1 || len < sizeof(*hdr))
+			*ack = VIRTIO_NET_ERR;
+		else if (hdr->class == VIRTIO_NET_CTRL_MQ)
+			*ack = virtio_net_ctrl_mq(net, hdr->cmd,
+				buf + sizeof(*hdr), len - sizeof(*hdr));
+		else {
+			DPRINTF(("vtnet: unsupported control class %d\n\r",
+				hdr->class));
+			*ack = VIRTIO_NET_ERR;
+		}
+		vq_relchain(vq, idx, sizeof(*ack));
+	}
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -625,10 +1033,15 @@ virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
 	return 0;
 }
 
+/*
+ * Open a tap queue with IFF_TAP | IFF_NO_PI and the extra flags asked in
+ * *flags. IFF_VNET_HDR is dropped from *flags if the kernel lacks it.
+ */
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, int *flags)
 {
 	int tunfd, rc;
+	unsigned int features;
 	struct ifreq ifr;
 
 #define PATH_NET_TUN "/dev/net/tun"
@@ -638,8 +1051,13 @@ virtio_net_tap_open(char *devname)
 		return -1;
 	}
 
+	if ((*flags & IFF_VNET_HDR) &&
+	    (ioctl(tunfd, TUNGETFEATURES, &features) < 0 ||
+	     !(features & IFF_VNET_HDR)))
+		*flags &= ~IFF_VNET_HDR;
+
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | *flags;
 
 	if (*devname)
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -656,12 +1074,53 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Tell the tap the virtio-net header size and which offloads the guest
+ * accepts in received frames, per the negotiated features.
+ */
+static void
+virtio_net_tap_offload(struct virtio_net *net)
+{
+	unsigned int offload = 0;
+	int hdrlen = net->rx_vhdrlen;
+
+	if (!net->vnet_hdr || net->qps[0].tapfd < 0)
+		return;
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offload |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offload |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offload |= TUN_F_TSO6;
+		if ((offload & (TUN_F_TSO4 | TUN_F_TSO6)) &&
+		    (net->features & VIRTIO_NET_F_GUEST_ECN))
+			offload |= TUN_F_TSO_ECN;
+	}
+
+	/* both are per tap device, the first queue is always attached */
+	if (ioctl(net->qps[0].tapfd, TUNSETVNETHDRSZ, &hdrlen) < 0)
+		WPRINTF(("vtnet: TUNSETVNETHDRSZ failed: %d\n", errno));
+	if (ioctl(net->qps[0].tapfd, TUNSETOFFLOAD, offload) < 0)
+		WPRINTF(("vtnet: TUNSETOFFLOAD failed: %d\n", errno));
+
+	net->rx_maxlen = net->rx_vhdrlen +
+		((offload & (TUN_F_TSO4 | TUN_F_TSO6)) ?
+		 VIRTIO_NET_MAX_GSO_FRAME : VIRTIO_NET_MAX_FRAME);
+}
+
+/*
+ * Open one tap queue per queue pair. A tap which can't be opened with
+ * IFF_MULTI_QUEUE (e.g. a persistent single queue tap) leaves the device
+ * with the queue pairs opened so far.
+ */
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
 	char tbuf[80 + 5];	/* room for "acrn_" prefix */
+	struct virtio_net_qpair *qp;
 	int vhost_fd = -1;
-	int rc;
+	int i, rc, opt, flags;
 
 	rc = snprintf(tbuf, strnlen(devname, 79) + 6, "acrn_%s", devname);
 	if (rc < 0 || rc >= 85)	/* give warning if error or truncation happens */
@@ -670,23 +1129,55 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
-	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
-
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * vhost-net provides the virtio-net header itself, otherwise have
+	 * the tap pass it through so that offloads work end to end.
 	 */
-	int opt = 1;
+	flags = net->use_vhost ? 0 : IFF_VNET_HDR;
+	if (net->nqps > 1)
+		flags |= IFF_MULTI_QUEUE;
+
+	for (i = 0; i < net->nqps; i++) {
+		qp = &net->qps[i];
+		qp->tapfd = virtio_net_tap_open(tbuf, &flags);
+		if (qp->tapfd == -1 && i == 0 && net->nqps > 1) {
+			WPRINTF(("multi-queue tap %s failed, use one queue\n",
+				tbuf));
+			net->nqps = 1;
+			flags &= ~IFF_MULTI_QUEUE;
+			qp->tapfd = virtio_net_tap_open(tbuf, &flags);
+		}
+		if (qp->tapfd == -1) {
+			WPRINTF(("open of tap device %s queue %d failed\n",
+				tbuf, i));
+			break;
+		}
+		DPRINTF(("open of tap device %s queue %d success!\n",
+			tbuf, i));
+
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		opt = 1;
+		if (ioctl(qp->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			close(qp->tapfd);
+			qp->tapfd = -1;
+			break;
+		}
+	}
+	if (i > 0 && i < net->nqps) {
+		WPRINTF(("vtnet: only %d queue pairs available\n", i));
+		net->nqps = i;
+	}
+	if (net->qps[0].tapfd == -1)
+		return;
 
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (flags & IFF_VNET_HDR) {
+		net->vnet_hdr = true;
+		net->base.device_caps |= VIRTIO_NET_S_OFFLOADS;
+		virtio_net_tap_offload(net);
 	}
 
 	if (net->use_vhost) {
@@ -695,7 +1186,7 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 			WPRINTF(("open of vhost-net failed\n"));
 		else {
 			net->vhost_net = vhost_net_init(&net->base, vhost_fd,
-				net->tapfd, 0);
+				net->qps[0].tapfd, 0, NULL);
 			if (!net->vhost_net) {
 				WPRINTF(("vhost_net_init failed, fallback "
 					"to userspace virtio\n"));
@@ -705,17 +1196,117 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 		}
 	}
 
-	if (vhost_fd < 0) {
-		net->mevp = mevent_add(net->tapfd, EVF_READ,
-				       virtio_net_rx_callback, net);
-		if (net->mevp == NULL) {
+	if (vhost_fd >= 0)
+		return;
+
+	/* each queue pair receives from its own event */
+	for (i = 0; i < net->nqps; i++) {
+		qp = &net->qps[i];
+		qp->mevp = mevent_add_loop(net->evloop, qp->tapfd, EVF_READ,
+					    virtio_net_rx_callback, qp);
+		if (qp->mevp == NULL) {
 			WPRINTF(("Could not register event\n"));
-			close(net->tapfd);
-			net->tapfd = -1;
+			close(qp->tapfd);
+			qp->tapfd = -1;
 		}
 	}
 }
 
+/*
+ * vhost-user backend: the queues are served by another process (e.g. a
+ * polling packet switch) listening on a UNIX socket, which maps guest
+ * memory itself. The device model only relays the setup.
+ */
+static void
+virtio_net_vhost_user_setup(struct virtio_net *net, char *path)
+{
+	int fd;
+
+	fd = vhost_user_connect(path);
+	if (fd < 0) {
+		WPRINTF(("vtnet: vhost-user connect to %s failed\n", path));
+		return;
+	}
+
+	/* the backend handles the offloads it offers */
+	net->base.device_caps |= VIRTIO_NET_S_OFFLOADS;
+	net->vhost_net = vhost_net_init(&net->base, fd, -1, 0,
+		&vhost_user_ops);
+	if (!net->vhost_net) {
+		WPRINTF(("vtnet: vhost-user init on %s failed\n", path));
+		net->base.device_caps &= ~VIRTIO_NET_S_OFFLOADS;
+		close(fd);
+	}
+}
+
+/*
+ * Packet socket backend: a raw AF_PACKET socket bound to a host
+ * interface, which unlike the tap takes several packets per syscall.
+ */
+static void
+virtio_net_pkt_setup(struct virtio_net *net, char *ifname)
+{
+	struct virtio_net_qpair *qp = &net->qps[0];
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+	int fd, ifindex, opt;
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		WPRINTF(("vtnet: no network interface %s\n", ifname));
+		return;
+	}
+
+	qp->rxb = calloc(1, sizeof(struct virtio_net_batch));
+	qp->txb = calloc(1, sizeof(struct virtio_net_batch));
+	if (!qp->rxb || !qp->txb) {
+		WPRINTF(("vtnet: calloc returns NULL\n"));
+		return;
+	}
+
+	fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, htons(ETH_P_ALL));
+	if (fd < 0) {
+		WPRINTF(("vtnet: packet socket failed: %d\n", errno));
+		return;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		WPRINTF(("vtnet: bind to %s failed: %d\n", ifname, errno));
+		close(fd);
+		return;
+	}
+
+	/* the guest has its own MAC address */
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+			sizeof(mreq)) < 0)
+		WPRINTF(("vtnet: promiscuous mode on %s failed\n", ifname));
+
+	/* don't loop the host's own transmits back to the guest */
+	opt = 1;
+	if (setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &opt,
+			sizeof(opt)) < 0)
+		WPRINTF(("vtnet: PACKET_IGNORE_OUTGOING unsupported\n"));
+
+	qp->tapfd = fd;
+	net->virtio_net_rx = virtio_net_pkt_rx;
+	net->virtio_net_tx_batch = virtio_net_pkt_proctx;
+
+	qp->mevp = mevent_add_loop(net->evloop, qp->tapfd, EVF_READ,
+				    virtio_net_rx_callback, qp);
+	if (qp->mevp == NULL) {
+		WPRINTF(("Could not register event\n"));
+		close(qp->tapfd);
+		qp->tapfd = -1;
+	}
+}
+
 static int
 virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -724,12 +1315,14 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char nstr[80];
 	char tname[MAXCOMLEN + 1];
 	struct virtio_net *net;
+	struct virtio_net_qpair *qp;
 	char *devname;
 	char *vtopts;
 	char *opt;
 	int mac_provided;
+	struct virtio_coalesce coal = { 0 };
 	pthread_mutexattr_t attr;
-	int rc;
+	int i, rc;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -751,25 +1344,13 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_net: pthread_mutex_init failed with "
 			"error %d!\n", rc));
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
-	net->base.mtx = &net->mtx;
-	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
-
 	/*
-	 * Attempt to open the tap device and read the MAC address
-	 * if specified
+	 * Parse the options: the tap device name, the MAC address,
+	 * vhost, the number of queue pairs and interrupt coalescing
 	 */
 	mac_provided = 0;
-	net->tapfd = -1;
+	devname = NULL;
+	net->nqps = 1;
 	net->vhost_net = NULL;
 	if (opts != NULL) {
 		int err;
@@ -785,7 +1366,29 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		while ((opt = strsep(&vtopts, ",")) != NULL) {
 			if (strcmp("vhost", opt) == 0)
 				net->use_vhost = true;
-			else {
+			else if (!strncmp(opt, "num_queues=",
+					strlen("num_queues="))) {
+				/* num_queues=<number of queue pairs> */
+				if (dm_strtoi(opt + strlen("num_queues="),
+						&opt, 10, &net->nqps) ||
+				    net->nqps < 1 ||
+				    net->nqps > VIRTIO_NET_MAX_QPAIRS) {
+					fprintf(stderr, "Invalid number of "
+						"queue pairs, max %d\n",
+						VIRTIO_NET_MAX_QPAIRS);
+					free(devname);
+					return -1;
+				}
+			} else if (!strncmp(opt, "coalesce=",
+					strlen("coalesce="))) {
+				/* coalesce=<max frames>:<max usecs> */
+				if (virtio_coalesce_parse(opt +
+						strlen("coalesce="), &coal)) {
+					fprintf(stderr, "Invalid %s\n", opt);
+					free(devname);
+					return -1;
+				}
+			} else {
 				err = virtio_net_parsemac(opt,
 					net->config.mac);
 				if (err != 0) {
@@ -795,14 +1398,87 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				mac_provided = 1;
 			}
 		}
+	}
+
+	if (devname && !strncmp(devname, "packet=", strlen("packet="))) {
+		/* the packet backend is served in user space */
+		net->use_vhost = false;
+		if (net->nqps > 1) {
+			WPRINTF(("vtnet: packet supports one queue pair\n"));
+			net->nqps = 1;
+		}
+	}
+
+	if (devname && !strncmp(devname, "vhostuser=", strlen("vhostuser="))) {
+		net->use_vhost = true;
+		if (net->nqps > 1) {
+			WPRINTF(("vtnet: vhost-user supports one queue pair\n"));
+			net->nqps = 1;
+		}
+	}
+
+	if (net->use_vhost && net->nqps > 1) {
+		WPRINTF(("vtnet: vhost supports one queue pair only\n"));
+		net->nqps = 1;
+	}
+
+	net->ops = virtio_net_ops;
+	net->ops.nvq = net->nqps > 1 ? net->nqps * 2 + 1 : VIRTIO_NET_MAXQ - 1;
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues);
+	net->base.mtx = &net->mtx;
+	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
 
+	for (i = 0; i < VIRTIO_NET_MAX_QPAIRS; i++) {
+		qp = &net->qps[i];
+		qp->net = net;
+		qp->rxq = i * 2 + VIRTIO_NET_RXQ;
+		qp->txq = i * 2 + VIRTIO_NET_TXQ;
+		qp->tapfd = -1;
+	}
+
+	net->rx_merge = 1;
+	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+
+	/* a dedicated loop if "--mevent_loop net<n>" was given */
+	snprintf(nstr, sizeof(nstr), "net%d", virtio_net_count++);
+	net->evloop = mevent_loop_get(nstr);
+	/* the tx kicks too */
+	net->base.evloop = net->evloop;
+
+	/*
+	 * Attempt to open the tap device, which may provide fewer queue
+	 * pairs than requested
+	 */
+	if (devname != NULL) {
 		if (strncmp(devname, "tap", 3) == 0 ||
 		    strncmp(devname, "vmnet", 5) == 0)
 			virtio_net_tap_setup(net, devname);
+		else if (!strncmp(devname, "packet=", strlen("packet=")))
+			virtio_net_pkt_setup(net, devname + strlen("packet="));
+		else if (!strncmp(devname, "vhostuser=", strlen("vhostuser=")))
+			virtio_net_vhost_user_setup(net,
+				devname + strlen("vhostuser="));
 
 		free(devname);
 	}
 
+	for (i = 0; i < net->nqps; i++) {
+		qp = &net->qps[i];
+		net->queues[qp->rxq].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[qp->rxq].notify = virtio_net_ping_rxq;
+		net->queues[qp->txq].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[qp->txq].notify = virtio_net_ping_txq;
+	}
+	if (net->nqps > 1) {
+		net->ops.nvq = net->nqps * 2 + 1;
+		net->queues[net->nqps * 2].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[net->nqps * 2].notify = virtio_net_ping_ctlq;
+		net->base.device_caps |= VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+	} else
+		net->ops.nvq = VIRTIO_NET_MAXQ - 1;
+	net->config.max_virtqueue_pairs = net->nqps;
+	virtio_net_set_qpairs(net, 1);
+
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
 	 * followed by an MD5 of the PCI slot/func number and dev name
@@ -830,40 +1506,56 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_NET);
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
-	/* Link is up if we managed to open tap device */
-	net->config.status = (opts == NULL || net->tapfd >= 0);
+	/* Link is up if we managed to open tap device or reach vhost-user */
+	net->config.status = (opts == NULL || net->qps[0].tapfd >= 0 ||
+		net->vhost_net != NULL);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
 		if (net)
 			free(net);
+		virtio_net_count--;
 		return -1;
 	}
 
 	/* use BAR 0 to map config regs in IO space */
 	virtio_set_io_bar(&net->base, 0);
 
+	/* transitional: legacy BAR 0 plus the modern BARs */
+	if (virtio_set_modern_bar(&net->base, true)) {
+		free(net);
+		virtio_net_count--;
+		return -1;
+	}
+	/* vhost only drives split rings */
+	if (net->vhost_net)
+		net->base.device_caps &= ~ACRN_VIRTIO_F_RING_PACKED;
+
+	/* vhost interrupts the guest itself */
+	if (!net->vhost_net)
+		virtio_coalesce_init(&net->base, &coal);
+
 	net->resetting = 0;
 	net->closing = 0;
 
-	net->rx_merge = 1;
-	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
-
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Initialize rx locks, tx semaphores & spawn one TX processing
+	 * thread per queue pair.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->nqps; i++) {
+		qp = &net->qps[i];
+		qp->rx_in_progress = 0;
+		pthread_mutex_init(&qp->rx_mtx, NULL);
+
+		qp->tx_in_progress = 0;
+		pthread_mutex_init(&qp->tx_mtx, NULL);
+		pthread_cond_init(&qp->tx_cond, NULL);
+		pthread_create(&qp->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)qp);
+		snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d", dev->slot,
+			 dev->func, i);
+		pthread_setname_np(qp->tx_tid, tname);
+	}
 
 	return 0;
 }
@@ -909,9 +1601,12 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 
 	if (!(net->features & VIRTIO_NET_F_MRG_RXBUF)) {
 		net->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		net->rx_vhdrlen -= 2;
+		/* legacy non-merge header is 2 bytes shorter, in both ways */
+		if (!(net->features & ACRN_VIRTIO_F_VERSION_1))
+			net->rx_vhdrlen -= 2;
 	}
+
+	virtio_net_tap_offload(net);
 }
 
 static void
@@ -925,9 +1620,9 @@ virtio_net_set_status(void *vdev, uint64_t status)
 
 	if (!net->vhost_net->vhost_started &&
 		(status & VIRTIO_CR_STATUS_DRIVER_OK)) {
-		if (net->mevp) {
-			mevent_delete(net->mevp);
-			net->mevp = NULL;
+		if (net->qps[0].mevp) {
+			mevent_delete(net->qps[0].mevp);
+			net->qps[0].mevp = NULL;
 		}
 
 		rc = vhost_net_start(net->vhost_net);
@@ -947,11 +1642,14 @@ static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	struct virtio_net_qpair *qp;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
 		virtio_net_tx_stop(net);
+		virtio_coalesce_deinit(&net->base);
 
 		if (net->vhost_net) {
 			vhost_net_stop(net->vhost_net);
@@ -960,16 +1658,23 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			net->vhost_net = NULL;
 		}
 
-		if (net->tapfd >= 0) {
-			close(net->tapfd);
-			net->tapfd = -1;
-		} else
-			fprintf(stderr, "net->tapfd is -1!\n");
+		for (i = 0; i < net->nqps; i++) {
+			qp = &net->qps[i];
+			if (qp->tapfd >= 0) {
+				close(qp->tapfd);
+				qp->tapfd = -1;
+			} else
+				fprintf(stderr, "qp->tapfd is -1!\n");
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
+			if (qp->mevp != NULL)
+				mevent_delete(qp->mevp);
+
+			free(qp->rxb);
+			free(qp->txb);
+		}
 
 		free(net);
+		virtio_net_count--;
 
 		DPRINTF(("%s: done\n", __func__));
 	} else
@@ -977,7 +1682,8 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 }
 
 static struct vhost_net *
-vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
+vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx,
+	       const struct vhost_ops *ops)
 {
 	struct vhost_net *vhost_net = NULL;
 	uint64_t vhost_features = VIRTIO_NET_S_VHOSTCAPS;
@@ -985,6 +1691,12 @@ vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
 	uint32_t busyloop_timeout = 0;
 	int rc;
 
+	/* vhost-user: no tap to put the header on, offloads are up to it */
+	if (ops == &vhost_user_ops) {
+		vhost_features |= VIRTIO_NET_S_OFFLOADS;
+		vhost_ext_features = 0;
+	}
+
 	vhost_net = calloc(1, sizeof(struct vhost_net));
 	if (!vhost_net) {
 		WPRINTF(("vhost init out of memory\n"));
@@ -994,6 +1706,7 @@ vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
 	/* pre-init before calling vhost_dev_init */
 	vhost_net->vdev.nvqs = ARRAY_SIZE(vhost_net->vqs);
 	vhost_net->vdev.vqs = vhost_net->vqs;
+	vhost_net->vdev.ops = ops;
 	vhost_net->tapfd = tapfd;
 
 	rc = vhost_dev_init(&vhost_net->vdev, base, vhostfd, vq_idx,
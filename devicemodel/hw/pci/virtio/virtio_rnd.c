@@ -412,6 +412,8 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			rnd->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
 		} else {
 			rnd->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+			/* the kernel backend owns the notify register */
+			rnd->base.flags |= VIRTIO_NO_EVENTFD;
 		}
 	}
 	if (rnd->vbs_k.status == VIRTIO_DEV_INITIAL ||
@@ -440,6 +442,13 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	virtio_set_io_bar(&rnd->base, 0);
 
+	/* VBS-U is transitional: legacy BAR 0 plus the modern BARs */
+	if (rnd->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS) {
+		rnd->base.device_caps = ACRN_VIRTIO_F_VERSION_1;
+		if (virtio_set_modern_bar(&rnd->base, true))
+			goto fail;
+	}
+
 	rnd->in_progress = 0;
 	pthread_mutex_init(&rnd->rx_mtx, NULL);
 	pthread_cond_init(&rnd->rx_cond, NULL);
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "inout.h"
 #include "vmmapi.h"
@@ -56,16 +57,22 @@ do { fprintf(dbg_file, format, args); fflush(dbg_file); } while (0)
 #define DPRINTF(format, arg...)
 #endif
 
+/* vCPUs run port I/O concurrently, the (addr,data) pair state is shared */
+static pthread_mutex_t cmos_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int buf_offset;
+static int next_ops;  /* 0 for addr, 1 for data, in pair (addr,data)*/
+
 static int
 cmos_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 				uint32_t *eax, void *arg)
 {
-	static int buf_offset;
-	static int next_ops;  /* 0 for addr, 1 for data, in pair (addr,data)*/
+	int error = 0;
 
 	assert(port == CMOS_ADDR || port == CMOS_DATA);
 	assert(bytes == 1);
 
+	pthread_mutex_lock(&cmos_mtx);
+
 #ifdef CMOS_DEBUG
 	if (!dbg_file)
 		dbg_file = fopen("/tmp/cmos_log", "a+");
@@ -80,7 +87,8 @@ cmos_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		assert(next_ops == 0 && !in);
 		if (next_ops != 0) {
 			next_ops = 0;
-			return -1;
+			error = -1;
+			goto out;
 		}
 
 		buf_offset = (uint8_t)(*eax);
@@ -91,7 +99,8 @@ cmos_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		assert(next_ops == 1);
 		if (next_ops != 1) {
 			next_ops = 0;
-			return -1;
+			error = -1;
+			goto out;
 		}
 
 		if (in) {
@@ -107,7 +116,9 @@ cmos_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		next_ops = 0;
 	}
 
-	return 0;
+out:
+	pthread_mutex_unlock(&cmos_mtx);
+	return error;
 }
 
 INOUT_PORT(cmos_io, CMOS_ADDR, IOPORT_F_INOUT, cmos_io_handler);
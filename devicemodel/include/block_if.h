@@ -36,11 +36,18 @@
 #ifndef _BLOCK_IF_H_
 #define _BLOCK_IF_H_
 
+#include <stdio.h>
 #include <sys/uio.h>
 #include <sys/unistd.h>
 
 #define BLOCKIF_IOV_MAX		33	/* not practical to be IOV_MAX */
 
+/* write cache modes, see blockif_set_wce() */
+#define BLOCKIF_WCE_OFF		0	/* writethru: sync after each write */
+#define BLOCKIF_WCE_ON		1	/* writeback: sync on guest flush */
+#define BLOCKIF_WCE_GROUP	2	/* writeback, flushes merged into
+					 * group commits */
+
 struct blockif_req {
 	struct iovec	iov[BLOCKIF_IOV_MAX];
 	int		iovcnt;
@@ -48,10 +55,12 @@ struct blockif_req {
 	ssize_t		resid;
 	void		(*callback)(struct blockif_req *req, int err);
 	void		*param;
+	int		qidx;	/* blockif queue serving this request */
 };
 
 struct blockif_ctxt;
-struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
+struct blockif_ctxt *blockif_open(const char *optstr, const char *ident,
+				  int queue_num);
 off_t	blockif_size(struct blockif_ctxt *bc);
 void	blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h,
 		    uint8_t *s);
@@ -65,9 +74,12 @@ int	blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
+void	blockif_plug(struct blockif_ctxt *bc, int qidx);
+void	blockif_unplug(struct blockif_ctxt *bc, int qidx);
 int	blockif_close(struct blockif_ctxt *bc);
 uint8_t	blockif_get_wce(struct blockif_ctxt *bc);
 void	blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce);
 int	blockif_flush_all(struct blockif_ctxt *bc);
+int	blockif_dump_stats(FILE *fp);
 
 #endif /* _BLOCK_IF_H_ */
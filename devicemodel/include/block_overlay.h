@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _BLOCK_OVERLAY_H_
+#define _BLOCK_OVERLAY_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Copy-on-write overlay image.
+ *
+ * The overlay file holds only the clusters written by the guest. A two
+ * level table (L1 kept in memory, L2 tables cached) maps each guest
+ * cluster to its place in the overlay file; unallocated clusters are read
+ * from the base image.
+ */
+struct ovl_image;
+
+/**
+ * @brief Open an overlay image.
+ *
+ * An empty overlay file is formatted on top of base. For an existing
+ * overlay file, base overrides the base image recorded in its header.
+ *
+ * @param fd File descriptor of the overlay file.
+ * @param base Path of the base image, can be NULL for an existing overlay.
+ * @param ro Open read only.
+ *
+ * @return NULL on error, otherwise the overlay image.
+ */
+struct ovl_image *ovl_open(int fd, const char *base, int ro);
+
+/**
+ * @brief Release an overlay image. The overlay fd is not closed.
+ */
+void ovl_close(struct ovl_image *ovl);
+
+/**
+ * @brief Get the virtual disk size of an overlay image.
+ */
+off_t ovl_size(struct ovl_image *ovl);
+
+/**
+ * @brief preadv()/pwritev() on the virtual disk of an overlay image.
+ *
+ * Safe to be called from multiple threads.
+ *
+ * @return Number of bytes transferred, -1 with errno set on error.
+ */
+ssize_t ovl_preadv(struct ovl_image *ovl, const struct iovec *iov,
+		   int iovcnt, off_t offset);
+ssize_t ovl_pwritev(struct ovl_image *ovl, const struct iovec *iov,
+		    int iovcnt, off_t offset);
+
+/**
+ * @brief Make the writes done so far durable, like fdatasync().
+ *
+ * Clusters allocated by writes are only mapped on disk by a flush: they
+ * read from the base image again after a crash before it.
+ *
+ * @return 0 on success, -1 with errno set on error.
+ */
+int ovl_flush(struct ovl_image *ovl);
+
+#endif /* _BLOCK_OVERLAY_H_ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _BOOT_TIMELINE_H_
+#define _BOOT_TIMELINE_H_
+
+#include <stdio.h>
+
+/*
+ * Start-up phase timing of the device model.
+ *
+ * Each phase is a named pair of monotonic timestamps kept in a fixed
+ * array, cheap enough to wrap every start-up stage and device init.
+ */
+
+/**
+ * @brief Drop all recorded phases and restart the clock, called once per
+ *	  VM (re)start.
+ */
+void boot_timeline_reset(void);
+
+/**
+ * @brief Start timing a phase.
+ *
+ * @param fmt printf-like format of the phase name.
+ *
+ * @return Phase handle for boot_phase_end(), -1 if the array is full.
+ */
+int boot_phase_begin(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Stop timing a phase started by boot_phase_begin().
+ */
+void boot_phase_end(int phase);
+
+/**
+ * @brief Write the recorded phases as a JSON timeline.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int boot_timeline_dump(FILE *fp);
+
+#endif /* _BOOT_TIMELINE_H_ */
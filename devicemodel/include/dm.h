@@ -37,6 +37,9 @@ struct vmctx;
 extern int guest_ncpus;
 extern char *guest_uuid_str;
 extern uint8_t trusty_enabled;
+extern bool rtvm_enabled;
+extern uint16_t sched_weight;
+extern uint16_t sched_cap;
 extern char *vsbl_file_name;
 extern char *kernel_file_name;
 extern char *elf_file_name;
@@ -29,6 +29,7 @@
 #ifndef _INOUT_H_
 #define	_INOUT_H_
 
+#include <stdio.h>
 #include "types.h"
 #include "acrn_common.h"
 struct vmctx;
@@ -77,4 +78,9 @@ int	unregister_inout(struct inout_port *iop);
 int	enable_inout(struct inout_port *iop);
 int	disable_inout(struct inout_port *iop);
 
+/*
+ * Write the hit and TSC cycle counters of every i/o handler as JSON.
+ */
+int	inout_dump_stats(FILE *fp);
+
 #endif	/* _INOUT_H_ */
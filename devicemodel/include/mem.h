@@ -57,5 +57,7 @@ int	unregister_mem(struct mem_range *memp);
 int	unregister_mem_fallback(struct mem_range *memp);
 int	disable_mem(struct mem_range *memp);
 int	enable_mem(struct mem_range *memp);
+void	mem_reclaim_hold(void);
+void	mem_reclaim_release(void);
 
 #endif	/* _MEM_H_ */
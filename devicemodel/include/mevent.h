@@ -39,10 +39,18 @@ enum ev_type {
 };
 
 struct mevent;
+struct mevent_loop;
 
 struct mevent *mevent_add(int fd, enum ev_type type,
 			  void (*func)(int, enum ev_type, void *),
 			  void *param);
+struct mevent *mevent_add_loop(struct mevent_loop *loop, int fd,
+			       enum ev_type type,
+			       void (*func)(int, enum ev_type, void *),
+			       void *param);
+struct mevent_loop *mevent_loop_get(const char *name);
+struct mevent_loop *mevent_loop_get_own(const char *name);
+int	mevent_loop_config(const char *opt);
 int	mevent_enable(struct mevent *evp);
 int	mevent_disable(struct mevent *evp);
 int	mevent_delete(struct mevent *evp);
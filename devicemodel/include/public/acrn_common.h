@@ -67,6 +67,7 @@
 
 /* Generic VM flags from guest OS */
 #define SECURE_WORLD_ENABLED    (1UL<<0)  /* Whether secure world is enabled */
+#define DEDICATED_PCPU_ENABLED  (1UL<<1)  /* Whether vcpus own their pcpus */
 
 /**
  * @brief Hypercall
@@ -173,11 +174,22 @@ struct vhm_request {
 	uint32_t type;
 
 	/**
-	 * @brief Reserved.
+	 * @brief The SOS vCPU to which the upcall for this request slot is
+	 * delivered.
+	 *
+	 * Written by VHM or clients in SOS, read by ACRN. An out of range
+	 * value falls back to vCPU 0.
 	 *
 	 * Byte offset: 4.
 	 */
-	uint32_t reserved0[15];
+	uint32_t notify_vcpu;
+
+	/**
+	 * @brief Reserved.
+	 *
+	 * Byte offset: 8.
+	 */
+	uint32_t reserved0[14];
 
 	/**
 	 * @brief Details about this request.
@@ -247,13 +259,20 @@ struct acrn_create_vm {
 
 	/* VM flag bits from Guest OS, now used
 	 *  SECURE_WORLD_ENABLED          (1UL<<0)
+	 *  DEDICATED_PCPU_ENABLED        (1UL<<1)
 	 */
 	uint64_t vm_flag;
 
 	uint64_t req_buf;
 
+	/** relative weight of the VCPUs sharing a PCPU, 0 for the default */
+	uint16_t sched_weight;
+
+	/** max percentage of a PCPU a VCPU may use, 0 for no cap */
+	uint16_t sched_cap;
+
 	/** Reserved for future use*/
-	uint8_t  reserved2[16];
+	uint8_t  reserved2[12];
 } __aligned(8);
 
 /**
@@ -62,10 +62,13 @@ int acrn_parse_gvtargs(char *arg);
 int acrn_parse_vsbl(char *arg);
 int acrn_parse_elf(char *arg);
 int acrn_parse_guest_part_info(char *arg);
+int acrn_parse_image_load(char *arg);
 char *get_bootargs(void);
 void vsbl_set_bdf(int bnum, int snum, int fnum);
 
 int check_image(char *path);
+ssize_t acrn_image_size(char *path);
+int acrn_load_image(char *path, void *dst, size_t len);
 uint32_t acrn_create_e820_table(struct vmctx *ctx, struct e820_entry *e820);
 int add_e820_entry(struct e820_entry *e820, int len, uint64_t start,
 	uint64_t size, uint32_t type);
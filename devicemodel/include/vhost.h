@@ -24,6 +24,49 @@
  * @{
  */
 
+/* the most memory regions a vhost-user message can carry */
+#define VHOST_MEM_REGIONS_MAX	8
+
+struct vhost_dev;
+struct vhost_vring_addr;
+struct vhost_vring_state;
+struct vhost_vring_file;
+struct vm_mem_region;
+
+/**
+ * @brief transport between the device model and a vhost backend
+ *
+ * The in-kernel vhost is driven through ioctls on its chardev; a
+ * vhost-user backend is another process driven over a UNIX socket.
+ */
+struct vhost_ops {
+	int (*set_mem_table)(struct vhost_dev *vdev,
+			     struct vm_mem_region *regions, int nregions);
+	int (*set_vring_addr)(struct vhost_dev *vdev,
+			      struct vhost_vring_addr *addr);
+	int (*set_vring_num)(struct vhost_dev *vdev,
+			     struct vhost_vring_state *ring);
+	int (*set_vring_base)(struct vhost_dev *vdev,
+			      struct vhost_vring_state *ring);
+	int (*get_vring_base)(struct vhost_dev *vdev,
+			      struct vhost_vring_state *ring);
+	int (*set_vring_kick)(struct vhost_dev *vdev,
+			      struct vhost_vring_file *file);
+	int (*set_vring_call)(struct vhost_dev *vdev,
+			      struct vhost_vring_file *file);
+	int (*set_vring_busyloop_timeout)(struct vhost_dev *vdev,
+					  struct vhost_vring_state *s);
+	int (*set_features)(struct vhost_dev *vdev, uint64_t features);
+	int (*get_features)(struct vhost_dev *vdev, uint64_t *features);
+	int (*set_owner)(struct vhost_dev *vdev);
+	int (*reset_device)(struct vhost_dev *vdev);
+	int (*net_set_backend)(struct vhost_dev *vdev,
+			       struct vhost_vring_file *file);
+};
+
+/* vhost-user transport, fd is a socket from vhost_user_connect() */
+extern const struct vhost_ops vhost_user_ops;
+
 struct vhost_vq {
 	int kick_fd;		/**< fd of kick eventfd */
 	int call_fd;		/**< fd of call eventfd */
@@ -49,7 +92,12 @@ struct vhost_dev {
 	int nvqs;
 
 	/**
-	 * vhost chardev fd
+	 * backend transport, the in-kernel vhost if left NULL
+	 */
+	const struct vhost_ops *ops;
+
+	/**
+	 * vhost chardev fd, or vhost-user socket fd
 	 */
 	int fd;
 
@@ -88,7 +136,7 @@ struct vhost_dev {
  *
  * @param vdev Pointer to struct vhost_dev.
  * @param base Pointer to struct virtio_base.
- * @param fd fd of the vhost chardev.
+ * @param fd fd of the vhost chardev, or of the vhost-user socket.
  * @param vq_idx The first virtqueue which would be used by this vhost dev.
  * @param vhost_features Subset of vhost features which would be enabled.
  * @param vhost_ext_features Specific vhost internal features to be enabled.
@@ -146,6 +194,19 @@ int vhost_dev_stop(struct vhost_dev *vdev);
  */
 int vhost_net_set_backend(struct vhost_dev *vdev, int backend_fd);
 
+/**
+ * @brief connect to a vhost-user backend.
+ *
+ * This interface is called to connect to the UNIX socket a vhost-user
+ * backend listens on. The returned fd is passed to vhost_dev_init()
+ * with vhost_dev.ops set to &vhost_user_ops.
+ *
+ * @param path Path of the UNIX socket.
+ *
+ * @return socket fd on success and -1 on failure.
+ */
+int vhost_user_connect(const char *path);
+
 /**
  * @}
  */
@@ -171,6 +171,33 @@ struct virtio_vring_used {
 /*	uint16_t	avail_event;	-- after N ring entries */
 } __attribute__((packed));
 
+/*
+ * Packed virtqueue layout (VIRTIO_F_RING_PACKED): a single descriptor
+ * ring written by both sides, plus one event suppression structure
+ * per side.  A descriptor is available when its AVAIL flag matches the
+ * driver's wrap counter and its USED flag does not; the device marks it
+ * used by making both flags match its own wrap counter.
+ */
+#define ACRN_VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define ACRN_VRING_PACKED_DESC_F_USED	(1 << 15)
+
+struct virtio_packed_desc {	/* AKA vring_packed_desc */
+	uint64_t	addr;	/* guest physical address */
+	uint32_t	len;	/* length of scatter/gather seg */
+	uint16_t	id;	/* buffer id, written in the last desc */
+	uint16_t	flags;	/* VRING_DESC_F_* and PACKED_DESC_F_* */
+} __attribute__((packed));
+
+#define ACRN_VRING_PACKED_EVENT_F_ENABLE	0x0
+#define ACRN_VRING_PACKED_EVENT_F_DISABLE	0x1
+#define ACRN_VRING_PACKED_EVENT_F_DESC		0x2
+#define ACRN_VRING_PACKED_EVENT_WRAP_SHIFT	15
+
+struct virtio_packed_event {	/* AKA vring_packed_desc_event */
+	uint16_t	off_wrap;	/* descriptor offset and wrap counter */
+	uint16_t	flags;		/* VRING_PACKED_EVENT_F_* */
+} __attribute__((packed));
+
 /*
  * The address of any given virtual queue is determined by a single
  * Page Frame Number register.  The guest writes the PFN into the
@@ -317,6 +344,9 @@ struct virtio_vring_used {
 /* v1.0 compliant. */
 #define ACRN_VIRTIO_F_VERSION_1		(1UL << 32)
 
+/* Packed virtqueue layout, only offered to modern devices. */
+#define ACRN_VIRTIO_F_RING_PACKED	(1UL << 34)
+
 /* From section 2.3, "Virtqueue Configuration", of the virtio specification */
 /**
  * @brief Calculate size of a virtual ring, this interface is only valid for
@@ -345,6 +375,9 @@ virtio_vring_size(u_int qsz)
 struct vmctx;
 struct pci_vdev;
 struct virtio_vq_info;
+struct mevent;
+struct mevent_loop;
+struct acrn_ioeventfd;
 
 /*
  * A virtual device, with some number (possibly 0) of virtual
@@ -378,6 +411,7 @@ struct virtio_vq_info;
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
+#define	VIRTIO_NO_EVENTFD	0x04	/* no ioeventfd/irqfd: vhost, VBS-K */
 #define	VIRTIO_BROKED		0x08	/* ??? */
 
 /*
@@ -520,6 +554,7 @@ struct virtio_base {
 	uint32_t device_feature_select;	/**< current selected device feature */
 	uint32_t driver_feature_select;	/**< current selected guest feature */
 	int cfg_coff;			/**< PCI cfg access capability offset */
+	struct mevent_loop *evloop;	/**< loop running the ioeventfd kicks */
 };
 
 #define	VIRTIO_BASE_LOCK(vb)					\
@@ -557,6 +592,7 @@ struct virtio_ops {
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+#define	VQ_PACKED	0x04	/* packed ring layout */
 /**
  * @brief Virtqueue data structure
  *
@@ -599,10 +635,51 @@ struct virtio_vq_info {
 	volatile struct virtio_vring_used *used;
 				/**< the "used" ring */
 
+	volatile struct virtio_packed_desc *pdesc;
+				/**< packed descriptor ring */
+	volatile struct virtio_packed_event *driver_event;
+				/**< packed ring driver event suppression */
+	volatile struct virtio_packed_event *device_event;
+				/**< packed ring device event suppression */
+	uint16_t used_idx;	/**< next packed ring slot to mark used */
+	bool avail_wrap;	/**< packed ring avail wrap counter */
+	bool used_wrap;		/**< packed ring used wrap counter */
+	bool save_wrap;		/**< saved used_wrap; see vq_endchains */
+	uint16_t *chain_len;	/**< packed ring descriptors per buffer id */
+	uint16_t *chain_tail;	/**< packed ring chain lengths, by tail slot */
+
+	struct {
+		uint64_t start;	/**< first gpa of the cached segment */
+		uint64_t end;	/**< end gpa of the cached segment */
+		char *hva;	/**< hva of gpa 0 for the cached segment */
+	} gpa_cache;		/**< last guest memory segment hit */
+
+	int kick_fd;		/**< ioeventfd of guest notify writes */
+	int call_fd;		/**< irqfd of interrupts to the guest */
+	struct mevent *kick_mevp;
+				/**< mevent of kick_fd, if registered */
+	bool irqfd_on;		/**< interrupts go through call_fd */
+
 	uint32_t gpa_desc[2];	/**< gpa of descriptors */
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	struct vq_coalesce *coal;
+				/**< interrupt coalescing state, if enabled */
+};
+
+/**
+ * @brief Interrupt coalescing parameters of a virtio device
+ *
+ * An interrupt is held back until max_frames used entries are pending or
+ * the oldest has waited max_usecs. The frame threshold actually applied
+ * follows the recent completion rate of each virtqueue, so that a queue
+ * at low rate still gets an interrupt per completion.
+ */
+struct virtio_coalesce {
+	uint32_t max_frames;	/**< most used entries per interrupt */
+	uint32_t max_usecs;	/**< longest an interrupt is delayed */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -624,6 +701,17 @@ vq_ring_ready(struct virtio_vq_info *vq)
 	return (vq->flags & VQ_ALLOC);
 }
 
+/*
+ * Is this packed ring descriptor available to the device, given the
+ * device's copy of the driver's wrap counter?
+ */
+static inline bool
+vq_packed_desc_avail(uint16_t flags, bool wrap)
+{
+	return (!!(flags & ACRN_VRING_PACKED_DESC_F_AVAIL) == wrap &&
+		!!(flags & ACRN_VRING_PACKED_DESC_F_USED) != wrap);
+}
+
 /**
  * @brief Are there "available" descriptors?
  *
@@ -636,10 +724,79 @@ vq_ring_ready(struct virtio_vq_info *vq)
 static inline int
 vq_has_descs(struct virtio_vq_info *vq)
 {
-	return (vq_ring_ready(vq) && vq->last_avail !=
-	    vq->avail->idx);
+	if (!vq_ring_ready(vq))
+		return 0;
+	if (vq->flags & VQ_PACKED)
+		return vq_packed_desc_avail(vq->pdesc[vq->last_avail].flags,
+			vq->avail_wrap);
+	return (vq->last_avail != vq->avail->idx);
+}
+
+/**
+ * @brief Ask the driver not to notify the device of new buffers.
+ *
+ * Sets the split ring NO_NOTIFY flag, or disables the packed ring device
+ * event. It is only a hint, notifications may still arrive.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return N/A
+ */
+static inline void
+vq_kick_disable(struct virtio_vq_info *vq)
+{
+	if (vq->flags & VQ_PACKED)
+		vq->device_event->flags = ACRN_VRING_PACKED_EVENT_F_DISABLE;
+	else
+		vq->used->flags |= ACRN_VRING_USED_F_NO_NOTIFY;
+}
+
+/**
+ * @brief Ask the driver to notify the device of new buffers again.
+ *
+ * The caller should check vq_has_descs() again after a memory barrier,
+ * as buffers may have been added while notifications were disabled.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return N/A
+ */
+static inline void
+vq_kick_enable(struct virtio_vq_info *vq)
+{
+	if (vq->flags & VQ_PACKED)
+		vq->device_event->flags = ACRN_VRING_PACKED_EVENT_F_ENABLE;
+	else
+		vq->used->flags &= ~ACRN_VRING_USED_F_NO_NOTIFY;
 }
 
+/**
+ * @brief Deliver an interrupt through the irqfd of a virtqueue.
+ *
+ * Only valid when vq->irqfd_on is set. virtio_base sets up the
+ * ioeventfd/irqfd of its virtqueues when the driver sets DRIVER_OK,
+ * unless VIRTIO_NO_EVENTFD is set in its flags.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return 1 if delivered, 0 if it should go through the ioctl path.
+ */
+int vq_irqfd_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq);
+
+/**
+ * @brief Fill in the notify address of a virtqueue for an ioeventfd.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param idx Index of the virtqueue.
+ * @param ioeventfd Pointer to struct acrn_ioeventfd, whose addr, len,
+ * data and flags are filled in.
+ *
+ * @return 0 on success and -1 on fail.
+ */
+int virtio_vq_ioeventfd_addr(struct virtio_base *base, int idx,
+			     struct acrn_ioeventfd *ioeventfd);
+
 /**
  * @brief Deliver an interrupt to guest on the given virtqueue.
  *
@@ -653,6 +810,8 @@ vq_has_descs(struct virtio_vq_info *vq)
 static inline void
 vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
 {
+	if (vq->irqfd_on && vq_irqfd_interrupt(vb, vq))
+		return;
 	if (pci_msix_enabled(vb->dev))
 		pci_generate_msix(vb->dev, vq->msix_idx);
 	else {
@@ -781,6 +940,35 @@ void virtio_set_io_bar(struct virtio_base *base, int barnum);
 int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		struct iovec *iov, int n_iov, uint16_t *flags);
 
+/**
+ * @brief A request chain fetched by vq_getchains().
+ */
+struct vq_chain {
+	uint16_t idx;		/**< chain index to pass to vq_relchain() */
+	int n;			/**< number of descriptors, -1 if invalid */
+	struct iovec *iov;	/**< iovecs of this chain */
+	uint16_t *flags;	/**< descriptor flags of this chain, or NULL */
+};
+
+/**
+ * @brief Fetch a batch of request chains in one pass.
+ *
+ * Like calling vq_getchain() up to nchains times, but the avail ring
+ * is read once for the whole batch. The i'th chain is placed into
+ * iov[i * n_iov] (and flags[i * n_iov]).
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to array of nchains struct vq_chain.
+ * @param nchains Max number of chains to fetch.
+ * @param iov Pointer to iov[] array of nchains * n_iov entries.
+ * @param n_iov Number of iov[] entries per chain.
+ * @param flags Pointer to array of nchains * n_iov uint16_t, or NULL.
+ *
+ * @return number of chains fetched.
+ */
+int vq_getchains(struct virtio_vq_info *vq, struct vq_chain *chains,
+		 int nchains, struct iovec *iov, int n_iov, uint16_t *flags);
+
 /**
  * @brief Return the currently-first request chain back to the
  * available ring.
@@ -816,6 +1004,39 @@ void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
  */
 void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
 
+/**
+ * @brief Parse an interrupt coalescing option.
+ *
+ * @param opt Option value, "<max_frames>:<max_usecs>".
+ * @param coal Pointer to struct virtio_coalesce to fill.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int virtio_coalesce_parse(const char *opt, struct virtio_coalesce *coal);
+
+/**
+ * @brief Enable interrupt coalescing on all virtqueues of a device.
+ *
+ * Must be called once vops->nvq is final. A device that calls it has to
+ * call virtio_coalesce_deinit() when it goes away.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param coal Pointer to the coalescing parameters.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int virtio_coalesce_init(struct virtio_base *base,
+			 const struct virtio_coalesce *coal);
+
+/**
+ * @brief Disable interrupt coalescing and release its resources.
+ *
+ * @param base Pointer to struct virtio_base.
+ *
+ * @return N/A
+ */
+void virtio_coalesce_deinit(struct virtio_base *base);
+
 /**
  * @brief Handle PCI configuration space reads.
  *
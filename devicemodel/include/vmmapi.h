@@ -107,6 +107,18 @@ void	vm_unsetup_memory(struct vmctx *ctx);
 bool	check_hugetlb_support(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
+void	hugetlb_set_prefault_threads(int nthreads);
+
+/* a guest memory segment backed by a hugetlbfs file */
+struct vm_mem_region {
+	uint64_t	gpa;
+	uint64_t	size;
+	void		*hva;
+	int		fd;
+	uint64_t	fd_offset;
+};
+int	hugetlb_get_mem_regions(struct vmctx *ctx,
+		struct vm_mem_region *regions, int max);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 void	vm_set_lowmem_limit(struct vmctx *ctx, uint32_t limit);
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * acrn_load_image() (core/sw_load_common.c) must copy every byte of an
+ * image and nothing past it, whatever the image length, the number of
+ * loader threads and whether the image cache is on.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmmapi.h"
+#include "sw_load.h"
+
+#define	GUARD		4096
+#define	GUARD_BYTE	0xa5
+
+/* the loaders sw_load_common.c dispatches to */
+char *vsbl_file_name;
+char *kernel_file_name;
+char *elf_file_name;
+
+int
+acrn_sw_load_bzimage(struct vmctx *ctx)
+{
+	return -1;
+}
+
+int
+acrn_sw_load_elf(struct vmctx *ctx)
+{
+	return -1;
+}
+
+int
+acrn_sw_load_vsbl(struct vmctx *ctx)
+{
+	return -1;
+}
+
+static const size_t lengths[] = {
+	0, 1, 4095,
+	4 * MB - 1, 4 * MB + 1,
+	8 * MB + 1,		/* 2 threads used to drop the last byte */
+	16 * MB + 3,		/* 4 threads used to drop the last 3 bytes */
+	50 * MB + 4095,
+};
+
+static char *const modes[] = {
+	"1", "2", "3", "4", "16", "4,cache", "16,cache",
+};
+
+static char *
+image_create(size_t len, char *path, unsigned char **data)
+{
+	unsigned char *p;
+	size_t i;
+	int fd;
+
+	p = malloc(len ? len : 1);
+	for (i = 0; i < len; i++)
+		p[i] = (i * 131 + (i >> 12)) & 0xff;
+
+	strcpy(path, "/tmp/image_load.XXXXXX");
+	fd = mkstemp(path);
+	if (fd < 0 || write(fd, p, len) != (ssize_t)len) {
+		perror("image");
+		exit(1);
+	}
+	close(fd);
+
+	*data = p;
+	return path;
+}
+
+static int
+image_check(const char *mode, size_t len, const unsigned char *want,
+	    const unsigned char *dst)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (dst[i] != want[i]) {
+			printf("FAIL %s len %zu: byte %zu is 0x%02x, not 0x%02x\n",
+				mode, len, i, dst[i], want[i]);
+			return -1;
+		}
+	}
+	for (i = len; i < len + GUARD; i++) {
+		if (dst[i] != GUARD_BYTE) {
+			printf("FAIL %s len %zu: wrote past the end at %zu\n",
+				mode, len, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char *want, *dst;
+	char path[32], arg[16];
+	size_t len;
+	int i, j, failed = 0;
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		len = lengths[i];
+		image_create(len, path, &want);
+		dst = malloc(len + GUARD);
+
+		for (j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+			snprintf(arg, sizeof(arg), "%s", modes[j]);
+			if (acrn_parse_image_load(arg)) {
+				printf("FAIL bad mode %s\n", modes[j]);
+				return 1;
+			}
+
+			memset(dst, GUARD_BYTE, len + GUARD);
+			if (acrn_load_image(path, dst, len)) {
+				printf("FAIL %s len %zu: load error\n",
+					modes[j], len);
+				failed++;
+				continue;
+			}
+			if (image_check(modes[j], len, want, dst))
+				failed++;
+		}
+
+		unlink(path);
+		free(dst);
+		free(want);
+	}
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * vCPUs accessing a PCI BAR while another vCPU moves it must neither
+ * crash the DM nor hang it: an access racing with the move sees the
+ * device or all-ones.  Two more vCPUs move BARs at the same time, one
+ * through the CF8/CFC path and one through the ECFG window, which used
+ * to be unlocked against each other.
+ *
+ * Runs hw/pci/core.c and core/mem.c with the "dummy" test device.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vmmapi.h"
+#include "mem.h"
+#include "inout.h"
+#include "pci_core.h"
+
+#define	LOWMEM		(1024UL * 1024 * 1024)
+#define	ECFG_BASE	0xE0000000UL	/* PCI_EMUL_ECFG_BASE */
+#define	SLOT		3
+#define	PATTERN		0x5a5aa5a5
+#define	RUN_SECS	2
+
+/* where the test moves the dummy's two 4KB memory BARs to and fro */
+static const uint64_t bar1_addrs[] = { 0xd0000000, 0xd0010000 };
+static const uint64_t bar2_addrs[] = { 0xd0020000, 0xd0030000 };
+
+static volatile bool done;
+static unsigned long nr_dev, nr_ones, nr_moves;
+
+/* the rest of acrn-dm hw/pci/core.c calls into */
+uint32_t vm_get_lowmem_limit(struct vmctx *ctx) { return LOWMEM; }
+size_t vm_get_lowmem_size(struct vmctx *ctx) { return LOWMEM; }
+int vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg) { return 0; }
+int boot_phase_begin(const char *fmt, ...) { return -1; }
+void boot_phase_end(int phase) {}
+int create_gsi_sharing_groups(void) { return 0; }
+int check_gsi_sharing_violation(void) { return 0; }
+void vsbl_set_bdf(int bnum, int snum, int fnum) {}
+void dsdt_line(const char *fmt, ...) {}
+void dsdt_fixed_ioport(uint16_t iobase, uint16_t length) {}
+void dsdt_indent(int levels) {}
+void dsdt_unindent(int levels) {}
+int ioapic_pci_alloc_irq(struct pci_vdev *pi) { return -1; }
+void pci_irq_assert(struct pci_vdev *pi) {}
+void pci_irq_deassert(struct pci_vdev *pi) {}
+int pirq_alloc_pin(struct pci_vdev *pi) { return 1; }
+int pirq_irq(int pin) { return 0; }
+char *lpc_pirq_name(int pin) { return NULL; }
+void lpc_pirq_routed(void) {}
+int register_inout(struct inout_port *iop) { return 0; }
+int unregister_inout(struct inout_port *iop) { return 0; }
+int enable_inout(struct inout_port *iop) { return 0; }
+int disable_inout(struct inout_port *iop) { return 0; }
+
+static int
+mmio(uint64_t addr, int dir, int size, uint64_t *val)
+{
+	struct mmio_request req;
+	int err;
+
+	memset(&req, 0, sizeof(req));
+	req.direction = dir;
+	req.address = addr;
+	req.size = size;
+	req.value = *val;
+	err = emulate_mem(NULL, &req);
+	*val = req.value;
+	return err;
+}
+
+static void
+cfg_write(int reg, uint32_t val)
+{
+	int v = val;
+
+	emulate_pci_cfgrw(NULL, 0, 0, 0, SLOT, 0, reg, 4, &v);
+}
+
+static void *
+bar_reader(void *arg)
+{
+	uint64_t val;
+	int i = 0, err;
+
+	while (!done) {
+		val = 0;
+		err = mmio(bar1_addrs[i++ & 1] + 0x10, REQUEST_READ, 4, &val);
+		if (err != 0) {
+			fprintf(stderr, "BAR read failed: %d\n", err);
+			exit(1);
+		} else if ((uint32_t)val == PATTERN) {
+			__atomic_add_fetch(&nr_dev, 1, __ATOMIC_RELAXED);
+		} else if ((uint32_t)val == 0xffffffff) {
+			/* the BAR was elsewhere, or moving */
+			__atomic_add_fetch(&nr_ones, 1, __ATOMIC_RELAXED);
+		} else {
+			fprintf(stderr, "BAR read 0x%lx\n", val);
+			exit(1);
+		}
+
+		/* lands in the device or is dropped */
+		val = PATTERN;
+		mmio(bar1_addrs[i & 1] + 0x10, REQUEST_WRITE, 4, &val);
+	}
+	return NULL;
+}
+
+/* moves BAR1 through the config cycles the hypervisor forwards */
+static void *
+cf8_mover(void *arg)
+{
+	int i = 0;
+
+	while (!done) {
+		cfg_write(PCIR_BAR(1), bar1_addrs[++i & 1]);
+		__atomic_add_fetch(&nr_moves, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* moves BAR2 through MMCONFIG, from inside an MMIO handler */
+static void *
+ecfg_mover(void *arg)
+{
+	uint64_t val;
+	int i = 0, err;
+
+	while (!done) {
+		val = bar2_addrs[++i & 1];
+		err = mmio(ECFG_BASE + (SLOT << 15) + PCIR_BAR(2),
+			   REQUEST_WRITE, 4, &val);
+		if (err) {
+			fprintf(stderr, "ECFG write failed: %d\n", err);
+			exit(1);
+		}
+		__atomic_add_fetch(&nr_moves, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t tids[4];
+	char slot[] = "3,dummy";
+	uint64_t val;
+	int i;
+
+	/* a deadlock between the two movers shows up as a timeout */
+	alarm(RUN_SECS + 10);
+
+	init_mem();
+	if (pci_parse_slot(slot) || init_pci(NULL)) {
+		fprintf(stderr, "init_pci failed\n");
+		return 1;
+	}
+
+	cfg_write(PCIR_BAR(1), bar1_addrs[0]);
+	cfg_write(PCIR_BAR(2), bar2_addrs[0]);
+	cfg_write(PCIR_COMMAND, PCIM_CMD_MEMEN);
+	val = PATTERN;
+	if (mmio(bar1_addrs[0] + 0x10, REQUEST_WRITE, 4, &val)) {
+		fprintf(stderr, "BAR1 not at 0x%lx\n", bar1_addrs[0]);
+		return 1;
+	}
+
+	pthread_create(&tids[0], NULL, bar_reader, NULL);
+	pthread_create(&tids[1], NULL, bar_reader, NULL);
+	pthread_create(&tids[2], NULL, cf8_mover, NULL);
+	pthread_create(&tids[3], NULL, ecfg_mover, NULL);
+
+	sleep(RUN_SECS);
+	done = true;
+	for (i = 0; i < 4; i++)
+		pthread_join(tids[i], NULL);
+
+	printf("%lu BAR moves, reads: %lu device, %lu all-ones\n",
+	       nr_moves, nr_dev, nr_ones);
+	if (nr_dev == 0 || nr_moves == 0) {
+		fprintf(stderr, "the threads didn't overlap\n");
+		return 1;
+	}
+	return 0;
+}
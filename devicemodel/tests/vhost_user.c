@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Wire format of the vhost-user transport (hw/pci/virtio/vhost_user.c).
+ *
+ * The ops run on one end of a socketpair; the test is the backend on the
+ * other end. It decodes each message with the layout of the vhost-user
+ * spec rather than the structs of vhost_user.c: a 12 byte header (request,
+ * flags, payload size) followed right away by the payload, with any fds
+ * passed as SCM_RIGHTS. Replies the ops wait for are queued beforehand.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/vhost.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "vmmapi.h"
+#include "vhost.h"
+
+/* from the vhost-user spec */
+#define	VU_GET_FEATURES		1
+#define	VU_SET_FEATURES		2
+#define	VU_SET_OWNER		3
+#define	VU_SET_MEM_TABLE	5
+#define	VU_SET_VRING_NUM	8
+#define	VU_SET_VRING_ADDR	9
+#define	VU_SET_VRING_BASE	10
+#define	VU_GET_VRING_BASE	11
+#define	VU_SET_VRING_KICK	12
+#define	VU_SET_VRING_CALL	13
+
+#define	VU_VERSION		0x1
+#define	VU_REPLY		0x4
+#define	VU_NOFD			0x100
+
+#define	VU_HDR_SIZE		12
+#define	VU_REGION_SIZE		32
+#define	VU_MAX_FDS		8
+
+struct vu_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	uint8_t payload[256];
+	int fds[VU_MAX_FDS];
+	int nfds;
+};
+
+static struct vhost_dev vdev;
+static int backend_fd;
+static bool failed;
+
+#define	CHECK(cond, fmt, args...) do {					\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __func__, __LINE__,	\
+			##args);					\
+		failed = true;						\
+	}								\
+} while (0)
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t
+get64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* receive one message from the ops, false if there is none */
+static bool
+vu_recv(struct vu_msg *m)
+{
+	char control[CMSG_SPACE(sizeof(int) * VU_MAX_FDS)];
+	uint8_t hdr[VU_HDR_SIZE];
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t rc;
+
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(hdr);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	rc = recvmsg(backend_fd, &mh, MSG_DONTWAIT);
+	if (rc < 0)
+		return false;
+	if (rc != sizeof(hdr)) {
+		printf("FAIL short header, %zd bytes\n", rc);
+		exit(1);
+	}
+
+	m->request = get32(hdr);
+	m->flags = get32(hdr + 4);
+	m->size = get32(hdr + 8);
+	m->nfds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		m->nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(m->fds, CMSG_DATA(cmsg), m->nfds * sizeof(int));
+	}
+
+	if (m->size > sizeof(m->payload) ||
+	    (m->size && recv(backend_fd, m->payload, m->size, MSG_WAITALL) !=
+			(ssize_t)m->size)) {
+		printf("FAIL payload of request %u, size %u\n", m->request,
+			m->size);
+		exit(1);
+	}
+	return true;
+}
+
+static void
+vu_close_fds(struct vu_msg *m)
+{
+	int i;
+
+	for (i = 0; i < m->nfds; i++)
+		close(m->fds[i]);
+}
+
+/* expect a message with the given request and payload size */
+static void
+vu_expect(struct vu_msg *m, uint32_t request, uint32_t size, int nfds)
+{
+	if (!vu_recv(m)) {
+		CHECK(0, "no message, expected request %u", request);
+		memset(m, 0, sizeof(*m));
+		return;
+	}
+	CHECK(m->request == request, "request %u, expected %u", m->request,
+		request);
+	CHECK(m->flags == VU_VERSION, "request %u: flags 0x%x", request,
+		m->flags);
+	CHECK(m->size == size, "request %u: size %u, expected %u", request,
+		m->size, size);
+	CHECK(m->nfds == nfds, "request %u: %d fds, expected %d", request,
+		m->nfds, nfds);
+}
+
+static void
+expect_nothing(const char *what)
+{
+	struct vu_msg m;
+
+	if (vu_recv(&m)) {
+		CHECK(0, "%s sent request %u", what, m.request);
+		vu_close_fds(&m);
+	}
+}
+
+/* queue a reply for the ops to read */
+static void
+vu_reply(uint32_t request, uint32_t flags, const void *payload,
+	 uint32_t size)
+{
+	uint8_t buf[VU_HDR_SIZE + 64];
+
+	memcpy(buf, &request, 4);
+	memcpy(buf + 4, &flags, 4);
+	memcpy(buf + 8, &size, 4);
+	memcpy(buf + VU_HDR_SIZE, payload, size);
+	if (write(backend_fd, buf, VU_HDR_SIZE + size) !=
+			VU_HDR_SIZE + size) {
+		perror("reply");
+		exit(1);
+	}
+}
+
+/* the ops leave the payload of a reply they reject unread */
+static void
+drop_rejected_reply(void)
+{
+	uint8_t buf[64];
+
+	while (recv(vdev.fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+/* the fd received refers to the same file as the one passed */
+static bool
+same_file(int a, int b)
+{
+	struct stat sa, sb;
+
+	return fstat(a, &sa) == 0 && fstat(b, &sb) == 0 &&
+		sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* a signal on the fd received shows up on the eventfd passed */
+static bool
+same_eventfd(int received, int efd)
+{
+	uint64_t val = 1;
+
+	return write(received, &val, sizeof(val)) == sizeof(val) &&
+		read(efd, &val, sizeof(val)) == sizeof(val);
+}
+
+static void
+test_owner_features(void)
+{
+	struct vu_msg m;
+	uint64_t features, offered = 0x140008000ULL;
+
+	CHECK(vhost_user_ops.set_owner(&vdev) == 0, "set_owner");
+	vu_expect(&m, VU_SET_OWNER, 0, 0);
+
+	CHECK(vhost_user_ops.set_features(&vdev, 0x100000020ULL) == 0,
+		"set_features");
+	vu_expect(&m, VU_SET_FEATURES, 8, 0);
+	CHECK(get64(m.payload) == 0x100000020ULL, "features 0x%lx",
+		get64(m.payload));
+
+	vu_reply(VU_GET_FEATURES, VU_VERSION | VU_REPLY, &offered, 8);
+	features = 0;
+	CHECK(vhost_user_ops.get_features(&vdev, &features) == 0,
+		"get_features");
+	vu_expect(&m, VU_GET_FEATURES, 0, 0);
+	CHECK(features == offered, "got features 0x%lx", features);
+
+	/* a reply without the reply flag, or to another request */
+	vu_reply(VU_GET_FEATURES, VU_VERSION, &offered, 8);
+	CHECK(vhost_user_ops.get_features(&vdev, &features) < 0,
+		"accepted a reply without the reply flag");
+	vu_expect(&m, VU_GET_FEATURES, 0, 0);
+	drop_rejected_reply();
+
+	vu_reply(VU_GET_VRING_BASE, VU_VERSION | VU_REPLY, &offered, 8);
+	CHECK(vhost_user_ops.get_features(&vdev, &features) < 0,
+		"accepted the reply to another request");
+	vu_expect(&m, VU_GET_FEATURES, 0, 0);
+	drop_rejected_reply();
+}
+
+static void
+test_mem_table(void)
+{
+	struct vm_mem_region regions[2];
+	struct vu_msg m;
+	const uint8_t *r;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		regions[i].gpa = i ? 0x100000000ULL : 0;
+		regions[i].size = (i + 1) * 0x200000ULL;
+		regions[i].hva = (void *)(0x7f0000000000UL + i * 0x40000000UL);
+		regions[i].fd = memfd_create("vhost_user", 0);
+		regions[i].fd_offset = i * 0x1000;
+	}
+
+	CHECK(vhost_user_ops.set_mem_table(&vdev, regions, 2) == 0,
+		"set_mem_table");
+	/* nregions, padding, then the regions */
+	vu_expect(&m, VU_SET_MEM_TABLE, 8 + 2 * VU_REGION_SIZE, 2);
+	CHECK(get32(m.payload) == 2, "nregions %u", get32(m.payload));
+	for (i = 0; i < 2 && i < m.nfds; i++) {
+		r = m.payload + 8 + i * VU_REGION_SIZE;
+		CHECK(get64(r) == regions[i].gpa, "region %d gpa 0x%lx", i,
+			get64(r));
+		CHECK(get64(r + 8) == regions[i].size, "region %d size 0x%lx",
+			i, get64(r + 8));
+		CHECK(get64(r + 16) == (uintptr_t)regions[i].hva,
+			"region %d hva 0x%lx", i, get64(r + 16));
+		CHECK(get64(r + 24) == regions[i].fd_offset,
+			"region %d offset 0x%lx", i, get64(r + 24));
+		CHECK(same_file(m.fds[i], regions[i].fd),
+			"region %d fd is another file", i);
+	}
+	vu_close_fds(&m);
+
+	/* memory the backend can't map is not sent at all */
+	close(regions[1].fd);
+	regions[1].fd = -1;
+	CHECK(vhost_user_ops.set_mem_table(&vdev, regions, 2) < 0,
+		"accepted a region without fd");
+	expect_nothing("set_mem_table without fd");
+	close(regions[0].fd);
+}
+
+static void
+test_vring(void)
+{
+	struct vhost_vring_state state = { .index = 1, .num = 256 };
+	struct vhost_vring_addr addr = {
+		.index = 1,
+		.flags = 0,
+		.desc_user_addr = 0x1000,
+		.used_user_addr = 0x3000,
+		.avail_user_addr = 0x2000,
+		.log_guest_addr = 0,
+	};
+	struct vhost_vring_file file;
+	struct vu_msg m;
+	uint32_t reply[2] = { 1, 1234 };
+
+	CHECK(vhost_user_ops.set_vring_num(&vdev, &state) == 0,
+		"set_vring_num");
+	vu_expect(&m, VU_SET_VRING_NUM, 8, 0);
+	CHECK(get32(m.payload) == 1 && get32(m.payload + 4) == 256,
+		"vring num %u/%u", get32(m.payload), get32(m.payload + 4));
+
+	state.num = 17;
+	CHECK(vhost_user_ops.set_vring_base(&vdev, &state) == 0,
+		"set_vring_base");
+	vu_expect(&m, VU_SET_VRING_BASE, 8, 0);
+	CHECK(get32(m.payload) == 1 && get32(m.payload + 4) == 17,
+		"vring base %u/%u", get32(m.payload), get32(m.payload + 4));
+
+	/* index, flags, desc, used, avail, log */
+	CHECK(vhost_user_ops.set_vring_addr(&vdev, &addr) == 0,
+		"set_vring_addr");
+	vu_expect(&m, VU_SET_VRING_ADDR, 40, 0);
+	CHECK(get32(m.payload) == 1 && get64(m.payload + 8) == 0x1000 &&
+		get64(m.payload + 16) == 0x3000 &&
+		get64(m.payload + 24) == 0x2000, "vring addr layout");
+
+	/* the ring is stopped by GET_VRING_BASE, which returns its base */
+	vu_reply(VU_GET_VRING_BASE, VU_VERSION | VU_REPLY, reply,
+		sizeof(reply));
+	state.num = 0;
+	CHECK(vhost_user_ops.get_vring_base(&vdev, &state) == 0,
+		"get_vring_base");
+	vu_expect(&m, VU_GET_VRING_BASE, 8, 0);
+	CHECK(get32(m.payload) == 1, "get_vring_base index %u",
+		get32(m.payload));
+	CHECK(state.num == 1234, "got vring base %u", state.num);
+
+	/* kick: the ring index with the eventfd */
+	file.index = 1;
+	file.fd = eventfd(0, EFD_NONBLOCK);
+	CHECK(vhost_user_ops.set_vring_kick(&vdev, &file) == 0,
+		"set_vring_kick");
+	vu_expect(&m, VU_SET_VRING_KICK, 8, 1);
+	CHECK(get64(m.payload) == 1, "kick payload 0x%lx", get64(m.payload));
+	if (m.nfds == 1)
+		CHECK(same_eventfd(m.fds[0], file.fd),
+			"kick fd is not the eventfd");
+	vu_close_fds(&m);
+	close(file.fd);
+
+	/* no kick fd: nothing to tell the backend */
+	file.fd = -1;
+	CHECK(vhost_user_ops.set_vring_kick(&vdev, &file) == 0,
+		"set_vring_kick without fd");
+	expect_nothing("set_vring_kick without fd");
+
+	/* call: the eventfd, or the NOFD flag without one */
+	file.index = 0;
+	file.fd = eventfd(0, EFD_NONBLOCK);
+	CHECK(vhost_user_ops.set_vring_call(&vdev, &file) == 0,
+		"set_vring_call");
+	vu_expect(&m, VU_SET_VRING_CALL, 8, 1);
+	CHECK(get64(m.payload) == 0, "call payload 0x%lx", get64(m.payload));
+	if (m.nfds == 1)
+		CHECK(same_eventfd(m.fds[0], file.fd),
+			"call fd is not the eventfd");
+	vu_close_fds(&m);
+	close(file.fd);
+
+	file.fd = -1;
+	CHECK(vhost_user_ops.set_vring_call(&vdev, &file) == 0,
+		"set_vring_call without fd");
+	vu_expect(&m, VU_SET_VRING_CALL, 8, 0);
+	CHECK(get64(m.payload) == VU_NOFD, "call payload 0x%lx",
+		get64(m.payload));
+
+	/* RESET_OWNER is deprecated and not sent */
+	CHECK(vhost_user_ops.reset_device(&vdev) == 0, "reset_device");
+	expect_nothing("reset_device");
+}
+
+int
+main(void)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	int sv[2];
+
+	/* a reader out of step with the stream fails rather than hangs */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+	    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+		perror("socketpair");
+		return 1;
+	}
+	vdev.fd = sv[0];
+	backend_fd = sv[1];
+
+	test_owner_features();
+	test_mem_table();
+	test_vring();
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
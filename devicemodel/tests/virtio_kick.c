@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Latency of a virtqueue kick through its ioeventfd, from the eventfd
+ * write the kernel does for the guest notify to the device's notify
+ * handler, with a busy neighbour device on the main mevent loop.
+ *
+ * Two devices run the virtio core (hw/pci/virtio/virtio.c) and the event
+ * library (core/mevent.c): the one in slot 3 has its kicks put on the
+ * main loop, the one in slot 4 on the "pci4.0" loop of its own that the
+ * virtio core starts by default. The neighbour takes work us of the main
+ * loop every period us.
+ *
+ *   virtio_kick [-w work us] [-p period us] [-n kicks]
+ */
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "mevent.h"
+#include "virtio.h"
+#include "virtio_stubs.h"
+
+#define	KICK_QSIZE	64
+#define	KICK_MEMSIZE	(16UL << 20)
+#define	KICK_GPA	0x10000UL	/* rings, one page per device */
+
+struct kick_dev {
+	struct virtio_base base;
+	struct virtio_vq_info vq;
+	struct pci_vdev dev;
+	int kick_fd;
+	int done_fd;			/* the handler's reply */
+	volatile uint64_t sent;		/* ns of the last kick */
+	volatile uint64_t latency;	/* ns, of the last kick handled */
+};
+
+static struct vmctx *ctx;
+static long work_us = 100, period_us = 250, nkicks = 20000;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+kick_reset(void *vdev)
+{
+}
+
+static void
+kick_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct kick_dev *kd = vdev;
+
+	kd->latency = now_ns() - kd->sent;
+	eventfd_write(kd->done_fd, 1);
+}
+
+static struct virtio_ops kick_ops = {
+	"vkick",		/* our name */
+	1,			/* we support 1 virtqueue */
+	0,			/* config reg size */
+	kick_reset,		/* reset */
+	kick_notify,		/* device-wide qnotify */
+	NULL,			/* read virtio config */
+	NULL,			/* write virtio config */
+	NULL,			/* apply negotiated features */
+	NULL,			/* called on guest set status */
+};
+
+static void
+common_write(struct kick_dev *kd, uint64_t offset, int size, uint64_t value)
+{
+	virtio_pci_write(ctx, 0, &kd->dev, VIRTIO_MODERN_MMIO_BAR_IDX,
+		VIRTIO_CAP_COMMON_OFFSET + offset, size, value);
+}
+
+/* bring up a device in slot the way a guest driver does */
+static void
+kick_dev_init(struct kick_dev *kd, int slot, struct mevent_loop *loop)
+{
+	uint64_t desc, avail, used;
+
+	kd->dev.vmctx = ctx;
+	kd->dev.slot = slot;
+	kd->done_fd = eventfd(0, 0);
+	virtio_linkup(&kd->base, &kick_ops, kd, &kd->dev, &kd->vq);
+	kd->base.evloop = loop;
+	kd->base.device_caps = ACRN_VIRTIO_F_VERSION_1;
+	kd->base.legacy_pio_bar_idx = VIRTIO_LEGACY_PIO_BAR_IDX;
+	kd->base.modern_mmio_bar_idx = VIRTIO_MODERN_MMIO_BAR_IDX;
+
+	common_write(kd, VIRTIO_COMMON_GFSELECT, 4, 1);
+	common_write(kd, VIRTIO_COMMON_GF, 4, ACRN_VIRTIO_F_VERSION_1 >> 32);
+
+	desc = KICK_GPA + slot * 4096UL;
+	avail = desc + KICK_QSIZE * sizeof(struct virtio_desc);
+	used = avail + (3 + KICK_QSIZE) * sizeof(uint16_t);
+	common_write(kd, VIRTIO_COMMON_Q_SELECT, 2, 0);
+	common_write(kd, VIRTIO_COMMON_Q_SIZE, 2, KICK_QSIZE);
+	common_write(kd, VIRTIO_COMMON_Q_DESCLO, 4, desc);
+	common_write(kd, VIRTIO_COMMON_Q_AVAILLO, 4, avail);
+	common_write(kd, VIRTIO_COMMON_Q_USEDLO, 4, used);
+	common_write(kd, VIRTIO_COMMON_Q_ENABLE, 2, 1);
+
+	/* DRIVER_OK moves the notifies to an ioeventfd */
+	stub_kick_fd = -1;
+	common_write(kd, VIRTIO_COMMON_STATUS, 1, VIRTIO_CR_STATUS_ACK |
+		VIRTIO_CR_STATUS_DRIVER | VIRTIO_CR_STATUS_DRIVER_OK);
+	kd->kick_fd = stub_kick_fd;
+	if (kd->kick_fd < 0) {
+		fprintf(stderr, "slot %d: no ioeventfd\n", slot);
+		exit(1);
+	}
+}
+
+/* a device that keeps the main loop busy */
+static void
+busy_handler(int fd, enum ev_type t, void *arg)
+{
+	eventfd_t val;
+	uint64_t end;
+
+	if (eventfd_read(fd, &val) < 0)
+		return;
+	end = now_ns() + work_us * 1000;
+	while (now_ns() < end)
+		;
+}
+
+static void *
+busy_thread(void *arg)
+{
+	int fd = *(int *)arg;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	for (;;) {
+		ts.tv_nsec += period_us * 1000;
+		while (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			ts.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		eventfd_write(fd, 1);
+	}
+	return NULL;
+}
+
+static void *
+dispatch_thread(void *arg)
+{
+	mevent_dispatch();
+	return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+kick_bench(struct kick_dev *kd, const char *name, uint64_t *lat)
+{
+	struct timespec gap = { 0, 0 };
+	eventfd_t val;
+	long i;
+
+	for (i = 0; i < nkicks; i++) {
+		/* spread the kicks over the neighbour's period */
+		gap.tv_nsec = (random() % 50) * 1000;
+		nanosleep(&gap, NULL);
+
+		kd->sent = now_ns();
+		eventfd_write(kd->kick_fd, 1);
+		eventfd_read(kd->done_fd, &val);
+		lat[i] = kd->latency;
+	}
+
+	qsort(lat, nkicks, sizeof(*lat), cmp_u64);
+	printf("%-8s  %8.1f  %8.1f  %8.1f\n", name, lat[nkicks / 2] / 1e3,
+		lat[nkicks * 99 / 100] / 1e3, lat[nkicks - 1] / 1e3);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct kick_dev main_dev, own_dev;
+	pthread_t tid;
+	uint64_t *lat;
+	int busy_fd, c;
+
+	while ((c = getopt(argc, argv, "w:p:n:")) != -1) {
+		switch (c) {
+		case 'w':
+			work_us = atol(optarg);
+			break;
+		case 'p':
+			period_us = atol(optarg);
+			break;
+		case 'n':
+			nkicks = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-w work us] [-p period us]"
+				" [-n kicks]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (work_us < 0 || period_us <= work_us || nkicks < 1) {
+		fprintf(stderr, "need 0 <= work < period and kicks > 0\n");
+		return 1;
+	}
+	lat = calloc(nkicks, sizeof(*lat));
+	if (lat == NULL)
+		return 1;
+
+	ctx = stub_vm_create(KICK_MEMSIZE, 0);
+	mevent_init();
+	/* an unconfigured name gets the main loop */
+	kick_dev_init(&main_dev, 3, mevent_loop_get("main"));
+	kick_dev_init(&own_dev, 4, NULL);
+
+	busy_fd = eventfd(0, EFD_NONBLOCK);
+	if (work_us > 0) {
+		mevent_add(busy_fd, EVF_READ, busy_handler, NULL);
+		pthread_create(&tid, NULL, busy_thread, &busy_fd);
+	}
+	pthread_create(&tid, NULL, dispatch_thread, NULL);
+
+	printf("kick latency in us, neighbour busy %ld us every %ld us"
+		" on the main loop\n", work_us, period_us);
+	printf("loop        median       p99       max\n");
+	kick_bench(&main_dev, "main", lat);
+	kick_bench(&own_dev, "pci4.0", lat);
+	return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Packet rate of the virtio-net host backends, 64-byte frames by default.
+ *
+ * It reproduces the syscall pattern of each backend in virtio_net.c on a
+ * scratch tap interface:
+ *
+ *   tap     one writev() per tx frame, one readv() per rx frame
+ *   packet  one sendmmsg()/recvmmsg() per batch of up to 32 frames on an
+ *           AF_PACKET socket bound to the interface
+ *
+ * The tap interface is its own traffic generator: frames written to the
+ * tap fd are received by the interface, and frames sent on the interface
+ * are read from the tap fd. For rx, a burst is queued first and only the
+ * time spent draining it is counted, so the figures are the cost paid by
+ * the acrn-dm rx/tx thread per frame.
+ *
+ * Needs CAP_NET_ADMIN and CAP_NET_RAW:
+ *   virtio_net_pps [-i ifname] [-s frame size] [-n frames]
+ */
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	PPS_BATCH	32		/* VIRTIO_NET_BATCH */
+#define	PPS_BURST	256		/* frames queued per rx round */
+#define	PPS_ETHTYPE	0x88b5		/* local experimental, dropped */
+#define	PPS_MAXFRAME	1514
+
+static char ifname[IFNAMSIZ] = "acrnpps0";
+static size_t frame_size = 64;
+static long nframes = 1000000;
+
+static uint8_t txbuf[PPS_BATCH][PPS_MAXFRAME];
+static uint8_t rxbuf[PPS_BATCH][PPS_MAXFRAME];
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+tap_open(void)
+{
+	struct ifreq ifr;
+	int fd, s;
+
+	fd = open("/dev/net/tun", O_RDWR);
+	if (fd < 0) {
+		perror("open /dev/net/tun");
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+		perror("TUNSETIFF");
+		close(fd);
+		return -1;
+	}
+
+	/* bring it up, the frames are dropped after the packet taps */
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0 || ioctl(s, SIOCGIFFLAGS, &ifr) < 0) {
+		perror("SIOCGIFFLAGS");
+		goto fail;
+	}
+	ifr.ifr_flags |= IFF_UP | IFF_NOARP;
+	if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0) {
+		perror("SIOCSIFFLAGS");
+		goto fail;
+	}
+	close(s);
+	return fd;
+
+fail:
+	if (s >= 0)
+		close(s);
+	close(fd);
+	return -1;
+}
+
+static int
+packet_open(void)
+{
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+	int fd, opt;
+
+	fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (fd < 0) {
+		perror("socket AF_PACKET");
+		return -1;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = if_nametoindex(ifname);
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		perror("bind");
+		goto fail;
+	}
+
+	/* same socket options as the acrn-dm packet backend */
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = sll.sll_ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+				sizeof(mreq)) < 0) {
+		perror("PACKET_ADD_MEMBERSHIP");
+		goto fail;
+	}
+	opt = 1;
+	(void)setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &opt,
+			sizeof(opt));
+	opt = 4 << 20;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+static void
+frames_init(void)
+{
+	struct ethhdr *eh;
+	int i;
+
+	for (i = 0; i < PPS_BATCH; i++) {
+		memset(txbuf[i], 0x5a, frame_size);
+		eh = (struct ethhdr *)txbuf[i];
+		memset(eh->h_dest, 0xff, ETH_ALEN);
+		memcpy(eh->h_source, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+		eh->h_proto = htons(PPS_ETHTYPE);
+	}
+}
+
+static void
+mmsg_init(struct mmsghdr *msgs, struct iovec *iov, uint8_t (*buf)[PPS_MAXFRAME],
+	  size_t len)
+{
+	int i;
+
+	memset(msgs, 0, sizeof(*msgs) * PPS_BATCH);
+	for (i = 0; i < PPS_BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/* virtio_net_tap_tx(): one writev() per frame */
+static double
+tap_tx(int tapfd)
+{
+	struct iovec iov;
+	double t;
+	long i;
+
+	iov.iov_base = txbuf[0];
+	iov.iov_len = frame_size;
+	t = now_ns();
+	for (i = 0; i < nframes; i++) {
+		if (writev(tapfd, &iov, 1) < 0) {
+			perror("writev");
+			return -1;
+		}
+	}
+	return now_ns() - t;
+}
+
+/* packet backend tx: one sendmmsg() per batch */
+static double
+packet_tx(int pfd)
+{
+	struct mmsghdr msgs[PPS_BATCH];
+	struct iovec iov[PPS_BATCH];
+	double t;
+	long i;
+	int n, sent;
+
+	mmsg_init(msgs, iov, txbuf, frame_size);
+	t = now_ns();
+	for (i = 0; i < nframes; i += n) {
+		n = nframes - i < PPS_BATCH ? nframes - i : PPS_BATCH;
+		sent = sendmmsg(pfd, msgs, n, 0);
+		if (sent < 0) {
+			perror("sendmmsg");
+			return -1;
+		}
+		n = sent;
+	}
+	return now_ns() - t;
+}
+
+/* queue a burst of frames on the interface for the tap fd to read */
+static int
+tap_fill(int pfd, int burst)
+{
+	struct mmsghdr msgs[PPS_BATCH];
+	struct iovec iov[PPS_BATCH];
+	int n, sent;
+
+	mmsg_init(msgs, iov, txbuf, frame_size);
+	for (; burst > 0; burst -= sent) {
+		n = burst < PPS_BATCH ? burst : PPS_BATCH;
+		sent = sendmmsg(pfd, msgs, n, 0);
+		if (sent <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* virtio_net_tap_rx(): one readv() per frame */
+static double
+tap_rx(int tapfd, int pfd)
+{
+	struct iovec iov;
+	double t = 0;
+	long done = 0;
+	ssize_t len;
+	double t0;
+
+	iov.iov_base = rxbuf[0];
+	iov.iov_len = PPS_MAXFRAME;
+	while (done < nframes) {
+		if (tap_fill(pfd, PPS_BURST) < 0) {
+			perror("sendmmsg");
+			return -1;
+		}
+		t0 = now_ns();
+		while ((len = readv(tapfd, &iov, 1)) > 0)
+			done++;
+		t += now_ns() - t0;
+		if (errno != EAGAIN) {
+			perror("readv");
+			return -1;
+		}
+	}
+	nframes = done;
+	return t;
+}
+
+/* queue a burst of frames on the interface for the packet socket */
+static int
+packet_fill(int tapfd, int burst)
+{
+	while (burst-- > 0) {
+		if (write(tapfd, txbuf[0], frame_size) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* packet backend rx: one recvmmsg() per batch */
+static double
+packet_rx(int tapfd, int pfd)
+{
+	struct mmsghdr msgs[PPS_BATCH];
+	struct iovec iov[PPS_BATCH];
+	double t = 0;
+	long done = 0;
+	int rcvd;
+	double t0;
+
+	mmsg_init(msgs, iov, rxbuf, PPS_MAXFRAME);
+	while (done < nframes) {
+		if (packet_fill(tapfd, PPS_BURST) < 0) {
+			perror("write");
+			return -1;
+		}
+		t0 = now_ns();
+		while ((rcvd = recvmmsg(pfd, msgs, PPS_BATCH, MSG_DONTWAIT,
+						NULL)) > 0)
+			done += rcvd;
+		t += now_ns() - t0;
+		if (errno != EAGAIN) {
+			perror("recvmmsg");
+			return -1;
+		}
+	}
+	nframes = done;
+	return t;
+}
+
+static void
+report(const char *name, double ns)
+{
+	printf("%-10s %8.0f kpps %8.1f ns/frame\n", name,
+		nframes / ns * 1e6, ns / nframes);
+}
+
+int
+main(int argc, char **argv)
+{
+	long want;
+	int tapfd, pfd, c;
+	double ns;
+
+	while ((c = getopt(argc, argv, "i:s:n:")) != -1) {
+		switch (c) {
+		case 'i':
+			snprintf(ifname, IFNAMSIZ, "%s", optarg);
+			break;
+		case 's':
+			frame_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nframes = strtol(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i ifname] [-s frame size]"
+				" [-n frames]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (frame_size < ETH_ZLEN || frame_size > PPS_MAXFRAME ||
+	    nframes <= 0) {
+		fprintf(stderr, "bad frame size or count\n");
+		return 1;
+	}
+	want = nframes;
+
+	tapfd = tap_open();
+	if (tapfd < 0)
+		return 1;
+	fcntl(tapfd, F_SETFL, O_NONBLOCK);
+	frames_init();
+
+	printf("%zu-byte frames on %s, batch %d\n", frame_size, ifname,
+		PPS_BATCH);
+
+	/* no packet socket open yet, it would take a copy of each frame */
+	if ((ns = tap_tx(tapfd)) < 0)
+		return 1;
+	report("tap tx", ns);
+	pfd = packet_open();
+	if (pfd < 0)
+		return 1;
+	if ((ns = packet_tx(pfd)) < 0)
+		return 1;
+	report("packet tx", ns);
+	close(pfd);
+
+	/* fresh sockets so the tx frames above are not counted as rx */
+	pfd = packet_open();
+	if (pfd < 0)
+		return 1;
+	while (read(tapfd, rxbuf[0], PPS_MAXFRAME) > 0)
+		;
+	if ((ns = tap_rx(tapfd, pfd)) < 0)
+		return 1;
+	report("tap rx", ns);
+	close(pfd);
+
+	nframes = want;
+	pfd = packet_open();
+	if (pfd < 0)
+		return 1;
+	if ((ns = packet_rx(tapfd, pfd)) < 0)
+		return 1;
+	report("packet rx", ns);
+
+	close(pfd);
+	close(tapfd);
+	return 0;
+}
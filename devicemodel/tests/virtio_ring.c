@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Device side cost of the split and packed virtqueue layouts.
+ *
+ * The virtio core (hw/pci/virtio/virtio.c) runs against a driver emulated
+ * here: each round the driver posts a burst of chains, the device takes
+ * them with vq_getchain(), returns them with vq_relchain() and ends with
+ * vq_endchains(), then the driver reaps the used buffers and checks their
+ * ids and lengths. Only the device side is timed.
+ *
+ * The second table compares taking the split ring chains one at a time
+ * with vq_getchain() and all at once with vq_getchains(), with buffers in
+ * one guest memory segment, where every translation hits the GPA cache of
+ * the virtqueue, and alternating between lowmem and highmem, where every
+ * translation misses it and goes through paddr_guest2host().
+ *
+ *   virtio_ring [-b chains per burst] [-r rounds]
+ */
+
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "virtio_stubs.h"
+
+#define	RING_QSIZE	256
+#define	RING_MAXSEGS	4
+#define	RING_MEMSIZE	(64UL << 20)	/* lowmem, and as much highmem */
+#define	RING_GPA	0x10000UL	/* rings */
+#define	RING_BUF_GPA	0x100000UL	/* buffers, one page per slot */
+
+static struct virtio_base base;
+static struct virtio_vq_info vq;
+static struct pci_vdev dev;
+static struct vmctx *ctx;
+
+/* device side fetch and buffer placement, see the top comment */
+static bool batched, scatter;
+
+static void
+ring_reset(void *vdev)
+{
+}
+
+static struct virtio_ops ring_ops = {
+	"vring",		/* our name */
+	1,			/* we support 1 virtqueue */
+	0,			/* config reg size */
+	ring_reset,		/* reset */
+	NULL,			/* device-wide qnotify */
+	NULL,			/* read virtio config */
+	NULL,			/* write virtio config */
+	NULL,			/* apply negotiated features */
+	NULL,			/* called on guest set status */
+};
+
+/* driver state */
+static bool packed;
+static uint16_t drv_avail, drv_used;	/* split: free running indexes */
+static bool drv_avail_wrap, drv_used_wrap;	/* packed wrap counters */
+static struct virtio_desc *sdesc;
+static struct virtio_vring_avail *savail;
+static struct virtio_vring_used *sused;
+static struct virtio_packed_desc *pdesc;
+
+static void
+common_write(uint64_t offset, int size, uint64_t value)
+{
+	virtio_pci_write(ctx, 0, &dev, VIRTIO_MODERN_MMIO_BAR_IDX,
+		VIRTIO_CAP_COMMON_OFFSET + offset, size, value);
+}
+
+static void
+ring_setup(bool use_packed)
+{
+	uint64_t caps, desc, avail, used;
+
+	memset(stub_guest_mem, 0, RING_BUF_GPA);
+	common_write(VIRTIO_COMMON_STATUS, 1, 0);
+
+	packed = use_packed;
+	caps = ACRN_VIRTIO_F_VERSION_1;
+	if (packed)
+		caps |= ACRN_VIRTIO_F_RING_PACKED;
+	common_write(VIRTIO_COMMON_GFSELECT, 4, 0);
+	common_write(VIRTIO_COMMON_GF, 4, caps & 0xffffffff);
+	common_write(VIRTIO_COMMON_GFSELECT, 4, 1);
+	common_write(VIRTIO_COMMON_GF, 4, caps >> 32);
+
+	desc = RING_GPA;
+	if (packed) {
+		avail = desc + RING_QSIZE * sizeof(struct virtio_packed_desc);
+		used = avail + sizeof(struct virtio_packed_event);
+		pdesc = (void *)(stub_guest_mem + desc);
+	} else {
+		avail = desc + RING_QSIZE * sizeof(struct virtio_desc);
+		used = roundup2(avail + (3 + RING_QSIZE) * sizeof(uint16_t),
+				VRING_ALIGN);
+		sdesc = (void *)(stub_guest_mem + desc);
+		savail = (void *)(stub_guest_mem + avail);
+		sused = (void *)(stub_guest_mem + used);
+	}
+
+	common_write(VIRTIO_COMMON_Q_SELECT, 2, 0);
+	common_write(VIRTIO_COMMON_Q_SIZE, 2, RING_QSIZE);
+	common_write(VIRTIO_COMMON_Q_DESCLO, 4, desc & 0xffffffff);
+	common_write(VIRTIO_COMMON_Q_DESCHI, 4, desc >> 32);
+	common_write(VIRTIO_COMMON_Q_AVAILLO, 4, avail & 0xffffffff);
+	common_write(VIRTIO_COMMON_Q_AVAILHI, 4, avail >> 32);
+	common_write(VIRTIO_COMMON_Q_USEDLO, 4, used & 0xffffffff);
+	common_write(VIRTIO_COMMON_Q_USEDHI, 4, used >> 32);
+	common_write(VIRTIO_COMMON_Q_ENABLE, 2, 1);
+	common_write(VIRTIO_COMMON_STATUS, 1, VIRTIO_CR_STATUS_ACK |
+		VIRTIO_CR_STATUS_DRIVER | VIRTIO_CR_STATUS_DRIVER_OK);
+
+	drv_avail = drv_used = 0;
+	drv_avail_wrap = drv_used_wrap = true;
+}
+
+static uint64_t
+buf_gpa(int slot, int seg)
+{
+	uint64_t gpa = RING_BUF_GPA + (uint64_t)slot * 4096;
+
+	return scatter && (seg & 1) ? 4 * GB + gpa : gpa;
+}
+
+/* post chain number id, made of segs descriptors */
+static void
+driver_post(int id, int segs)
+{
+	uint16_t head, slot, flags, head_flags = 0;
+	int i;
+
+	if (packed) {
+		head = drv_avail;
+		for (i = 0; i < segs; i++) {
+			slot = (head + i) % RING_QSIZE;
+			pdesc[slot].addr = buf_gpa(slot, i);
+			pdesc[slot].len = 64 * (i + 1);
+			pdesc[slot].id = id;
+			flags = i < segs - 1 ? ACRN_VRING_DESC_F_NEXT : 0;
+			flags |= drv_avail_wrap ?
+				ACRN_VRING_PACKED_DESC_F_AVAIL :
+				ACRN_VRING_PACKED_DESC_F_USED;
+			if (i == 0)
+				head_flags = flags;
+			else
+				pdesc[slot].flags = flags;
+			if (slot == RING_QSIZE - 1)
+				drv_avail_wrap = !drv_avail_wrap;
+		}
+		/* the head makes the chain visible to the device */
+		__sync_synchronize();
+		pdesc[head].flags = head_flags;
+		drv_avail = (head + segs) % RING_QSIZE;
+	} else {
+		/* chain id always owns descriptors id * segs and up */
+		head = id * segs;
+		for (i = 0; i < segs; i++) {
+			slot = head + i;
+			sdesc[slot].addr = buf_gpa(slot, i);
+			sdesc[slot].len = 64 * (i + 1);
+			sdesc[slot].flags = i < segs - 1 ?
+				ACRN_VRING_DESC_F_NEXT : 0;
+			sdesc[slot].next = slot + 1;
+		}
+		savail->ring[drv_avail % RING_QSIZE] = head;
+		__sync_synchronize();
+		savail->idx = ++drv_avail;
+	}
+}
+
+/* reap the next used buffer, -1 if there is none */
+static int
+driver_reap(int segs, uint32_t *len)
+{
+	struct virtio_used *ue;
+	uint16_t flags;
+	int id;
+
+	if (packed) {
+		flags = pdesc[drv_used].flags;
+		if (!!(flags & ACRN_VRING_PACKED_DESC_F_AVAIL) !=
+		    drv_used_wrap ||
+		    !!(flags & ACRN_VRING_PACKED_DESC_F_USED) !=
+		    drv_used_wrap)
+			return -1;
+		id = pdesc[drv_used].id;
+		*len = pdesc[drv_used].len;
+		drv_used += segs;
+		if (drv_used >= RING_QSIZE) {
+			drv_used -= RING_QSIZE;
+			drv_used_wrap = !drv_used_wrap;
+		}
+		return id;
+	}
+
+	if (drv_used == sused->idx)
+		return -1;
+	ue = &sused->ring[drv_used++ % RING_QSIZE];
+	*len = ue->tlen;
+	return ue->idx / segs;
+}
+
+static void
+device_chain(uint16_t idx, struct iovec *iov, int n, int segs)
+{
+	uint32_t len;
+	int i;
+
+	if (n != segs) {
+		fprintf(stderr, "chain of %d descriptors, not %d\n", n, segs);
+		exit(1);
+	}
+	len = 0;
+	for (i = 0; i < n; i++) {
+		if (iov[i].iov_base == NULL) {
+			fprintf(stderr, "descriptor %d not mapped\n", i);
+			exit(1);
+		}
+		len += iov[i].iov_len;
+	}
+	vq_relchain(&vq, idx, len);
+}
+
+/* the device: what a virtio device model does on a queue notify */
+static void
+device_run(int segs)
+{
+	static struct iovec iov[RING_QSIZE * RING_MAXSEGS];
+	static struct vq_chain chains[RING_QSIZE];
+	uint16_t idx;
+	int i, n;
+
+	while (vq_has_descs(&vq)) {
+		if (batched) {
+			n = vq_getchains(&vq, chains, RING_QSIZE, iov,
+					 RING_MAXSEGS, NULL);
+			for (i = 0; i < n; i++)
+				device_chain(chains[i].idx, chains[i].iov,
+					     chains[i].n, segs);
+		} else {
+			n = vq_getchain(&vq, &idx, iov, RING_MAXSEGS, NULL);
+			device_chain(idx, iov, n, segs);
+		}
+	}
+	vq_endchains(&vq, 1);
+}
+
+static double
+ring_bench(bool use_packed, int segs, int burst, int rounds)
+{
+	uint64_t cycles = 0, t;
+	uint32_t len, want;
+	int r, i, id;
+
+	ring_setup(use_packed);
+	want = 64 * segs * (segs + 1) / 2;
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < burst; i++)
+			driver_post(i, segs);
+
+		t = __rdtsc();
+		device_run(segs);
+		cycles += __rdtsc() - t;
+
+		for (i = 0; i < burst; i++) {
+			id = driver_reap(segs, &len);
+			if (id != i || len != want) {
+				fprintf(stderr, "%s round %d: got id %d len %u,"
+					" want %d len %u\n",
+					packed ? "packed" : "split", r, id,
+					len, i, want);
+				exit(1);
+			}
+		}
+		if (driver_reap(segs, &len) != -1) {
+			fprintf(stderr, "extra used buffer\n");
+			exit(1);
+		}
+	}
+	return (double)cycles / ((double)rounds * burst);
+}
+
+int
+main(int argc, char **argv)
+{
+	int burst = 32, rounds = 200000;
+	int segs, c;
+	double split_c, packed_c, one_c, batch_c;
+
+	while ((c = getopt(argc, argv, "b:r:")) != -1) {
+		switch (c) {
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b burst] [-r rounds]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (burst < 1 || burst * RING_MAXSEGS > RING_QSIZE || rounds < 1) {
+		fprintf(stderr, "burst must be 1..%d\n",
+			RING_QSIZE / RING_MAXSEGS);
+		return 1;
+	}
+
+	ctx = stub_vm_create(RING_MEMSIZE, RING_MEMSIZE);
+	dev.vmctx = ctx;
+	virtio_linkup(&base, &ring_ops, &base, &dev, &vq);
+	base.device_caps = ACRN_VIRTIO_F_VERSION_1 |
+		ACRN_VIRTIO_F_RING_PACKED;
+	base.flags = VIRTIO_NO_EVENTFD;
+	base.legacy_pio_bar_idx = VIRTIO_LEGACY_PIO_BAR_IDX;
+	base.modern_mmio_bar_idx = VIRTIO_MODERN_MMIO_BAR_IDX;
+
+	printf("device cycles per chain, %d chains per burst\n", burst);
+	printf("descriptors     split    packed\n");
+	for (segs = 1; segs <= 3; segs += 2) {
+		split_c = ring_bench(false, segs, burst, rounds);
+		packed_c = ring_bench(true, segs, burst, rounds);
+		printf("%11d  %8.1f  %8.1f\n", segs, split_c, packed_c);
+	}
+
+	printf("\nsplit ring, 3 descriptors per chain\n");
+	printf("buffers              vq_getchain  vq_getchains\n");
+	for (c = 0; c < 2; c++) {
+		scatter = c;
+		batched = false;
+		one_c = ring_bench(false, 3, burst, rounds);
+		batched = true;
+		batch_c = ring_bench(false, 3, burst, rounds);
+		printf("%-19s  %11.1f  %12.1f\n",
+			scatter ? "low/high alternate" : "one segment",
+			one_c, batch_c);
+	}
+	return 0;
+}
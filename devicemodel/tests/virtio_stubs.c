@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "timer.h"
+#include "dm_string.h"
+#include "virtio_stubs.h"
+
+uint8_t *stub_guest_mem;
+uint64_t stub_interrupts;
+int stub_kick_fd = -1;
+
+static struct vmctx stub_ctx;
+
+/*
+ * Guest memory as vm_setup_memory() lays it out: lowmem at gpa 0 and
+ * highmem at 4GB, in one host range reserved from baseaddr.
+ */
+struct vmctx *
+stub_vm_create(size_t lowmem, size_t highmem)
+{
+	size_t span = highmem ? 4 * GB + highmem : lowmem;
+
+	stub_guest_mem = mmap(NULL, span, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (stub_guest_mem == MAP_FAILED ||
+	    mprotect(stub_guest_mem, lowmem, PROT_READ | PROT_WRITE) ||
+	    (highmem && mprotect(stub_guest_mem + 4 * GB, highmem,
+				 PROT_READ | PROT_WRITE))) {
+		perror("mmap");
+		exit(1);
+	}
+	stub_ctx.lowmem = lowmem;
+	stub_ctx.highmem = highmem;
+	stub_ctx.baseaddr = (char *)stub_guest_mem;
+	return &stub_ctx;
+}
+
+/* same as core/vmmapi.c, a call away like it */
+void *
+vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
+{
+
+	if (ctx->lowmem > 0) {
+		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
+		    gaddr + len <= ctx->lowmem)
+			return (ctx->baseaddr + gaddr);
+	}
+
+	if (ctx->highmem > 0) {
+		if (gaddr >= 4*GB) {
+			if (gaddr < 4*GB + ctx->highmem &&
+			    len <= ctx->highmem &&
+			    gaddr + len <= 4*GB + ctx->highmem)
+				return (ctx->baseaddr + gaddr);
+		}
+	}
+
+	return NULL;
+}
+
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t gaddr, size_t len)
+{
+	return vm_map_gpa(ctx, gaddr, len);
+}
+
+size_t
+vm_get_lowmem_size(struct vmctx *ctx)
+{
+	return ctx->lowmem;
+}
+
+size_t
+vm_get_highmem_size(struct vmctx *ctx)
+{
+	return ctx->highmem;
+}
+
+int
+vm_ioeventfd(struct vmctx *ctx, struct acrn_ioeventfd *args)
+{
+	if ((args->flags & ACRN_IOEVENTFD_FLAG_DEASSIGN) == 0)
+		stub_kick_fd = args->fd;
+	return 0;
+}
+
+int
+vm_irqfd(struct vmctx *ctx, struct acrn_irqfd *args)
+{
+	return -1;
+}
+
+int
+vm_get_suspend_mode(void)
+{
+	return VM_SUSPEND_NONE;
+}
+
+int32_t
+acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *), void *param)
+{
+	timer->callback = cb;
+	timer->callback_param = param;
+	return 0;
+}
+
+void
+acrn_timer_deinit(struct acrn_timer *timer)
+{
+}
+
+int32_t
+acrn_timer_settime(struct acrn_timer *timer, struct itimerspec *new_value)
+{
+	return 0;
+}
+
+int
+dm_strtoui(const char *s, char **end, unsigned int base, unsigned int *val)
+{
+	*val = strtoul(s, end, base);
+	return *end == s ? -1 : 0;
+}
+
+int
+pci_emul_alloc_bar(struct pci_vdev *pdi, int idx, enum pcibar_type type,
+		   uint64_t size)
+{
+	return 0;
+}
+
+int
+pci_emul_add_capability(struct pci_vdev *dev, u_char *capdata, int caplen)
+{
+	return 0;
+}
+
+int
+pci_emul_find_capability(struct pci_vdev *dev, uint8_t capid, int *p_capoff)
+{
+	return -1;
+}
+
+int
+pci_emul_add_msicap(struct pci_vdev *pi, int msgnum)
+{
+	return 0;
+}
+
+int
+pci_emul_add_msixcap(struct pci_vdev *pi, int msgnum, int barnum)
+{
+	return 0;
+}
+
+int
+pci_emul_msix_twrite(struct pci_vdev *pi, uint64_t offset, int size,
+		     uint64_t value)
+{
+	return 0;
+}
+
+uint64_t
+pci_emul_msix_tread(struct pci_vdev *pi, uint64_t offset, int size)
+{
+	return 0;
+}
+
+int
+pci_msix_enabled(struct pci_vdev *pi)
+{
+	return 1;
+}
+
+int
+pci_msix_table_bar(struct pci_vdev *pi)
+{
+	return -1;
+}
+
+int
+pci_msix_pba_bar(struct pci_vdev *pi)
+{
+	return -1;
+}
+
+void
+pci_generate_msix(struct pci_vdev *dev, int index)
+{
+	stub_interrupts++;
+}
+
+void
+pci_generate_msi(struct pci_vdev *dev, int index)
+{
+	stub_interrupts++;
+}
+
+void
+pci_lintr_assert(struct pci_vdev *dev)
+{
+}
+
+void
+pci_lintr_deassert(struct pci_vdev *dev)
+{
+}
+
+void
+pci_lintr_request(struct pci_vdev *pi)
+{
+}
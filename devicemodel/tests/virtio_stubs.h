@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Just enough of acrn-dm to run hw/pci/virtio/virtio.c and core/mevent.c
+ * on the host: the guest memory is a plain buffer with lowmem at gpa 0 and
+ * highmem at 4GB, interrupts, timers, irqfds and PCI config space are
+ * no-ops. An ioeventfd is accepted and left for the caller to signal.
+ */
+
+#ifndef _VIRTIO_STUBS_H_
+#define _VIRTIO_STUBS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct vmctx;
+
+extern uint8_t *stub_guest_mem;
+extern uint64_t stub_interrupts;	/* guest interrupts raised */
+extern int stub_kick_fd;		/* last ioeventfd assigned */
+
+struct vmctx *stub_vm_create(size_t lowmem, size_t highmem);
+
+#endif /* _VIRTIO_STUBS_H_ */
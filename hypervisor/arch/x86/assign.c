@@ -442,11 +442,8 @@ static void ptdev_intr_handle_irq(struct acrn_vm *vm,
 	}
 }
 
-void ptdev_softirq(uint16_t pcpu_id)
+static void ptdev_softirq_vm(struct acrn_vm *vm)
 {
-	struct acrn_vcpu *vcpu = (struct acrn_vcpu *)per_cpu(vcpu, pcpu_id);
-	struct acrn_vm *vm = vcpu->vm;
-
 	while (1) {
 		struct ptdev_remapping_info *entry = ptdev_dequeue_softirq(vm);
 		struct ptdev_msi_info *msi;
@@ -484,6 +481,23 @@ void ptdev_softirq(uint16_t pcpu_id)
 	}
 }
 
+/*
+ * The pcpu taking the interrupt may run a vcpu of another VM, or none at
+ * all when its vcpus are switched out, so drain the queues of all VMs.
+ */
+void ptdev_softirq(__unused uint16_t pcpu_id)
+{
+	uint16_t vm_id;
+	struct acrn_vm *vm;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (vm != NULL) {
+			ptdev_softirq_vm(vm);
+		}
+	}
+}
+
 void ptdev_intx_ack(struct acrn_vm *vm, uint8_t virt_pin,
 		enum ptdev_vpin_source vpin_src)
 {
@@ -28,9 +28,11 @@ uint64_t local_gpa2hpa(struct acrn_vm *vm, uint64_t gpa, uint32_t *size)
 	uint64_t hpa = INVALID_HPA;
 	uint64_t *pgentry, pg_size = 0UL;
 	void *eptp;
-	struct acrn_vcpu *vcpu = vcpu_from_pid(vm, get_cpu_id());
+	struct acrn_vcpu *vcpu = get_cpu_var(sched_ctx).curr_vcpu;
 
-	if ((vcpu != NULL) && (vcpu->arch.cur_context == SECURE_WORLD)) {
+	/* the world of the vcpu of vm running on this pcpu, if any */
+	if ((vcpu != NULL) && (vcpu->vm == vm) &&
+			(vcpu->arch.cur_context == SECURE_WORLD)) {
 		eptp = vm->arch_vm.sworld_eptp;
 	} else {
 		eptp = vm->arch_vm.nworld_eptp;
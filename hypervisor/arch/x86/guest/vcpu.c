@@ -8,6 +8,9 @@
 #include <schedule.h>
 #include <vm0_boot.h>
 
+/* first halt polling window, doubled up to CONFIG_HALT_POLL_MAX_US */
+#define HALT_POLL_START_US	10U
+
 vm_sw_loader_t vm_sw_loader;
 
 inline uint64_t vcpu_get_gpreg(const struct acrn_vcpu *vcpu, uint32_t reg)
@@ -163,6 +166,125 @@ struct acrn_vcpu *get_ever_run_vcpu(uint16_t pcpu_id)
 	return per_cpu(ever_run_vcpu, pcpu_id);
 }
 
+/* FPU, XCR0, debug registers and syscall MSRs at their reset values */
+static void init_vcpu_ext_state(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vcpu_arch *arch = &vcpu->arch;
+
+	/* an all zero XSAVE header restores the init state of every
+	 * component, but FCW and MXCSR are loaded from the legacy area
+	 */
+	(void)memset(arch->xsave_area, 0U, sizeof(arch->xsave_area));
+	*(uint16_t *)&arch->xsave_area[0] = 0x37FU;
+	*(uint32_t *)&arch->xsave_area[24] = 0x1F80U;
+
+	arch->xcr0 = 1UL;
+	arch->msr_star = 0UL;
+	arch->msr_lstar = 0UL;
+	arch->msr_fmask = 0UL;
+	arch->msr_kernel_gs_base = 0UL;
+	(void)memset(arch->dr, 0U, sizeof(arch->dr));
+	arch->dr6 = 0xFFFF0FF0UL;
+}
+
+#define CPU_DR_READ(dr, result_ptr)				\
+	asm volatile ("mov %%" STRINGIFY(dr) ", %0"		\
+			: "=r"(*(result_ptr)))
+#define CPU_DR_WRITE(dr, value)					\
+	asm volatile ("mov %0, %%" STRINGIFY(dr)		\
+			: : "r"(value))
+
+/*
+ * The guest state which is neither in the VMCS nor switched on VM entry
+ * and exit stays in the pcpu when the vcpu is switched out, and is only
+ * saved once another vcpu is loaded on the pcpu.
+ */
+static void save_vcpu_ext_state(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vcpu_arch *arch = &vcpu->arch;
+
+	if (cpu_has_cap(X86_FEATURE_OSXSAVE)) {
+		/* every component enabled in the guest XCR0 */
+		asm volatile ("xsave64 (%0)"
+				: : "r"(arch->xsave_area), "a"(~0U), "d"(~0U)
+				: "memory");
+	} else {
+		asm volatile ("fxsave64 (%0)"
+				: : "r"(arch->xsave_area) : "memory");
+	}
+
+	arch->msr_star = msr_read(MSR_IA32_STAR);
+	arch->msr_lstar = msr_read(MSR_IA32_LSTAR);
+	arch->msr_fmask = msr_read(MSR_IA32_FMASK);
+	arch->msr_kernel_gs_base = msr_read(MSR_IA32_KERNEL_GS_BASE);
+
+	CPU_DR_READ(dr0, &arch->dr[0]);
+	CPU_DR_READ(dr1, &arch->dr[1]);
+	CPU_DR_READ(dr2, &arch->dr[2]);
+	CPU_DR_READ(dr3, &arch->dr[3]);
+	CPU_DR_READ(dr6, &arch->dr6);
+}
+
+static void restore_vcpu_ext_state(const struct acrn_vcpu *vcpu)
+{
+	const struct acrn_vcpu_arch *arch = &vcpu->arch;
+
+	if (cpu_has_cap(X86_FEATURE_OSXSAVE)) {
+		write_xcr(0, arch->xcr0);
+		asm volatile ("xrstor64 (%0)"
+				: : "r"(arch->xsave_area), "a"(~0U), "d"(~0U)
+				: "memory");
+	} else {
+		asm volatile ("fxrstor64 (%0)"
+				: : "r"(arch->xsave_area) : "memory");
+	}
+
+	msr_write(MSR_IA32_STAR, arch->msr_star);
+	msr_write(MSR_IA32_LSTAR, arch->msr_lstar);
+	msr_write(MSR_IA32_FMASK, arch->msr_fmask);
+	msr_write(MSR_IA32_KERNEL_GS_BASE, arch->msr_kernel_gs_base);
+
+	CPU_DR_WRITE(dr0, arch->dr[0]);
+	CPU_DR_WRITE(dr1, arch->dr[1]);
+	CPU_DR_WRITE(dr2, arch->dr[2]);
+	CPU_DR_WRITE(dr3, arch->dr[3]);
+	CPU_DR_WRITE(dr6, arch->dr6);
+}
+
+/*
+ * @pre vcpu != NULL && vcpu->pcpu_id == get_cpu_id()
+ * @pre the schedule lock of the pcpu is held
+ */
+void load_vcpu_context(struct acrn_vcpu *vcpu)
+{
+	uint16_t pcpu_id = vcpu->pcpu_id;
+	struct acrn_vcpu *last = get_ever_run_vcpu(pcpu_id);
+	uint64_t vmcs_pa;
+
+	if (last != vcpu) {
+		if ((last != NULL) && last->launched) {
+			save_vcpu_ext_state(last);
+		}
+		restore_vcpu_ext_state(vcpu);
+
+		/* the VMCS of a vcpu not launched yet is set up and loaded
+		 * by init_vmcs()
+		 */
+		if (vcpu->launched) {
+			vmcs_pa = hva2hpa(vcpu->arch.vmcs);
+			exec_vmptrld((void *)&vmcs_pa);
+		}
+
+		/* avoid VMCS recycling RSB usage */
+		if (ibrs_type == IBRS_RAW) {
+			msr_write(MSR_IA32_PRED_CMD, PRED_SET_IBPB);
+		}
+
+		per_cpu(ever_run_vcpu, pcpu_id) = vcpu;
+		per_cpu(vcpu, pcpu_id) = vcpu;
+	}
+}
+
 static void set_vcpu_mode(struct acrn_vcpu *vcpu, uint32_t cs_attr, uint64_t ia32_efer,
 		uint64_t cr0)
 {
@@ -337,7 +459,6 @@ int create_vcpu(uint16_t pcpu_id, struct acrn_vm *vm, struct acrn_vcpu **rtn_vcp
 	/* Initialize CPU ID for this VCPU */
 	vcpu->vcpu_id = vcpu_id;
 	vcpu->pcpu_id = pcpu_id;
-	per_cpu(ever_run_vcpu, pcpu_id) = vcpu;
 
 	/* Initialize the parent VM reference */
 	vcpu->vm = vm;
@@ -350,7 +471,11 @@ int create_vcpu(uint16_t pcpu_id, struct acrn_vm *vm, struct acrn_vcpu **rtn_vcp
 	 * needs revise.
 	 */
 
-	per_cpu(vcpu, pcpu_id) = vcpu;
+	/* the vcpus sharing a pcpu are loaded on it by the scheduler */
+	if (per_cpu(ever_run_vcpu, pcpu_id) == NULL) {
+		per_cpu(ever_run_vcpu, pcpu_id) = vcpu;
+		per_cpu(vcpu, pcpu_id) = vcpu;
+	}
 
 	pr_info("PCPU%d is working as VM%d VCPU%d, Role: %s",
 			vcpu->pcpu_id, vcpu->vm->vm_id, vcpu->vcpu_id,
@@ -363,6 +488,10 @@ int create_vcpu(uint16_t pcpu_id, struct acrn_vm *vm, struct acrn_vcpu **rtn_vcp
 
 	/* Initialize cur context */
 	vcpu->arch.cur_context = NORMAL_WORLD;
+	init_vcpu_ext_state(vcpu);
+
+	vcpu->sched_weight = vm->sched_weight;
+	vcpu->sched_cap = vm->sched_cap;
 
 	/* Create per vcpu vlapic */
 	vlapic_create(vcpu);
@@ -425,9 +554,10 @@ int run_vcpu(struct acrn_vcpu *vcpu)
 		vcpu->launched = true;
 
 		/* avoid VMCS recycling RSB usage, set IBPB.
-		 * NOTE: this should be done for any time vmcs got switch
-		 * currently, there is no other place to do vmcs switch
-		 * Please add IBPB set for future vmcs switch case(like trusty)
+		 * NOTE: this should be done for any time vmcs got switch,
+		 * load_vcpu_context() does it when the scheduler switches
+		 * vcpus. Please add IBPB set for future vmcs switch
+		 * case(like trusty)
 		 */
 		if (ibrs_type == IBRS_RAW)
 			msr_write(MSR_IA32_PRED_CMD, PRED_SET_IBPB);
@@ -502,9 +632,15 @@ int shutdown_vcpu(__unused struct acrn_vcpu *vcpu)
  */
 void offline_vcpu(struct acrn_vcpu *vcpu)
 {
+	uint16_t pcpu_id = vcpu->pcpu_id;
+
 	vlapic_free(vcpu);
-	per_cpu(ever_run_vcpu, vcpu->pcpu_id) = NULL;
-	free_pcpu(vcpu->pcpu_id);
+	get_schedule_lock(pcpu_id);
+	if (per_cpu(ever_run_vcpu, pcpu_id) == vcpu) {
+		per_cpu(ever_run_vcpu, pcpu_id) = NULL;
+	}
+	release_schedule_lock(pcpu_id);
+	free_pcpu(pcpu_id);
 	vcpu->state = VCPU_OFFLINE;
 }
 
@@ -528,6 +664,8 @@ void reset_vcpu(struct acrn_vcpu *vcpu)
 	vcpu->launched = false;
 	vcpu->paused_cnt = 0U;
 	vcpu->running = 0;
+	vcpu->ioreq_waiting = 0U;
+	vcpu->halted = 0U;
 	vcpu->arch.nr_sipi = 0;
 	vcpu->pending_pre_work = 0U;
 
@@ -542,6 +680,7 @@ void reset_vcpu(struct acrn_vcpu *vcpu)
 			sizeof(struct run_context));
 	}
 	vcpu->arch.cur_context = NORMAL_WORLD;
+	init_vcpu_ext_state(vcpu);
 
 	vlapic = vcpu_vlapic(vcpu);
 	vlapic_reset(vlapic);
@@ -582,6 +721,32 @@ void resume_vcpu(struct acrn_vcpu *vcpu)
 	get_schedule_lock(vcpu->pcpu_id);
 	vcpu->state = vcpu->prev_state;
 
+	/* a vcpu still waiting for its ioreq is put back by ioreq_wake_vcpu,
+	 * a halted one by wake_halted_vcpu
+	 */
+	if ((vcpu->state == VCPU_RUNNING) && (vcpu->ioreq_waiting == 0U) &&
+			(vcpu->halted == 0U)) {
+		add_vcpu_to_runqueue(vcpu);
+		make_reschedule_request(vcpu);
+	}
+	release_schedule_lock(vcpu->pcpu_id);
+}
+
+void ioreq_wait_vcpu(struct acrn_vcpu *vcpu)
+{
+	get_schedule_lock(vcpu->pcpu_id);
+	vcpu->ioreq_waiting = 1U;
+	remove_vcpu_from_runqueue(vcpu);
+	make_reschedule_request(vcpu);
+	release_schedule_lock(vcpu->pcpu_id);
+}
+
+void ioreq_wake_vcpu(struct acrn_vcpu *vcpu)
+{
+	get_schedule_lock(vcpu->pcpu_id);
+	vcpu->ioreq_waiting = 0U;
+
+	/* a paused vcpu is put back by resume_vcpu */
 	if (vcpu->state == VCPU_RUNNING) {
 		add_vcpu_to_runqueue(vcpu);
 		make_reschedule_request(vcpu);
@@ -589,6 +754,71 @@ void resume_vcpu(struct acrn_vcpu *vcpu)
 	release_schedule_lock(vcpu->pcpu_id);
 }
 
+void halt_vcpu(struct acrn_vcpu *vcpu)
+{
+	get_schedule_lock(vcpu->pcpu_id);
+	/* publish halted before the last check, wake_halted_vcpu() tests it
+	 * after making the event pending
+	 */
+	(void)atomic_swap32(&vcpu->halted, 1U);
+	if (vcpu_has_pending_wakeup(vcpu)) {
+		vcpu->halted = 0U;
+	} else {
+		vcpu->halt_tsc = rdtsc();
+		vcpu->idle_stats.sleeps++;
+		remove_vcpu_from_runqueue(vcpu);
+		make_reschedule_request(vcpu);
+	}
+	release_schedule_lock(vcpu->pcpu_id);
+}
+
+/*
+ * Grow the polling window if polling a bit longer would have caught the
+ * wakeup, shrink it after a sleep longer than the longest window.
+ */
+static void update_halt_poll(struct acrn_vcpu *vcpu, uint64_t slept)
+{
+	uint64_t max = us_to_ticks(CONFIG_HALT_POLL_MAX_US);
+	uint64_t window = vcpu->halt_poll_cycles;
+
+	if (slept > max) {
+		window >>= 1U;
+		if (window < us_to_ticks(HALT_POLL_START_US)) {
+			window = 0UL;
+		}
+	} else if ((window + slept) <= max) {
+		window = (window == 0UL) ?
+			us_to_ticks(HALT_POLL_START_US) : (window << 1U);
+		if (window > max) {
+			window = max;
+		}
+	} else {
+		/* keep it */
+	}
+
+	vcpu->halt_poll_cycles = window;
+}
+
+void wake_halted_vcpu(struct acrn_vcpu *vcpu)
+{
+	if (atomic_load32(&vcpu->halted) == 0U) {
+		return;
+	}
+
+	get_schedule_lock(vcpu->pcpu_id);
+	if (vcpu->halted != 0U) {
+		vcpu->halted = 0U;
+		update_halt_poll(vcpu, rdtsc() - vcpu->halt_tsc);
+
+		/* a paused vcpu is put back by resume_vcpu */
+		if (vcpu->state == VCPU_RUNNING) {
+			add_vcpu_to_runqueue(vcpu);
+			make_reschedule_request(vcpu);
+		}
+	}
+	release_schedule_lock(vcpu->pcpu_id);
+}
+
 void schedule_vcpu(struct acrn_vcpu *vcpu)
 {
 	vcpu->state = VCPU_RUNNING;
@@ -615,8 +845,6 @@ int prepare_vcpu(struct acrn_vm *vm, uint16_t pcpu_id)
 	/* initialize the vcpu tsc aux */
 	vcpu->msr_tsc_aux_guest = vcpu->vcpu_id;
 
-	set_pcpu_used(pcpu_id);
-
 	INIT_LIST_HEAD(&vcpu->run_list);
 
 	return ret;
@@ -629,8 +857,7 @@ void request_vcpu_pre_work(struct acrn_vcpu *vcpu, uint16_t pre_work_id)
 
 #ifdef HV_DEBUG
 #define DUMPREG_SP_SIZE	32
-/* the input 'data' must != NULL and indicate a vcpu structure pointer */
-void vcpu_dumpreg(void *data)
+static void dump_vcpu_reg(void *data)
 {
 	int status;
 	uint64_t i, fault_addr, tmp[DUMPREG_SP_SIZE];
@@ -713,6 +940,28 @@ void vcpu_dumpreg(void *data)
 overflow:
 	printf("buffer size could not be enough! please check!\n");
 }
+
+/* the input 'data' must != NULL and indicate a vcpu structure pointer */
+void vcpu_dumpreg(void *data)
+{
+	struct vcpu_dump *dump = data;
+	struct acrn_vcpu *vcpu = dump->vcpu;
+	struct acrn_vcpu *loaded = get_ever_run_vcpu(vcpu->pcpu_id);
+	uint64_t vmcs_pa;
+
+	/* another vcpu sharing the pcpu may own the current VMCS */
+	if ((loaded != vcpu) && vcpu->launched) {
+		vmcs_pa = hva2hpa(vcpu->arch.vmcs);
+		exec_vmptrld((void *)&vmcs_pa);
+		dump_vcpu_reg(data);
+		if ((loaded != NULL) && loaded->launched) {
+			vmcs_pa = hva2hpa(loaded->arch.vmcs);
+			exec_vmptrld((void *)&vmcs_pa);
+		}
+	} else {
+		dump_vcpu_reg(data);
+	}
+}
 #else
 void vcpu_dumpreg(__unused void *data)
 {
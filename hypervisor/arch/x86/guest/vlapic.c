@@ -499,6 +499,7 @@ vlapic_set_intr_ready(struct acrn_vlapic *vlapic, uint32_t vector, bool level)
 			 */
 			bitmap_set_lock(ACRN_REQUEST_EVENT,
 				&vlapic->vcpu->arch.pending_req);
+			wake_halted_vcpu(vlapic->vcpu);
 			vlapic_post_intr(vlapic->vcpu->pcpu_id);
 			return 0;
 		}
@@ -1352,6 +1353,24 @@ vlapic_pending_intr(const struct acrn_vlapic *vlapic, uint32_t *vecptr)
 	return 0;
 }
 
+bool vlapic_has_pending_intr(struct acrn_vcpu *vcpu)
+{
+	const struct acrn_vlapic *vlapic = vcpu_vlapic(vcpu);
+	uint32_t rvi, ppr;
+	bool pending;
+
+	if (is_apicv_intr_delivery_supported()) {
+		/* the processor keeps the vPPR in the virtual-APIC page */
+		rvi = (uint32_t)exec_vmread16(VMX_GUEST_INTR_STATUS) & 0xF0U;
+		ppr = vlapic->apic_page.ppr.v & 0xF0U;
+		pending = (rvi > ppr) || (apicv_pending_intr(vlapic) != 0);
+	} else {
+		pending = (vlapic_pending_intr(vlapic, NULL) != 0);
+	}
+
+	return pending;
+}
+
 /**
  * @brief Accept virtual interrupt.
  *
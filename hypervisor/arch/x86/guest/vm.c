@@ -83,6 +83,11 @@ int create_vm(struct vm_description *vm_desc, struct acrn_vm **rtn_vm)
 	vm->hw.created_vcpus = 0U;
 	vm->emul_mmio_regions = 0U;
 
+	vm->dedicated_pcpu = vm_desc->dedicated_pcpu;
+	vm->sched_weight = (vm_desc->sched_weight != 0U) ?
+		vm_desc->sched_weight : SCHED_DEFAULT_WEIGHT;
+	vm->sched_cap = vm_desc->sched_cap;
+
 	/* gpa_lowtop are used for system start up */
 	vm->hw.gpa_lowtop = 0UL;
 
@@ -349,11 +354,15 @@ int prepare_vm(uint16_t pcpu_id)
 
 		mptable_build(vm);
 
+		/* pcpus are partitioned among the VMs, never shared */
+		set_pcpu_used(vm_desc->vm_pcpu_ids[0], true);
 		prepare_vcpu(vm, vm_desc->vm_pcpu_ids[0]);
 
 		/* Prepare the AP for vm */
-		for (i = 1U; i < vm_desc->vm_hw_num_cores; i++)
+		for (i = 1U; i < vm_desc->vm_hw_num_cores; i++) {
+			set_pcpu_used(vm_desc->vm_pcpu_ids[i], true);
 			prepare_vcpu(vm, vm_desc->vm_pcpu_ids[i]);
+		}
 
 		if (vm_sw_loader == NULL) {
 			vm_sw_loader = general_sw_loader;
@@ -382,14 +391,18 @@ int prepare_vm0(void)
 
 	(void)memset((void *)&vm0_desc, 0U, sizeof(vm0_desc));
 	vm0_desc.vm_hw_num_cores = phys_cpu_num;
+	vm0_desc.dedicated_pcpu = true;
 
 	err = create_vm(&vm0_desc, &vm);
 	if (err != 0) {
 		return err;
 	}
 
-	/* Allocate all cpus to vm0 at the beginning */
+	/* Allocate all cpus to vm0 at the beginning, the SOS keeps them
+	 * for itself till it offlines them for the UOSes
+	 */
 	for (i = 0U; i < vm0_desc.vm_hw_num_cores; i++) {
+		set_pcpu_used(i, true);
 		err = prepare_vcpu(vm, i);
 		if (err != 0) {
 			return err;
@@ -116,6 +116,58 @@ void dm_emulate_mmio_post(struct acrn_vcpu *vcpu)
 	emulate_mmio_post(vcpu, io_req);
 }
 
+/**
+ * @brief Post-work of a VHM request completed asynchronously
+ *
+ * @remark This function must be called on the physical CPU of \p vcpu, after
+ * the VHM request corresponding to \p vcpu being transferred to the COMPLETE
+ * state.
+ */
+void dm_emulate_io_post(struct acrn_vcpu *vcpu)
+{
+	union vhm_request_buffer *req_buf;
+	struct vhm_request *vhm_req;
+
+	switch (vcpu->req.type) {
+	case REQ_MMIO:
+		dm_emulate_mmio_post(vcpu);
+		break;
+
+	case REQ_PORTIO:
+	case REQ_PCICFG:
+		/* see emulate_io_post() for REQ_PCICFG */
+		dm_emulate_pio_post(vcpu);
+		break;
+
+	default:
+		req_buf = (union vhm_request_buffer *)vcpu->vm->sw.io_shared_page;
+		vhm_req = &req_buf->req_queue[vcpu->vcpu_id];
+		complete_ioreq(vhm_req);
+		break;
+	}
+}
+
+static void ioreq_record_latency(struct acrn_vcpu *vcpu)
+{
+	struct ioreq_latency_stats *stats = &vcpu->ioreq_stats;
+	uint64_t us = ticks_to_us(rdtsc() - vcpu->ioreq_start_tsc);
+	uint32_t bucket = 0U;
+
+	if (us != 0UL) {
+		bucket = (uint32_t)fls64(us) + 1U;
+		if (bucket >= IOREQ_LAT_BUCKETS) {
+			bucket = IOREQ_LAT_BUCKETS - 1U;
+		}
+	}
+
+	stats->buckets[bucket]++;
+	stats->count++;
+	stats->total_us += us;
+	if (us > stats->max_us) {
+		stats->max_us = us;
+	}
+}
+
 #ifdef CONFIG_PARTITION_MODE
 static void io_instr_dest_handler(struct io_request *io_req)
 {
@@ -154,6 +206,22 @@ void emulate_io_post(struct acrn_vcpu *vcpu)
 		return;
 	}
 
+#ifdef CONFIG_IOREQ_ASYNC_COMPLETION
+	/*
+	 * Leave the post-work to the physical CPU of the vcpu, which may be
+	 * running another vcpu meanwhile. A repeated notification finds the
+	 * pre-work already requested.
+	 */
+	if (bitmap_test_and_set_lock(ACRN_VCPU_IOREQ_COMPLETE,
+			&vcpu->pending_pre_work)) {
+		return;
+	}
+
+	ioreq_record_latency(vcpu);
+	ioreq_wake_vcpu(vcpu);
+#else
+	ioreq_record_latency(vcpu);
+
 	switch (vcpu->req.type) {
 	case REQ_MMIO:
 		request_vcpu_pre_work(vcpu, ACRN_VCPU_MMIO_COMPLETE);
@@ -178,6 +246,7 @@ void emulate_io_post(struct acrn_vcpu *vcpu)
 	}
 
 	resume_vcpu(vcpu);
+#endif
 }
 
 /**
@@ -230,10 +299,43 @@ hv_emulate_pio(const struct acrn_vcpu *vcpu, struct io_request *io_req)
 	return status;
 }
 
+static inline bool mmio_node_contains(const struct mem_io_node *mmio_node,
+		uint64_t address, uint64_t size)
+{
+	return ((address >= mmio_node->range_start) &&
+		((address + size) <= mmio_node->range_end));
+}
+
+/*
+ * Return the number of MMIO handlers of \p vm whose range starts below \p end.
+ *
+ * vm->emul_mmio[] is sorted by range_start and the ranges do not overlap, see
+ * register_mmio_emulation_handler().
+ */
+static uint16_t mmio_nodes_below(const struct acrn_vm *vm, uint64_t end)
+{
+	uint16_t lo = 0U, hi = vm->emul_mmio_regions, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1U);
+		if (vm->emul_mmio[mid].range_start < end) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
 /**
  * Use registered MMIO handlers on the given request if it falls in the range of
  * any of them.
  *
+ * The handler hit last by \p vcpu is tried first, then the sorted handler
+ * array is binary searched for the only handler that can overlap the access:
+ * the last one starting below its end.
+ *
  * @pre io_req->type == REQ_MMIO
  *
  * @return 0       - Successfully emulated by registered handlers.
@@ -246,31 +348,39 @@ hv_emulate_mmio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 	int status = -ENODEV;
 	uint16_t idx;
 	uint64_t address, size;
+	struct acrn_vm *vm = vcpu->vm;
 	struct mmio_request *mmio_req = &io_req->reqs.mmio;
 	struct mem_io_node *mmio_handler = NULL;
 
 	address = mmio_req->address;
 	size = mmio_req->size;
 
-	for (idx = 0U; idx < vcpu->vm->emul_mmio_regions; idx++) {
-		uint64_t base, end;
-
-		mmio_handler = &(vcpu->vm->emul_mmio[idx]);
-		base = mmio_handler->range_start;
-		end = mmio_handler->range_end;
-
-		if ((address + size <= base) || (address >= end)) {
-			continue;
-		} else if (!((address >= base) && (address + size <= end))) {
-			pr_fatal("Err MMIO, address:0x%llx, size:%x", address, size);
-			return -EIO;
-		} else {
-			/* Handle this MMIO operation */
-			if (mmio_handler->read_write) {
-				status = mmio_handler->read_write(io_req, mmio_handler->handler_private_data);
-				break;
+	idx = vcpu->mmio_last_hit;
+	if ((idx >= vm->emul_mmio_regions) ||
+		!mmio_node_contains(&(vm->emul_mmio[idx]), address, size)) {
+		idx = mmio_nodes_below(vm, address + size);
+		if (idx > 0U) {
+			idx--;
+			mmio_handler = &(vm->emul_mmio[idx]);
+			if (address >= mmio_handler->range_end) {
+				mmio_handler = NULL;
 			}
 		}
+	} else {
+		mmio_handler = &(vm->emul_mmio[idx]);
+	}
+
+	if (mmio_handler == NULL) {
+		/* no handler overlaps the access */
+	} else if (!mmio_node_contains(mmio_handler, address, size)) {
+		pr_fatal("Err MMIO, address:0x%llx, size:%x", address, size);
+		status = -EIO;
+	} else {
+		/* Handle this MMIO operation */
+		if (mmio_handler->read_write) {
+			vcpu->mmio_last_hit = idx;
+			status = mmio_handler->read_write(io_req, mmio_handler->handler_private_data);
+		}
 	}
 
 	return status;
@@ -475,7 +585,8 @@ void register_io_emulation_handler(struct acrn_vm *vm, uint32_t pio_idx,
  * @param handler_private_data Handler-specific data which will be passed to \p read_write when called
  *
  * @return 0 - Registration succeeds
- * @return -EINVAL - \p read_write is NULL, \p end is not larger than \p start or \p vm has been launched
+ * @return -EINVAL - \p read_write is NULL, \p end is not larger than \p start, \p vm has been launched,
+ *                   or the range overlaps the one of a registered handler
  */
 int register_mmio_emulation_handler(struct acrn_vm *vm,
 	hv_mem_io_handler_t read_write, uint64_t start,
@@ -483,6 +594,7 @@ int register_mmio_emulation_handler(struct acrn_vm *vm,
 {
 	int status = -EINVAL;
 	struct mem_io_node *mmio_node;
+	uint16_t i, idx;
 
 	if ((vm->hw.created_vcpus > 0U) && vm->hw.vcpu_array[0].launched) {
 		ASSERT(false, "register mmio handler after vm launched");
@@ -496,7 +608,22 @@ int register_mmio_emulation_handler(struct acrn_vm *vm,
 			pr_err("the emulated mmio region is out of range");
 			return status;
 		}
-		mmio_node = &(vm->emul_mmio[vm->emul_mmio_regions]);
+
+		/*
+		 * Keep emul_mmio[] sorted by range_start and free of overlaps
+		 * for the binary search in hv_emulate_mmio().
+		 */
+		idx = mmio_nodes_below(vm, end);
+		if ((idx > 0U) && (vm->emul_mmio[idx - 1U].range_end > start)) {
+			pr_err("mmio region [0x%llx, 0x%llx) overlaps [0x%llx, 0x%llx)",
+				start, end, vm->emul_mmio[idx - 1U].range_start,
+				vm->emul_mmio[idx - 1U].range_end);
+			return status;
+		}
+		for (i = vm->emul_mmio_regions; i > idx; i--) {
+			vm->emul_mmio[i] = vm->emul_mmio[i - 1U];
+		}
+		mmio_node = &(vm->emul_mmio[idx]);
 		/* Fill in information for this node */
 		mmio_node->read_write = read_write;
 		mmio_node->handler_private_data = handler_private_data;
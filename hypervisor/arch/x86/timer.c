@@ -29,44 +29,148 @@ static void tsc_deadline_handler(__unused uint32_t irq, __unused void *data)
 	fire_softirq(SOFTIRQ_TIMER);
 }
 
-static inline void update_physical_timer(struct per_cpu_timers *cpu_timer)
+#define TIMER_WHEEL_RANGE	(1UL << (TIMER_WHEEL_LVL_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_WHEEL_NONE	(~0UL)
+
+/*
+ * Put a timer into the slot its deadline falls into. A timer with a passed
+ * deadline goes to the current slot, one beyond the top level is parked in
+ * the farthest slot and added again when that slot cascades.
+ */
+static void local_add_timer(struct per_cpu_timers *cpu_timer,
+			struct hv_timer *timer)
 {
-	struct hv_timer *timer = NULL;
+	uint64_t expires = timer->fire_tsc >> TIMER_WHEEL_SHIFT;
+	uint64_t delta;
+	uint32_t level = 0U;
+	uint16_t idx;
 
-	/* find the next event timer */
-	if (!list_empty(&cpu_timer->timer_list)) {
-		timer = list_entry((&cpu_timer->timer_list)->next,
-			struct hv_timer, node);
+	if (expires < cpu_timer->clk) {
+		expires = cpu_timer->clk;
+	}
 
-		/* it is okay to program a expired time */
-		msr_write(MSR_IA32_TSC_DEADLINE, timer->fire_tsc);
+	delta = expires - cpu_timer->clk;
+	if (delta >= TIMER_WHEEL_RANGE) {
+		expires = cpu_timer->clk + TIMER_WHEEL_RANGE - 1UL;
+		delta = TIMER_WHEEL_RANGE - 1UL;
 	}
+
+	while ((delta >> (TIMER_WHEEL_LVL_BITS * (level + 1U))) != 0UL) {
+		level++;
+	}
+
+	idx = (uint16_t)((expires >> (TIMER_WHEEL_LVL_BITS * level)) &
+			TIMER_WHEEL_SLOT_MASK);
+	list_add_tail(&timer->node, &cpu_timer->wheel[level][idx]);
+	bitmap_set_nolock(idx, &cpu_timer->pending[level]);
 }
 
-static void local_add_timer(struct per_cpu_timers *cpu_timer,
-			struct hv_timer *timer,
-			bool *need_update)
+/*
+ * Return the wheel time at which the first non-empty slot of a level is
+ * processed and store its index to idx, or return TIMER_WHEEL_NONE. A slot
+ * of level n is processed when the wheel time enters its span, that is at
+ * the first multiple of 2^(n * TIMER_WHEEL_LVL_BITS) not before clk.
+ */
+static uint64_t wheel_level_next(struct per_cpu_timers *cpu_timer,
+			uint32_t level, uint16_t *idx)
 {
-	struct list_head *pos, *prev;
-	struct hv_timer *tmp;
-	uint64_t tsc = timer->fire_tsc;
-
-	prev = &cpu_timer->timer_list;
-	list_for_each(pos, &cpu_timer->timer_list) {
-		tmp = list_entry(pos, struct hv_timer, node);
-		if (tmp->fire_tsc < tsc) {
-			prev = &tmp->node;
-		}
-		else {
+	uint32_t shift = TIMER_WHEEL_LVL_BITS * level;
+	uint64_t base = (cpu_timer->clk + (1UL << shift) - 1UL) >> shift;
+	uint32_t start = (uint32_t)base & TIMER_WHEEL_SLOT_MASK;
+	uint64_t pending, next = TIMER_WHEEL_NONE;
+	uint16_t off;
+
+	while (cpu_timer->pending[level] != 0UL) {
+		/* rotate the slot at base to bit 0 */
+		pending = cpu_timer->pending[level];
+		pending = (pending >> start) |
+			(pending << ((TIMER_WHEEL_SLOTS - start) & TIMER_WHEEL_SLOT_MASK));
+		off = ffs64(pending);
+		*idx = (uint16_t)((start + off) & TIMER_WHEEL_SLOT_MASK);
+
+		if (list_empty(&cpu_timer->wheel[level][*idx])) {
+			/* emptied by del_timer() */
+			bitmap_clear_nolock(*idx, &cpu_timer->pending[level]);
+		} else {
+			next = (base + off) << shift;
 			break;
 		}
 	}
 
-	list_add(&timer->node, prev);
+	return next;
+}
 
-	if (need_update != NULL) {
-		/* update the physical timer if we're on the timer_list head */
-		*need_update = (prev == &cpu_timer->timer_list);
+/*
+ * Return the wheel time of the first slot to process, and store the one of
+ * each level to level_next[] and its slot to level_idx[].
+ */
+static uint64_t wheel_next(struct per_cpu_timers *cpu_timer,
+			uint64_t *level_next, uint16_t *level_idx)
+{
+	uint64_t next = TIMER_WHEEL_NONE;
+	uint32_t level;
+
+	for (level = 0U; level < TIMER_WHEEL_LEVELS; level++) {
+		level_next[level] = wheel_level_next(cpu_timer, level,
+					&level_idx[level]);
+		if (level_next[level] < next) {
+			next = level_next[level];
+		}
+	}
+
+	return next;
+}
+
+/*
+ * The earliest deadline of each level is in its first non-empty slot, as
+ * every later slot of the level only holds later deadlines.
+ */
+static uint64_t wheel_earliest_deadline(struct per_cpu_timers *cpu_timer)
+{
+	uint64_t deadline = TIMER_WHEEL_NONE;
+	struct list_head *pos;
+	struct hv_timer *timer;
+	uint32_t level;
+	uint16_t idx;
+
+	for (level = 0U; level < TIMER_WHEEL_LEVELS; level++) {
+		if (wheel_level_next(cpu_timer, level, &idx) != TIMER_WHEEL_NONE) {
+			list_for_each(pos, &cpu_timer->wheel[level][idx]) {
+				timer = list_entry(pos, struct hv_timer, node);
+				if (timer->fire_tsc < deadline) {
+					deadline = timer->fire_tsc;
+				}
+			}
+		}
+	}
+
+	return deadline;
+}
+
+static void wheel_cascade(struct per_cpu_timers *cpu_timer,
+			uint32_t level, uint16_t idx)
+{
+	struct list_head *pos, *n;
+	struct hv_timer *timer;
+
+	bitmap_clear_nolock(idx, &cpu_timer->pending[level]);
+	list_for_each_safe(pos, n, &cpu_timer->wheel[level][idx]) {
+		timer = list_entry(pos, struct hv_timer, node);
+		list_del_init(&timer->node);
+		local_add_timer(cpu_timer, timer);
+	}
+}
+
+static inline void update_physical_timer(struct per_cpu_timers *cpu_timer)
+{
+	uint64_t deadline = wheel_earliest_deadline(cpu_timer);
+
+	/* program the next event timer only if it changes,
+	 * it is okay to program a expired time
+	 */
+	if ((deadline != TIMER_WHEEL_NONE) && (deadline != cpu_timer->deadline)) {
+		cpu_timer->deadline = deadline;
+		msr_write(MSR_IA32_TSC_DEADLINE, deadline);
 	}
 }
 
@@ -74,7 +178,8 @@ int add_timer(struct hv_timer *timer)
 {
 	struct per_cpu_timers *cpu_timer;
 	uint16_t pcpu_id;
-	bool need_update;
+	uint32_t level;
+	bool idle = true;
 
 	if ((timer == NULL) || (timer->func == NULL) || (timer->fire_tsc == 0UL)) {
 		return -EINVAL;
@@ -90,10 +195,29 @@ int add_timer(struct hv_timer *timer)
 
 	pcpu_id  = get_cpu_id();
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
-	local_add_timer(cpu_timer, timer, &need_update);
 
-	if (need_update) {
+	/* an empty wheel can skip the time it has been idle */
+	for (level = 0U; level < TIMER_WHEEL_LEVELS; level++) {
+		if (cpu_timer->pending[level] != 0UL) {
+			idle = false;
+		}
+	}
+	if (idle) {
+		cpu_timer->clk = max(cpu_timer->clk, rdtsc() >> TIMER_WHEEL_SHIFT);
+	}
+
+	local_add_timer(cpu_timer, timer);
+
+	/* update the physical timer if the earliest deadline changes */
+	if (cpu_timer->deadline_stale) {
+		cpu_timer->deadline_stale = false;
 		update_physical_timer(cpu_timer);
+	} else if ((cpu_timer->deadline == 0UL) ||
+			(timer->fire_tsc < cpu_timer->deadline)) {
+		cpu_timer->deadline = timer->fire_tsc;
+		msr_write(MSR_IA32_TSC_DEADLINE, timer->fire_tsc);
+	} else {
+		/* the programmed deadline is still the earliest */
 	}
 
 	TRACE_2L(TRACE_TIMER_ACTION_ADDED, timer->fire_tsc, 0UL);
@@ -103,17 +227,36 @@ int add_timer(struct hv_timer *timer)
 
 void del_timer(struct hv_timer *timer)
 {
+	struct per_cpu_timers *cpu_timer;
+
 	if ((timer != NULL) && !list_empty(&timer->node)) {
 		list_del_init(&timer->node);
+
+		/* let the next add_timer() find the new earliest deadline,
+		 * otherwise the old one just fires for nothing
+		 */
+		cpu_timer = &per_cpu(cpu_timers, get_cpu_id());
+		if (timer->fire_tsc == cpu_timer->deadline) {
+			cpu_timer->deadline_stale = true;
+		}
 	}
 }
 
 static void init_percpu_timer(uint16_t pcpu_id)
 {
 	struct per_cpu_timers *cpu_timer;
+	uint32_t level, idx;
 
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
-	INIT_LIST_HEAD(&cpu_timer->timer_list);
+	for (level = 0U; level < TIMER_WHEEL_LEVELS; level++) {
+		for (idx = 0U; idx < TIMER_WHEEL_SLOTS; idx++) {
+			INIT_LIST_HEAD(&cpu_timer->wheel[level][idx]);
+		}
+		cpu_timer->pending[level] = 0UL;
+	}
+	cpu_timer->clk = rdtsc() >> TIMER_WHEEL_SHIFT;
+	cpu_timer->deadline = 0UL;
+	cpu_timer->deadline_stale = false;
 }
 
 static void init_tsc_deadline_timer(void)
@@ -129,40 +272,87 @@ static void init_tsc_deadline_timer(void)
 	msr_write(MSR_IA32_TSC_DEADLINE, 0UL);
 }
 
+/*
+ * Run the passed timers of the current level 0 slot, return true if some
+ * are left, either not passed yet or beyond the tries.
+ */
+static bool run_wheel_slot(struct per_cpu_timers *cpu_timer,
+			uint64_t current_tsc, int *tries)
+{
+	struct list_head *slot, *pos, *n;
+	struct hv_timer *timer;
+
+	slot = &cpu_timer->wheel[0][cpu_timer->clk & TIMER_WHEEL_SLOT_MASK];
+	list_for_each_safe(pos, n, slot) {
+		timer = list_entry(pos, struct hv_timer, node);
+		/* timer expried */
+		if ((timer->fire_tsc <= current_tsc) && (*tries > 0)) {
+			(*tries)--;
+			del_timer(timer);
+
+			run_timer(timer);
+
+			if (timer->mode == TICK_MODE_PERIODIC) {
+				/* update periodic timer fire tsc */
+				timer->fire_tsc += timer->period_in_cycle;
+				local_add_timer(cpu_timer, timer);
+			}
+		}
+	}
+
+	return !list_empty(slot);
+}
+
 static void timer_softirq(uint16_t pcpu_id)
 {
 	struct per_cpu_timers *cpu_timer;
-	struct hv_timer *timer;
-	struct list_head *pos, *n;
 	int tries = MAX_TIMER_ACTIONS;
 	uint64_t current_tsc = rdtsc();
+	uint64_t now = current_tsc >> TIMER_WHEEL_SHIFT;
+	uint64_t next, level_next[TIMER_WHEEL_LEVELS];
+	uint16_t level_idx[TIMER_WHEEL_LEVELS];
+	uint32_t level;
 
 	/* handle passed timer */
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
 
+	/* the programmed deadline is consumed once passed */
+	if (cpu_timer->deadline <= current_tsc) {
+		cpu_timer->deadline = 0UL;
+	}
+	cpu_timer->deadline_stale = false;
+
 	/* This is to make sure we are not blocked due to delay inside func()
 	 * force to exit irq handler after we serviced >31 timers
 	 * caller used to local_add_timer() for periodic timer, if there is a delay
 	 * inside func(), it will infinitely loop here, because new added timer
 	 * already passed due to previously func()'s delay.
+	 *
+	 * The wheel time jumps from one non-empty slot to the next, so an
+	 * idle period costs nothing.
 	 */
-	list_for_each_safe(pos, n, &cpu_timer->timer_list) {
-		timer = list_entry(pos, struct hv_timer, node);
-		/* timer expried */
-		tries--;
-		if ((timer->fire_tsc <= current_tsc) && (tries > 0)) {
-			del_timer(timer);
-
-			run_timer(timer);
+	while (tries > 0) {
+		next = wheel_next(cpu_timer, level_next, level_idx);
+		if (next > now) {
+			/* no slot before now is in use */
+			cpu_timer->clk = now;
+			break;
+		}
 
-			if (timer->mode == TICK_MODE_PERIODIC) {
-				/* update periodic timer fire tsc */
-				timer->fire_tsc += timer->period_in_cycle;
-				local_add_timer(cpu_timer, timer, NULL);
+		/* a cascade only adds to the levels below, so the slots
+		 * found by wheel_next() still hold for the levels above
+		 */
+		cpu_timer->clk = next;
+		for (level = 1U; level < TIMER_WHEEL_LEVELS; level++) {
+			if (level_next[level] == next) {
+				wheel_cascade(cpu_timer, level, level_idx[level]);
 			}
-		} else {
+		}
+
+		if (run_wheel_slot(cpu_timer, current_tsc, &tries)) {
 			break;
 		}
+		cpu_timer->clk = next + 1UL;
 	}
 
 	/* update nearest timer */
@@ -91,17 +91,46 @@ static bool vcpu_pending_request(struct acrn_vcpu *vcpu)
 	return vcpu->arch.pending_req != 0UL;
 }
 
+/*
+ * Whether a halted vcpu has to resume: on an NMI or exception, or if it
+ * takes interrupts, on an external or a vlapic interrupt.
+ */
+bool vcpu_has_pending_wakeup(struct acrn_vcpu *vcpu)
+{
+	uint64_t pending_req = vcpu->arch.pending_req;
+	bool wakeup;
+
+	wakeup = ((pending_req & ((1UL << ACRN_REQUEST_EXCP) |
+			(1UL << ACRN_REQUEST_NMI) |
+			(1UL << ACRN_REQUEST_TRP_FAULT))) != 0UL);
+
+	if (!wakeup &&
+		((vcpu_get_rflags(vcpu) & HV_ARCH_VCPU_RFLAGS_IF) != 0UL)) {
+		wakeup = ((pending_req & ((1UL << ACRN_REQUEST_EVENT) |
+				(1UL << ACRN_REQUEST_EXTINT))) != 0UL) ||
+			vlapic_has_pending_intr(vcpu);
+	}
+
+	return wakeup;
+}
+
 void vcpu_make_request(struct acrn_vcpu *vcpu, uint16_t eventid)
 {
 	bitmap_set_lock(eventid, &vcpu->arch.pending_req);
+
+	if ((eventid != ACRN_REQUEST_TMR_UPDATE) &&
+			(eventid != ACRN_REQUEST_EPT_FLUSH) &&
+			(eventid != ACRN_REQUEST_VPID_FLUSH)) {
+		wake_halted_vcpu(vcpu);
+	}
+
 	/*
 	 * if current hostcpu is not the target vcpu's hostcpu, we need
 	 * to invoke IPI to wake up target vcpu
 	 *
-	 * TODO: Here we just compare with cpuid, since cpuid currently is
-	 *  global under pCPU / vCPU 1:1 mapping. If later we enabled vcpu
-	 *  scheduling, we need change here to determine it target vcpu is
-	 *  VMX non-root or root mode
+	 * A target vcpu switched out by the scheduler handles the request
+	 * before its next VM entry, the IPI then just makes the vcpu sharing
+	 * its hostcpu exit for nothing.
 	 */
 	if (get_cpu_id() != vcpu->pcpu_id) {
 		send_single_ipi(vcpu->pcpu_id, VECTOR_NOTIFY_VCPU);
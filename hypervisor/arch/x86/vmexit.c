@@ -5,6 +5,8 @@
  */
 
 #include <hypervisor.h>
+#include <schedule.h>
+#include <softirq.h>
 
 /*
  * According to "SDM APPENDIX C VMX BASIC EXIT REASONS",
@@ -15,6 +17,8 @@
 static int unhandled_vmexit_handler(struct acrn_vcpu *vcpu);
 static int xsetbv_vmexit_handler(struct acrn_vcpu *vcpu);
 static int wbinvd_vmexit_handler(struct acrn_vcpu *vcpu);
+static int hlt_vmexit_handler(struct acrn_vcpu *vcpu);
+static int pause_vmexit_handler(struct acrn_vcpu *vcpu);
 
 /* VM Dispatch table for Exit condition handling */
 static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
@@ -43,7 +47,7 @@ static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
 	[VMX_EXIT_REASON_GETSEC] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_HLT] = {
-		.handler = unhandled_vmexit_handler},
+		.handler = hlt_vmexit_handler},
 	[VMX_EXIT_REASON_INVD] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_INVLPG] = {
@@ -98,7 +102,7 @@ static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
 	[VMX_EXIT_REASON_MONITOR] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_PAUSE] = {
-		.handler = unhandled_vmexit_handler},
+		.handler = pause_vmexit_handler},
 	[VMX_EXIT_REASON_ENTRY_FAILURE_MACHINE_CHECK] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_TPR_BELOW_THRESHOLD] = {
@@ -358,6 +362,7 @@ static int xsetbv_vmexit_handler(struct acrn_vcpu *vcpu)
 		return 0;
 	}
 
+	vcpu->arch.xcr0 = val64;
 	write_xcr(0, val64);
 	return 0;
 }
@@ -370,3 +375,66 @@ static int wbinvd_vmexit_handler(struct acrn_vcpu *vcpu)
 
 	return 0;
 }
+
+/*
+ * HLT exits only while the pcpu is shared. Before handing the pcpu over,
+ * poll for a wakeup as long as the adaptive window of the vcpu, since a
+ * wakeup soon after the HLT costs less than switching out and back. The
+ * window is adapted by wake_halted_vcpu() to how long the vcpu slept.
+ */
+static int hlt_vmexit_handler(struct acrn_vcpu *vcpu)
+{
+	uint64_t start, window = vcpu->halt_poll_cycles;
+	uint64_t guest_state;
+
+	vcpu->idle_stats.hlt_exits++;
+
+	/* the halt ends the STI blocking of the HLT following an STI */
+	guest_state = exec_vmread32(VMX_GUEST_INTERRUPTIBILITY_INFO);
+	if ((guest_state & HV_ARCH_VCPU_BLOCKED_BY_STI) != 0UL) {
+		exec_vmwrite32(VMX_GUEST_INTERRUPTIBILITY_INFO,
+			(uint32_t)(guest_state & ~HV_ARCH_VCPU_BLOCKED_BY_STI));
+	}
+
+	if (vcpu_has_pending_wakeup(vcpu)) {
+		return 0;
+	}
+
+	/* polling only pays off if the pcpu would idle */
+	if ((window != 0UL) && !is_runqueue_contended(vcpu->pcpu_id)) {
+		start = rdtsc();
+		while ((rdtsc() - start) < window) {
+			/* the vlapic timer and interrupt remapping */
+			do_softirq();
+			if (vcpu_has_pending_wakeup(vcpu)) {
+				vcpu->idle_stats.poll_hits++;
+				return 0;
+			}
+			if (is_runqueue_contended(vcpu->pcpu_id)) {
+				break;
+			}
+			pause_cpu();
+		}
+		vcpu->idle_stats.poll_misses++;
+	}
+
+	halt_vcpu(vcpu);
+
+	return 0;
+}
+
+/*
+ * PAUSE-loop exiting is on while the pcpu is shared, a long spin likely
+ * waits for a lock held by a vcpu of the VM which is switched out.
+ */
+static int pause_vmexit_handler(struct acrn_vcpu *vcpu)
+{
+	vcpu->idle_stats.pause_exits++;
+
+	if (is_runqueue_contended(vcpu->pcpu_id)) {
+		vcpu->idle_stats.yields++;
+		yield_vcpu(vcpu);
+	}
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include <hypervisor.h>
 #include <vm0_boot.h>
 #include <cpu.h>
+#include <schedule.h>
 #ifdef CONFIG_EFI_STUB
 extern struct efi_context* efi_ctx;
 #endif
@@ -19,6 +20,8 @@ extern struct efi_context* efi_ctx;
 #define DR7_INIT_VALUE			(0x400UL)
 #define LDTR_AR				(0x0082U) /* LDT, type must be 2, refer to SDM Vol3 26.3.1.2 */
 #define TR_AR				(0x008bU) /* TSS (busy), refer to SDM Vol3 26.3.1.2 */
+#define PLE_GAP_CYCLES			128U
+#define PLE_WINDOW_CYCLES		4096U
 
 static uint64_t cr0_host_mask;
 static uint64_t cr0_always_on_mask;
@@ -112,12 +115,25 @@ static inline void exec_vmxoff(void)
 
 void vmx_off(uint16_t pcpu_id)
 {
-
-	struct acrn_vcpu *vcpu = get_ever_run_vcpu(pcpu_id);
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
 	uint64_t vmcs_pa;
+	uint16_t vm_id, i;
 
-	vmcs_pa = hva2hpa(vcpu->arch.vmcs);
-	exec_vmclear((void *)&vmcs_pa);
+	/* the VMCS of every vcpu placed on the pcpu may be active on it */
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (vm == NULL) {
+			continue;
+		}
+
+		foreach_vcpu(i, vm, vcpu) {
+			if (vcpu->pcpu_id == pcpu_id) {
+				vmcs_pa = hva2hpa(vcpu->arch.vmcs);
+				exec_vmclear((void *)&vmcs_pa);
+			}
+		}
+	}
 
 	exec_vmxoff();
 }
@@ -861,6 +877,9 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 	exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS2, value32);
 	pr_dbg("VMX_PROC_VM_EXEC_CONTROLS2: 0x%x ", value32);
 
+	/* HLT and PAUSE-loop exiting are off till the pcpu is shared */
+	vcpu->arch.idle_exiting = false;
+
 	/*APIC-v, config APIC-access address*/
 	value64 = vlapic_apicv_get_apic_access_addr();
 	exec_vmwrite64(VMX_APIC_ACCESS_ADDR_FULL, value64);
@@ -1064,6 +1083,48 @@ void init_vmcs(struct acrn_vcpu *vcpu)
 	init_exit_ctrl();
 }
 
+/*
+ * A vcpu with a pcpu of its own halts or spins in non-root mode, avoiding
+ * the exits. Once the pcpu is shared, HLT lets the others run and a long
+ * PAUSE loop yields, see hlt_vmexit_handler() and pause_vmexit_handler().
+ *
+ * @pre vcpu is the current vcpu on this pcpu
+ */
+void update_idle_exiting(struct acrn_vcpu *vcpu)
+{
+	bool shared = is_pcpu_shared(vcpu->pcpu_id);
+	uint32_t value32, allowed;
+
+	if (shared == vcpu->arch.idle_exiting) {
+		return;
+	}
+
+	allowed = (uint32_t)(msr_read(MSR_IA32_VMX_PROCBASED_CTLS) >> 32U);
+	value32 = exec_vmread32(VMX_PROC_VM_EXEC_CONTROLS);
+	if (shared) {
+		value32 |= (VMX_PROCBASED_CTLS_HLT & allowed);
+	} else {
+		value32 &= ~VMX_PROCBASED_CTLS_HLT;
+	}
+	exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS, value32);
+
+	allowed = (uint32_t)(msr_read(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32U);
+	value32 = exec_vmread32(VMX_PROC_VM_EXEC_CONTROLS2);
+	if (shared && ((allowed & VMX_PROCBASED_CTLS2_PAUSE_LOOP) != 0U)) {
+		/* PAUSEs less than the gap apart form a loop, which exits
+		 * once it spins longer than the window
+		 */
+		exec_vmwrite32(VMX_PLE_GAP, PLE_GAP_CYCLES);
+		exec_vmwrite32(VMX_PLE_WINDOW, PLE_WINDOW_CYCLES);
+		value32 |= VMX_PROCBASED_CTLS2_PAUSE_LOOP;
+	} else {
+		value32 &= ~VMX_PROCBASED_CTLS2_PAUSE_LOOP;
+	}
+	exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS2, value32);
+
+	vcpu->arch.idle_exiting = shared;
+}
+
 #ifndef CONFIG_PARTITION_MODE
 void switch_apicv_mode_x2apic(struct acrn_vcpu *vcpu)
 {
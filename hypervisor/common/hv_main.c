@@ -15,6 +15,10 @@ static void run_vcpu_pre_work(struct acrn_vcpu *vcpu)
 	if (bitmap_test_and_clear_lock(ACRN_VCPU_MMIO_COMPLETE, pending_pre_work)) {
 		dm_emulate_mmio_post(vcpu);
 	}
+
+	if (bitmap_test_and_clear_lock(ACRN_VCPU_IOREQ_COMPLETE, pending_pre_work)) {
+		dm_emulate_io_post(vcpu);
+	}
 }
 
 void vcpu_thread(struct acrn_vcpu *vcpu)
@@ -58,6 +62,9 @@ void vcpu_thread(struct acrn_vcpu *vcpu)
 			continue;
 		}
 
+		/* HLT and PAUSE exits only while the pcpu is shared */
+		update_idle_exiting(vcpu);
+
 		TRACE_2L(TRACE_VM_ENTER, 0UL, 0UL);
 
 		profiling_vmenter_handler(vcpu);
@@ -112,9 +112,18 @@ int32_t hcall_create_vm(struct acrn_vm *vm, uint64_t param)
 		return -1;
 	}
 
+	if (cv.sched_cap > 100U) {
+		pr_err("%s: invalid cap %hu\n", __func__, cv.sched_cap);
+		return -1;
+	}
+
 	(void)memset(&vm_desc, 0U, sizeof(vm_desc));
 	vm_desc.sworld_supported =
 		((cv.vm_flag & (SECURE_WORLD_ENABLED)) != 0U);
+	vm_desc.dedicated_pcpu =
+		((cv.vm_flag & (DEDICATED_PCPU_ENABLED)) != 0U);
+	vm_desc.sched_weight = cv.sched_weight;
+	vm_desc.sched_cap = cv.sched_cap;
 	(void)memcpy_s(&vm_desc.GUID[0], 16U, &cv.GUID[0], 16U);
 	ret = create_vm(&vm_desc, &target_vm);
 
@@ -241,13 +250,16 @@ int32_t hcall_create_vcpu(struct acrn_vm *vm, uint16_t vmid, uint64_t param)
 		return -1;
 	}
 
-	pcpu_id = allocate_pcpu();
+	pcpu_id = allocate_pcpu(target_vm->dedicated_pcpu);
 	if (pcpu_id == INVALID_CPU_ID) {
 		pr_err("%s: No physical available\n", __func__);
 		return -1;
 	}
 
 	ret = prepare_vcpu(target_vm, pcpu_id);
+	if (ret != 0) {
+		free_pcpu(pcpu_id);
+	}
 
 	return ret;
 }
@@ -9,18 +9,22 @@
 
 uint32_t acrn_vhm_vector = VECTOR_VIRT_IRQ_VHM;
 
-static void fire_vhm_interrupt(void)
+static void fire_vhm_interrupt(const struct vhm_request *vhm_req)
 {
 	/*
-	 * use vLAPIC to inject vector to SOS vcpu 0 if vlapic is enabled
-	 * otherwise, send IPI hardcoded to BOOT_CPU_ID
+	 * use vLAPIC to inject vector to the SOS vcpu chosen by the slot,
+	 * which is the one the handling thread runs on, vcpu 0 by default
 	 */
 	struct acrn_vm *vm0;
 	struct acrn_vcpu *vcpu;
+	uint16_t vcpu_id = 0U;
 
 	vm0 = get_vm_from_vmid(0U);
 
-	vcpu = vcpu_from_vid(vm0, 0U);
+	if (vhm_req->notify_vcpu < vm0->hw.created_vcpus) {
+		vcpu_id = (uint16_t)vhm_req->notify_vcpu;
+	}
+	vcpu = vcpu_from_vid(vm0, vcpu_id);
 
 	vlapic_intr_edge(vcpu, acrn_vhm_vector);
 }
@@ -104,11 +108,19 @@ int32_t acrn_insert_request_wait(struct acrn_vcpu *vcpu, const struct io_request
 	(void)memcpy_s(&vhm_req->reqs, sizeof(union vhm_io_request),
 		&io_req->reqs, sizeof(union vhm_io_request));
 
+#ifdef CONFIG_IOREQ_ASYNC_COMPLETION
+	/* take vcpu off the runqueue so that the pcpu is free to run others
+	 * till VHM completes the request, see emulate_io_post()
+	 */
+	ioreq_wait_vcpu(vcpu);
+#else
 	/* pause vcpu, wait for VHM to handle the MMIO request.
 	 * TODO: when pause_vcpu changed to switch vcpu out directlly, we
 	 * should fix the race issue between req.valid = true and vcpu pause
 	 */
 	pause_vcpu(vcpu, VCPU_PAUSED);
+#endif
+	vcpu->ioreq_start_tsc = rdtsc();
 
 	/* Must clear the signal before we mark req as pending
 	 * Once we mark it pending, VHM may process req and signal us
@@ -121,7 +133,77 @@ int32_t acrn_insert_request_wait(struct acrn_vcpu *vcpu, const struct io_request
 	acrn_print_request(vcpu->vcpu_id, vhm_req);
 
 	/* signal VHM */
-	fire_vhm_interrupt();
+	fire_vhm_interrupt(vhm_req);
 
 	return 0;
 }
+
+#ifdef HV_DEBUG
+void get_ioreq_latency_info(char *str_arg, size_t str_max, uint16_t vmid)
+{
+	char *str = str_arg;
+	size_t len, size = str_max;
+	struct acrn_vm *vm = get_vm_from_vmid(vmid);
+	struct acrn_vcpu *vcpu;
+	struct ioreq_latency_stats sum;
+	uint16_t i;
+	uint32_t bucket;
+
+	if (vm == NULL) {
+		len = snprintf(str, size, "\r\nvm is not exist for vmid %hu", vmid);
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+		goto END;
+	}
+
+	(void)memset(&sum, 0U, sizeof(sum));
+	foreach_vcpu(i, vm, vcpu) {
+		sum.count += vcpu->ioreq_stats.count;
+		sum.total_us += vcpu->ioreq_stats.total_us;
+		if (vcpu->ioreq_stats.max_us > sum.max_us) {
+			sum.max_us = vcpu->ioreq_stats.max_us;
+		}
+		for (bucket = 0U; bucket < IOREQ_LAT_BUCKETS; bucket++) {
+			sum.buckets[bucket] += vcpu->ioreq_stats.buckets[bucket];
+		}
+	}
+
+	len = snprintf(str, size, "\r\nioreqs: %lu  avg: %luus  max: %luus"
+			"\r\nUS\t\tCOUNT",
+			sum.count,
+			(sum.count != 0UL) ? (sum.total_us / sum.count) : 0UL,
+			sum.max_us);
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (bucket = 0U; bucket < IOREQ_LAT_BUCKETS; bucket++) {
+		if (bucket == 0U) {
+			len = snprintf(str, size, "\r\n< 1\t\t%lu", sum.buckets[bucket]);
+		} else if (bucket == (IOREQ_LAT_BUCKETS - 1U)) {
+			len = snprintf(str, size, "\r\n>= %lu\t\t%lu",
+					1UL << (bucket - 1U), sum.buckets[bucket]);
+		} else {
+			len = snprintf(str, size, "\r\n%lu-%lu\t\t%lu",
+					1UL << (bucket - 1U), (1UL << bucket) - 1UL,
+					sum.buckets[bucket]);
+		}
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+	}
+END:
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+#endif /* HV_DEBUG */
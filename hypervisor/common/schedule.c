@@ -6,14 +6,96 @@
 
 #include <hypervisor.h>
 #include <schedule.h>
+#include <softirq.h>
 
-static unsigned long pcpu_used_bitmap;
+/*
+ * The credit scheduler shares a physical CPU among its vcpus in proportion
+ * to their weights. Every SCHED_CREDIT_TICK_MS the running vcpu is charged
+ * for the TSC cycles it ran and its time slice ends, and every
+ * SCHED_CREDIT_PERIOD_TICKS ticks the runnable vcpus are handed one period
+ * of credit split by weight. A vcpu woken up with credit left runs first,
+ * then the vcpus with credit left, then those which overran theirs, and
+ * vcpus of the same priority take turns. A vcpu with a cap is not picked
+ * once it ran its cap of the current period, even if the pcpu idles.
+ */
+#define SCHED_CREDIT_TICK_MS		10U
+#define SCHED_CREDIT_PERIOD_TICKS	3U
+
+#define SCHED_PRIO_OVER		0
+#define SCHED_PRIO_UNDER	1
+#define SCHED_PRIO_BOOST	2
+
+static uint64_t pcpu_used_bitmap;
+static spinlock_t pcpu_alloc_lock = { .head = 0U, .tail = 0U, };
+
+static struct acrn_vcpu *noop_pick_next(struct sched_context *ctx);
+
+/* one vcpu per pcpu, run whenever it is runnable */
+static const struct acrn_scheduler sched_noop = {
+	.name		= "noop",
+	.pick_next	= noop_pick_next,
+};
+
+#ifdef CONFIG_SCHED_CREDIT
+static void credit_wake(struct sched_context *ctx, struct acrn_vcpu *vcpu);
+static struct acrn_vcpu *credit_pick_next(struct sched_context *ctx);
+static void credit_tick(struct sched_context *ctx);
+static bool credit_need_tick(const struct sched_context *ctx);
+static void credit_yield(struct sched_context *ctx);
+
+static const struct acrn_scheduler sched_credit = {
+	.name		= "credit",
+	.wake		= credit_wake,
+	.pick_next	= credit_pick_next,
+	.tick		= credit_tick,
+	.need_tick	= credit_need_tick,
+	.yield		= credit_yield,
+};
+#endif
+
+/* the policy of the pcpus which are not dedicated to a vcpu */
+static const struct acrn_scheduler *default_scheduler = &sched_noop;
+
+static void sched_tick_handler(void *param);
+
+static inline bool is_vcpu_runnable(const struct acrn_vcpu *vcpu)
+{
+	return !list_empty(&vcpu->run_list);
+}
+
+#ifdef CONFIG_SCHED_CREDIT
+/*
+ * The guest FPU state of a vcpu switched out is saved in its one page XSAVE
+ * area, which has to hold every state component the guest may enable.
+ */
+static bool is_xsave_area_enough(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	bool enough = true;
+
+	if (cpu_has_cap(X86_FEATURE_XSAVE)) {
+		cpuid_subleaf(0xDU, 0U, &eax, &ebx, &ecx, &edx);
+		enough = (ecx <= CPU_PAGE_SIZE);
+	}
+
+	return enough;
+}
+#endif
 
 void init_scheduler(void)
 {
 	struct sched_context *ctx;
 	uint32_t i;
 
+#ifdef CONFIG_SCHED_CREDIT
+	if (is_xsave_area_enough()) {
+		default_scheduler = &sched_credit;
+	} else {
+		pr_err("%s: XSAVE area too large, pcpu sharing disabled",
+				__func__);
+	}
+#endif
+
 	for (i = 0U; i < phys_cpu_num; i++) {
 		ctx = &per_cpu(sched_ctx, i);
 
@@ -22,6 +104,15 @@ void init_scheduler(void)
 		INIT_LIST_HEAD(&ctx->runqueue);
 		ctx->flags = 0UL;
 		ctx->curr_vcpu = NULL;
+		ctx->scheduler = &sched_noop;
+		ctx->nr_vcpus = 0U;
+		ctx->dedicated = false;
+		initialize_timer(&ctx->tick_timer, sched_tick_handler, ctx,
+				0UL, TICK_MODE_PERIODIC, 0UL);
+		ctx->ticks = 0U;
+		ctx->period = 0U;
+		ctx->slice_expired = false;
+		ctx->yield_to = NULL;
 	}
 }
 
@@ -37,27 +128,83 @@ void release_schedule_lock(uint16_t pcpu_id)
 	spinlock_release(&ctx->scheduler_lock);
 }
 
-uint16_t allocate_pcpu(void)
+/* pcpu_alloc_lock must be held */
+static void reserve_pcpu(uint16_t pcpu_id, bool dedicated)
 {
-	uint16_t i;
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
 
+	if (ctx->nr_vcpus == 0U) {
+		get_schedule_lock(pcpu_id);
+		ctx->dedicated = dedicated;
+		ctx->scheduler = dedicated ? &sched_noop : default_scheduler;
+		release_schedule_lock(pcpu_id);
+	}
+	ctx->nr_vcpus++;
+	bitmap_set_nolock(pcpu_id, &pcpu_used_bitmap);
+}
+
+/**
+ * @brief Pick the pcpu for a new vcpu.
+ *
+ * A free pcpu is taken first. Otherwise a vcpu not asking for a dedicated
+ * pcpu shares the least loaded pcpu not dedicated to a vcpu, if the
+ * scheduler supports sharing.
+ *
+ * @return INVALID_CPU_ID if no pcpu is available.
+ */
+uint16_t allocate_pcpu(bool dedicated)
+{
+	uint16_t i, pcpu_id = INVALID_CPU_ID;
+	struct sched_context *ctx;
+
+	spinlock_obtain(&pcpu_alloc_lock);
 	for (i = 0U; i < phys_cpu_num; i++) {
-		if (bitmap_test_and_set_lock(i, &pcpu_used_bitmap) == 0) {
-			return i;
+		if (!bitmap_test(i, &pcpu_used_bitmap)) {
+			pcpu_id = i;
+			break;
+		}
+	}
+
+	if ((pcpu_id == INVALID_CPU_ID) && !dedicated &&
+			(default_scheduler != &sched_noop)) {
+		for (i = 0U; i < phys_cpu_num; i++) {
+			ctx = &per_cpu(sched_ctx, i);
+			if (!ctx->dedicated && ((pcpu_id == INVALID_CPU_ID) ||
+				(ctx->nr_vcpus < per_cpu(sched_ctx, pcpu_id).nr_vcpus))) {
+				pcpu_id = i;
+			}
 		}
 	}
 
-	return INVALID_CPU_ID;
+	if (pcpu_id != INVALID_CPU_ID) {
+		reserve_pcpu(pcpu_id, dedicated);
+	}
+	spinlock_release(&pcpu_alloc_lock);
+
+	return pcpu_id;
 }
 
-void set_pcpu_used(uint16_t pcpu_id)
+void set_pcpu_used(uint16_t pcpu_id, bool dedicated)
 {
-	bitmap_set_lock(pcpu_id, &pcpu_used_bitmap);
+	spinlock_obtain(&pcpu_alloc_lock);
+	reserve_pcpu(pcpu_id, dedicated);
+	spinlock_release(&pcpu_alloc_lock);
 }
 
+/* release one vcpu placed on the pcpu */
 void free_pcpu(uint16_t pcpu_id)
 {
-	bitmap_clear_lock(pcpu_id, &pcpu_used_bitmap);
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
+
+	spinlock_obtain(&pcpu_alloc_lock);
+	if (ctx->nr_vcpus > 0U) {
+		ctx->nr_vcpus--;
+		if (ctx->nr_vcpus == 0U) {
+			ctx->dedicated = false;
+			bitmap_clear_nolock(pcpu_id, &pcpu_used_bitmap);
+		}
+	}
+	spinlock_release(&pcpu_alloc_lock);
 }
 
 void add_vcpu_to_runqueue(struct acrn_vcpu *vcpu)
@@ -68,6 +215,9 @@ void add_vcpu_to_runqueue(struct acrn_vcpu *vcpu)
 	spinlock_obtain(&ctx->runqueue_lock);
 	if (list_empty(&vcpu->run_list)) {
 		list_add_tail(&vcpu->run_list, &ctx->runqueue);
+		if (ctx->scheduler->wake != NULL) {
+			ctx->scheduler->wake(ctx, vcpu);
+		}
 	}
 	spinlock_release(&ctx->runqueue_lock);
 }
@@ -82,15 +232,306 @@ void remove_vcpu_from_runqueue(struct acrn_vcpu *vcpu)
 	spinlock_release(&ctx->runqueue_lock);
 }
 
-static struct acrn_vcpu *select_next_vcpu(uint16_t pcpu_id)
+/* more than one vcpu is placed on the pcpu */
+bool is_pcpu_shared(uint16_t pcpu_id)
+{
+	return (per_cpu(sched_ctx, pcpu_id).nr_vcpus > 1U);
+}
+
+/* more than one vcpu is runnable on the pcpu */
+bool is_runqueue_contended(uint16_t pcpu_id)
 {
 	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
-	struct acrn_vcpu *vcpu = NULL;
+	bool contended;
 
 	spinlock_obtain(&ctx->runqueue_lock);
+	contended = !list_empty(&ctx->runqueue) &&
+			(ctx->runqueue.next != ctx->runqueue.prev);
+	spinlock_release(&ctx->runqueue_lock);
+
+	return contended;
+}
+
+/*
+ * The running vcpu spins on a lock, likely held by a vcpu of its VM which
+ * is switched out: let the policy run another vcpu.
+ */
+void yield_vcpu(struct acrn_vcpu *vcpu)
+{
+	uint16_t pcpu_id = vcpu->pcpu_id;
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
+
+	get_schedule_lock(pcpu_id);
+	if (ctx->scheduler->yield != NULL) {
+		spinlock_obtain(&ctx->runqueue_lock);
+		ctx->scheduler->yield(ctx);
+		spinlock_release(&ctx->runqueue_lock);
+		make_reschedule_request(vcpu);
+	}
+	release_schedule_lock(pcpu_id);
+}
+
+static struct acrn_vcpu *noop_pick_next(struct sched_context *ctx)
+{
+	struct acrn_vcpu *vcpu = NULL;
+
 	if (!list_empty(&ctx->runqueue)) {
 		vcpu = get_first_item(&ctx->runqueue, struct acrn_vcpu, run_list);
 	}
+
+	return vcpu;
+}
+
+#ifdef CONFIG_SCHED_CREDIT
+static inline uint64_t credit_period_cycles(void)
+{
+	return CYCLES_PER_MS * SCHED_CREDIT_TICK_MS * SCHED_CREDIT_PERIOD_TICKS;
+}
+
+/* start the cap accounting of a vcpu which slept through a refill */
+static void credit_sync_period(const struct sched_context *ctx,
+		struct acrn_vcpu *vcpu)
+{
+	if (vcpu->sched_period != ctx->period) {
+		vcpu->sched_period = ctx->period;
+		vcpu->sched_used = 0UL;
+	}
+}
+
+static bool credit_capped(const struct sched_context *ctx,
+		struct acrn_vcpu *vcpu)
+{
+	credit_sync_period(ctx, vcpu);
+	return (vcpu->sched_cap != 0U) && (vcpu->sched_used >=
+		((credit_period_cycles() * vcpu->sched_cap) / 100UL));
+}
+
+static int32_t credit_prio(const struct acrn_vcpu *vcpu)
+{
+	int32_t prio;
+
+	if (vcpu->sched_credit <= 0L) {
+		prio = SCHED_PRIO_OVER;
+	} else if (vcpu->sched_boost) {
+		prio = SCHED_PRIO_BOOST;
+	} else {
+		prio = SCHED_PRIO_UNDER;
+	}
+
+	return prio;
+}
+
+/* charge the running vcpu for the cycles it ran since the last charge */
+static void credit_charge(struct sched_context *ctx, uint64_t now)
+{
+	struct acrn_vcpu *curr = ctx->curr_vcpu;
+	uint64_t delta;
+
+	if (curr != NULL) {
+		delta = now - curr->sched_start_tsc;
+		credit_sync_period(ctx, curr);
+		curr->sched_credit -= (int64_t)delta;
+		curr->sched_used += delta;
+		curr->sched_start_tsc = now;
+	}
+}
+
+/* hand out one period of credit to the runnable vcpus */
+static void credit_refill(struct sched_context *ctx)
+{
+	int64_t period = (int64_t)credit_period_cycles();
+	uint64_t total_weight = 0UL;
+	struct list_head *pos;
+	struct acrn_vcpu *vcpu;
+
+	ctx->period++;
+
+	list_for_each(pos, &ctx->runqueue) {
+		vcpu = list_entry(pos, struct acrn_vcpu, run_list);
+		total_weight += vcpu->sched_weight;
+	}
+
+	if (total_weight == 0UL) {
+		return;
+	}
+
+	list_for_each(pos, &ctx->runqueue) {
+		vcpu = list_entry(pos, struct acrn_vcpu, run_list);
+		vcpu->sched_credit += (period * (int64_t)vcpu->sched_weight) /
+					(int64_t)total_weight;
+		/* neither hoard credit nor owe it beyond one period */
+		if (vcpu->sched_credit > period) {
+			vcpu->sched_credit = period;
+		} else if (vcpu->sched_credit < -period) {
+			vcpu->sched_credit = -period;
+		}
+	}
+}
+
+static void credit_wake(struct sched_context *ctx, struct acrn_vcpu *vcpu)
+{
+	/*
+	 * Let a vcpu blocked on I/O or an event respond quickly.
+	 *
+	 * curr_vcpu may be stale here, see struct acrn_scheduler: a vcpu
+	 * switched in meanwhile keeps the boost until its next tick,
+	 * one switched out misses it for this wake and runs in credit order.
+	 */
+	if ((vcpu != ctx->curr_vcpu) && (vcpu->sched_credit > 0L)) {
+		vcpu->sched_boost = true;
+	}
+}
+
+static struct acrn_vcpu *credit_pick_next(struct sched_context *ctx)
+{
+	struct acrn_vcpu *curr = ctx->curr_vcpu;
+	struct acrn_vcpu *vcpu, *next = NULL;
+	struct list_head *pos;
+	int32_t prio, best = -1;
+	uint64_t now = rdtsc();
+
+	credit_charge(ctx, now);
+
+	if ((curr != NULL) && is_vcpu_runnable(curr)) {
+		if (ctx->slice_expired || (ctx->yield_to != NULL)) {
+			/* queue it behind the vcpus of the same priority */
+			list_del(&curr->run_list);
+			list_add_tail(&curr->run_list, &ctx->runqueue);
+		} else if (!credit_capped(ctx, curr)) {
+			/* keep it till its slice ends unless a better one waits */
+			next = curr;
+			best = credit_prio(curr);
+		} else {
+			/* capped */
+		}
+	}
+	ctx->slice_expired = false;
+
+	list_for_each(pos, &ctx->runqueue) {
+		vcpu = list_entry(pos, struct acrn_vcpu, run_list);
+		if (!credit_capped(ctx, vcpu)) {
+			prio = credit_prio(vcpu);
+			/* the siblings of a yielding vcpu, one of them holds
+			 * the lock it spins on
+			 */
+			if ((vcpu->vm == ctx->yield_to) && (vcpu != curr) &&
+					(prio == SCHED_PRIO_UNDER)) {
+				prio = SCHED_PRIO_BOOST;
+			}
+			if (prio > best) {
+				best = prio;
+				next = vcpu;
+			}
+		}
+	}
+	ctx->yield_to = NULL;
+
+	if (next != curr) {
+		if (curr != NULL) {
+			curr->sched_boost = false;
+		}
+		if (next != NULL) {
+			next->sched_start_tsc = now;
+		}
+	}
+
+	return next;
+}
+
+static void credit_tick(struct sched_context *ctx)
+{
+	credit_charge(ctx, rdtsc());
+	if (ctx->curr_vcpu != NULL) {
+		ctx->curr_vcpu->sched_boost = false;
+	}
+
+	ctx->ticks++;
+	if (ctx->ticks >= SCHED_CREDIT_PERIOD_TICKS) {
+		ctx->ticks = 0U;
+		credit_refill(ctx);
+	}
+
+	ctx->slice_expired = true;
+}
+
+static void credit_yield(struct sched_context *ctx)
+{
+	if (ctx->curr_vcpu != NULL) {
+		ctx->yield_to = ctx->curr_vcpu->vm;
+	}
+}
+
+static bool credit_need_tick(const struct sched_context *ctx)
+{
+	struct list_head *pos;
+	struct acrn_vcpu *vcpu;
+	bool need = (ctx->nr_vcpus > 1U);
+
+	/* a lone vcpu only needs the tick to enforce its cap */
+	if (!need) {
+		list_for_each(pos, &ctx->runqueue) {
+			vcpu = list_entry(pos, struct acrn_vcpu, run_list);
+			if (vcpu->sched_cap != 0U) {
+				need = true;
+			}
+		}
+	}
+
+	return need;
+}
+#endif
+
+static void sched_tick_handler(void *param)
+{
+	struct sched_context *ctx = (struct sched_context *)param;
+	uint16_t pcpu_id = get_cpu_id();
+
+	get_schedule_lock(pcpu_id);
+	if (ctx->scheduler->tick != NULL) {
+		spinlock_obtain(&ctx->runqueue_lock);
+		ctx->scheduler->tick(ctx);
+		spinlock_release(&ctx->runqueue_lock);
+		bitmap_set_lock(NEED_RESCHEDULE, &ctx->flags);
+	}
+	release_schedule_lock(pcpu_id);
+}
+
+/*
+ * Arm or stop the tick of the current pcpu as its policy needs, called
+ * with the scheduler_lock held.
+ */
+static void update_sched_tick(struct sched_context *ctx)
+{
+	const struct acrn_scheduler *scheduler = ctx->scheduler;
+	struct hv_timer *timer = &ctx->tick_timer;
+	uint64_t tick = CYCLES_PER_MS * SCHED_CREDIT_TICK_MS;
+	bool need = false;
+
+	if (scheduler->need_tick != NULL) {
+		spinlock_obtain(&ctx->runqueue_lock);
+		need = scheduler->need_tick(ctx);
+		spinlock_release(&ctx->runqueue_lock);
+	}
+
+	if (need && list_empty(&timer->node)) {
+		ctx->ticks = 0U;
+		timer->fire_tsc = rdtsc() + tick;
+		timer->period_in_cycle = tick;
+		(void)add_timer(timer);
+	} else if (!need && !list_empty(&timer->node)) {
+		del_timer(timer);
+	} else {
+		/* nothing to change */
+	}
+}
+
+static struct acrn_vcpu *select_next_vcpu(uint16_t pcpu_id)
+{
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
+	struct acrn_vcpu *vcpu = NULL;
+
+	spinlock_obtain(&ctx->runqueue_lock);
+	vcpu = ctx->scheduler->pick_next(ctx);
 	spinlock_release(&ctx->runqueue_lock);
 
 	return vcpu;
@@ -124,10 +565,8 @@ static void context_switch_out(struct acrn_vcpu *vcpu)
 	cancel_event_injection(vcpu);
 
 	atomic_store32(&vcpu->running, 0U);
-	/* do prev vcpu context switch out */
-	/* For now, we don't need to invalid ept.
-	 * But if we have more than one vcpu on one pcpu,
-	 * we need add ept invalid operation here.
+	/* Its guest state stays in the pcpu till another vcpu is loaded,
+	 * so going idle and back costs nothing.
 	 */
 }
 
@@ -142,12 +581,13 @@ static void context_switch_in(struct acrn_vcpu *vcpu)
 	}
 
 	atomic_store32(&vcpu->running, 1U);
-	/* FIXME:
-	 * Now, we don't need to load new vcpu VMCS because
-	 * we only do switch between vcpu loop and idle loop.
-	 * If we have more than one vcpu on on pcpu, need to
-	 * add VMCS load operation here.
+	/* Load its VMCS and guest state if another vcpu ran last. No EPT or
+	 * VPID flush is needed: every vcpu has its own VPID, so the TLB
+	 * entries of the others never match, and an EPT change is flushed
+	 * on each vcpu of the VM by a request handled before its next VM
+	 * entry.
 	 */
+	load_vcpu_context(vcpu);
 }
 
 void make_pcpu_offline(uint16_t pcpu_id)
@@ -178,6 +618,10 @@ void default_idle(void)
 			cpu_dead(pcpu_id);
 		} else {
 			CPU_IRQ_ENABLE();
+			/* the scheduler tick and the timers of the vcpus
+			 * switched out run on an idle pcpu as well
+			 */
+			do_softirq();
 			cpu_do_idle();
 			CPU_IRQ_DISABLE();
 		}
@@ -224,11 +668,13 @@ static void switch_to(struct acrn_vcpu *curr)
 void schedule(void)
 {
 	uint16_t pcpu_id = get_cpu_id();
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
 	struct acrn_vcpu *next = NULL;
-	struct acrn_vcpu *prev = per_cpu(sched_ctx, pcpu_id).curr_vcpu;
+	struct acrn_vcpu *prev = ctx->curr_vcpu;
 
 	get_schedule_lock(pcpu_id);
 	next = select_next_vcpu(pcpu_id);
+	update_sched_tick(ctx);
 
 	if (prev == next) {
 		release_schedule_lock(pcpu_id);
@@ -243,3 +689,101 @@ void schedule(void)
 
 	ASSERT(false, "Shouldn't go here");
 }
+
+#ifdef HV_DEBUG
+void get_sched_info(char *str_arg, size_t str_max)
+{
+	char *str = str_arg;
+	uint16_t pcpu_id, vm_id, i;
+	size_t len, size = str_max;
+	struct sched_context *ctx;
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	const struct vcpu_idle_stats *stats;
+
+	len = snprintf(str, size, "\r\nPCPU ID\tSCHEDULER\tVCPUS\tDEDICATED");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (pcpu_id = 0U; pcpu_id < phys_cpu_num; pcpu_id++) {
+		ctx = &per_cpu(sched_ctx, pcpu_id);
+		len = snprintf(str, size, "\r\n%hu\t%s\t\t%hu\t%s", pcpu_id,
+			ctx->scheduler->name, ctx->nr_vcpus,
+			ctx->dedicated ? "yes" : "no");
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+	}
+
+	len = snprintf(str, size, "\r\n\r\nVM ID\tVCPU ID\tPCPU ID\tWEIGHT"
+			"\tCAP(%%)\tCREDIT(us)\tRUNNABLE");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (vm == NULL) {
+			continue;
+		}
+
+		foreach_vcpu(i, vm, vcpu) {
+			len = snprintf(str, size,
+				"\r\n%hu\t%hu\t%hu\t%hu\t%hu\t%ld\t\t%s",
+				vm_id, vcpu->vcpu_id, vcpu->pcpu_id,
+				vcpu->sched_weight, vcpu->sched_cap,
+				vcpu->sched_credit / (int64_t)us_to_ticks(1U),
+				is_vcpu_runnable(vcpu) ? "yes" : "no");
+			if (len >= size) {
+				goto overflow;
+			}
+			size -= len;
+			str += len;
+		}
+	}
+
+	len = snprintf(str, size, "\r\n\r\nVM ID\tVCPU ID\tHLT\tPOLL HIT"
+			"\tPOLL MISS\tSLEEP\tWINDOW(us)\tPAUSE\tYIELD");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (vm == NULL) {
+			continue;
+		}
+
+		foreach_vcpu(i, vm, vcpu) {
+			stats = &vcpu->idle_stats;
+			len = snprintf(str, size,
+				"\r\n%hu\t%hu\t%llu\t%llu\t\t%llu\t\t%llu\t%llu"
+				"\t\t%llu\t%llu",
+				vm_id, vcpu->vcpu_id, stats->hlt_exits,
+				stats->poll_hits, stats->poll_misses,
+				stats->sleeps,
+				vcpu->halt_poll_cycles / us_to_ticks(1U),
+				stats->pause_exits, stats->yields);
+			if (len >= size) {
+				goto overflow;
+			}
+			size -= len;
+			str += len;
+		}
+	}
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+#endif
@@ -29,6 +29,8 @@ static int shell_show_cpu_int(__unused int argc, __unused char **argv);
 static int shell_show_ptdev_info(__unused int argc, __unused char **argv);
 static int shell_show_vioapic_info(int argc, char **argv);
 static int shell_show_ioapic_info(__unused int argc, __unused char **argv);
+static int shell_show_ioreq_latency(int argc, char **argv);
+static int shell_show_sched_info(__unused int argc, __unused char **argv);
 static int shell_dump_logbuf(int argc, char **argv);
 static int shell_loglevel(int argc, char **argv);
 static int shell_cpuid(int argc, char **argv);
@@ -95,6 +97,18 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_IOAPIC_HELP,
 		.fcn		= shell_show_ioapic_info,
 	},
+	{
+		.str		= SHELL_CMD_IOREQ_LAT,
+		.cmd_param	= SHELL_CMD_IOREQ_LAT_PARAM,
+		.help_str	= SHELL_CMD_IOREQ_LAT_HELP,
+		.fcn		= shell_show_ioreq_latency,
+	},
+	{
+		.str		= SHELL_CMD_SCHED,
+		.cmd_param	= SHELL_CMD_SCHED_PARAM,
+		.help_str	= SHELL_CMD_SCHED_HELP,
+		.fcn		= shell_show_sched_info,
+	},
 	{
 		.str		= SHELL_CMD_LOGDUMP,
 		.cmd_param	= SHELL_CMD_LOGDUMP_PARAM,
@@ -762,6 +776,14 @@ static int shell_show_cpu_int(__unused int argc, __unused char **argv)
 	return 0;
 }
 
+static int shell_show_sched_info(__unused int argc, __unused char **argv)
+{
+	get_sched_info(shell_log_buf, SHELL_LOG_BUF_SIZE);
+	shell_puts(shell_log_buf);
+
+	return 0;
+}
+
 static int shell_show_ptdev_info(__unused int argc, __unused char **argv)
 {
 	get_ptdev_info(shell_log_buf, SHELL_LOG_BUF_SIZE);
@@ -800,6 +822,26 @@ static int shell_show_ioapic_info(__unused int argc, __unused char **argv)
 	return err;
 }
 
+static int shell_show_ioreq_latency(int argc, char **argv)
+{
+	uint16_t vmid;
+	int32_t ret;
+
+	/* User input invalidation */
+	if (argc != 2) {
+		return -EINVAL;
+	}
+	ret = atoi(argv[1]);
+	if (ret >= 0) {
+		vmid = (uint16_t) ret;
+		get_ioreq_latency_info(shell_log_buf, SHELL_LOG_BUF_SIZE, vmid);
+		shell_puts(shell_log_buf);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
 static int shell_dump_logbuf(int argc, char **argv)
 {
 	uint16_t pcpu_id;
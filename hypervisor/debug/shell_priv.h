@@ -78,6 +78,14 @@ struct shell {
 #define SHELL_CMD_VIOAPIC_PARAM		"<vm id>"
 #define SHELL_CMD_VIOAPIC_HELP		"show vioapic info"
 
+#define SHELL_CMD_IOREQ_LAT		"ioreq_lat"
+#define SHELL_CMD_IOREQ_LAT_PARAM	"<vm id>"
+#define SHELL_CMD_IOREQ_LAT_HELP	"show ioreq round-trip latency histogram"
+
+#define SHELL_CMD_SCHED			"sched"
+#define SHELL_CMD_SCHED_PARAM		NULL
+#define SHELL_CMD_SCHED_HELP		"show vcpu scheduling info per pcpu"
+
 #define SHELL_CMD_LOGDUMP		"logdump"
 #define SHELL_CMD_LOGDUMP_PARAM		"<pcpu id>"
 #define SHELL_CMD_LOGDUMP_HELP		"log buffer dump"
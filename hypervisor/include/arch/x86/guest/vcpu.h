@@ -14,6 +14,7 @@
 #define VCPU_H
 
 #define	ACRN_VCPU_MMIO_COMPLETE		(0U)
+#define	ACRN_VCPU_IOREQ_COMPLETE	(1U)
 
 /* Number of GPRs saved / restored for guest in VCPU structure */
 #define NUM_GPRS                            16U
@@ -179,6 +180,8 @@ struct cpu_context {
 struct acrn_vcpu_arch {
 	/* vmcs region for this vcpu, MUST be 4KB-aligned */
 	uint8_t vmcs[CPU_PAGE_SIZE];
+	/* XSAVE (or FXSAVE) image of the guest FPU state while switched out */
+	uint8_t xsave_area[CPU_PAGE_SIZE];
 	/* per vcpu lapic */
 	struct acrn_vlapic vlapic;
 	int cur_context;
@@ -217,8 +220,33 @@ struct acrn_vcpu_arch {
 	bool inject_event_pending;
 	struct event_injection_info inject_info;
 
+	/* guest XCR0, the value in the physical CPU while the vcpu is loaded */
+	uint64_t xcr0;
+	/* guest state neither in the VMCS nor switched by VM entry/exit,
+	 * saved here while another vcpu is loaded on the physical CPU
+	 */
+	uint64_t msr_star;
+	uint64_t msr_lstar;
+	uint64_t msr_fmask;
+	uint64_t msr_kernel_gs_base;
+	uint64_t dr[4];
+	uint64_t dr6;
+
+	/* HLT and PAUSE-loop exiting are on, see update_idle_exiting() */
+	bool idle_exiting;
+
 } __aligned(CPU_PAGE_SIZE);
 
+/* HLT and PAUSE exits of a vcpu, to tune its halt polling window */
+struct vcpu_idle_stats {
+	uint64_t hlt_exits;
+	uint64_t poll_hits;	/* woken up while polling */
+	uint64_t poll_misses;	/* polled the whole window, then slept */
+	uint64_t sleeps;	/* taken off the runqueue */
+	uint64_t pause_exits;
+	uint64_t yields;	/* PAUSE exits handing the pcpu over */
+};
+
 struct acrn_vm;
 struct acrn_vcpu {
 	/* Architecture specific definitions for this VCPU */
@@ -239,8 +267,27 @@ struct acrn_vcpu {
 	bool launched; /* Whether the vcpu is launched on target pcpu */
 	uint32_t paused_cnt; /* how many times vcpu is paused */
 	uint32_t running; /* vcpu is picked up and run? */
+	uint32_t ioreq_waiting; /* off the runqueue waiting for an ioreq? */
+
+	/* credit scheduler, see schedule.c */
+	uint16_t sched_weight; /* share of the pcpu relative to the others */
+	uint16_t sched_cap; /* max percent of the pcpu to use, 0 for no cap */
+	bool sched_boost; /* just woken up, runs before the other vcpus */
+	int64_t sched_credit; /* TSC cycles it may run before the others */
+	uint64_t sched_used; /* TSC cycles it ran in period sched_period */
+	uint32_t sched_period;
+	uint64_t sched_start_tsc; /* when it was last switched in */
+
+	/* halt polling, see hlt_vmexit_handler() */
+	uint32_t halted; /* off the runqueue till it has an interrupt? */
+	uint64_t halt_tsc; /* when it was taken off */
+	uint64_t halt_poll_cycles; /* current polling window */
+	struct vcpu_idle_stats idle_stats;
 
 	struct io_request req; /* used by io/ept emulation */
+	uint16_t mmio_last_hit; /* index in vm->emul_mmio[] of the last hit */
+	uint64_t ioreq_start_tsc; /* when req was delivered to VHM */
+	struct ioreq_latency_stats ioreq_stats;
 
 	/* save guest msr tsc aux register.
 	 * Before VMENTRY, save guest MSR_TSC_AUX to this fields.
@@ -529,6 +576,19 @@ int create_vcpu(uint16_t pcpu_id, struct acrn_vm *vm, struct acrn_vcpu **rtn_vcp
  */
 int run_vcpu(struct acrn_vcpu *vcpu);
 
+/**
+ * @brief load the vcpu on its pcpu
+ *
+ * Saves the guest state not kept in the VMCS (FPU/XSAVE state, XCR0, debug
+ * registers and syscall MSRs) of the vcpu last loaded on the pcpu, restores
+ * the one of this vcpu and makes its VMCS the current one. Nothing is done
+ * if the vcpu is already loaded.
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ * @pre vcpu != NULL && vcpu->pcpu_id == get_cpu_id()
+ */
+void load_vcpu_context(struct acrn_vcpu *vcpu);
+
 int shutdown_vcpu(struct acrn_vcpu *vcpu);
 
 /**
@@ -569,6 +629,52 @@ void pause_vcpu(struct acrn_vcpu *vcpu, enum vcpu_state new_state);
  */
 void resume_vcpu(struct acrn_vcpu *vcpu);
 
+/**
+ * @brief take the vcpu off the runqueue till its ioreq completes
+ *
+ * Removes a vCPU from the run queue and make a reschedule request for it,
+ * without changing the vCPU state. The vCPU is put back by
+ * ioreq_wake_vcpu() and is ignored by resume_vcpu() until then.
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ */
+void ioreq_wait_vcpu(struct acrn_vcpu *vcpu);
+
+/**
+ * @brief put back a vcpu taken off by ioreq_wait_vcpu()
+ *
+ * Adds the vCPU into the run queue and make a reschedule request for it if
+ * its state is VCPU_RUNNING.
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ */
+void ioreq_wake_vcpu(struct acrn_vcpu *vcpu);
+
+/**
+ * @brief take a halted vcpu off the runqueue till it has an interrupt
+ *
+ * Removes the vCPU from the run queue and make a reschedule request for
+ * it, unless an event waking it up is already pending. The vCPU is put
+ * back by wake_halted_vcpu().
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ *
+ * @pre vcpu->pcpu_id == get_cpu_id()
+ */
+void halt_vcpu(struct acrn_vcpu *vcpu);
+
+/**
+ * @brief put back a vcpu taken off by halt_vcpu()
+ *
+ * Called after an event waking up a halted vCPU is made pending. Adds the
+ * vCPU into the run queue and make a reschedule request for it if it is
+ * halted and its state is VCPU_RUNNING, and adapts its halt polling
+ * window to how long it was halted.
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ */
+void wake_halted_vcpu(struct acrn_vcpu *vcpu);
+
 /**
  * @brief set the vcpu to running state, then it will be scheculed.
  *
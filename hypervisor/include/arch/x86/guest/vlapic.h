@@ -134,6 +134,20 @@ uint64_t vlapic_get_cr8(const struct acrn_vlapic *vlapic);
  */
 int vlapic_pending_intr(const struct acrn_vlapic *vlapic, uint32_t *vecptr);
 
+/**
+ * @brief Check for an interrupt the vCPU takes once interrupts are enabled.
+ *
+ * Unlike vlapic_pending_intr(), it also covers the vectors already moved to
+ * the vIRR for the virtual-interrupt delivery, which raise no request.
+ *
+ * @param[in] vcpu Target vCPU, whose VMCS is the current one
+ *
+ * @return true if such an interrupt is pending
+ *
+ * @pre vcpu != NULL
+ */
+bool vlapic_has_pending_intr(struct acrn_vcpu *vcpu);
+
 /**
  * @brief Accept virtual interrupt.
  *
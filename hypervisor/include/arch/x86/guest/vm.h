@@ -147,6 +147,11 @@ struct acrn_vm {
 	 */
 	struct cpu_context sworld_snapshot;
 
+	/* Scheduling: vcpus get pcpus of their own, or share them by weight */
+	bool dedicated_pcpu;
+	uint16_t sched_weight;
+	uint16_t sched_cap;	/* max percentage of a pcpu, 0 for no cap */
+
 	uint32_t vcpuid_entry_nr, vcpuid_level, vcpuid_xlevel;
 	struct vcpuid_entry vcpuid_entries[MAX_VM_VCPUID_ENTRIES];
 	struct vpci vpci;
@@ -176,6 +181,10 @@ struct vm_description {
 	uint16_t               vm_hw_num_cores;   /* Number of virtual cores */
 	/* Whether secure world is supported for current VM. */
 	bool                   sworld_supported;
+	/* Whether each vcpu gets a physical CPU not shared with other vcpus */
+	bool                   dedicated_pcpu;
+	uint16_t               sched_weight;	/* 0 for the default weight */
+	uint16_t               sched_cap;	/* max percentage of a pcpu */
 #ifdef CONFIG_PARTITION_MODE
 	uint8_t			vm_id;
 	struct mptable_info	*mptable;
@@ -38,6 +38,27 @@ struct io_request {
 	union vhm_io_request reqs;
 };
 
+/**
+ * @brief Number of buckets of the ioreq latency histogram
+ *
+ * Bucket 0 counts round trips below 1us, bucket i (i > 0) those in
+ * [2^(i-1), 2^i) us and the last bucket everything above.
+ */
+#define IOREQ_LAT_BUCKETS	16U
+
+/**
+ * @brief Round-trip latency of the I/O requests delivered to VHM
+ *
+ * Only updated by the completion of the owning vCPU's request, so no lock
+ * is needed.
+ */
+struct ioreq_latency_stats {
+	uint64_t count;		/**< Number of completed requests */
+	uint64_t total_us;	/**< Sum of the round trips in us */
+	uint64_t max_us;	/**< Longest round trip in us */
+	uint64_t buckets[IOREQ_LAT_BUCKETS];	/**< log2(us) histogram */
+};
+
 /**
  * @brief Definition of a IO port range
  */
@@ -221,7 +242,8 @@ void   register_io_emulation_handler(struct acrn_vm *vm, uint32_t pio_idx,
  * @param handler_private_data Handler-specific data which will be passed to \p read_write when called
  *
  * @return 0 - Registration succeeds
- * @return -EINVAL - \p read_write is NULL, \p end is not larger than \p start or \p vm has been launched
+ * @return -EINVAL - \p read_write is NULL, \p end is not larger than \p start, \p vm has been launched,
+ *                   or the range overlaps the one of a registered handler
  */
 int register_mmio_emulation_handler(struct acrn_vm *vm,
 	hv_mem_io_handler_t read_write, uint64_t start,
@@ -277,6 +299,15 @@ int32_t emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req);
  */
 void emulate_io_post(struct acrn_vcpu *vcpu);
 
+/**
+ * @brief Post-work of a VHM request completed asynchronously
+ *
+ * Run on the physical CPU of \p vcpu when it is scheduled again.
+ *
+ * @param vcpu The virtual CPU that triggers the I/O access
+ */
+void dm_emulate_io_post(struct acrn_vcpu *vcpu);
+
 /**
  * @brief Deliver \p io_req to SOS and suspend \p vcpu till its completion
  *
@@ -287,6 +318,17 @@ void emulate_io_post(struct acrn_vcpu *vcpu);
  */
 int32_t acrn_insert_request_wait(struct acrn_vcpu *vcpu, const struct io_request *io_req);
 
+#ifdef HV_DEBUG
+/**
+ * @brief Dump the ioreq round-trip latency histogram of a VM
+ *
+ * @param str_arg The buffer to print to
+ * @param str_max Size of \p str_arg
+ * @param vmid ID of the VM
+ */
+void get_ioreq_latency_info(char *str_arg, size_t str_max, uint16_t vmid);
+#endif
+
 /**
  * @brief Reset all IO requests status of the VM
  *
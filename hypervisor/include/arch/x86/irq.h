@@ -223,6 +223,7 @@ void vcpu_inject_ac(struct acrn_vcpu *vcpu);
  */
 void vcpu_inject_ss(struct acrn_vcpu *vcpu);
 void vcpu_make_request(struct acrn_vcpu *vcpu, uint16_t eventid);
+bool vcpu_has_pending_wakeup(struct acrn_vcpu *vcpu);
 
 /*
  * @pre vcpu != NULL
@@ -14,12 +14,35 @@ enum tick_mode {
 	TICK_MODE_PERIODIC,
 };
 
+/*
+ * The active timers of a physical CPU are kept in a hierarchical timing
+ * wheel. Level 0 has TIMER_WHEEL_SLOTS slots of 2^TIMER_WHEEL_SHIFT TSC
+ * cycles each and every level above has TIMER_WHEEL_SLOTS slots spanning a
+ * whole turn of the level below. A timer sits in the slot of the lowest
+ * level its deadline falls into and moves down a level (cascades) when the
+ * wheel reaches its slot, so adding and deleting a timer are O(1).
+ */
+#define TIMER_WHEEL_SHIFT	10U
+#define TIMER_WHEEL_LVL_BITS	6U
+#define TIMER_WHEEL_SLOTS	(1U << TIMER_WHEEL_LVL_BITS)	/* bits of pending[] */
+#define TIMER_WHEEL_SLOT_MASK	(TIMER_WHEEL_SLOTS - 1U)
+#define TIMER_WHEEL_LEVELS	4U
+
 struct per_cpu_timers {
-	struct list_head timer_list;	/* it's for runtime active timer list */
+	/* unsorted timer list of each slot */
+	struct list_head wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	/* slots which may be non-empty, del_timer() leaves its bit set */
+	uint64_t pending[TIMER_WHEEL_LEVELS];
+	/* wheel time in level 0 slots, all slots before it are processed */
+	uint64_t clk;
+	/* TSC deadline last programmed, 0 if none */
+	uint64_t deadline;
+	/* the timer of deadline may be deleted */
+	bool deadline_stale;
 };
 
 struct hv_timer {
-	struct list_head node;		/* link all timers */
+	struct list_head node;		/* link the timers of a wheel slot */
 	enum tick_mode mode;			/* timer mode: one-shot or periodic */
 	uint64_t fire_tsc;		/* tsc deadline to interrupt */
 	uint64_t period_in_cycle;	/* period of the periodic timer in unit of TSC cycles */
@@ -465,6 +465,7 @@ void vmx_write_cr0(struct acrn_vcpu *vcpu, uint64_t cr0);
 void vmx_write_cr4(struct acrn_vcpu *vcpu, uint64_t cr4);
 bool is_vmx_disabled(void);
 void switch_apicv_mode_x2apic(struct acrn_vcpu *vcpu);
+void update_idle_exiting(struct acrn_vcpu *vcpu);
 
 static inline enum vm_cpu_mode get_vcpu_mode(const struct acrn_vcpu *vcpu)
 {
@@ -10,24 +10,70 @@
 #define	NEED_RESCHEDULE		(1U)
 #define	NEED_OFFLINE		(2U)
 
+/* default weight of a vcpu, the weights of the vcpus on a pcpu are relative */
+#define SCHED_DEFAULT_WEIGHT	256U
+
+struct sched_context;
+
+/**
+ * @brief A scheduling policy of a physical CPU.
+ *
+ * All the callbacks are called with the runqueue_lock of the physical CPU
+ * held, and the policy state relies on it alone: ->wake is called from
+ * add_vcpu_to_runqueue() on any physical CPU without the scheduler_lock.
+ * curr_vcpu is written under the scheduler_lock only, so ->wake may read
+ * it stale. The runqueue holds the runnable vcpus, including the running
+ * one.
+ */
+struct acrn_scheduler {
+	const char *name;
+	/* a runnable vcpu was added to the runqueue, may be NULL */
+	void (*wake)(struct sched_context *ctx, struct acrn_vcpu *vcpu);
+	/* the vcpu to run next, NULL to idle */
+	struct acrn_vcpu *(*pick_next)(struct sched_context *ctx);
+	/* periodic accounting, NULL if the policy needs no tick */
+	void (*tick)(struct sched_context *ctx);
+	/* whether the tick is needed with the current vcpus */
+	bool (*need_tick)(const struct sched_context *ctx);
+	/* the running vcpu spins on a lock, may be NULL */
+	void (*yield)(struct sched_context *ctx);
+};
+
 struct sched_context {
 	spinlock_t runqueue_lock;
 	struct list_head runqueue;
 	uint64_t flags;
 	struct acrn_vcpu *curr_vcpu;
 	spinlock_t scheduler_lock;
+
+	const struct acrn_scheduler *scheduler;
+	/* vcpus placed on this pcpu, protected by the pcpu allocation lock */
+	uint16_t nr_vcpus;
+	/* the pcpu is owned by one vcpu of a VM asking for it */
+	bool dedicated;
+
+	/* time slice and credit accounting of the credit scheduler */
+	struct hv_timer tick_timer;
+	uint32_t ticks;
+	uint32_t period;	/* credit periods elapsed */
+	bool slice_expired;
+	/* the VM whose vcpus go first at the next pick, after a yield */
+	const struct acrn_vm *yield_to;
 };
 
 void init_scheduler(void);
 void get_schedule_lock(uint16_t pcpu_id);
 void release_schedule_lock(uint16_t pcpu_id);
 
-void set_pcpu_used(uint16_t pcpu_id);
-uint16_t allocate_pcpu(void);
+void set_pcpu_used(uint16_t pcpu_id, bool dedicated);
+uint16_t allocate_pcpu(bool dedicated);
 void free_pcpu(uint16_t pcpu_id);
 
 void add_vcpu_to_runqueue(struct acrn_vcpu *vcpu);
 void remove_vcpu_from_runqueue(struct acrn_vcpu *vcpu);
+bool is_pcpu_shared(uint16_t pcpu_id);
+bool is_runqueue_contended(uint16_t pcpu_id);
+void yield_vcpu(struct acrn_vcpu *vcpu);
 
 void default_idle(void);
 
@@ -39,5 +85,8 @@ int need_offline(uint16_t pcpu_id);
 void schedule(void);
 
 void vcpu_thread(struct acrn_vcpu *vcpu);
-#endif /* SCHEDULE_H */
 
+#ifdef HV_DEBUG
+void get_sched_info(char *str_arg, size_t str_max);
+#endif
+#endif /* SCHEDULE_H */
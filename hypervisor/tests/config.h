@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Configuration the host benchmarks build the hypervisor sources with, in
+ * place of the one generated from Kconfig: the defaults for BOARD=apl-mrb,
+ * with room for more emulated MMIO regions than a board needs so that
+ * mmio_lookup can go past them.
+ */
+#ifndef __HV_KCONFIG__
+#define __HV_KCONFIG__
+#define CONFIG_PLATFORM_SBL 1
+#define CONFIG_PLATFORM "sbl"
+#define CONFIG_BOARD "apl-mrb"
+#define CONFIG_MAX_VM_NUM 4U
+#define CONFIG_MAX_VCPUS_PER_VM 4U
+#define CONFIG_MAX_PCPU_NUM 8U
+#define CONFIG_MAX_EMULATED_MMIO_REGIONS 128U
+#define CONFIG_MAX_IOMMU_NUM 2U
+#define CONFIG_STACK_SIZE 0x2000U
+#define CONFIG_LOG_BUF_SIZE 0x40000U
+#define CONFIG_LOG_DESTINATION 7U
+#define CONFIG_CPU_UP_TIMEOUT 100U
+#define CONFIG_SERIAL_MMIO 1
+#define CONFIG_SERIAL_MMIO_BASE 0xfc000000U
+#define CONFIG_COM_BASE 0x3e8U
+#define CONFIG_COM_IRQ 0x6U
+#define CONFIG_MALLOC_ALIGN 16U
+#define CONFIG_HEAP_SIZE 0x100000U
+#define CONFIG_CONSOLE_LOGLEVEL_DEFAULT 3U
+#define CONFIG_MEM_LOGLEVEL_DEFAULT 5U
+#define CONFIG_NPK_LOGLEVEL_DEFAULT 5U
+#define CONFIG_LOW_RAM_SIZE 0x00010000U
+#define CONFIG_HV_RAM_START 0x6e000000U
+#define CONFIG_HV_RAM_SIZE 0x04800000U
+#define CONFIG_PLATFORM_RAM_SIZE 0x200000000U
+#define CONFIG_SOS_RAM_SIZE 0x200000000U
+#define CONFIG_UOS_RAM_SIZE 0x100000000U
+#define CONFIG_MTRR_ENABLED 1
+#define CONFIG_IOMMU_BUS_NUM 0x10U
+#define CONFIG_MAX_PCI_DEV_NUM 96U
+#define CONFIG_MAX_MSIX_TABLE_NUM 16U
+#define CONFIG_HALT_POLL_MAX_US 200U
+#define CONFIG_SHARING_MODE 1
+#define CONFIG_IOREQ_ASYNC_COMPLETION 1
+#define CONFIG_SCHED_NOOP 1
+#endif
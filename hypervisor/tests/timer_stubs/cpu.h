@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* what bits.h uses of cpu.h, on one pCPU */
+#ifndef CPU_H
+#define CPU_H
+
+#define BUS_LOCK	"lock ; "
+
+#endif /* CPU_H */
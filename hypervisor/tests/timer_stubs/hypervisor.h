@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * What arch/x86/timer.c uses of the hypervisor, for timer_wheel to run it
+ * on the host: one pCPU, a TSC which is the variable stub_tsc, and a TSC
+ * deadline MSR which timer_wheel.c reads back from msr_write().
+ */
+
+#ifndef HYPERVISOR_H
+#define HYPERVISOR_H
+
+#include <types.h>
+#include <list.h>
+#include <bits.h>
+
+#define EINVAL			22
+
+#define MSR_IA32_TSC_DEADLINE		0x000006E0U
+#define MSR_IA32_EXT_APIC_LVT_TIMER	0x00000832U
+#define VECTOR_TIMER			0xEFU
+#define APIC_LVTT_TM_TSCDLT		0x00040000U
+#define SOFTIRQ_TIMER			0U
+#define TIMER_IRQ			0U
+#define IRQF_NONE			0U
+#define BOOT_CPU_ID			0U
+#define CR4_TSD				(1UL << 2U)
+
+#define TRACE_TIMER_ACTION_ADDED	0x1U
+#define TRACE_TIMER_ACTION_PCKUP	0x2U
+#define TRACE_2L(evid, e, f)		do { } while (0)
+
+#define ASSERT(x, ...)	do { if (!(x)) { stub_assert(#x); } } while (0)
+#define pr_err(...)	do { } while (0)
+
+#define max(x, y)	(((x) < (y)) ? (y) : (x))
+#define min(x, y)	(((x) < (y)) ? (x) : (y))
+
+#define cpu_memory_barrier()	do { } while (0)
+#define CPU_CR_READ(cr, result_ptr)	(*(result_ptr) = 0UL)
+#define CPU_CR_WRITE(cr, value)		do { } while (0)
+
+typedef void (*irq_action_t)(uint32_t irq, void *priv_data);
+
+extern uint64_t stub_tsc;
+
+static inline uint64_t rdtsc(void)
+{
+	return stub_tsc;
+}
+
+#include <timer.h>
+
+struct per_cpu_region {
+	struct per_cpu_timers cpu_timers;
+};
+
+extern struct per_cpu_region per_cpu_data[1];
+#define per_cpu(name, pcpu_id)	(per_cpu_data[(pcpu_id)].name)
+
+struct cpuinfo_x86 {
+	uint32_t cpuid_level;
+};
+
+extern struct cpuinfo_x86 boot_cpu_data;
+static inline uint16_t get_cpu_id(void)
+{
+	return 0U;
+}
+
+/* a 2GHz TSC */
+static inline uint64_t us_to_ticks(uint32_t us)
+{
+	return (uint64_t)us * 2000UL;
+}
+
+void stub_assert(const char *txt);
+void msr_write(uint32_t reg_num, uint64_t value64);
+void fire_softirq(uint16_t nr);
+void register_softirq(uint16_t nr, void (*func)(uint16_t));
+int32_t request_irq(uint32_t req_irq, irq_action_t action_fn, void *priv_data,
+			uint32_t flags);
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
+			uint32_t *edx);
+void pio_write8(uint8_t value, uint16_t port);
+uint8_t pio_read8(uint16_t port);
+void printf(const char *fmt, ...);
+
+#endif /* HYPERVISOR_H */
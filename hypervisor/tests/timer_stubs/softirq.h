@@ -0,0 +1,7 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* the softirq API is declared in timer_stubs/hypervisor.h */
@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Cost of the per-CPU timers of arch/x86/timer.c, in TSC cycles per
+ * operation, with 4 to 1024 timers due in 50us to 2ms:
+ *
+ *   add     add_timer() of each timer
+ *   cancel  del_timer() of each timer, in a random order
+ *   re-arm  del_timer() then add_timer() of a random armed timer, as a
+ *           guest write to its vLAPIC timer does
+ *   expire  timer_softirq() running the timers due, per timer run, with
+ *           the time moving on 1us at a time
+ *
+ * and the TSC deadline MSR writes per re-arm.
+ *
+ * timer.c runs against timer_stubs/: the TSC is stub_tsc, moved by hand,
+ * and the timer interrupt is raised here when it reaches the deadline
+ * written to the TSC deadline MSR. First, 1M random arms, re-arms,
+ * cancels and idle periods over 256 one-shot and periodic timers check
+ * that no timer runs early, late or when cancelled, and that the deadline
+ * armed is never after the earliest timer.
+ *
+ *   timer_wheel
+ */
+
+#include <hypervisor.h>
+#include <softirq.h>
+
+/* from the host C library, no header of it can be used with these ones */
+int rand(void);
+void srand(unsigned int seed);
+void exit(int status);
+
+#define	CHECK_TIMERS	256U
+#define	CHECK_STEPS	1000000U
+#define	BENCH_MAX	1024U
+#define	BENCH_OPS	262144U
+
+/* what arch/x86/timer.c calls outside of itself */
+struct per_cpu_region per_cpu_data[1];
+struct cpuinfo_x86 boot_cpu_data;
+uint64_t stub_tsc = 123456789UL;
+
+static uint64_t armed;		/* TSC deadline MSR, 0: disarmed */
+static uint64_t msr_writes;
+static void (*timer_softirq)(uint16_t pcpu_id);
+
+void stub_assert(const char *txt)
+{
+	printf("FAIL assertion %s\n", txt);
+	exit(1);
+}
+
+void msr_write(uint32_t reg_num, uint64_t value64)
+{
+	if (reg_num == MSR_IA32_TSC_DEADLINE) {
+		armed = value64;
+		msr_writes++;
+	}
+}
+
+void fire_softirq(__unused uint16_t nr)
+{
+}
+
+void register_softirq(__unused uint16_t nr, void (*func)(uint16_t))
+{
+	timer_softirq = func;
+}
+
+int32_t request_irq(__unused uint32_t req_irq, __unused irq_action_t action_fn,
+	__unused void *priv_data, __unused uint32_t flags)
+{
+	return 0;
+}
+
+void cpuid(__unused uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+	uint32_t *ecx, uint32_t *edx)
+{
+	*eax = 0U;
+	*ebx = 0U;
+	*ecx = 0U;
+	*edx = 0U;
+}
+
+void pio_write8(__unused uint8_t value, __unused uint16_t port)
+{
+}
+
+uint8_t pio_read8(__unused uint16_t port)
+{
+	return 0U;
+}
+
+static struct hv_timer timers[BENCH_MAX];
+static uint32_t rearm_timer[BENCH_OPS];
+static uint64_t rearm_tsc[BENCH_OPS];
+static bool active[CHECK_TIMERS];
+static uint64_t expect[CHECK_TIMERS];
+static uint64_t nruns;
+
+/* the real TSC, for the timings */
+static inline uint64_t cycles(void)
+{
+	uint32_t lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32U) | lo;
+}
+
+static uint64_t rand64(void)
+{
+	return ((uint64_t)rand() << 31U) ^ (uint64_t)rand();
+}
+
+static uint64_t rand_below(uint64_t n)
+{
+	return rand64() % n;
+}
+
+/* the timer interrupt, if the time has reached the armed deadline */
+static void timer_irq(void)
+{
+	while ((armed != 0UL) && (stub_tsc >= armed)) {
+		armed = 0UL;
+		timer_softirq(BOOT_CPU_ID);
+	}
+}
+
+static void check_run(void *data)
+{
+	uint32_t i = (uint32_t)(uint64_t)data;
+
+	if (!active[i] || (stub_tsc < expect[i])) {
+		printf("FAIL timer %u ran at %lu, due at %lu, %s\n", i,
+			stub_tsc, expect[i], active[i] ? "armed" : "cancelled");
+		exit(1);
+	}
+	if (timers[i].mode == TICK_MODE_PERIODIC) {
+		expect[i] += timers[i].period_in_cycle;
+	} else {
+		active[i] = false;
+	}
+	nruns++;
+}
+
+/* how far out a timer is armed, around each level of the wheel */
+static uint64_t check_delta(void)
+{
+	uint64_t delta;
+
+	switch (rand_below(6UL)) {
+	case 0UL:
+		delta = rand_below(2048UL);
+		break;
+	case 1UL:
+		delta = rand_below(100000UL);
+		break;
+	case 2UL:
+		delta = rand_below(20000000UL);
+		break;
+	case 3UL:
+		delta = rand_below(4000000000UL);
+		break;
+	case 4UL:
+		delta = rand_below(100000000000UL);
+		break;
+	default:
+		delta = 0UL;
+		break;
+	}
+	return delta;
+}
+
+static void check_arm(uint32_t i)
+{
+	struct hv_timer *timer = &timers[i];
+
+	del_timer(timer);
+	if (rand_below(10UL) == 0UL) {
+		timer->fire_tsc = stub_tsc - rand_below(5000UL);
+	} else {
+		timer->fire_tsc = stub_tsc + check_delta();
+	}
+	timer->mode = (rand_below(4UL) == 0UL) ?
+		TICK_MODE_PERIODIC : TICK_MODE_ONESHOT;
+	timer->period_in_cycle = rand_below(50000000UL);
+	if (add_timer(timer) != 0) {
+		printf("FAIL add_timer\n");
+		exit(1);
+	}
+	expect[i] = timer->fire_tsc;
+	active[i] = true;
+}
+
+static void check_idle(void)
+{
+	uint64_t r = rand_below(100UL);
+
+	if ((r == 0UL) && (rand_below(20UL) == 0UL)) {
+		stub_tsc += rand_below(20000000000UL);
+	} else {
+		stub_tsc += rand_below((r < 50UL) ? 3000UL : 3000000UL);
+	}
+}
+
+static void check(void)
+{
+	uint64_t earliest;
+	uint32_t step, i, j;
+
+	for (i = 0U; i < CHECK_TIMERS; i++) {
+		initialize_timer(&timers[i], check_run, (void *)(uint64_t)i,
+			0UL, TICK_MODE_ONESHOT, 0UL);
+	}
+
+	for (step = 0U; step < CHECK_STEPS; step++) {
+		i = (uint32_t)rand_below(CHECK_TIMERS);
+		switch (rand_below(8UL)) {
+		case 0UL:
+		case 1UL:
+		case 2UL:
+		case 3UL:
+			check_arm(i);
+			break;
+		case 4UL:
+			del_timer(&timers[i]);
+			active[i] = false;
+			break;
+		default:
+			check_idle();
+			break;
+		}
+		timer_irq();
+
+		earliest = ~0UL;
+		for (j = 0U; j < CHECK_TIMERS; j++) {
+			if (active[j] && (expect[j] < earliest)) {
+				earliest = expect[j];
+			}
+		}
+		if (earliest <= stub_tsc) {
+			printf("FAIL a timer due at %lu did not run at %lu\n",
+				earliest, stub_tsc);
+			exit(1);
+		}
+		if ((earliest != ~0UL) && ((armed == 0UL) || (armed > earliest))) {
+			printf("FAIL deadline %lu armed after the earliest timer"
+				" %lu\n", armed, earliest);
+			exit(1);
+		}
+	}
+
+	for (i = 0U; i < CHECK_TIMERS; i++) {
+		del_timer(&timers[i]);
+	}
+	printf("%u steps, %lu timer runs: PASS\n", CHECK_STEPS, nruns);
+}
+
+static void bench_run(__unused void *data)
+{
+	nruns++;
+}
+
+/* 50us to 2ms from now */
+static void bench_arm(struct hv_timer *timer)
+{
+	timer->fire_tsc = stub_tsc + 100000UL + rand_below(3900000UL);
+}
+
+static void bench(uint32_t n)
+{
+	uint32_t order[BENCH_MAX];
+	uint64_t add = 0UL, cancel = 0UL, rearm, expire = 0UL, writes, start;
+	uint32_t rounds = BENCH_OPS / n, r, i, j, t;
+
+	for (i = 0U; i < n; i++) {
+		initialize_timer(&timers[i], bench_run, NULL, 0UL,
+			TICK_MODE_ONESHOT, 0UL);
+		order[i] = i;
+	}
+
+	for (r = 0U; r < rounds; r++) {
+		for (i = 0U; i < n; i++) {
+			bench_arm(&timers[i]);
+		}
+		start = cycles();
+		for (i = 0U; i < n; i++) {
+			(void)add_timer(&timers[i]);
+		}
+		add += cycles() - start;
+
+		for (i = n - 1U; i > 0U; i--) {
+			j = (uint32_t)rand_below(i + 1U);
+			t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+		start = cycles();
+		for (i = 0U; i < n; i++) {
+			del_timer(&timers[order[i]]);
+		}
+		cancel += cycles() - start;
+	}
+
+	for (i = 0U; i < n; i++) {
+		bench_arm(&timers[i]);
+		(void)add_timer(&timers[i]);
+	}
+	for (i = 0U; i < BENCH_OPS; i++) {
+		rearm_timer[i] = (uint32_t)rand_below(n);
+		bench_arm(&timers[rearm_timer[i]]);
+		rearm_tsc[i] = timers[rearm_timer[i]].fire_tsc;
+	}
+	writes = msr_writes;
+	start = cycles();
+	for (i = 0U; i < BENCH_OPS; i++) {
+		j = rearm_timer[i];
+		del_timer(&timers[j]);
+		timers[j].fire_tsc = rearm_tsc[i];
+		(void)add_timer(&timers[j]);
+	}
+	rearm = cycles() - start;
+	writes = msr_writes - writes;
+
+	/* the timers armed are due within 2ms, let them all run each round */
+	nruns = 0UL;
+	for (r = 0U; r < rounds; r++) {
+		if (r > 0U) {
+			for (i = 0U; i < n; i++) {
+				bench_arm(&timers[i]);
+				(void)add_timer(&timers[i]);
+			}
+		}
+		while (nruns < ((uint64_t)(r + 1U) * n)) {
+			stub_tsc += us_to_ticks(1U);
+			if ((armed != 0UL) && (stub_tsc >= armed)) {
+				armed = 0UL;
+				start = cycles();
+				timer_softirq(BOOT_CPU_ID);
+				expire += cycles() - start;
+			}
+		}
+	}
+
+	printf("%6u %8lu %8lu %8lu %8lu %8lu.%02lu\n", n,
+		add / (rounds * n), cancel / (rounds * n), rearm / BENCH_OPS,
+		expire / nruns, writes / BENCH_OPS,
+		((writes % BENCH_OPS) * 100UL) / BENCH_OPS);
+}
+
+int main(void)
+{
+	uint32_t n;
+
+	srand(1U);
+	timer_init();
+	check();
+
+	printf("cycles per operation\n");
+	printf("timers      add   cancel   re-arm   expire   msr/re-arm\n");
+	for (n = 4U; n <= BENCH_MAX; n *= 4U) {
+		bench(n);
+	}
+	return 0;
+}
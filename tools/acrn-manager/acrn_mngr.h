@@ -23,6 +23,7 @@ struct mngr_msg {
 	unsigned long timestamp;
 	union {
 		/* ack of DM_STOP, DM_SUSPEND, DM_RESUME, DM_PAUSE, DM_CONTINUE,
+		   DM_BOOT_TIMELINE, DM_PIO_STATS, DM_BLK_STATS,
 		   ACRND_TIMER, ACRND_STOP, ACRND_RESUME, RTC_TIMER */
 		int err;
 
@@ -81,6 +82,14 @@ enum dm_msgid {
 	DM_CONTINUE,		/* Unfreeze this virtual machine */
 	DM_QUERY,		/* Ask power state of this UOS */
 	DM_MAX,
+
+	/*
+	 * Later requests take fixed ids past all the ranges, so that none
+	 * of the ids above and below moves.
+	 */
+	DM_BOOT_TIMELINE = 0x100,	/* Write start-up phase timings of this UOS */
+	DM_PIO_STATS = 0x101,		/* Write port i/o handler stats of this UOS */
+	DM_BLK_STATS = 0x102,		/* Write block device stats of this UOS */
 };
 
 /* DM handled message req/ack pairs */
@@ -450,6 +450,59 @@ int suspend_vm(const char *vmname)
 	return ack.data.err;
 }
 
+/*
+ * The DM answers a dump request by writing the dump to
+ * /run/acrn/<vmname>.<suffix>.json, print it once the request is acked.
+ */
+static int dump_vm(const char *vmname, int msgid, const char *suffix)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	char path[PATH_MAX], buf[4096];
+	size_t n;
+	FILE *fp;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = msgid;
+	req.timestamp = time(NULL);
+
+	if (send_msg(vmname, &req, &ack))
+		return -1;
+
+	if (ack.data.err) {
+		printf("Unable to dump %s of vm. errno(%d)\n", suffix,
+			ack.data.err);
+		return ack.data.err;
+	}
+
+	snprintf(path, sizeof(path), "/run/acrn/%s.%s.json", vmname, suffix);
+	fp = fopen(path, "r");
+	if (!fp) {
+		printf("Unable to open %s\n", path);
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(fp);
+
+	return 0;
+}
+
+int boot_timeline_vm(const char *vmname)
+{
+	return dump_vm(vmname, DM_BOOT_TIMELINE, "boot");
+}
+
+int pio_stats_vm(const char *vmname)
+{
+	return dump_vm(vmname, DM_PIO_STATS, "pio");
+}
+
+int blk_stats_vm(const char *vmname)
+{
+	return dump_vm(vmname, DM_BLK_STATS, "blk");
+}
+
 int resume_vm(const char *vmname, unsigned reason)
 {
 	struct mngr_msg req;
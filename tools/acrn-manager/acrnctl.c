@@ -39,6 +39,9 @@
 #define SUSPEND_DESC   "Switch virtual machine to suspend state"
 #define RESUME_DESC    "Resume virtual machine from suspend state"
 #define RESET_DESC     "Stop and then start virtual machine VM_NAME"
+#define TIMELINE_DESC  "Print start-up phase timings of virtual machine VM_NAME"
+#define PIOSTATS_DESC  "Print port I/O handler stats of virtual machine VM_NAME"
+#define BLKSTATS_DESC  "Print block device stats of virtual machine VM_NAME"
 
 #define STOP_TIMEOUT	10U
 
@@ -644,6 +647,49 @@ static int acrnctl_do_reset(int argc, char *argv[])
 	return 0;
 }
 
+/* Ask acrn-dm of each running vm for a dump */
+static int acrnctl_do_dump(int argc, char *argv[], const char *what,
+			   int (*dump)(const char *vmname))
+{
+	struct vmmngr_struct *s;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		s = vmmngr_find(argv[i]);
+		if (!s) {
+			printf("Can't find vm %s\n", argv[i]);
+			continue;
+		}
+
+		switch (s->state) {
+			case VM_STARTED:
+			case VM_PAUSED:
+				dump(argv[i]);
+				break;
+			default:
+				printf("%s current state %s, no %s\n",
+					argv[i], state_str[s->state], what);
+		}
+	}
+
+	return 0;
+}
+
+static int acrnctl_do_timeline(int argc, char *argv[])
+{
+	return acrnctl_do_dump(argc, argv, "timeline", boot_timeline_vm);
+}
+
+static int acrnctl_do_piostats(int argc, char *argv[])
+{
+	return acrnctl_do_dump(argc, argv, "pio stats", pio_stats_vm);
+}
+
+static int acrnctl_do_blkstats(int argc, char *argv[])
+{
+	return acrnctl_do_dump(argc, argv, "block stats", blk_stats_vm);
+}
+
 /* Default args validation function */
 int df_valid_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
@@ -702,6 +748,9 @@ struct acrnctl_cmd acmds[] = {
 	ACMD("suspend", acrnctl_do_suspend, SUSPEND_DESC, df_valid_args),
 	ACMD("resume", acrnctl_do_resume, RESUME_DESC, df_valid_args),
 	ACMD("reset", acrnctl_do_reset, RESET_DESC, df_valid_args),
+	ACMD("timeline", acrnctl_do_timeline, TIMELINE_DESC, df_valid_args),
+	ACMD("piostats", acrnctl_do_piostats, PIOSTATS_DESC, df_valid_args),
+	ACMD("blkstats", acrnctl_do_blkstats, BLKSTATS_DESC, df_valid_args),
 };
 
 #define NCMD	(sizeof(acmds)/sizeof(struct acrnctl_cmd))
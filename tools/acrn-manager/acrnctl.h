@@ -61,4 +61,9 @@ int continue_vm(const char *vmname);
 int suspend_vm(const char *vmname);
 int resume_vm(const char *vmname, unsigned reason);
 
+/* vm stats */
+int boot_timeline_vm(const char *vmname);
+int pio_stats_vm(const char *vmname);
+int blk_stats_vm(const char *vmname);
+
 #endif				/* _ACRNCTL_H_ */